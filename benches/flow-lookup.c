@@ -0,0 +1,330 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Microbenchmark for flow hash lookups: one by one versus batched with
+ * prefetching of the buckets and the first flow of each bucket, like
+ * FlowPrefetchBatch() does for the flow worker.
+ *
+ * The table mimics the flow hash layout: cache line sized buckets with a
+ * lock and a list of flows, and flows that start with the tuple. Packets
+ * are read from a pcap (ethernet, IPv4/IPv6, TCP/UDP), or generated if no
+ * pcap is given. The table is populated with all flows first, so the
+ * benchmark measures the lookups of existing flows.
+ *
+ * Build and run:
+ *
+ *   gcc -O2 -o flow-lookup flow-lookup.c -lpcap -lpthread
+ *   ./flow-lookup [file.pcap] [hash-size]
+ *
+ * Without a pcap 1M flows are generated, with 4 packets each in random
+ * order.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <pcap/pcap.h>
+
+#define BATCH           64
+#define DEFAULT_FLOWS   (1024 * 1024)
+#define CLS             64
+
+typedef struct Tuple_ {
+    uint32_t src[4];
+    uint32_t dst[4];
+    uint16_t sp;
+    uint16_t dp;
+    uint8_t proto;
+} Tuple;
+
+typedef struct BFlow_ {
+    Tuple t;
+    struct BFlow_ *hnext;
+    uint64_t pkts;
+    uint8_t pad[64];
+} BFlow;
+
+typedef struct BBucket_ {
+    pthread_spinlock_t s;
+    BFlow *head;
+} __attribute__((aligned(CLS))) BBucket;
+
+typedef struct BPacket_ {
+    Tuple t;
+    uint32_t hash;
+} BPacket;
+
+static BBucket *hash;
+static uint32_t hash_size = DEFAULT_FLOWS;
+
+static inline uint64_t Cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Bob Jenkins' final mix, as used by hashword() */
+#define rot(x,k) (((x)<<(k)) | ((x)>>(32-(k))))
+static uint32_t TupleHash(const Tuple *t)
+{
+    uint32_t a = 0xdeadbeef, b = 0xdeadbeef, c = 0xdeadbeef;
+    uint32_t s = t->src[0] ^ t->src[1] ^ t->src[2] ^ t->src[3];
+    uint32_t d = t->dst[0] ^ t->dst[1] ^ t->dst[2] ^ t->dst[3];
+
+    /* direction independent, like FlowGetHash() */
+    a += s < d ? s : d;
+    b += s < d ? d : s;
+    c += ((uint32_t)(t->sp < t->dp ? t->sp : t->dp) << 16 |
+          (t->sp < t->dp ? t->dp : t->sp)) ^ t->proto;
+    c ^= b; c -= rot(b,14);
+    a ^= c; a -= rot(c,11);
+    b ^= a; b -= rot(a,25);
+    c ^= b; c -= rot(b,16);
+    a ^= c; a -= rot(c,4);
+    b ^= a; b -= rot(a,14);
+    c ^= b; c -= rot(b,24);
+    return c;
+}
+
+static int TupleCompare(const Tuple *f, const Tuple *p)
+{
+    if (f->proto != p->proto)
+        return 0;
+    if (memcmp(f->src, p->src, 16) == 0 && memcmp(f->dst, p->dst, 16) == 0 &&
+            f->sp == p->sp && f->dp == p->dp)
+        return 1;
+    if (memcmp(f->src, p->dst, 16) == 0 && memcmp(f->dst, p->src, 16) == 0 &&
+            f->sp == p->dp && f->dp == p->sp)
+        return 1;
+    return 0;
+}
+
+static BFlow *Lookup(const BPacket *p, int insert)
+{
+    BBucket *fb = &hash[p->hash % hash_size];
+    pthread_spin_lock(&fb->s);
+
+    BFlow *f = fb->head;
+    while (f != NULL) {
+        if (TupleCompare(&f->t, &p->t))
+            break;
+        f = f->hnext;
+    }
+    if (f == NULL && insert) {
+        f = calloc(1, sizeof(*f));
+        if (f == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        f->t = p->t;
+        f->hnext = fb->head;
+        fb->head = f;
+    }
+    if (f != NULL)
+        f->pkts++;
+
+    pthread_spin_unlock(&fb->s);
+    return f;
+}
+
+static void LookupBatch(const BPacket *pkts, uint32_t cnt)
+{
+    BBucket *fbs[BATCH];
+    uint32_t i;
+
+    for (i = 0; i < cnt; i++) {
+        fbs[i] = &hash[pkts[i].hash % hash_size];
+        __builtin_prefetch(fbs[i]);
+    }
+    for (i = 0; i < cnt; i++) {
+        BFlow *f = fbs[i]->head;
+        if (f != NULL)
+            __builtin_prefetch(f);
+    }
+    for (i = 0; i < cnt; i++) {
+        (void)Lookup(&pkts[i], 0);
+    }
+}
+
+static int ParseFrame(const uint8_t *d, uint32_t len, BPacket *p)
+{
+    memset(p, 0, sizeof(*p));
+
+    if (len < 14)
+        return 0;
+    uint16_t type = (uint16_t)(d[12] << 8 | d[13]);
+    d += 14; len -= 14;
+    if (type == 0x8100 && len >= 4) {
+        type = (uint16_t)(d[2] << 8 | d[3]);
+        d += 4; len -= 4;
+    }
+
+    uint32_t hlen;
+    if (type == 0x0800) {
+        if (len < 20)
+            return 0;
+        hlen = (d[0] & 0x0f) * 4;
+        p->t.proto = d[9];
+        memcpy(&p->t.src[0], d + 12, 4);
+        memcpy(&p->t.dst[0], d + 16, 4);
+    } else if (type == 0x86dd) {
+        if (len < 40)
+            return 0;
+        hlen = 40;
+        p->t.proto = d[6];
+        memcpy(p->t.src, d + 8, 16);
+        memcpy(p->t.dst, d + 24, 16);
+    } else {
+        return 0;
+    }
+    if ((p->t.proto == 6 || p->t.proto == 17) && len >= hlen + 4) {
+        p->t.sp = (uint16_t)(d[hlen] << 8 | d[hlen + 1]);
+        p->t.dp = (uint16_t)(d[hlen + 2] << 8 | d[hlen + 3]);
+    }
+    p->hash = TupleHash(&p->t);
+    return 1;
+}
+
+static BPacket *ReadPcap(const char *file, uint32_t *cnt)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t *pcap = pcap_open_offline(file, errbuf);
+    if (pcap == NULL) {
+        fprintf(stderr, "%s\n", errbuf);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t size = 1024 * 1024, n = 0;
+    BPacket *pkts = malloc(size * sizeof(*pkts));
+    struct pcap_pkthdr *h;
+    const u_char *data;
+
+    while (pkts != NULL && pcap_next_ex(pcap, &h, &data) == 1) {
+        if (n == size) {
+            size *= 2;
+            BPacket *tmp = realloc(pkts, size * sizeof(*pkts));
+            if (tmp == NULL) {
+                free(pkts);
+                pkts = NULL;
+                break;
+            }
+            pkts = tmp;
+        }
+        if (ParseFrame(data, h->caplen, &pkts[n]))
+            n++;
+    }
+    pcap_close(pcap);
+
+    if (pkts == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    *cnt = n;
+    return pkts;
+}
+
+static BPacket *Generate(uint32_t flows, uint32_t *cnt)
+{
+    const uint32_t n = flows * 4;
+    BPacket *pkts = malloc(n * sizeof(*pkts));
+    if (pkts == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srandom(1);
+    for (uint32_t i = 0; i < n; i++) {
+        BPacket *p = &pkts[i];
+        const uint32_t flow = (uint32_t)random() % flows;
+        memset(p, 0, sizeof(*p));
+        p->t.proto = 6;
+        p->t.src[0] = htonl(0x0a000000 | (flow >> 8));
+        p->t.dst[0] = htonl(0xc0a80000 | (flow & 0xff));
+        p->t.sp = (uint16_t)(1024 + (flow % 60000));
+        p->t.dp = 80;
+        p->hash = TupleHash(&p->t);
+    }
+    *cnt = n;
+    return pkts;
+}
+
+int main(int argc, char *argv[])
+{
+    BPacket *pkts;
+    uint32_t cnt = 0, i;
+
+    if (argc > 2)
+        hash_size = (uint32_t)strtoul(argv[2], NULL, 10);
+    if (hash_size == 0)
+        hash_size = DEFAULT_FLOWS;
+
+    if (argc > 1)
+        pkts = ReadPcap(argv[1], &cnt);
+    else
+        pkts = Generate(DEFAULT_FLOWS, &cnt);
+    if (cnt == 0) {
+        fprintf(stderr, "no packets\n");
+        return EXIT_FAILURE;
+    }
+
+    if (posix_memalign((void **)&hash, CLS, hash_size * sizeof(BBucket)) != 0) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    memset(hash, 0, hash_size * sizeof(BBucket));
+    for (i = 0; i < hash_size; i++)
+        pthread_spin_init(&hash[i].s, PTHREAD_PROCESS_PRIVATE);
+
+    uint32_t flows = 0;
+    for (i = 0; i < cnt; i++) {
+        BFlow *f = Lookup(&pkts[i], 1);
+        if (f->pkts == 1)
+            flows++;
+    }
+    printf("%u packets, %u flows, %u buckets\n", cnt, flows, hash_size);
+
+    uint64_t start = Cycles();
+    for (i = 0; i < cnt; i++)
+        (void)Lookup(&pkts[i], 0);
+    uint64_t single = Cycles() - start;
+
+    start = Cycles();
+    for (i = 0; i < cnt; i += BATCH) {
+        const uint32_t n = (cnt - i) < BATCH ? (cnt - i) : BATCH;
+        LookupBatch(&pkts[i], n);
+    }
+    uint64_t batched = Cycles() - start;
+
+    printf("single:  %.1f cycles per lookup\n", (double)single / cnt);
+    printf("batched: %.1f cycles per lookup (batch size %u)\n",
+            (double)batched / cnt, BATCH);
+    return EXIT_SUCCESS;
+}
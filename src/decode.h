@@ -63,6 +63,7 @@ enum PktSrcEnum {
 #include "source-pcap.h"
 #include "source-af-packet.h"
 #include "source-netmap.h"
+#include "source-af-xdp.h"
 #include "source-windivert.h"
 #ifdef HAVE_PF_RING_FLOW_OFFLOAD
 #include "source-pfring.h"
@@ -70,6 +71,8 @@ enum PktSrcEnum {
 
 #include "action-globals.h"
 
+#include "util-checksum-simd.h"
+
 #include "decode-erspan.h"
 #include "decode-ethernet.h"
 #include "decode-gre.h"
@@ -465,6 +468,9 @@ typedef struct Packet_
 #ifdef HAVE_NETMAP
         NetmapPacketVars netmap_v;
 #endif
+#ifdef HAVE_AF_XDP
+        AFXDPPacketVars afxdp_v;
+#endif
 #ifdef HAVE_PFRING
 #ifdef HAVE_PF_RING_FLOW_OFFLOAD
         PfringPacketVars pfring_v;
@@ -690,6 +696,10 @@ typedef struct DecodeThreadVars_
      * flow recycle during lookups */
     void *output_flow_thread_data;
 
+    /** thread's private flow table, NULL if the shared flow
+     *  hash is used */
+    struct FlowPartition_ *flow_partition;
+
 } DecodeThreadVars;
 
 typedef struct CaptureStats_ {
@@ -1126,6 +1136,10 @@ void DecodeUnregisterCounters(void);
  *  so flag it for not setting stream events */
 #define PKT_STREAM_NO_EVENTS            (1<<28)
 
+/** The capture source validated the TCP or UDP checksum, e.g. the NIC
+ *  did on receive */
+#define PKT_L4_CSUM_VALID               (1<<29)
+
 /** \brief return 1 if the packet is a pseudo packet */
 #define PKT_IS_PSEUDOPKT(p) \
     ((p)->flags & (PKT_PSEUDO_STREAM_END|PKT_PSEUDO_DETECTLOG_FLUSH))
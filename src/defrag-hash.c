@@ -37,7 +37,7 @@ static DefragTrackerQueue defragtracker_spare_q;
  */
 int DefragTrackerSetMemcap(uint64_t size)
 {
-    if ((uint64_t)SC_ATOMIC_GET(defrag_memuse) < size) {
+    if ((uint64_t)MemcapShardsGetMemuse(&defrag_memuse) < size) {
         SC_ATOMIC_SET(defrag_config.memcap, size);
         return 1;
     }
@@ -63,7 +63,7 @@ uint64_t DefragTrackerGetMemcap(void)
  */
 uint64_t DefragTrackerGetMemuse(void)
 {
-    uint64_t memusecopy = (uint64_t)SC_ATOMIC_GET(defrag_memuse);
+    uint64_t memusecopy = (uint64_t)MemcapShardsGetMemuse(&defrag_memuse);
     return memusecopy;
 }
 
@@ -84,7 +84,7 @@ static DefragTracker *DefragTrackerAlloc(void)
         return NULL;
     }
 
-    (void) SC_ATOMIC_ADD(defrag_memuse, sizeof(DefragTracker));
+    MemcapShardsIncr(&defrag_memuse, sizeof(DefragTracker));
 
     DefragTracker *dt = SCMalloc(sizeof(DefragTracker));
     if (unlikely(dt == NULL))
@@ -107,7 +107,7 @@ static void DefragTrackerFree(DefragTracker *dt)
 
         SCMutexDestroy(&dt->lock);
         SCFree(dt);
-        (void) SC_ATOMIC_SUB(defrag_memuse, sizeof(DefragTracker));
+        MemcapShardsDecr(&defrag_memuse, sizeof(DefragTracker));
     }
 }
 
@@ -165,7 +165,7 @@ void DefragInitConfig(char quiet)
     memset(&defrag_config,  0, sizeof(defrag_config));
     //SC_ATOMIC_INIT(flow_flags);
     SC_ATOMIC_INIT(defragtracker_counter);
-    SC_ATOMIC_INIT(defrag_memuse);
+    MemcapShardsInit(&defrag_memuse, MEMCAP_SHARDS_DEFRAG, 0);
     SC_ATOMIC_INIT(defragtracker_prune_idx);
     SC_ATOMIC_INIT(defrag_config.memcap);
     DefragTrackerQueueInit(&defragtracker_spare_q);
@@ -239,12 +239,12 @@ void DefragInitConfig(char quiet)
     for (i = 0; i < defrag_config.hash_size; i++) {
         DRLOCK_INIT(&defragtracker_hash[i]);
     }
-    (void) SC_ATOMIC_ADD(defrag_memuse, (defrag_config.hash_size * sizeof(DefragTrackerHashRow)));
+    MemcapShardsIncr(&defrag_memuse, (defrag_config.hash_size * sizeof(DefragTrackerHashRow)));
 
     if (quiet == FALSE) {
         SCLogConfig("allocated %"PRIu64" bytes of memory for the defrag hash... "
                   "%" PRIu32 " buckets of size %" PRIuMAX "",
-                  SC_ATOMIC_GET(defrag_memuse), defrag_config.hash_size,
+                  MemcapShardsGetMemuse(&defrag_memuse), defrag_config.hash_size,
                   (uintmax_t)sizeof(DefragTrackerHashRow));
     }
 
@@ -257,7 +257,7 @@ void DefragInitConfig(char quiet)
                     SCLogError(SC_ERR_DEFRAG_INIT, "preallocating defrag trackers failed: "
                             "max defrag memcap reached. Memcap %"PRIu64", "
                             "Memuse %"PRIu64".", SC_ATOMIC_GET(defrag_config.memcap),
-                            ((uint64_t)SC_ATOMIC_GET(defrag_memuse) + (uint64_t)sizeof(DefragTracker)));
+                            ((uint64_t)MemcapShardsGetMemuse(&defrag_memuse) + (uint64_t)sizeof(DefragTracker)));
                     exit(EXIT_FAILURE);
                 }
 
@@ -277,7 +277,7 @@ void DefragInitConfig(char quiet)
 
     if (quiet == FALSE) {
         SCLogConfig("defrag memory usage: %"PRIu64" bytes, maximum: %"PRIu64,
-                SC_ATOMIC_GET(defrag_memuse), SC_ATOMIC_GET(defrag_config.memcap));
+                MemcapShardsGetMemuse(&defrag_memuse), SC_ATOMIC_GET(defrag_config.memcap));
     }
 
     return;
@@ -320,11 +320,11 @@ void DefragHashShutdown(void)
         SCFree(defragtracker_hash);
         defragtracker_hash = NULL;
     }
-    (void) SC_ATOMIC_SUB(defrag_memuse, defrag_config.hash_size * sizeof(DefragTrackerHashRow));
+    MemcapShardsDecr(&defrag_memuse, defrag_config.hash_size * sizeof(DefragTrackerHashRow));
     DefragTrackerQueueDestroy(&defragtracker_spare_q);
 
     SC_ATOMIC_DESTROY(defragtracker_prune_idx);
-    SC_ATOMIC_DESTROY(defrag_memuse);
+    MemcapShardsDestroy(&defrag_memuse);
     SC_ATOMIC_DESTROY(defragtracker_counter);
     SC_ATOMIC_DESTROY(defrag_config.memcap);
     //SC_ATOMIC_DESTROY(flow_flags);
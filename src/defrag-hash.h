@@ -26,6 +26,7 @@
 
 #include "decode.h"
 #include "defrag.h"
+#include "util-memcap-shards.h"
 
 /** Spinlocks or Mutex for the flow buckets. */
 //#define DRLOCK_SPIN
@@ -82,10 +83,10 @@ typedef struct DefragConfig_ {
  *  \retval 0 no fit
  */
 #define DEFRAG_CHECK_MEMCAP(size) \
-    ((((uint64_t)SC_ATOMIC_GET(defrag_memuse) + (uint64_t)(size)) <= SC_ATOMIC_GET(defrag_config.memcap)))
+    MemcapShardsCheck(&defrag_memuse, (uint64_t)(size), SC_ATOMIC_GET(defrag_config.memcap))
 
 DefragConfig defrag_config;
-SC_ATOMIC_DECLARE(uint64_t,defrag_memuse);
+MemcapShards defrag_memuse;
 SC_ATOMIC_DECLARE(unsigned int,defragtracker_counter);
 SC_ATOMIC_DECLARE(unsigned int,defragtracker_prune_idx);
 
@@ -28,11 +28,13 @@
 #include "detect-engine-port.h"
 #include "detect-engine-prefilter.h"
 #include "detect-engine-proto.h"
+#include "detect-engine-content-inspection.h"
 
 #include "detect-dsize.h"
 #include "detect-flags.h"
 #include "detect-flow.h"
 #include "detect-flowbits.h"
+#include "detect-pcre.h"
 
 #include "util-profiling.h"
 
@@ -1408,6 +1410,18 @@ int SigAddressPrepareStage1(DetectEngineCtx *de_ctx)
             }
         }
 
+        /* rules without mpm or another prefilter can use their payload
+         * pcre as prefilter */
+        if (de_ctx->prefilter_pcre && !(s->flags & SIG_FLAG_PREFILTER)) {
+            SigMatch *sm = DetectPcreGetPrefilterSm(s);
+            if (sm != NULL) {
+                s->init_data->prefilter_sm = sm;
+                s->flags |= SIG_FLAG_PREFILTER;
+                de_ctx->sm_types_prefilter[DETECT_PCRE] = true;
+                SCLogConfig("sid %u: prefilter is on \"pcre\"", s->id);
+            }
+        }
+
         /* run buffer type callbacks if any */
         int x;
         for (x = 0; x < (int)s->init_data->smlists_array_size; x++) {
@@ -1791,6 +1805,7 @@ int SigAddressPrepareStage4(DetectEngineCtx *de_ctx)
         PrefilterSetupRuleGroup(de_ctx, sgh);
 
         SigGroupHeadBuildNonPrefilterArray(de_ctx, sgh);
+        SigGroupHeadSetPrefilterBitmapFlag(sgh);
 
         SigGroupHeadInitDataFree(sgh->init);
         sgh->init = NULL;
@@ -1854,6 +1869,8 @@ static int SigMatchPrepare(DetectEngineCtx *de_ctx)
                 continue;
             SigMatch *sm = s->init_data->smlists[type];
             s->sm_arrays[type] = SigMatchList2DataArray(sm);
+            if (type == DETECT_SM_LIST_PMATCH || type == DETECT_SM_LIST_BASE64_DATA)
+                DetectEngineContentInspectionCompile(de_ctx, s, s->sm_arrays[type]);
         }
         if (rule_engine_analysis_set) {
 #ifdef HAVE_LIBJANSSON
@@ -1929,7 +1946,8 @@ int SigGroupBuild(DetectEngineCtx *de_ctx)
         exit(EXIT_FAILURE);
     }
 
-    int r = DetectMpmPrepareBuiltinMpms(de_ctx);
+    int r = DetectMpmPrepareQueued(de_ctx);
+    r |= DetectMpmPrepareBuiltinMpms(de_ctx);
     r |= DetectMpmPrepareAppMpms(de_ctx);
     if (r != 0) {
         SCLogError(SC_ERR_DETECT_PREPARE, "initializing the detection engine failed");
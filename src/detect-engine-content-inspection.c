@@ -60,6 +60,794 @@
 #include "util-lua.h"
 #endif
 
+/**
+ *  \internal
+ *  \brief get the part of the buffer a content can match in
+ *
+ *  \param prev_buffer_offset end of the previous match, for relative
+ *                            contents
+ *  \param offset [out] start of the search window
+ *  \param depth [out] end of the search window, not yet limited to
+ *                     the buffer
+ *
+ *  \retval 0 content can't match in this buffer
+ *  \retval 1 offset and depth are set
+ */
+static inline int DetectContentInspectBounds(const DetectEngineThreadCtx *det_ctx,
+        const DetectContentData *cd, uint32_t prev_buffer_offset,
+        uint32_t buffer_len, uint32_t stream_start_offset,
+        uint32_t *out_offset, uint32_t *out_depth)
+{
+    uint32_t offset = 0;
+    uint32_t depth = buffer_len;
+
+    if ((cd->flags & DETECT_CONTENT_DISTANCE) ||
+        (cd->flags & DETECT_CONTENT_WITHIN)) {
+        SCLogDebug("det_ctx->buffer_offset %"PRIu32, det_ctx->buffer_offset);
+
+        offset = prev_buffer_offset;
+        depth = buffer_len;
+
+        int distance = cd->distance;
+        if (cd->flags & DETECT_CONTENT_DISTANCE) {
+            if (cd->flags & DETECT_CONTENT_DISTANCE_BE) {
+                distance = det_ctx->bj_values[cd->distance];
+            }
+            if (distance < 0 && (uint32_t)(abs(distance)) > offset)
+                offset = 0;
+            else
+                offset += distance;
+
+            SCLogDebug("cd->distance %"PRIi32", offset %"PRIu32", depth %"PRIu32,
+                       distance, offset, depth);
+        }
+
+        if (cd->flags & DETECT_CONTENT_WITHIN) {
+            if (cd->flags & DETECT_CONTENT_WITHIN_BE) {
+                if ((int32_t)depth > (int32_t)(prev_buffer_offset + det_ctx->bj_values[cd->within] + distance)) {
+                    depth = prev_buffer_offset + det_ctx->bj_values[cd->within] + distance;
+                }
+            } else {
+                if ((int32_t)depth > (int32_t)(prev_buffer_offset + cd->within + distance)) {
+                    depth = prev_buffer_offset + cd->within + distance;
+                }
+
+                SCLogDebug("cd->within %"PRIi32", det_ctx->buffer_offset %"PRIu32", depth %"PRIu32,
+                           cd->within, prev_buffer_offset, depth);
+            }
+
+            if (stream_start_offset != 0 && prev_buffer_offset == 0) {
+                if (depth <= stream_start_offset) {
+                    return 0;
+                } else if (depth >= (stream_start_offset + buffer_len)) {
+                    ;
+                } else {
+                    depth = depth - stream_start_offset;
+                }
+            }
+        }
+
+        if (cd->flags & DETECT_CONTENT_DEPTH_BE) {
+            if ((det_ctx->bj_values[cd->depth] + prev_buffer_offset) < depth) {
+                depth = prev_buffer_offset + det_ctx->bj_values[cd->depth];
+            }
+        } else {
+            if (cd->depth != 0) {
+                if ((cd->depth + prev_buffer_offset) < depth) {
+                    depth = prev_buffer_offset + cd->depth;
+                }
+
+                SCLogDebug("cd->depth %"PRIu32", depth %"PRIu32, cd->depth, depth);
+            }
+        }
+
+        if (cd->flags & DETECT_CONTENT_OFFSET_BE) {
+            if (det_ctx->bj_values[cd->offset] > offset)
+                offset = det_ctx->bj_values[cd->offset];
+        } else {
+            if (cd->offset > offset) {
+                offset = cd->offset;
+                SCLogDebug("setting offset %"PRIu32, offset);
+            }
+        }
+    } else { /* implied no relative matches */
+        /* set depth */
+        if (cd->flags & DETECT_CONTENT_DEPTH_BE) {
+            depth = det_ctx->bj_values[cd->depth];
+        } else {
+            if (cd->depth != 0) {
+                depth = cd->depth;
+            }
+        }
+
+        if (stream_start_offset != 0 && cd->flags & DETECT_CONTENT_DEPTH) {
+            if (depth <= stream_start_offset) {
+                return 0;
+            } else if (depth >= (stream_start_offset + buffer_len)) {
+                ;
+            } else {
+                depth = depth - stream_start_offset;
+            }
+        }
+
+        /* set offset */
+        if (cd->flags & DETECT_CONTENT_OFFSET_BE)
+            offset = det_ctx->bj_values[cd->offset];
+        else
+            offset = cd->offset;
+    }
+
+    *out_offset = offset;
+    *out_depth = depth;
+    return 1;
+}
+
+/**
+ *  \internal
+ *  \brief check if a keyword is inspected in a single step, so without
+ *         looking for other matches if the keywords after it fail
+ */
+static inline int DetectContentInspectIsSingle(const uint8_t type)
+{
+    switch (type) {
+        case DETECT_ISDATAAT:
+        case DETECT_BYTETEST:
+        case DETECT_BYTEJUMP:
+        case DETECT_BYTE_EXTRACT:
+        case DETECT_BSIZE:
+        case DETECT_AL_URILEN:
+#ifdef HAVE_LUA
+        case DETECT_LUA:
+#endif
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ *  \internal
+ *  \brief inspect a keyword for which DetectContentInspectIsSingle() is true
+ *
+ *  \retval 0 no match
+ *  \retval 1 match
+ */
+static inline int DetectContentInspectSingle(DetectEngineThreadCtx *det_ctx,
+        const Signature *s, const SigMatchData *smd, Flow *f,
+        uint8_t *buffer, uint32_t buffer_len,
+        uint32_t stream_start_offset, uint8_t flags)
+{
+    switch (smd->type) {
+        case DETECT_ISDATAAT: {
+            SCLogDebug("inspecting isdataat");
+
+            const DetectIsdataatData *id = (DetectIsdataatData *)smd->ctx;
+            uint32_t dataat = id->dataat;
+            if (id->flags & ISDATAAT_OFFSET_BE) {
+                uint64_t be_value = det_ctx->bj_values[dataat];
+                if (be_value >= 100000000) {
+                    if ((id->flags & ISDATAAT_NEGATED) == 0) {
+                        SCLogDebug("extracted value %"PRIu64" very big: no match", be_value);
+                        return 0;
+                    }
+                    SCLogDebug("extracted value way %"PRIu64" very big: match", be_value);
+                    return 1;
+                }
+                dataat = (uint32_t)be_value;
+                SCLogDebug("isdataat: using value %u from byte_extract local_id %u", dataat, id->dataat);
+            }
+
+            if (id->flags & ISDATAAT_RELATIVE) {
+                if (det_ctx->buffer_offset + dataat > buffer_len) {
+                    SCLogDebug("det_ctx->buffer_offset + dataat %"PRIu32" > %"PRIu32, det_ctx->buffer_offset + dataat, buffer_len);
+                    if (id->flags & ISDATAAT_NEGATED)
+                        return 1;
+                    return 0;
+                } else {
+                    SCLogDebug("relative isdataat match");
+                    if (id->flags & ISDATAAT_NEGATED)
+                        return 0;
+                    return 1;
+                }
+            } else {
+                if (dataat < buffer_len) {
+                    SCLogDebug("absolute isdataat match");
+                    if (id->flags & ISDATAAT_NEGATED)
+                        return 0;
+                    return 1;
+                } else {
+                    SCLogDebug("absolute isdataat mismatch, id->isdataat %"PRIu32", buffer_len %"PRIu32"", dataat, buffer_len);
+                    if (id->flags & ISDATAAT_NEGATED)
+                        return 1;
+                    return 0;
+                }
+            }
+        }
+        case DETECT_BYTETEST: {
+            DetectBytetestData *btd = (DetectBytetestData *)smd->ctx;
+            uint8_t btflags = btd->flags;
+            int32_t offset = btd->offset;
+            uint64_t value = btd->value;
+            if (btflags & DETECT_BYTETEST_OFFSET_BE) {
+                offset = det_ctx->bj_values[offset];
+            }
+            if (btflags & DETECT_BYTETEST_VALUE_BE) {
+                value = det_ctx->bj_values[value];
+            }
+
+            /* if we have dce enabled we will have to use the endianness
+             * specified by the dce header */
+            if (btflags & DETECT_BYTETEST_DCE) {
+                /* enable the endianness flag temporarily.  once we are done
+                 * processing we reset the flags to the original value*/
+                btflags |= ((flags & DETECT_CI_FLAGS_DCE_LE) ?
+                          DETECT_BYTETEST_LITTLE: 0);
+            }
+
+            if (DetectBytetestDoMatch(det_ctx, s, smd->ctx, buffer, buffer_len, btflags,
+                                      offset, value) != 1) {
+                return 0;
+            }
+
+            return 1;
+        }
+        case DETECT_BYTEJUMP: {
+            DetectBytejumpData *bjd = (DetectBytejumpData *)smd->ctx;
+            uint8_t bjflags = bjd->flags;
+            int32_t offset = bjd->offset;
+
+            if (bjflags & DETECT_BYTEJUMP_OFFSET_BE) {
+                offset = det_ctx->bj_values[offset];
+            }
+
+            /* if we have dce enabled we will have to use the endianness
+             * specified by the dce header */
+            if (bjflags & DETECT_BYTEJUMP_DCE) {
+                /* enable the endianness flag temporarily.  once we are done
+                 * processing we reset the flags to the original value*/
+                bjflags |= ((flags & DETECT_CI_FLAGS_DCE_LE) ?
+                          DETECT_BYTEJUMP_LITTLE: 0);
+            }
+
+            if (DetectBytejumpDoMatch(det_ctx, s, smd->ctx, buffer, buffer_len,
+                                      bjflags, offset) != 1) {
+                return 0;
+            }
+
+            return 1;
+        }
+        case DETECT_BYTE_EXTRACT: {
+
+            DetectByteExtractData *bed = (DetectByteExtractData *)smd->ctx;
+            uint8_t endian = bed->endian;
+
+            /* if we have dce enabled we will have to use the endianness
+             * specified by the dce header */
+            if ((bed->flags & DETECT_BYTE_EXTRACT_FLAG_ENDIAN) &&
+                endian == DETECT_BYTE_EXTRACT_ENDIAN_DCE &&
+                flags & (DETECT_CI_FLAGS_DCE_LE|DETECT_CI_FLAGS_DCE_BE)) {
+
+                /* enable the endianness flag temporarily.  once we are done
+                 * processing we reset the flags to the original value*/
+                endian |= ((flags & DETECT_CI_FLAGS_DCE_LE) ?
+                           DETECT_BYTE_EXTRACT_ENDIAN_LITTLE : DETECT_BYTE_EXTRACT_ENDIAN_BIG);
+            }
+
+            if (DetectByteExtractDoMatch(det_ctx, smd, s, buffer,
+                                         buffer_len,
+                                         &det_ctx->bj_values[bed->local_id],
+                                         endian) != 1) {
+                return 0;
+            }
+
+            return 1;
+        }
+        case DETECT_BSIZE: {
+
+            bool eof = (flags & DETECT_CI_FLAGS_END);
+            const uint64_t data_size = buffer_len + stream_start_offset;
+            int r = DetectBsizeMatch(smd->ctx, data_size, eof);
+            if (r < 0) {
+                det_ctx->discontinue_matching = 1;
+                return 0;
+
+            } else if (r == 0) {
+                return 0;
+            }
+            return 1;
+        }
+        case DETECT_AL_URILEN: {
+            SCLogDebug("inspecting uri len");
+
+            int r = 0;
+            DetectUrilenData *urilend = (DetectUrilenData *) smd->ctx;
+
+            switch (urilend->mode) {
+                case DETECT_URILEN_EQ:
+                    if (buffer_len == urilend->urilen1)
+                        r = 1;
+                    break;
+                case DETECT_URILEN_LT:
+                    if (buffer_len < urilend->urilen1)
+                        r = 1;
+                    break;
+                case DETECT_URILEN_GT:
+                    if (buffer_len > urilend->urilen1)
+                        r = 1;
+                    break;
+                case DETECT_URILEN_RA:
+                    if (buffer_len > urilend->urilen1 &&
+                        buffer_len < urilend->urilen2) {
+                        r = 1;
+                    }
+                    break;
+            }
+
+            if (r == 1) {
+                return 1;
+            }
+
+            det_ctx->discontinue_matching = 0;
+
+            return 0;
+        }
+#ifdef HAVE_LUA
+        case DETECT_LUA: {
+            SCLogDebug("lua starting");
+
+            if (DetectLuaMatchBuffer(det_ctx, s, smd, buffer, buffer_len,
+                        det_ctx->buffer_offset, f) != 1)
+            {
+                SCLogDebug("lua no_match");
+                return 0;
+            }
+            SCLogDebug("lua match");
+            return 1;
+        }
+#endif /* HAVE_LUA */
+    }
+    return 0;
+}
+
+/* Compiled inspection programs
+ *
+ * At build time the keyword list is turned into a flat program of one
+ * instruction per keyword, with the content offset/depth modifiers
+ * resolved into the instruction. The program is then run in a loop.
+ * Where the recursive inspection would call itself to inspect the rest
+ * of the list after a content or pcre match, the program pushes a
+ * backtrack frame instead. When a later keyword fails, the topmost frame
+ * is popped to look for the next occurrence of its content or pcre.
+ *
+ * Each step into the next instruction counts as a recursion, so the
+ * recursion limit and det_ctx->inspection_recursion_counter behave the
+ * same for both engines.
+ */
+
+enum DetectCiOp {
+    DETECT_CI_OP_CONTENT,           /**< content at a fixed offset/depth */
+    DETECT_CI_OP_CONTENT_RELATIVE,  /**< content with distance/within */
+    DETECT_CI_OP_CONTENT_VAR,       /**< content using byte_extract vars */
+    DETECT_CI_OP_PCRE,
+    DETECT_CI_OP_BASE64_DECODE,
+    DETECT_CI_OP_SINGLE,            /**< see DetectContentInspectIsSingle() */
+};
+
+/** last instruction of the program */
+#define DETECT_CI_INSN_LAST     BIT_U8(0)
+/** content: look for the next occurrence if the instructions after it fail */
+#define DETECT_CI_INSN_RETRY    BIT_U8(1)
+
+typedef struct DetectCiInsn_ {
+    uint8_t op;         /**< DETECT_CI_OP_* */
+    uint8_t flags;      /**< DETECT_CI_INSN_* */
+    /** content: start and end (0 for none) of the search window, relative
+     *  to the previous match for DETECT_CI_OP_CONTENT_RELATIVE */
+    uint32_t offset;
+    uint32_t depth;
+    /** content: distance and distance + within */
+    int32_t distance;
+    int32_t window;
+    const SigMatchData *smd;
+} DetectCiInsn;
+
+typedef struct DetectCiProgram_ {
+    uint32_t len;
+    DetectCiInsn insn[];
+} DetectCiProgram;
+
+/** programs of a signature, looked up by their list */
+typedef struct DetectCiPrograms_ {
+    uint32_t cnt;
+    struct {
+        const SigMatchData *smd;
+        DetectCiProgram *prog;
+    } list[];
+} DetectCiPrograms;
+
+/** backtrack point of a content or pcre instruction */
+typedef struct DetectCiFrame_ {
+    uint32_t pc;
+    uint32_t prev_buffer_offset;
+    uint32_t prev_offset;
+} DetectCiFrame;
+
+enum {
+    DETECT_CI_NO_MATCH = 0,
+    DETECT_CI_MATCH,
+    /** match that can be retried for the next occurrence */
+    DETECT_CI_MATCH_RETRY,
+};
+
+static inline const DetectCiProgram *DetectCiProgramGet(const Signature *s,
+        const SigMatchData *smd)
+{
+    const DetectCiPrograms *progs = s->ci_programs;
+    if (progs != NULL) {
+        for (uint32_t i = 0; i < progs->cnt; i++) {
+            if (progs->list[i].smd == smd)
+                return progs->list[i].prog;
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  \brief compile the content inspection list smd of signature s into
+ *         a program
+ *
+ *  The program is stored in the signature and used by
+ *  DetectEngineContentInspection() for this list from then on. Lists
+ *  with keywords the program doesn't support are left to the recursive
+ *  inspection.
+ */
+void DetectEngineContentInspectionCompile(const DetectEngineCtx *de_ctx,
+        Signature *s, const SigMatchData *smd)
+{
+    if (smd == NULL || !de_ctx->inspection_compile)
+        return;
+    if (DetectCiProgramGet(s, smd) != NULL)
+        return;
+
+    uint32_t len = 0;
+    const SigMatchData *iter = smd;
+    while (1) {
+        if (iter->type != DETECT_CONTENT && iter->type != DETECT_PCRE &&
+                iter->type != DETECT_BASE64_DECODE &&
+                !DetectContentInspectIsSingle(iter->type))
+            return;
+        len++;
+        if (iter->is_last)
+            break;
+        iter++;
+    }
+
+    DetectCiProgram *prog = SCCalloc(1, sizeof(*prog) + len * sizeof(DetectCiInsn));
+    if (unlikely(prog == NULL))
+        return;
+    prog->len = len;
+
+    for (uint32_t i = 0; i < len; i++) {
+        DetectCiInsn *insn = &prog->insn[i];
+        insn->smd = &smd[i];
+        if (smd[i].is_last)
+            insn->flags |= DETECT_CI_INSN_LAST;
+
+        switch (smd[i].type) {
+            case DETECT_CONTENT: {
+                const DetectContentData *cd = (const DetectContentData *)smd[i].ctx;
+                if (cd->flags & (DETECT_CONTENT_DISTANCE_BE|DETECT_CONTENT_WITHIN_BE|
+                                 DETECT_CONTENT_OFFSET_BE|DETECT_CONTENT_DEPTH_BE)) {
+                    insn->op = DETECT_CI_OP_CONTENT_VAR;
+                } else if (cd->flags & (DETECT_CONTENT_DISTANCE|DETECT_CONTENT_WITHIN)) {
+                    insn->op = DETECT_CI_OP_CONTENT_RELATIVE;
+                } else {
+                    insn->op = DETECT_CI_OP_CONTENT;
+                }
+                insn->offset = cd->offset;
+                insn->depth = cd->depth;
+                insn->distance = cd->distance;
+                insn->window = cd->within + cd->distance;
+                if (cd->flags & DETECT_CONTENT_WITHIN_NEXT)
+                    insn->flags |= DETECT_CI_INSN_RETRY;
+                break;
+            }
+            case DETECT_PCRE:
+                insn->op = DETECT_CI_OP_PCRE;
+                break;
+            case DETECT_BASE64_DECODE:
+                insn->op = DETECT_CI_OP_BASE64_DECODE;
+                break;
+            default:
+                insn->op = DETECT_CI_OP_SINGLE;
+                break;
+        }
+    }
+
+    const uint32_t cnt = s->ci_programs ? s->ci_programs->cnt : 0;
+    DetectCiPrograms *progs = SCRealloc(s->ci_programs, sizeof(*progs) +
+            (cnt + 1) * sizeof(progs->list[0]));
+    if (unlikely(progs == NULL)) {
+        SCFree(prog);
+        return;
+    }
+    progs->list[cnt].smd = smd;
+    progs->list[cnt].prog = prog;
+    progs->cnt = cnt + 1;
+    s->ci_programs = progs;
+}
+
+/** \brief free the content inspection programs of a signature */
+void DetectEngineContentInspectionFreePrograms(Signature *s)
+{
+    DetectCiPrograms *progs = s->ci_programs;
+    if (progs == NULL)
+        return;
+
+    for (uint32_t i = 0; i < progs->cnt; i++) {
+        SCFree(progs->list[i].prog);
+    }
+    SCFree(progs);
+    s->ci_programs = NULL;
+}
+
+/**
+ *  \internal
+ *  \brief get the search window of a content instruction, see
+ *         DetectContentInspectBounds()
+ */
+static inline int DetectCiContentBounds(const DetectEngineThreadCtx *det_ctx,
+        const DetectCiInsn *insn, const DetectContentData *cd,
+        uint32_t prev_buffer_offset, uint32_t buffer_len,
+        uint32_t stream_start_offset, uint32_t *out_offset, uint32_t *out_depth)
+{
+    uint32_t offset;
+    uint32_t depth = buffer_len;
+
+    if (insn->op == DETECT_CI_OP_CONTENT) {
+        if (insn->depth != 0)
+            depth = insn->depth;
+
+        if (stream_start_offset != 0 && cd->flags & DETECT_CONTENT_DEPTH) {
+            if (depth <= stream_start_offset) {
+                return 0;
+            } else if (depth < (stream_start_offset + buffer_len)) {
+                depth = depth - stream_start_offset;
+            }
+        }
+        offset = insn->offset;
+
+    } else if (insn->op == DETECT_CI_OP_CONTENT_RELATIVE) {
+        offset = prev_buffer_offset;
+
+        if (cd->flags & DETECT_CONTENT_DISTANCE) {
+            const int32_t distance = insn->distance;
+            if (distance < 0 && (uint32_t)(abs(distance)) > offset)
+                offset = 0;
+            else
+                offset += distance;
+        }
+
+        if (cd->flags & DETECT_CONTENT_WITHIN) {
+            if ((int32_t)depth > (int32_t)(prev_buffer_offset + insn->window)) {
+                depth = prev_buffer_offset + insn->window;
+            }
+
+            if (stream_start_offset != 0 && prev_buffer_offset == 0) {
+                if (depth <= stream_start_offset) {
+                    return 0;
+                } else if (depth < (stream_start_offset + buffer_len)) {
+                    depth = depth - stream_start_offset;
+                }
+            }
+        }
+
+        if (insn->depth != 0 && (insn->depth + prev_buffer_offset) < depth) {
+            depth = prev_buffer_offset + insn->depth;
+        }
+        if (insn->offset > offset) {
+            offset = insn->offset;
+        }
+
+    } else {
+        return DetectContentInspectBounds(det_ctx, cd, prev_buffer_offset,
+                buffer_len, stream_start_offset, out_offset, out_depth);
+    }
+
+    *out_offset = offset;
+    *out_depth = depth;
+    return 1;
+}
+
+/**
+ *  \internal
+ *  \brief search for a content, starting at *prev_offset if it is set
+ *
+ *  \param prev_offset [in/out] where to continue the search for the next
+ *                     occurrence, set on DETECT_CI_MATCH_RETRY
+ */
+static inline int DetectCiContent(DetectEngineThreadCtx *det_ctx,
+        const DetectCiInsn *insn, uint8_t *buffer, uint32_t buffer_len,
+        uint32_t stream_start_offset, uint8_t inspection_mode,
+        uint32_t prev_buffer_offset, uint32_t *prev_offset)
+{
+    DetectContentData *cd = (DetectContentData *)insn->smd->ctx;
+    uint32_t offset = 0;
+    uint32_t depth = 0;
+
+    while (1) {
+        if (DetectCiContentBounds(det_ctx, insn, cd, prev_buffer_offset,
+                    buffer_len, stream_start_offset, &offset, &depth) == 0) {
+            return DETECT_CI_NO_MATCH;
+        }
+
+        if (*prev_offset != 0)
+            offset = *prev_offset;
+        if (depth > buffer_len)
+            depth = buffer_len;
+
+        /* if offset is bigger than depth we can never match on a pattern.
+         * We can however, "match" on a negated pattern. */
+        if (offset > depth || depth == 0) {
+            if (cd->flags & DETECT_CONTENT_NEGATED)
+                return DETECT_CI_MATCH;
+            return DETECT_CI_NO_MATCH;
+        }
+
+        const uint32_t sbuffer_len = depth - offset;
+        uint8_t *found = NULL;
+        if (cd->flags & DETECT_CONTENT_ENDS_WITH && depth < buffer_len) {
+            found = NULL;
+        } else if (cd->content_len > sbuffer_len) {
+            found = NULL;
+        } else {
+            found = SpmScan(cd->spm_ctx, det_ctx->spm_thread_ctx,
+                    buffer + offset, sbuffer_len);
+        }
+
+        if (found == NULL) {
+            if (cd->flags & DETECT_CONTENT_NEGATED)
+                return DETECT_CI_MATCH;
+            if ((cd->flags & (DETECT_CONTENT_DISTANCE|DETECT_CONTENT_WITHIN)) == 0) {
+                /* independent match from previous matches, so failure is fatal */
+                det_ctx->discontinue_matching = 1;
+            }
+            return DETECT_CI_NO_MATCH;
+        }
+        if (cd->flags & DETECT_CONTENT_NEGATED) {
+            if (DETECT_CONTENT_IS_SINGLE(cd))
+                det_ctx->discontinue_matching = 1;
+            return DETECT_CI_NO_MATCH;
+        }
+
+        const uint32_t match_offset = (uint32_t)((found - buffer) + cd->content_len);
+        det_ctx->buffer_offset = match_offset;
+        *prev_offset = match_offset - (cd->content_len - 1);
+
+        if ((cd->flags & DETECT_CONTENT_ENDS_WITH) == 0 || match_offset == buffer_len) {
+            if (cd->flags & DETECT_CONTENT_REPLACE) {
+                if (inspection_mode == DETECT_ENGINE_CONTENT_INSPECTION_MODE_PAYLOAD) {
+                    /* we will need to replace content if match is confirmed */
+                    det_ctx->replist = DetectReplaceAddToList(det_ctx->replist, found, cd);
+                } else {
+                    SCLogWarning(SC_ERR_INVALID_VALUE, "Can't modify payload without packet");
+                }
+            }
+            return DETECT_CI_MATCH_RETRY;
+        }
+    }
+}
+
+/**
+ *  \internal
+ *  \brief run a compiled inspection program, see
+ *         DetectEngineContentInspection() for the parameters
+ */
+static int DetectEngineContentInspectionRun(DetectEngineCtx *de_ctx,
+        DetectEngineThreadCtx *det_ctx, const Signature *s,
+        const DetectCiProgram *prog, Packet *p, Flow *f,
+        uint8_t *buffer, uint32_t buffer_len,
+        uint32_t stream_start_offset, uint8_t flags, uint8_t inspection_mode)
+{
+    DetectCiFrame stack[prog->len];
+    uint32_t sp = 0;
+    uint32_t pc = 0;
+    const DetectCiInsn *insn;
+    uint32_t prev_buffer_offset;
+    uint32_t prev_offset;
+    int r;
+
+next:
+    det_ctx->inspection_recursion_counter++;
+    if (det_ctx->inspection_recursion_counter == de_ctx->inspection_recursion_limit) {
+        det_ctx->discontinue_matching = 1;
+        return 0;
+    }
+    if (buffer_len == 0)
+        return 0;
+
+    insn = &prog->insn[pc];
+    prev_buffer_offset = det_ctx->buffer_offset;
+    prev_offset = 0;
+    if (insn->op == DETECT_CI_OP_PCRE)
+        det_ctx->pcre_match_start_offset = 0;
+
+run:
+    {
+        KEYWORD_PROFILING_START;
+        switch (insn->op) {
+            case DETECT_CI_OP_CONTENT:
+            case DETECT_CI_OP_CONTENT_RELATIVE:
+            case DETECT_CI_OP_CONTENT_VAR:
+                r = DetectCiContent(det_ctx, insn, buffer, buffer_len,
+                        stream_start_offset, inspection_mode,
+                        prev_buffer_offset, &prev_offset);
+                break;
+            case DETECT_CI_OP_PCRE: {
+                const DetectPcreData *pe = (const DetectPcreData *)insn->smd->ctx;
+                r = DetectPcrePayloadMatch(det_ctx, s, insn->smd, p, f,
+                        buffer, buffer_len);
+                if (r != 0) {
+                    prev_offset = det_ctx->pcre_match_start_offset;
+                    r = (pe->flags & DETECT_PCRE_RELATIVE_NEXT) ?
+                        DETECT_CI_MATCH_RETRY : DETECT_CI_MATCH;
+                }
+                break;
+            }
+            case DETECT_CI_OP_BASE64_DECODE:
+                r = DETECT_CI_NO_MATCH;
+                if (DetectBase64DecodeDoMatch(det_ctx, s, insn->smd, buffer, buffer_len)) {
+                    if (s->sm_arrays[DETECT_SM_LIST_BASE64_DATA] != NULL) {
+                        KEYWORD_PROFILING_END(det_ctx, insn->smd->type, 1);
+                        if (DetectBase64DataDoMatch(de_ctx, det_ctx, s, f)) {
+                            /* Base64 is a terminal list. */
+                            return 1;
+                        }
+                    }
+                }
+                break;
+            default:
+                r = DetectContentInspectSingle(det_ctx, s, insn->smd, f,
+                        buffer, buffer_len, stream_start_offset, flags);
+                break;
+        }
+        KEYWORD_PROFILING_END(det_ctx, insn->smd->type, (r != DETECT_CI_NO_MATCH));
+    }
+
+    if (r == DETECT_CI_NO_MATCH)
+        goto backtrack;
+    if (insn->flags & DETECT_CI_INSN_LAST)
+        return 1;
+    if (r == DETECT_CI_MATCH_RETRY) {
+        stack[sp].pc = pc;
+        stack[sp].prev_buffer_offset = prev_buffer_offset;
+        stack[sp].prev_offset = prev_offset;
+        sp++;
+    }
+    pc++;
+    goto next;
+
+backtrack:
+    if (det_ctx->discontinue_matching || sp == 0)
+        return 0;
+
+    sp--;
+    pc = stack[sp].pc;
+    insn = &prog->insn[pc];
+    prev_buffer_offset = stack[sp].prev_buffer_offset;
+    prev_offset = stack[sp].prev_offset;
+
+    if (insn->op == DETECT_CI_OP_PCRE) {
+        det_ctx->buffer_offset = prev_buffer_offset;
+        det_ctx->pcre_match_start_offset = prev_offset;
+    } else if ((insn->flags & DETECT_CI_INSN_RETRY) == 0) {
+        /* no match and no reason to look for another instance */
+        det_ctx->discontinue_matching = 1;
+        return 0;
+    }
+    goto run;
+}
+
 /**
  * \brief Run the actual payload match functions
  *
@@ -98,12 +886,12 @@
  *  \retval 0 no match
  *  \retval 1 match
  */
-int DetectEngineContentInspection(DetectEngineCtx *de_ctx, DetectEngineThreadCtx *det_ctx,
-                                  const Signature *s, const SigMatchData *smd,
-                                  Packet *p, Flow *f,
-                                  uint8_t *buffer, uint32_t buffer_len,
-                                  uint32_t stream_start_offset, uint8_t flags,
-                                  uint8_t inspection_mode)
+static int DetectEngineContentInspectionList(DetectEngineCtx *de_ctx,
+        DetectEngineThreadCtx *det_ctx, const Signature *s,
+        const SigMatchData *smd, Packet *p, Flow *f,
+        uint8_t *buffer, uint32_t buffer_len,
+        uint32_t stream_start_offset, uint8_t flags,
+        uint8_t inspection_mode)
 {
     SCEnter();
     KEYWORD_PROFILING_START;
@@ -148,101 +936,9 @@ int DetectEngineContentInspection(DetectEngineCtx *de_ctx, DetectEngineThreadCtx
         uint32_t prev_buffer_offset = det_ctx->buffer_offset;
 
         do {
-            if ((cd->flags & DETECT_CONTENT_DISTANCE) ||
-                (cd->flags & DETECT_CONTENT_WITHIN)) {
-                SCLogDebug("det_ctx->buffer_offset %"PRIu32, det_ctx->buffer_offset);
-
-                offset = prev_buffer_offset;
-                depth = buffer_len;
-
-                int distance = cd->distance;
-                if (cd->flags & DETECT_CONTENT_DISTANCE) {
-                    if (cd->flags & DETECT_CONTENT_DISTANCE_BE) {
-                        distance = det_ctx->bj_values[cd->distance];
-                    }
-                    if (distance < 0 && (uint32_t)(abs(distance)) > offset)
-                        offset = 0;
-                    else
-                        offset += distance;
-
-                    SCLogDebug("cd->distance %"PRIi32", offset %"PRIu32", depth %"PRIu32,
-                               distance, offset, depth);
-                }
-
-                if (cd->flags & DETECT_CONTENT_WITHIN) {
-                    if (cd->flags & DETECT_CONTENT_WITHIN_BE) {
-                        if ((int32_t)depth > (int32_t)(prev_buffer_offset + det_ctx->bj_values[cd->within] + distance)) {
-                            depth = prev_buffer_offset + det_ctx->bj_values[cd->within] + distance;
-                        }
-                    } else {
-                        if ((int32_t)depth > (int32_t)(prev_buffer_offset + cd->within + distance)) {
-                            depth = prev_buffer_offset + cd->within + distance;
-                        }
-
-                        SCLogDebug("cd->within %"PRIi32", det_ctx->buffer_offset %"PRIu32", depth %"PRIu32,
-                                   cd->within, prev_buffer_offset, depth);
-                    }
-
-                    if (stream_start_offset != 0 && prev_buffer_offset == 0) {
-                        if (depth <= stream_start_offset) {
-                            goto no_match;
-                        } else if (depth >= (stream_start_offset + buffer_len)) {
-                            ;
-                        } else {
-                            depth = depth - stream_start_offset;
-                        }
-                    }
-                }
-
-                if (cd->flags & DETECT_CONTENT_DEPTH_BE) {
-                    if ((det_ctx->bj_values[cd->depth] + prev_buffer_offset) < depth) {
-                        depth = prev_buffer_offset + det_ctx->bj_values[cd->depth];
-                    }
-                } else {
-                    if (cd->depth != 0) {
-                        if ((cd->depth + prev_buffer_offset) < depth) {
-                            depth = prev_buffer_offset + cd->depth;
-                        }
-
-                        SCLogDebug("cd->depth %"PRIu32", depth %"PRIu32, cd->depth, depth);
-                    }
-                }
-
-                if (cd->flags & DETECT_CONTENT_OFFSET_BE) {
-                    if (det_ctx->bj_values[cd->offset] > offset)
-                        offset = det_ctx->bj_values[cd->offset];
-                } else {
-                    if (cd->offset > offset) {
-                        offset = cd->offset;
-                        SCLogDebug("setting offset %"PRIu32, offset);
-                    }
-                }
-            } else { /* implied no relative matches */
-                /* set depth */
-                if (cd->flags & DETECT_CONTENT_DEPTH_BE) {
-                    depth = det_ctx->bj_values[cd->depth];
-                } else {
-                    if (cd->depth != 0) {
-                        depth = cd->depth;
-                    }
-                }
-
-                if (stream_start_offset != 0 && cd->flags & DETECT_CONTENT_DEPTH) {
-                    if (depth <= stream_start_offset) {
-                        goto no_match;
-                    } else if (depth >= (stream_start_offset + buffer_len)) {
-                        ;
-                    } else {
-                        depth = depth - stream_start_offset;
-                    }
-                }
-
-                /* set offset */
-                if (cd->flags & DETECT_CONTENT_OFFSET_BE)
-                    offset = det_ctx->bj_values[cd->offset];
-                else
-                    offset = cd->offset;
-                prev_buffer_offset = 0;
+            if (DetectContentInspectBounds(det_ctx, cd, prev_buffer_offset,
+                        buffer_len, stream_start_offset, &offset, &depth) == 0) {
+                goto no_match;
             }
 
             /* update offset with prev_offset if we're searching for
@@ -331,7 +1027,7 @@ int DetectEngineContentInspection(DetectEngineCtx *de_ctx, DetectEngineThreadCtx
                     /* see if the next buffer keywords match. If not, we will
                      * search for another occurence of this content and see
                      * if the others match then until we run out of matches */
-                    int r = DetectEngineContentInspection(de_ctx, det_ctx, s, smd+1,
+                    int r = DetectEngineContentInspectionList(de_ctx, det_ctx, s, smd+1,
                             p, f, buffer, buffer_len, stream_start_offset, flags,
                             inspection_mode);
                     if (r == 1) {
@@ -360,51 +1056,6 @@ int DetectEngineContentInspection(DetectEngineCtx *de_ctx, DetectEngineThreadCtx
 
         } while(1);
 
-    } else if (smd->type == DETECT_ISDATAAT) {
-        SCLogDebug("inspecting isdataat");
-
-        const DetectIsdataatData *id = (DetectIsdataatData *)smd->ctx;
-        uint32_t dataat = id->dataat;
-        if (id->flags & ISDATAAT_OFFSET_BE) {
-            uint64_t be_value = det_ctx->bj_values[dataat];
-            if (be_value >= 100000000) {
-                if ((id->flags & ISDATAAT_NEGATED) == 0) {
-                    SCLogDebug("extracted value %"PRIu64" very big: no match", be_value);
-                    goto no_match;
-                }
-                SCLogDebug("extracted value way %"PRIu64" very big: match", be_value);
-                goto match;
-            }
-            dataat = (uint32_t)be_value;
-            SCLogDebug("isdataat: using value %u from byte_extract local_id %u", dataat, id->dataat);
-        }
-
-        if (id->flags & ISDATAAT_RELATIVE) {
-            if (det_ctx->buffer_offset + dataat > buffer_len) {
-                SCLogDebug("det_ctx->buffer_offset + dataat %"PRIu32" > %"PRIu32, det_ctx->buffer_offset + dataat, buffer_len);
-                if (id->flags & ISDATAAT_NEGATED)
-                    goto match;
-                goto no_match;
-            } else {
-                SCLogDebug("relative isdataat match");
-                if (id->flags & ISDATAAT_NEGATED)
-                    goto no_match;
-                goto match;
-            }
-        } else {
-            if (dataat < buffer_len) {
-                SCLogDebug("absolute isdataat match");
-                if (id->flags & ISDATAAT_NEGATED)
-                    goto no_match;
-                goto match;
-            } else {
-                SCLogDebug("absolute isdataat mismatch, id->isdataat %"PRIu32", buffer_len %"PRIu32"", dataat, buffer_len);
-                if (id->flags & ISDATAAT_NEGATED)
-                    goto match;
-                goto no_match;
-            }
-        }
-
     } else if (smd->type == DETECT_PCRE) {
         SCLogDebug("inspecting pcre");
         DetectPcreData *pe = (DetectPcreData *)smd->ctx;
@@ -432,7 +1083,7 @@ int DetectEngineContentInspection(DetectEngineCtx *de_ctx, DetectEngineThreadCtx
             /* see if the next payload keywords match. If not, we will
              * search for another occurence of this pcre and see
              * if the others match, until we run out of matches */
-            r = DetectEngineContentInspection(de_ctx, det_ctx, s, smd+1,
+            r = DetectEngineContentInspectionList(de_ctx, det_ctx, s, smd+1,
                     p, f, buffer, buffer_len, stream_start_offset, flags,
                     inspection_mode);
             if (r == 1) {
@@ -446,147 +1097,13 @@ int DetectEngineContentInspection(DetectEngineCtx *de_ctx, DetectEngineThreadCtx
             det_ctx->pcre_match_start_offset = prev_offset;
         } while (1);
 
-    } else if (smd->type == DETECT_BYTETEST) {
-        DetectBytetestData *btd = (DetectBytetestData *)smd->ctx;
-        uint8_t btflags = btd->flags;
-        int32_t offset = btd->offset;
-        uint64_t value = btd->value;
-        if (btflags & DETECT_BYTETEST_OFFSET_BE) {
-            offset = det_ctx->bj_values[offset];
-        }
-        if (btflags & DETECT_BYTETEST_VALUE_BE) {
-            value = det_ctx->bj_values[value];
-        }
-
-        /* if we have dce enabled we will have to use the endianness
-         * specified by the dce header */
-        if (btflags & DETECT_BYTETEST_DCE) {
-            /* enable the endianness flag temporarily.  once we are done
-             * processing we reset the flags to the original value*/
-            btflags |= ((flags & DETECT_CI_FLAGS_DCE_LE) ?
-                      DETECT_BYTETEST_LITTLE: 0);
-        }
-
-        if (DetectBytetestDoMatch(det_ctx, s, smd->ctx, buffer, buffer_len, btflags,
-                                  offset, value) != 1) {
-            goto no_match;
-        }
-
-        goto match;
-
-    } else if (smd->type == DETECT_BYTEJUMP) {
-        DetectBytejumpData *bjd = (DetectBytejumpData *)smd->ctx;
-        uint8_t bjflags = bjd->flags;
-        int32_t offset = bjd->offset;
-
-        if (bjflags & DETECT_BYTEJUMP_OFFSET_BE) {
-            offset = det_ctx->bj_values[offset];
-        }
-
-        /* if we have dce enabled we will have to use the endianness
-         * specified by the dce header */
-        if (bjflags & DETECT_BYTEJUMP_DCE) {
-            /* enable the endianness flag temporarily.  once we are done
-             * processing we reset the flags to the original value*/
-            bjflags |= ((flags & DETECT_CI_FLAGS_DCE_LE) ?
-                      DETECT_BYTEJUMP_LITTLE: 0);
-        }
-
-        if (DetectBytejumpDoMatch(det_ctx, s, smd->ctx, buffer, buffer_len,
-                                  bjflags, offset) != 1) {
-            goto no_match;
-        }
-
-        goto match;
-
-    } else if (smd->type == DETECT_BYTE_EXTRACT) {
-
-        DetectByteExtractData *bed = (DetectByteExtractData *)smd->ctx;
-        uint8_t endian = bed->endian;
-
-        /* if we have dce enabled we will have to use the endianness
-         * specified by the dce header */
-        if ((bed->flags & DETECT_BYTE_EXTRACT_FLAG_ENDIAN) &&
-            endian == DETECT_BYTE_EXTRACT_ENDIAN_DCE &&
-            flags & (DETECT_CI_FLAGS_DCE_LE|DETECT_CI_FLAGS_DCE_BE)) {
-
-            /* enable the endianness flag temporarily.  once we are done
-             * processing we reset the flags to the original value*/
-            endian |= ((flags & DETECT_CI_FLAGS_DCE_LE) ?
-                       DETECT_BYTE_EXTRACT_ENDIAN_LITTLE : DETECT_BYTE_EXTRACT_ENDIAN_BIG);
-        }
-
-        if (DetectByteExtractDoMatch(det_ctx, smd, s, buffer,
-                                     buffer_len,
-                                     &det_ctx->bj_values[bed->local_id],
-                                     endian) != 1) {
-            goto no_match;
-        }
-
-        goto match;
-
-    } else if (smd->type == DETECT_BSIZE) {
-
-        bool eof = (flags & DETECT_CI_FLAGS_END);
-        const uint64_t data_size = buffer_len + stream_start_offset;
-        int r = DetectBsizeMatch(smd->ctx, data_size, eof);
-        if (r < 0) {
-            det_ctx->discontinue_matching = 1;
-            goto no_match;
-
-        } else if (r == 0) {
-            goto no_match;
-        }
-        goto match;
-
-    } else if (smd->type == DETECT_AL_URILEN) {
-        SCLogDebug("inspecting uri len");
-
-        int r = 0;
-        DetectUrilenData *urilend = (DetectUrilenData *) smd->ctx;
-
-        switch (urilend->mode) {
-            case DETECT_URILEN_EQ:
-                if (buffer_len == urilend->urilen1)
-                    r = 1;
-                break;
-            case DETECT_URILEN_LT:
-                if (buffer_len < urilend->urilen1)
-                    r = 1;
-                break;
-            case DETECT_URILEN_GT:
-                if (buffer_len > urilend->urilen1)
-                    r = 1;
-                break;
-            case DETECT_URILEN_RA:
-                if (buffer_len > urilend->urilen1 &&
-                    buffer_len < urilend->urilen2) {
-                    r = 1;
-                }
-                break;
-        }
-
-        if (r == 1) {
+    } else if (DetectContentInspectIsSingle(smd->type)) {
+        if (DetectContentInspectSingle(det_ctx, s, smd, f, buffer, buffer_len,
+                    stream_start_offset, flags) == 1) {
             goto match;
         }
-
-        det_ctx->discontinue_matching = 0;
-
         goto no_match;
-#ifdef HAVE_LUA
-    }
-    else if (smd->type == DETECT_LUA) {
-        SCLogDebug("lua starting");
-
-        if (DetectLuaMatchBuffer(det_ctx, s, smd, buffer, buffer_len,
-                    det_ctx->buffer_offset, f) != 1)
-        {
-            SCLogDebug("lua no_match");
-            goto no_match;
-        }
-        SCLogDebug("lua match");
-        goto match;
-#endif /* HAVE_LUA */
+
     } else if (smd->type == DETECT_BASE64_DECODE) {
         if (DetectBase64DecodeDoMatch(det_ctx, s, smd, buffer, buffer_len)) {
             if (s->sm_arrays[DETECT_SM_LIST_BASE64_DATA] != NULL) {
@@ -613,7 +1130,7 @@ match:
      * the buffer portion of the signature matched. */
     if (!smd->is_last) {
         KEYWORD_PROFILING_END(det_ctx, smd->type, 1);
-        int r = DetectEngineContentInspection(de_ctx, det_ctx, s, smd+1,
+        int r = DetectEngineContentInspectionList(de_ctx, det_ctx, s, smd+1,
                 p, f, buffer, buffer_len, stream_start_offset, flags,
                 inspection_mode);
         SCReturnInt(r);
@@ -623,6 +1140,33 @@ final_match:
     SCReturnInt(1);
 }
 
+/**
+ * \brief Run the content inspection of a list, using the compiled program
+ *        of the list if there is one.
+ *
+ * See DetectEngineContentInspectionList() for the parameters.
+ *
+ *  \retval 0 no match
+ *  \retval 1 match
+ */
+int DetectEngineContentInspection(DetectEngineCtx *de_ctx, DetectEngineThreadCtx *det_ctx,
+                                  const Signature *s, const SigMatchData *smd,
+                                  Packet *p, Flow *f,
+                                  uint8_t *buffer, uint32_t buffer_len,
+                                  uint32_t stream_start_offset, uint8_t flags,
+                                  uint8_t inspection_mode)
+{
+    const DetectCiProgram *prog = DetectCiProgramGet(s, smd);
+    if (prog != NULL) {
+        return DetectEngineContentInspectionRun(de_ctx, det_ctx, s, prog,
+                p, f, buffer, buffer_len, stream_start_offset, flags,
+                inspection_mode);
+    }
+    return DetectEngineContentInspectionList(de_ctx, det_ctx, s, smd,
+            p, f, buffer, buffer_len, stream_start_offset, flags,
+            inspection_mode);
+}
+
 #ifdef UNITTESTS
 #include "tests/detect-engine-content-inspection.c"
 #endif
@@ -51,6 +51,10 @@ int DetectEngineContentInspection(DetectEngineCtx *de_ctx, DetectEngineThreadCtx
                                   uint32_t stream_start_offset, uint8_t flags,
                                   uint8_t inspection_mode);
 
+void DetectEngineContentInspectionCompile(const DetectEngineCtx *de_ctx,
+        Signature *s, const SigMatchData *smd);
+void DetectEngineContentInspectionFreePrograms(Signature *s);
+
 void DetectEngineContentInspectionRegisterTests(void);
 
 #endif /* __DETECT_ENGINE_CONTENT_INSPECTION_H__ */
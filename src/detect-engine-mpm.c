@@ -55,6 +55,7 @@
 #include "stream.h"
 
 #include "util-enum.h"
+#include "util-cpu.h"
 #include "util-debug.h"
 #include "util-print.h"
 #include "util-validate.h"
@@ -1004,10 +1005,131 @@ void MpmStoreFree(DetectEngineCtx *de_ctx)
 
     HashListTableFree(de_ctx->mpm_hash_table);
     de_ctx->mpm_hash_table = NULL;
+
+    SCFree(de_ctx->mpm_prepare_queue);
+    de_ctx->mpm_prepare_queue = NULL;
+    de_ctx->mpm_prepare_queue_cnt = 0;
+    de_ctx->mpm_prepare_queue_size = 0;
     return;
 }
 
-static void MpmStoreSetup(const DetectEngineCtx *de_ctx, MpmStore *ms)
+/** \internal
+ *  \brief queue a unique mpm ctx to be prepared by DetectMpmPrepareQueued()
+ *
+ *  If the queue can't be grown the ctx is prepared right away.
+ */
+static void MpmStoreQueuePrepare(DetectEngineCtx *de_ctx, MpmCtx *mpm_ctx)
+{
+    if (de_ctx->mpm_prepare_queue_cnt == de_ctx->mpm_prepare_queue_size) {
+        uint32_t size = de_ctx->mpm_prepare_queue_size ?
+            de_ctx->mpm_prepare_queue_size * 2 : 64;
+        void *ptmp = SCRealloc(de_ctx->mpm_prepare_queue,
+                size * sizeof(MpmCtx *));
+        if (ptmp == NULL) {
+            mpm_table[mpm_ctx->mpm_type].Prepare(mpm_ctx);
+            return;
+        }
+        de_ctx->mpm_prepare_queue = ptmp;
+        de_ctx->mpm_prepare_queue_size = size;
+    }
+    de_ctx->mpm_prepare_queue[de_ctx->mpm_prepare_queue_cnt++] = mpm_ctx;
+}
+
+#define MPM_PREPARE_MAX_THREADS 64
+
+typedef struct MpmPrepareJob_ {
+    MpmCtx **queue;
+    uint32_t cnt;
+    SC_ATOMIC_DECLARE(unsigned int, next);
+    SC_ATOMIC_DECLARE(unsigned int, errors);
+} MpmPrepareJob;
+
+static void *MpmPrepareWorker(void *arg)
+{
+    MpmPrepareJob *job = (MpmPrepareJob *)arg;
+
+    while (1) {
+        const unsigned int i = SC_ATOMIC_ADD(job->next, 1) - 1;
+        if (i >= job->cnt)
+            break;
+
+        MpmCtx *mpm_ctx = job->queue[i];
+        if (mpm_table[mpm_ctx->mpm_type].Prepare(mpm_ctx) != 0)
+            (void)SC_ATOMIC_ADD(job->errors, 1);
+    }
+    return NULL;
+}
+
+/**
+ *  \brief prepare the unique mpm contexts queued by MpmStoreSetup()
+ *
+ *  The pattern compilation of the per rule group mpm's is the most
+ *  expensive part of building the engine. Each ctx is independent of the
+ *  others, so they are handed out to a number of short lived threads.
+ *  The ctx's are only read by the runtime after this completes, so the
+ *  order in which they are prepared doesn't influence the result.
+ *
+ *  The number of threads is set by detect.mpm-prepare-threads, defaulting
+ *  to the number of cpus.
+ *
+ *  \retval 0 ok
+ *  \retval -1 one or more ctx's failed to prepare
+ */
+int DetectMpmPrepareQueued(DetectEngineCtx *de_ctx)
+{
+    MpmPrepareJob job;
+    memset(&job, 0, sizeof(job));
+    job.queue = de_ctx->mpm_prepare_queue;
+    job.cnt = de_ctx->mpm_prepare_queue_cnt;
+    SC_ATOMIC_INIT(job.next);
+    SC_ATOMIC_INIT(job.errors);
+
+    if (job.cnt == 0)
+        goto end;
+
+    intmax_t threads = 0;
+    if (ConfGetInt("detect.mpm-prepare-threads", &threads) != 1 || threads <= 0)
+        threads = UtilCpuGetNumProcessorsOnline();
+    if (threads > (intmax_t)job.cnt)
+        threads = job.cnt;
+    if (threads > MPM_PREPARE_MAX_THREADS)
+        threads = MPM_PREPARE_MAX_THREADS;
+
+    pthread_t tids[MPM_PREPARE_MAX_THREADS];
+    int spawned = 0;
+    for (int t = 0; t < threads - 1; t++) {
+        if (pthread_create(&tids[spawned], NULL, MpmPrepareWorker, &job) != 0) {
+            SCLogDebug("failed to start mpm prepare thread, continuing with %d",
+                    spawned + 1);
+            break;
+        }
+        spawned++;
+    }
+    /* this thread takes part as well */
+    MpmPrepareWorker(&job);
+    for (int t = 0; t < spawned; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    SCLogDebug("prepared %u mpm ctx's using %d threads", job.cnt, spawned + 1);
+
+end:
+    SCFree(de_ctx->mpm_prepare_queue);
+    de_ctx->mpm_prepare_queue = NULL;
+    de_ctx->mpm_prepare_queue_cnt = 0;
+    de_ctx->mpm_prepare_queue_size = 0;
+
+    const unsigned int errors = SC_ATOMIC_GET(job.errors);
+    SC_ATOMIC_DESTROY(job.next);
+    SC_ATOMIC_DESTROY(job.errors);
+    if (errors > 0) {
+        SCLogError(SC_ERR_DETECT_PREPARE, "%u mpm contexts failed to prepare",
+                errors);
+        return -1;
+    }
+    return 0;
+}
+
+static void MpmStoreSetup(DetectEngineCtx *de_ctx, MpmStore *ms)
 {
     const Signature *s = NULL;
     uint32_t sig;
@@ -1051,6 +1173,13 @@ static void MpmStoreSetup(const DetectEngineCtx *de_ctx, MpmStore *ms)
 
     MpmInitCtx(ms->mpm_ctx, de_ctx->mpm_matcher);
 
+    if (de_ctx->mpm_stream_mode &&
+        (ms->buffer == MPMB_TCP_STREAM_TS || ms->buffer == MPMB_TCP_STREAM_TC) &&
+        mpm_table[ms->mpm_ctx->mpm_type].StreamSearch != NULL)
+    {
+        ms->mpm_ctx->flags |= MPMCTX_FLAGS_STREAM;
+    }
+
     /* add the patterns */
     for (sig = 0; sig < (ms->sid_array_size * 8); sig++) {
         if (ms->sid_array[sig / 8] & (1 << (sig % 8))) {
@@ -1097,7 +1226,7 @@ static void MpmStoreSetup(const DetectEngineCtx *de_ctx, MpmStore *ms)
     } else {
         if (ms->sgh_mpm_context == MPM_CTX_FACTORY_UNIQUE_CONTEXT) {
             if (mpm_table[ms->mpm_ctx->mpm_type].Prepare != NULL) {
-                mpm_table[ms->mpm_ctx->mpm_type].Prepare(ms->mpm_ctx);
+                MpmStoreQueuePrepare(de_ctx, ms->mpm_ctx);
             }
         }
     }
@@ -0,0 +1,300 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Mask and alproto filter of the non-prefilter rules of a rule group.
+ *
+ * Every packet runs all non-prefilter rules of its rule group through
+ * the SignatureMask and alproto checks. The rules are stored as
+ * structure of arrays, so the checks can be done for 16 (SSE2) or 32
+ * (AVX2) rules at once. The result is a bitmap of the surviving rules
+ * that is turned into the candidate id list. The implementation is
+ * selected at runtime based on the CPU.
+ */
+
+#include "suricata-common.h"
+#include "detect.h"
+#include "detect-engine-nonpf.h"
+#include "util-cpu.h"
+#include "util-unittest.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define NONPF_HAVE_SSE2 1
+#endif
+
+#if defined(__x86_64__) && (defined(__clang__) || \
+        (defined(__GNUC__) && __GNUC__ >= 5))
+#include <immintrin.h>
+#define NONPF_HAVE_AVX2 1
+#endif
+
+typedef uint32_t (*NonPfFilterFunc)(const SignatureNonPrefilterStore *,
+        uint32_t, SignatureMask, uint8_t, SigIntId *);
+
+static uint32_t NonPfFilterScalar(const SignatureNonPrefilterStore *store,
+        uint32_t cnt, SignatureMask mask, uint8_t alproto, SigIntId *out);
+
+/** set by DetectNonPfSetup() before the detect threads start */
+static NonPfFilterFunc nonpf_filter = NonPfFilterScalar;
+
+/**
+ *  \brief allocate the arrays for cnt rules, padded to DETECT_NONPF_BATCH
+ *
+ *  \retval 0 ok, -1 error
+ */
+int DetectNonPfStoreAlloc(SignatureNonPrefilterStore *store, uint32_t cnt)
+{
+    memset(store, 0, sizeof(*store));
+
+    const uint32_t size = (cnt + DETECT_NONPF_BATCH - 1) &
+        ~(DETECT_NONPF_BATCH - 1);
+    store->id = SCCalloc(size, sizeof(SigIntId));
+    store->mask = SCCalloc(size, sizeof(SignatureMask));
+    store->alproto = SCCalloc(size, sizeof(uint8_t));
+    if (store->id == NULL || store->mask == NULL || store->alproto == NULL) {
+        DetectNonPfStoreFree(store);
+        return -1;
+    }
+    return 0;
+}
+
+void DetectNonPfStoreSet(SignatureNonPrefilterStore *store, uint32_t idx,
+        const Signature *s)
+{
+    store->id[idx] = s->num;
+    store->mask[idx] = s->mask;
+    store->alproto[idx] = (uint8_t)s->alproto;
+}
+
+void DetectNonPfStoreFree(SignatureNonPrefilterStore *store)
+{
+    SCFree(store->id);
+    SCFree(store->mask);
+    SCFree(store->alproto);
+    memset(store, 0, sizeof(*store));
+}
+
+static uint32_t NonPfFilterScalar(const SignatureNonPrefilterStore *store,
+        uint32_t cnt, SignatureMask mask, uint8_t alproto, SigIntId *out)
+{
+    uint32_t n = 0;
+    for (uint32_t x = 0; x < cnt; x++) {
+        /* only if the mask matches this rule can possibly match,
+         * so build the non_mpm array only for match candidates */
+        const SignatureMask rule_mask = store->mask[x];
+        const uint8_t rule_alproto = store->alproto[x];
+        if ((rule_mask & mask) == rule_mask &&
+                (rule_alproto == 0 || rule_alproto == alproto)) {
+            out[n++] = store->id[x];
+        }
+    }
+    return n;
+}
+
+#if defined(NONPF_HAVE_SSE2) || defined(NONPF_HAVE_AVX2)
+/** \internal
+ *  \brief add the ids of the rules set in bits to out */
+static inline uint32_t NonPfEmit(const SigIntId *id, uint32_t bits,
+        SigIntId *out)
+{
+    uint32_t n = 0;
+    while (bits) {
+        out[n++] = id[__builtin_ctz(bits)];
+        bits &= bits - 1;
+    }
+    return n;
+}
+
+/** \internal
+ *  \brief clear the bits of the padding after the last rule */
+static inline uint32_t NonPfTrim(uint32_t bits, uint32_t left)
+{
+    return left < 32 ? bits & ((1U << left) - 1) : bits;
+}
+#endif
+
+#ifdef NONPF_HAVE_SSE2
+static uint32_t NonPfFilterSSE2(const SignatureNonPrefilterStore *store,
+        uint32_t cnt, SignatureMask mask, uint8_t alproto, SigIntId *out)
+{
+    const __m128i pkt_mask = _mm_set1_epi8((char)mask);
+    const __m128i pkt_alproto = _mm_set1_epi8((char)alproto);
+    const __m128i zero = _mm_setzero_si128();
+
+    uint32_t n = 0;
+    for (uint32_t x = 0; x < cnt; x += 16) {
+        const __m128i rule_mask = _mm_loadu_si128((const __m128i *)(store->mask + x));
+        const __m128i rule_alproto = _mm_loadu_si128((const __m128i *)(store->alproto + x));
+
+        const __m128i mask_ok = _mm_cmpeq_epi8(_mm_and_si128(rule_mask, pkt_mask),
+                rule_mask);
+        const __m128i alproto_ok = _mm_or_si128(_mm_cmpeq_epi8(rule_alproto, zero),
+                _mm_cmpeq_epi8(rule_alproto, pkt_alproto));
+        uint32_t bits = (uint32_t)_mm_movemask_epi8(_mm_and_si128(mask_ok, alproto_ok));
+        bits = NonPfTrim(bits, cnt - x);
+        n += NonPfEmit(store->id + x, bits, out + n);
+    }
+    return n;
+}
+#endif
+
+#ifdef NONPF_HAVE_AVX2
+__attribute__((target("avx2")))
+static uint32_t NonPfFilterAVX2(const SignatureNonPrefilterStore *store,
+        uint32_t cnt, SignatureMask mask, uint8_t alproto, SigIntId *out)
+{
+    const __m256i pkt_mask = _mm256_set1_epi8((char)mask);
+    const __m256i pkt_alproto = _mm256_set1_epi8((char)alproto);
+    const __m256i zero = _mm256_setzero_si256();
+
+    uint32_t n = 0;
+    for (uint32_t x = 0; x < cnt; x += 32) {
+        const __m256i rule_mask = _mm256_loadu_si256((const __m256i *)(store->mask + x));
+        const __m256i rule_alproto = _mm256_loadu_si256((const __m256i *)(store->alproto + x));
+
+        const __m256i mask_ok = _mm256_cmpeq_epi8(_mm256_and_si256(rule_mask, pkt_mask),
+                rule_mask);
+        const __m256i alproto_ok = _mm256_or_si256(_mm256_cmpeq_epi8(rule_alproto, zero),
+                _mm256_cmpeq_epi8(rule_alproto, pkt_alproto));
+        uint32_t bits = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(mask_ok, alproto_ok));
+        bits = NonPfTrim(bits, cnt - x);
+        n += NonPfEmit(store->id + x, bits, out + n);
+    }
+    return n;
+}
+#endif
+
+/**
+ *  \brief add the ids of the rules from store that can match a packet
+ *         with mask and alproto to out
+ *
+ *  \param out array with room for cnt ids
+ *
+ *  \retval number of ids added to out
+ */
+uint32_t DetectNonPfFilter(const SignatureNonPrefilterStore *store,
+        uint32_t cnt, SignatureMask mask, uint8_t alproto, SigIntId *out)
+{
+    return nonpf_filter(store, cnt, mask, alproto, out);
+}
+
+/**
+ *  \brief select the filter implementation for the CPU we run on
+ */
+void DetectNonPfSetup(void)
+{
+    const char *name = "scalar";
+    nonpf_filter = NonPfFilterScalar;
+#ifdef NONPF_HAVE_SSE2
+    name = "sse2";
+    nonpf_filter = NonPfFilterSSE2;
+#endif
+#ifdef NONPF_HAVE_AVX2
+    if (UtilCpuHasAVX2()) {
+        name = "avx2";
+        nonpf_filter = NonPfFilterAVX2;
+    }
+#endif
+    SCLogDebug("using %s non-prefilter rule filter", name);
+}
+
+#ifdef UNITTESTS
+static int NonPfCompare(NonPfFilterFunc func,
+        const SignatureNonPrefilterStore *store, uint32_t cnt)
+{
+    SigIntId expect[cnt + 1], got[cnt + 1];
+
+    for (int m = 0; m < 256; m += 7) {
+        for (uint8_t alproto = 0; alproto < 4; alproto++) {
+            uint32_t e = NonPfFilterScalar(store, cnt, (SignatureMask)m,
+                    alproto, expect);
+            uint32_t g = func(store, cnt, (SignatureMask)m, alproto, got);
+            if (e != g || memcmp(expect, got, e * sizeof(SigIntId)) != 0)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/** \test vector implementations agree with the scalar one, including
+ *        counts that don't fill the last batch */
+static int DetectNonPfTest01(void)
+{
+    const uint32_t counts[] = { 0, 1, 15, 16, 17, 31, 32, 33, 100 };
+    uint32_t rnd = 1;
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        const uint32_t cnt = counts[c];
+        SignatureNonPrefilterStore store;
+        FAIL_IF(DetectNonPfStoreAlloc(&store, cnt) != 0);
+
+        for (uint32_t i = 0; i < cnt; i++) {
+            rnd = rnd * 1103515245 + 12345;
+            store.id[i] = (SigIntId)(i * 3);
+            store.mask[i] = (SignatureMask)(rnd >> 16) & (rnd >> 24);
+            store.alproto[i] = (uint8_t)((rnd >> 8) % 4);
+        }
+        /* padding must never be reported */
+        if (cnt % DETECT_NONPF_BATCH)
+            store.id[cnt] = 0xffff;
+
+#ifdef NONPF_HAVE_SSE2
+        FAIL_IF_NOT(NonPfCompare(NonPfFilterSSE2, &store, cnt));
+#endif
+#ifdef NONPF_HAVE_AVX2
+        if (UtilCpuHasAVX2()) {
+            FAIL_IF_NOT(NonPfCompare(NonPfFilterAVX2, &store, cnt));
+        }
+#endif
+        FAIL_IF_NOT(NonPfCompare(DetectNonPfFilter, &store, cnt));
+        DetectNonPfStoreFree(&store);
+    }
+    PASS;
+}
+
+/** \test a rule without alproto and mask matches everything */
+static int DetectNonPfTest02(void)
+{
+    SignatureNonPrefilterStore store;
+    FAIL_IF(DetectNonPfStoreAlloc(&store, 3) != 0);
+    store.id[0] = 1;
+    store.id[1] = 2;
+    store.mask[1] = SIG_MASK_REQUIRE_PAYLOAD;
+    store.id[2] = 3;
+    store.alproto[2] = 5;
+
+    SigIntId out[3];
+    FAIL_IF(DetectNonPfFilter(&store, 3, 0, 0, out) != 1);
+    FAIL_IF(out[0] != 1);
+    FAIL_IF(DetectNonPfFilter(&store, 3, SIG_MASK_REQUIRE_PAYLOAD, 5, out) != 3);
+    FAIL_IF(out[0] != 1 || out[1] != 2 || out[2] != 3);
+
+    DetectNonPfStoreFree(&store);
+    PASS;
+}
+#endif /* UNITTESTS */
+
+void DetectNonPfRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("DetectNonPfTest01", DetectNonPfTest01);
+    UtRegisterTest("DetectNonPfTest02", DetectNonPfTest02);
+#endif /* UNITTESTS */
+}
@@ -0,0 +1,41 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Mask and alproto filter of the non-prefilter rules of a rule group.
+ */
+
+#ifndef __DETECT_ENGINE_NONPF_H__
+#define __DETECT_ENGINE_NONPF_H__
+
+/** number of rules checked at once, the store arrays are padded to it */
+#define DETECT_NONPF_BATCH 32
+
+int DetectNonPfStoreAlloc(SignatureNonPrefilterStore *store, uint32_t cnt);
+void DetectNonPfStoreSet(SignatureNonPrefilterStore *store, uint32_t idx,
+        const Signature *s);
+void DetectNonPfStoreFree(SignatureNonPrefilterStore *store);
+
+uint32_t DetectNonPfFilter(const SignatureNonPrefilterStore *store,
+        uint32_t cnt, SignatureMask mask, uint8_t alproto, SigIntId *out);
+
+void DetectNonPfSetup(void);
+void DetectNonPfRegisterTests(void);
+
+#endif /* __DETECT_ENGINE_NONPF_H__ */
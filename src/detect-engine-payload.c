@@ -51,12 +51,26 @@
 struct StreamMpmData {
     DetectEngineThreadCtx *det_ctx;
     const MpmCtx *mpm_ctx;
+    /** stream holding the streaming mpm state, NULL if the mpm_ctx
+     *  doesn't use stream mode */
+    TcpStream *stream;
 };
 
-static int StreamMpmFunc(void *cb_data, const uint8_t *data, const uint32_t data_len)
+static int StreamMpmFunc(void *cb_data, const uint8_t *data, const uint32_t data_len,
+        const uint64_t data_offset)
 {
     struct StreamMpmData *smd = cb_data;
-    if (data_len >= smd->mpm_ctx->minlen) {
+    if (smd->stream != NULL) {
+        /* short chunks are scanned too, their data can be part of a
+         * match crossing into the next chunk */
+#ifdef DEBUG
+        smd->det_ctx->stream_mpm_cnt++;
+        smd->det_ctx->stream_mpm_size += data_len;
+#endif
+        (void)mpm_table[smd->mpm_ctx->mpm_type].StreamSearch(smd->mpm_ctx,
+                &smd->det_ctx->mtcs, &smd->det_ctx->pmq,
+                &smd->stream->mpm_state, data, data_len, data_offset);
+    } else if (data_len >= smd->mpm_ctx->minlen) {
 #ifdef DEBUG
         smd->det_ctx->stream_mpm_cnt++;
         smd->det_ctx->stream_mpm_size += data_len;
@@ -79,7 +93,12 @@ static void PrefilterPktStream(DetectEngineThreadCtx *det_ctx,
     if (p->flags & PKT_DETECT_HAS_STREAMDATA) {
         SCLogDebug("PRE det_ctx->raw_stream_progress %"PRIu64,
                 det_ctx->raw_stream_progress);
-        struct StreamMpmData stream_mpm_data = { det_ctx, mpm_ctx };
+        struct StreamMpmData stream_mpm_data = { det_ctx, mpm_ctx, NULL };
+        if (mpm_ctx->flags & MPMCTX_FLAGS_STREAM) {
+            TcpSession *ssn = p->flow->protoctx;
+            stream_mpm_data.stream = PKT_IS_TOSERVER(p) ?
+                &ssn->client : &ssn->server;
+        }
         StreamReassembleRaw(p->flow->protoctx, p,
                 StreamMpmFunc, &stream_mpm_data,
                 &det_ctx->raw_stream_progress,
@@ -224,7 +243,8 @@ struct StreamContentInspectData {
     Flow *f;
 };
 
-static int StreamContentInspectFunc(void *cb_data, const uint8_t *data, const uint32_t data_len)
+static int StreamContentInspectFunc(void *cb_data, const uint8_t *data, const uint32_t data_len,
+        const uint64_t data_offset)
 {
     SCEnter();
     int r = 0;
@@ -282,7 +302,8 @@ struct StreamContentInspectEngineData {
     Flow *f;
 };
 
-static int StreamContentInspectEngineFunc(void *cb_data, const uint8_t *data, const uint32_t data_len)
+static int StreamContentInspectEngineFunc(void *cb_data, const uint8_t *data, const uint32_t data_len,
+        const uint64_t data_offset)
 {
     SCEnter();
     int r = 0;
@@ -41,7 +41,9 @@
  *
  * After the engines have run the resulting list of match candidates is
  * sorted by the rule id's so that the individual inspection happens in
- * the correct order.
+ * the correct order. For packets this is left to the caller, which may
+ * merge the candidates using a bitmap instead, see
+ * PrefilterSortCandidates().
  */
 
 #include "suricata-common.h"
@@ -175,15 +177,17 @@ void Prefilter(DetectEngineThreadCtx *det_ctx, const SigGroupHead *sgh,
         }
         PACKET_PROFILING_DETECT_END(p, PROF_DETECT_PF_PAYLOAD);
     }
+    SCReturn;
+}
 
-    /* Sort the rule list to lets look at pmq.
-     * NOTE due to merging of 'stream' pmqs we *MAY* have duplicate entries */
+/** \brief sort the candidates the packet engines of Prefilter() added
+ *
+ *  NOTE due to merging of 'stream' pmqs we *MAY* have duplicate entries */
+void PrefilterSortCandidates(DetectEngineThreadCtx *det_ctx)
+{
     if (likely(det_ctx->pmq.rule_id_array_cnt > 1)) {
-        PACKET_PROFILING_DETECT_START(p, PROF_DETECT_PF_SORT1);
         QuickSortSigIntId(det_ctx->pmq.rule_id_array, det_ctx->pmq.rule_id_array_cnt);
-        PACKET_PROFILING_DETECT_END(p, PROF_DETECT_PF_SORT1);
     }
-    SCReturn;
 }
 
 int PrefilterAppendEngine(DetectEngineCtx *de_ctx, SigGroupHead *sgh,
@@ -34,6 +34,7 @@ typedef struct PrefilterStore_ {
 
 void Prefilter(DetectEngineThreadCtx *, const SigGroupHead *, Packet *p,
         const uint8_t flags);
+void PrefilterSortCandidates(DetectEngineThreadCtx *det_ctx);
 
 int PrefilterAppendEngine(DetectEngineCtx *de_ctx, SigGroupHead *sgh,
         void (*Prefilter)(DetectEngineThreadCtx *det_ctx, Packet *p, const void *pectx),
@@ -35,6 +35,7 @@
 #include "detect-engine.h"
 #include "detect-engine-address.h"
 #include "detect-engine-mpm.h"
+#include "detect-engine-nonpf.h"
 #include "detect-engine-siggroup.h"
 #include "detect-engine-prefilter.h"
 
@@ -160,17 +161,11 @@ void SigGroupHeadFree(const DetectEngineCtx *de_ctx, SigGroupHead *sgh)
         sgh->match_array = NULL;
     }
 
-    if (sgh->non_pf_other_store_array != NULL) {
-        SCFree(sgh->non_pf_other_store_array);
-        sgh->non_pf_other_store_array = NULL;
-        sgh->non_pf_other_store_cnt = 0;
-    }
+    DetectNonPfStoreFree(&sgh->non_pf_other_store);
+    sgh->non_pf_other_store_cnt = 0;
 
-    if (sgh->non_pf_syn_store_array != NULL) {
-        SCFree(sgh->non_pf_syn_store_array);
-        sgh->non_pf_syn_store_array = NULL;
-        sgh->non_pf_syn_store_cnt = 0;
-    }
+    DetectNonPfStoreFree(&sgh->non_pf_syn_store);
+    sgh->non_pf_syn_store_cnt = 0;
 
     sgh->sig_cnt = 0;
 
@@ -652,7 +647,7 @@ int SigGroupHeadBuildNonPrefilterArray(DetectEngineCtx *de_ctx, SigGroupHead *sg
     if (sgh == NULL)
         return 0;
 
-    BUG_ON(sgh->non_pf_other_store_array != NULL);
+    BUG_ON(sgh->non_pf_other_store.id != NULL);
 
     for (sig = 0; sig < sgh->sig_cnt; sig++) {
         s = sgh->match_array[sig];
@@ -668,21 +663,17 @@ int SigGroupHeadBuildNonPrefilterArray(DetectEngineCtx *de_ctx, SigGroupHead *sg
     }
 
     if (non_pf == 0 && non_pf_syn == 0) {
-        sgh->non_pf_other_store_array = NULL;
-        sgh->non_pf_syn_store_array = NULL;
         return 0;
     }
 
     if (non_pf > 0) {
-        sgh->non_pf_other_store_array = SCMalloc(non_pf * sizeof(SignatureNonPrefilterStore));
-        BUG_ON(sgh->non_pf_other_store_array == NULL);
-        memset(sgh->non_pf_other_store_array, 0, non_pf * sizeof(SignatureNonPrefilterStore));
+        int r = DetectNonPfStoreAlloc(&sgh->non_pf_other_store, non_pf);
+        BUG_ON(r != 0);
     }
 
     if (non_pf_syn > 0) {
-        sgh->non_pf_syn_store_array = SCMalloc(non_pf_syn * sizeof(SignatureNonPrefilterStore));
-        BUG_ON(sgh->non_pf_syn_store_array == NULL);
-        memset(sgh->non_pf_syn_store_array, 0, non_pf_syn * sizeof(SignatureNonPrefilterStore));
+        int r = DetectNonPfStoreAlloc(&sgh->non_pf_syn_store, non_pf_syn);
+        BUG_ON(r != 0);
     }
 
     for (sig = 0; sig < sgh->sig_cnt; sig++) {
@@ -693,18 +684,14 @@ int SigGroupHeadBuildNonPrefilterArray(DetectEngineCtx *de_ctx, SigGroupHead *sg
         if (!(s->flags & SIG_FLAG_PREFILTER) || (s->flags & SIG_FLAG_MPM_NEG)) {
             if (!(DetectFlagsSignatureNeedsSynPackets(s))) {
                 BUG_ON(sgh->non_pf_other_store_cnt >= non_pf);
-                BUG_ON(sgh->non_pf_other_store_array == NULL);
-                sgh->non_pf_other_store_array[sgh->non_pf_other_store_cnt].id = s->num;
-                sgh->non_pf_other_store_array[sgh->non_pf_other_store_cnt].mask = s->mask;
-                sgh->non_pf_other_store_array[sgh->non_pf_other_store_cnt].alproto = s->alproto;
+                DetectNonPfStoreSet(&sgh->non_pf_other_store,
+                        sgh->non_pf_other_store_cnt, s);
                 sgh->non_pf_other_store_cnt++;
             }
 
             BUG_ON(sgh->non_pf_syn_store_cnt >= non_pf_syn);
-            BUG_ON(sgh->non_pf_syn_store_array == NULL);
-            sgh->non_pf_syn_store_array[sgh->non_pf_syn_store_cnt].id = s->num;
-            sgh->non_pf_syn_store_array[sgh->non_pf_syn_store_cnt].mask = s->mask;
-            sgh->non_pf_syn_store_array[sgh->non_pf_syn_store_cnt].alproto = s->alproto;
+            DetectNonPfStoreSet(&sgh->non_pf_syn_store,
+                    sgh->non_pf_syn_store_cnt, s);
             sgh->non_pf_syn_store_cnt++;
         }
     }
@@ -717,6 +704,36 @@ int SigGroupHeadBuildNonPrefilterArray(DetectEngineCtx *de_ctx, SigGroupHead *sg
     return 0;
 }
 
+/** \brief use the bitmap candidate merge for this sgh, unless its
+ *         signatures are spread over too large a part of the sig_array.
+ *
+ *  The bitmap merge scans the words between the lowest and highest
+ *  candidate, which is bounded by the spread of the sgh's signatures.
+ */
+void SigGroupHeadSetPrefilterBitmapFlag(SigGroupHead *sgh)
+{
+    SigIntId first = 0, last = 0;
+    int found = 0;
+
+    if (sgh == NULL || sgh->match_array == NULL)
+        return;
+
+    for (uint32_t sig = 0; sig < sgh->sig_cnt; sig++) {
+        const Signature *s = sgh->match_array[sig];
+        if (s == NULL)
+            continue;
+        if (!found) {
+            first = s->num;
+            found = 1;
+        }
+        last = s->num;
+    }
+
+    if (found && (last / 64) - (first / 64) < SGH_PF_BITMAP_MAX_WORDS) {
+        sgh->flags |= SIG_GROUP_HEAD_PF_BITMAP;
+    }
+}
+
 /**
  * \brief Check if a SigGroupHead contains a Signature, whose sid is sent as an
  *        argument.
@@ -73,5 +73,9 @@ uint16_t SigGroupHeadGetMinMpmSize(DetectEngineCtx *de_ctx,
                                    SigGroupHead *sgh, int list);
 
 int SigGroupHeadBuildNonPrefilterArray(DetectEngineCtx *de_ctx, SigGroupHead *sgh);
+/** max number of bitmap words the signatures of a sgh may span for the
+ *  bitmap candidate merge, beyond that the sort merge is used */
+#define SGH_PF_BITMAP_MAX_WORDS 512
+void SigGroupHeadSetPrefilterBitmapFlag(SigGroupHead *sgh);
 
 #endif /* __DETECT_ENGINE_SIGGROUP_H__ */
@@ -35,6 +35,9 @@
 #include "util-unittest.h"
 #include "util-unittest-helper.h"
 #include "util-debug.h"
+#include "util-conf.h"
+#include "util-path.h"
+#include "util-fmemopen.h"
 #include "util-action.h"
 #include "action-globals.h"
 #include "flow-util.h"
@@ -64,6 +67,18 @@
 #define DETECT_XBITS_TYPE_SET_READ 3
 #define DETECT_XBITS_TYPE_SET      4
 
+/** profiled cost of a rule, from the detect.rule-cost-file */
+typedef struct SCSigCost_ {
+    uint32_t gid;
+    uint32_t sid;
+    /** average ticks per check */
+    int cost;
+} SCSigCost;
+
+typedef struct SCSigCostTable_ {
+    SCSigCost *costs;
+    uint32_t cnt;
+} SCSigCostTable;
 
 /**
  * \brief Registers a keyword-based, signature ordering function
@@ -685,6 +700,131 @@ static int SCSigOrderByPriorityCompare(SCSigSignatureWrapper *sw1,
     return sw2->sig->prio - sw1->sig->prio;
 }
 
+/**
+ * \brief Orders an incoming Signature based on its profiled cost, cheaper
+ *        rules first. Rules without profiling data have cost 0.
+ *
+ * \param sw1 The first signature wrapper
+ * \param sw2 The second signature wrapper
+ */
+static int SCSigOrderByCostCompare(SCSigSignatureWrapper *sw1,
+                                   SCSigSignatureWrapper *sw2)
+{
+    const int c1 = sw1->user[SC_RADIX_USER_DATA_COST];
+    const int c2 = sw2->user[SC_RADIX_USER_DATA_COST];
+    return (c1 < c2) - (c1 > c2);
+}
+
+static int SCSigCostCompareId(const void *a, const void *b)
+{
+    const SCSigCost *c1 = a;
+    const SCSigCost *c2 = b;
+    if (c1->gid != c2->gid)
+        return c1->gid < c2->gid ? -1 : 1;
+    if (c1->sid != c2->sid)
+        return c1->sid < c2->sid ? -1 : 1;
+    return 0;
+}
+
+/**
+ * \brief Parse the rule cost file written by the rule profiling
+ *
+ * Lines are "gid sid rev checks ticks", lines starting with a '#' are
+ * comments.
+ *
+ * \retval 0 ok, -1 on memory error
+ */
+static int SCSigParseCostFile(FILE *fp, SCSigCostTable *table)
+{
+    char line[256];
+    uint32_t size = 0;
+    int lineno = 0;
+
+    while (fgets(line, (int)sizeof(line), fp) != NULL) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\0')
+            continue;
+
+        uint32_t gid, sid, rev;
+        uint64_t checks, ticks;
+        if (sscanf(line, "%"SCNu32" %"SCNu32" %"SCNu32" %"SCNu64" %"SCNu64,
+                    &gid, &sid, &rev, &checks, &ticks) != 5) {
+            SCLogWarning(SC_ERR_INVALID_VALUE, "invalid line %d in rule cost file",
+                    lineno);
+            continue;
+        }
+        if (checks == 0)
+            continue;
+
+        if (table->cnt == size) {
+            uint32_t new_size = size ? size * 2 : 1024;
+            void *ptr = SCRealloc(table->costs, new_size * sizeof(SCSigCost));
+            if (ptr == NULL)
+                return -1;
+            table->costs = ptr;
+            size = new_size;
+        }
+        SCSigCost *c = &table->costs[table->cnt++];
+        c->gid = gid;
+        c->sid = sid;
+        c->cost = (int)MIN(ticks / checks, (uint64_t)INT_MAX);
+    }
+
+    if (table->cnt > 0) {
+        qsort(table->costs, table->cnt, sizeof(SCSigCost), SCSigCostCompareId);
+    }
+    return 0;
+}
+
+/** \brief get the path of the rule cost file, relative paths are in the
+ *         log dir like the profiling output
+ *  \retval 1 if set, 0 if not */
+static int SCSigGetCostFile(char *path, size_t path_size)
+{
+    const char *filename = NULL;
+    if (ConfGet("detect.rule-cost-file", &filename) != 1 || filename == NULL)
+        return 0;
+
+    if (PathIsAbsolute(filename)) {
+        strlcpy(path, filename, path_size);
+    } else {
+        snprintf(path, path_size, "%s/%s", ConfigGetLogDirectory(), filename);
+    }
+    return 1;
+}
+
+static void SCSigLoadCostFile(SCSigCostTable *table)
+{
+    char path[PATH_MAX];
+    if (!SCSigGetCostFile(path, sizeof(path)))
+        return;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        /* first run: the rule profiling hasn't written it yet */
+        SCLogConfig("rule cost file %s not loaded: %s", path, strerror(errno));
+        return;
+    }
+    if (SCSigParseCostFile(fp, table) < 0) {
+        SCLogError(SC_ERR_MEM_ALLOC, "failed to load rule cost file %s", path);
+    } else {
+        SCLogConfig("loaded profiled cost of %u rules from %s", table->cnt, path);
+    }
+    fclose(fp);
+}
+
+static void SCSigSetCost(SCSigSignatureWrapper *sw, const SCSigCostTable *table)
+{
+    if (table->cnt == 0)
+        return;
+
+    SCSigCost key = { .gid = sw->sig->gid, .sid = sw->sig->id };
+    const SCSigCost *c = bsearch(&key, table->costs, table->cnt,
+            sizeof(SCSigCost), SCSigCostCompareId);
+    if (c != NULL)
+        sw->user[SC_RADIX_USER_DATA_COST] = c->cost;
+}
+
 /**
  * \brief Creates a Wrapper around the Signature
  *
@@ -715,12 +855,11 @@ static inline SCSigSignatureWrapper *SCSigAllocSignatureWrapper(Signature *sig)
 }
 
 /**
- * \brief Orders the signatures
- *
- * \param de_ctx Pointer to the Detection Engine Context that holds the
- *               signatures to be ordered
+ * \brief Orders the signatures, using the profiled cost in table if the
+ *        cost ordering is registered
  */
-void SCSigOrderSignatures(DetectEngineCtx *de_ctx)
+static void SCSigOrderSignaturesWithCost(DetectEngineCtx *de_ctx,
+                                        const SCSigCostTable *table)
 {
     Signature *sig = NULL;
     SCSigSignatureWrapper *sigw = NULL;
@@ -732,6 +871,7 @@ void SCSigOrderSignatures(DetectEngineCtx *de_ctx)
     sig = de_ctx->sig_list;
     while (sig != NULL) {
         sigw = SCSigAllocSignatureWrapper(sig);
+        SCSigSetCost(sigw, table);
         /* Push signature wrapper onto a list, order doesn't matter here. */
         sigw->next = sigw_list;
         sigw_list = sigw;
@@ -769,6 +909,23 @@ void SCSigOrderSignatures(DetectEngineCtx *de_ctx)
     SCLogDebug("total signatures reordered by the sigordering module: %d", i);
 }
 
+/**
+ * \brief Orders the signatures
+ *
+ * \param de_ctx Pointer to the Detection Engine Context that holds the
+ *               signatures to be ordered
+ */
+void SCSigOrderSignatures(DetectEngineCtx *de_ctx)
+{
+    SCSigCostTable table = { NULL, 0 };
+    SCSigLoadCostFile(&table);
+
+    SCSigOrderSignaturesWithCost(de_ctx, &table);
+
+    if (table.costs != NULL)
+        SCFree(table.costs);
+}
+
 /**
  * \brief Lets you register the Signature ordering functions.  The order in
  *        which the functions are registered, show the priority.  The first
@@ -792,6 +949,13 @@ void SCSigRegisterSignatureOrderingFuncs(DetectEngineCtx *de_ctx)
     SCSigRegisterSignatureOrderingFunc(de_ctx, SCSigOrderByHostbitsCompare);
     SCSigRegisterSignatureOrderingFunc(de_ctx, SCSigOrderByIPPairbitsCompare);
     SCSigRegisterSignatureOrderingFunc(de_ctx, SCSigOrderByPriorityCompare);
+
+    /* profile guided: only reorders rules that are equal for all of the
+     * above, so their dependencies are still respected */
+    char path[PATH_MAX];
+    if (SCSigGetCostFile(path, sizeof(path))) {
+        SCSigRegisterSignatureOrderingFunc(de_ctx, SCSigOrderByCostCompare);
+    }
 }
 
 /**
@@ -2142,6 +2306,57 @@ end:
     return result;
 }
 
+/** \test rules that are equal otherwise are ordered on their profiled
+ *        cost, rules without cost data first */
+static int SCSigOrderingTest14(void)
+{
+    char buffer[] =
+        "# gid sid rev checks ticks\n"
+        "1 1 1 100 50000\n"
+        "1 2 1 100 1000\n"
+        "1 4 1 0 0\n"
+        "1 5 1 10 100000\n";
+
+    DetectEngineCtx *de_ctx = DetectEngineCtxInit();
+    FAIL_IF_NULL(de_ctx);
+
+    FAIL_IF_NULL(DetectEngineAppendSig(de_ctx,
+                "alert tcp any any -> any any (content:\"a\"; sid:1;)"));
+    FAIL_IF_NULL(DetectEngineAppendSig(de_ctx,
+                "alert tcp any any -> any any (content:\"b\"; sid:2;)"));
+    FAIL_IF_NULL(DetectEngineAppendSig(de_ctx,
+                "alert tcp any any -> any any (content:\"c\"; sid:3;)"));
+    /* expensive, but the priority goes first */
+    FAIL_IF_NULL(DetectEngineAppendSig(de_ctx,
+                "alert tcp any any -> any any (content:\"d\"; priority:1; sid:5;)"));
+
+    FILE *fp = SCFmemopen((void *)buffer, strlen(buffer), "r");
+    FAIL_IF_NULL(fp);
+    SCSigCostTable table = { NULL, 0 };
+    FAIL_IF(SCSigParseCostFile(fp, &table) != 0);
+    fclose(fp);
+    /* no checks means no data */
+    FAIL_IF(table.cnt != 3);
+
+    SCSigRegisterSignatureOrderingFunc(de_ctx, SCSigOrderByPriorityCompare);
+    SCSigRegisterSignatureOrderingFunc(de_ctx, SCSigOrderByCostCompare);
+    SCSigOrderSignaturesWithCost(de_ctx, &table);
+    SCFree(table.costs);
+
+    Signature *sig = de_ctx->sig_list;
+    FAIL_IF(sig->id != 5);
+    sig = sig->next;
+    FAIL_IF(sig->id != 3);
+    sig = sig->next;
+    FAIL_IF(sig->id != 2);
+    sig = sig->next;
+    FAIL_IF(sig->id != 1);
+    FAIL_IF_NOT_NULL(sig->next);
+
+    DetectEngineCtxFree(de_ctx);
+    PASS;
+}
+
 #endif
 
 void SCSigRegisterSignatureOrderingTests(void)
@@ -2161,5 +2376,6 @@ void SCSigRegisterSignatureOrderingTests(void)
     UtRegisterTest("SCSigOrderingTest11", SCSigOrderingTest11);
     UtRegisterTest("SCSigOrderingTest12", SCSigOrderingTest12);
     UtRegisterTest("SCSigOrderingTest13", SCSigOrderingTest13);
+    UtRegisterTest("SCSigOrderingTest14", SCSigOrderingTest14);
 #endif
 }
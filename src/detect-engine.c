@@ -73,6 +73,7 @@
 #include "util-spm.h"
 #include "util-device.h"
 #include "util-var-name.h"
+#include "util-misc.h"
 
 #include "tm-threads.h"
 #include "runmodes.h"
@@ -374,6 +375,7 @@ int DetectEngineAppInspectionEngine2Signature(DetectEngineCtx *de_ctx, Signature
             continue;
 
         ptrs[i] = SigMatchList2DataArray(s->init_data->smlists[i]);
+        DetectEngineContentInspectionCompile(de_ctx, s, ptrs[i]);
         SCLogDebug("ptrs[%d] is set", i);
     }
 
@@ -478,6 +480,7 @@ next:
         /* if engine is added multiple times, we pass it the same list */
         SigMatchData *stream = SigMatchList2DataArray(s->init_data->smlists[DETECT_SM_LIST_PMATCH]);
         BUG_ON(stream == NULL);
+        DetectEngineContentInspectionCompile(de_ctx, s, stream);
         if (s->flags & SIG_FLAG_TOSERVER && !(s->flags & SIG_FLAG_TOCLIENT)) {
             AppendStreamInspectEngine(s, stream, 0, last_id + 1);
         } else if (s->flags & SIG_FLAG_TOCLIENT && !(s->flags & SIG_FLAG_TOSERVER)) {
@@ -842,6 +845,129 @@ int DetectBufferGetActiveList(DetectEngineCtx *de_ctx, Signature *s)
     return 0;
 }
 
+#define INSPECT_ARENA_ALIGN     8
+#define INSPECT_ARENA_MIN_SIZE  4096
+/** shrink the base block if this many resets in a row used at most
+ *  1/INSPECT_ARENA_SHRINK_RATIO of it */
+#define INSPECT_ARENA_SHRINK_RESETS 4096
+#define INSPECT_ARENA_SHRINK_RATIO  4
+#define INSPECT_ARENA_DEFAULT_MEMCAP (64 * 1024 * 1024)
+
+/** \internal
+ *  \brief get size bytes from the arena
+ *  \retval ptr or NULL if we failed to add a block */
+static uint8_t *InspectionBufferArenaAlloc(InspectionBufferArena *arena, uint32_t size)
+{
+    if (unlikely(size > UINT32_MAX - INSPECT_ARENA_ALIGN))
+        return NULL;
+    size = (size + INSPECT_ARENA_ALIGN - 1) & ~(INSPECT_ARENA_ALIGN - 1);
+    if (arena->memcap > 0 && (uint64_t)arena->total + size > arena->memcap) {
+        arena->memcap_hits++;
+        return NULL;
+    }
+
+    uint8_t *ptr;
+    if (likely(arena->size - arena->used >= size)) {
+        ptr = arena->base + arena->used;
+        arena->used += size;
+    } else {
+        InspectionBufferArenaBlock *block = SCMalloc(sizeof(*block) + size);
+        if (unlikely(block == NULL))
+            return NULL;
+        block->next = arena->extra;
+        arena->extra = block;
+        ptr = block->data;
+    }
+
+    arena->total = (arena->total > UINT32_MAX - size) ? UINT32_MAX : arena->total + size;
+    if (arena->total > arena->high_water)
+        arena->high_water = arena->total;
+    return ptr;
+}
+
+static void InspectionBufferArenaFreeExtra(InspectionBufferArena *arena)
+{
+    while (arena->extra != NULL) {
+        InspectionBufferArenaBlock *next = arena->extra->next;
+        SCFree(arena->extra);
+        arena->extra = next;
+    }
+}
+
+/** \internal
+ *  \brief replace the base block by one that holds at least size bytes
+ *  \note the base block must be unused */
+static void InspectionBufferArenaResize(InspectionBufferArena *arena, uint32_t size)
+{
+    arena->low_resets = 0;
+    arena->low_max = 0;
+
+    if (size > UINT32_MAX - INSPECT_ARENA_MIN_SIZE)
+        return;
+    uint32_t new_size = (size + INSPECT_ARENA_MIN_SIZE - 1) &
+        ~(INSPECT_ARENA_MIN_SIZE - 1);
+    new_size = MAX(new_size, INSPECT_ARENA_MIN_SIZE);
+    if (new_size == arena->size)
+        return;
+
+    uint8_t *ptr = SCMalloc(new_size);
+    if (ptr != NULL) {
+        if (arena->base != NULL)
+            SCFree(arena->base);
+        arena->base = ptr;
+        arena->size = new_size;
+    }
+}
+
+/** \internal
+ *  \brief give back all memory handed out by the arena
+ *
+ *  If extra blocks were needed the base block is replaced by one
+ *  that holds everything that was used, so that next time it all fits
+ *  in it. If at most a quarter of a base block above the minimum size
+ *  was used for INSPECT_ARENA_SHRINK_RESETS resets in a row, it's
+ *  shrunk to the most used in those resets.
+ *
+ *  \note no buffer may still point into the arena */
+static void InspectionBufferArenaReset(InspectionBufferArena *arena)
+{
+    if (arena->extra != NULL) {
+        InspectionBufferArenaFreeExtra(arena);
+        InspectionBufferArenaResize(arena, arena->total);
+    } else if (arena->size > INSPECT_ARENA_MIN_SIZE &&
+            arena->total <= arena->size / INSPECT_ARENA_SHRINK_RATIO) {
+        arena->low_max = MAX(arena->low_max, arena->total);
+        if (++arena->low_resets >= INSPECT_ARENA_SHRINK_RESETS) {
+            InspectionBufferArenaResize(arena, arena->low_max);
+        }
+    } else {
+        arena->low_resets = 0;
+        arena->low_max = 0;
+    }
+    arena->used = 0;
+    arena->total = 0;
+}
+
+static void InspectionBufferArenaFree(InspectionBufferArena *arena)
+{
+    InspectionBufferArenaFreeExtra(arena);
+    if (arena->base != NULL) {
+        SCFree(arena->base);
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+/** \internal
+ *  \brief forget the data of a buffer if it came from the arena */
+static inline void InspectionBufferReleaseArena(InspectionBuffer *buffer)
+{
+    if (buffer->arena != NULL) {
+        buffer->buf = NULL;
+        buffer->size = 0;
+        buffer->len = 0;
+    }
+}
+
 void InspectionBufferClean(DetectEngineThreadCtx *det_ctx)
 {
     /* single buffers */
@@ -850,6 +976,7 @@ void InspectionBufferClean(DetectEngineThreadCtx *det_ctx)
         const uint32_t idx = det_ctx->inspect.to_clear_queue[i];
         InspectionBuffer *buffer = &det_ctx->inspect.buffers[idx];
         buffer->inspect = NULL;
+        InspectionBufferReleaseArena(buffer);
     }
     det_ctx->inspect.to_clear_idx = 0;
 
@@ -861,11 +988,29 @@ void InspectionBufferClean(DetectEngineThreadCtx *det_ctx)
         for (uint32_t x = 0; x <= mbuffer->max; x++) {
             InspectionBuffer *buffer = &mbuffer->inspection_buffers[x];
             buffer->inspect = NULL;
+            InspectionBufferReleaseArena(buffer);
         }
         mbuffer->init = 0;
         mbuffer->max = 0;
     }
     det_ctx->multi_inspect.to_clear_idx = 0;
+
+    /* all buffers are released, so the arena can be reused */
+    InspectionBufferArena *arena = &det_ctx->inspect_arena;
+    if (arena->total > 0) {
+        if (det_ctx->tv != NULL && det_ctx->counter_inspect_arena_max > 0) {
+            StatsSetUI64(det_ctx->tv, det_ctx->counter_inspect_arena_max,
+                    (uint64_t)arena->high_water);
+        }
+        if (arena->memcap_hits > 0) {
+            if (det_ctx->tv != NULL && det_ctx->counter_inspect_arena_memcap > 0) {
+                StatsAddUI64(det_ctx->tv, det_ctx->counter_inspect_arena_memcap,
+                        (uint64_t)arena->memcap_hits);
+            }
+            arena->memcap_hits = 0;
+        }
+        InspectionBufferArenaReset(arena);
+    }
 }
 
 InspectionBuffer *InspectionBufferGet(DetectEngineThreadCtx *det_ctx, const int list_id)
@@ -897,6 +1042,9 @@ InspectionBuffer *InspectionBufferMultipleForListGet(InspectionBufferMultipleFor
         InspectionBuffer *to_zero = (InspectionBuffer *)ptr + old_size;
         SCLogDebug("ptr %p to_zero %p", ptr, to_zero);
         memset((uint8_t *)to_zero, 0, (grow_by * sizeof(InspectionBuffer)));
+        for (uint32_t x = 0; x < grow_by; x++) {
+            to_zero[x].arena = fb->arena;
+        }
         fb->inspection_buffers = ptr;
         fb->size = new_size;
     }
@@ -936,7 +1084,7 @@ void InspectionBufferSetup(InspectionBuffer *buffer, const uint8_t *data, const
 
 void InspectionBufferFree(InspectionBuffer *buffer)
 {
-    if (buffer->buf != NULL) {
+    if (buffer->buf != NULL && buffer->arena == NULL) {
         SCFree(buffer->buf);
     }
     memset(buffer, 0, sizeof(*buffer));
@@ -951,6 +1099,18 @@ void InspectionBufferCheckAndExpand(InspectionBuffer *buffer, uint32_t min_size)
     if (likely(buffer->size >= min_size))
         return;
 
+    if (buffer->arena != NULL) {
+        uint8_t *ptr = InspectionBufferArenaAlloc(buffer->arena, min_size);
+        if (ptr != NULL) {
+            if (buffer->size > 0) {
+                memcpy(ptr, buffer->buf, buffer->size);
+            }
+            buffer->buf = ptr;
+            buffer->size = min_size;
+        }
+        return;
+    }
+
     uint32_t new_size = (buffer->size == 0) ? 4096 : buffer->size;
     while (new_size < min_size) {
         new_size *= 2;
@@ -1979,6 +2139,29 @@ static int DetectEngineCtxLoadConf(DetectEngineCtx *de_ctx)
     SCLogDebug("de_ctx->inspection_recursion_limit: %d",
                de_ctx->inspection_recursion_limit);
 
+    int compile = 1;
+    (void)ConfGetBool("detect.inspection-compile", &compile);
+    de_ctx->inspection_compile = (compile != 0);
+
+    int stream_mode = 0;
+    (void)ConfGetBool("detect.mpm-stream-mode", &stream_mode);
+    de_ctx->mpm_stream_mode = (stream_mode != 0);
+
+    de_ctx->inspect_arena_memcap = INSPECT_ARENA_DEFAULT_MEMCAP;
+    const char *arena_memcap = NULL;
+    if (ConfGet("detect.inspection-arena-memcap", &arena_memcap) == 1 &&
+            arena_memcap != NULL) {
+        uint64_t value64 = 0;
+        if (ParseSizeStringU64(arena_memcap, &value64) < 0 ||
+                value64 > UINT32_MAX) {
+            SCLogError(SC_ERR_SIZE_PARSE, "invalid value for "
+                    "detect.inspection-arena-memcap: %s, using the default",
+                    arena_memcap);
+        } else {
+            de_ctx->inspect_arena_memcap = (uint32_t)value64;
+        }
+    }
+
     /* parse port grouping whitelisting settings */
 
     const char *ports = NULL;
@@ -2046,6 +2229,18 @@ static int DetectEngineCtxLoadConf(DetectEngineCtx *de_ctx)
             break;
     }
 
+    int pf_pcre = 0;
+    (void)ConfGetBool("detect.prefilter.pcre", &pf_pcre);
+    if (pf_pcre) {
+#ifdef BUILD_HYPERSCAN
+        de_ctx->prefilter_pcre = true;
+        SCLogConfig("prefilter engines: pcre");
+#else
+        SCLogWarning(SC_ERR_INVALID_YAML_CONF_ENTRY, "detect.prefilter.pcre requires "
+                "Hyperscan support, ignoring");
+#endif
+    }
+
     return 0;
 }
 
@@ -2308,6 +2503,12 @@ static TmEcode ThreadCtxDoInit (DetectEngineCtx *de_ctx, DetectEngineThreadCtx *
         memset(det_ctx->match_array, 0,
                det_ctx->match_array_len * sizeof(Signature *));
 
+        det_ctx->pf_bitmap = SCCalloc((de_ctx->sig_array_len + 63) / 64,
+                sizeof(uint64_t));
+        if (det_ctx->pf_bitmap == NULL) {
+            return TM_ECODE_FAILED;
+        }
+
         RuleMatchCandidateTxArrayInit(det_ctx, de_ctx->sig_array_len);
     }
 
@@ -2338,6 +2539,10 @@ static TmEcode ThreadCtxDoInit (DetectEngineCtx *de_ctx, DetectEngineThreadCtx *
         return TM_ECODE_FAILED;
     }
     det_ctx->inspect.to_clear_idx = 0;
+    for (uint32_t i = 0; i < det_ctx->inspect.buffers_size; i++) {
+        det_ctx->inspect.buffers[i].arena = &det_ctx->inspect_arena;
+    }
+    det_ctx->inspect_arena.memcap = de_ctx->inspect_arena_memcap;
 
     det_ctx->multi_inspect.buffers_size = de_ctx->buffer_type_id;
     det_ctx->multi_inspect.buffers = SCCalloc(det_ctx->multi_inspect.buffers_size, sizeof(InspectionBufferMultipleForList));
@@ -2349,7 +2554,9 @@ static TmEcode ThreadCtxDoInit (DetectEngineCtx *de_ctx, DetectEngineThreadCtx *
         return TM_ECODE_FAILED;
     }
     det_ctx->multi_inspect.to_clear_idx = 0;
-
+    for (uint32_t i = 0; i < det_ctx->multi_inspect.buffers_size; i++) {
+        det_ctx->multi_inspect.buffers[i].arena = &det_ctx->inspect_arena;
+    }
 
     DetectEngineThreadCtxInitKeywords(de_ctx, det_ctx);
     DetectEngineThreadCtxInitGlobalKeywords(det_ctx);
@@ -2415,6 +2622,8 @@ TmEcode DetectEngineThreadCtxInit(ThreadVars *tv, void *initdata, void **data)
 
     /** alert counter setup */
     det_ctx->counter_alerts = StatsRegisterCounter("detect.alert", tv);
+    det_ctx->counter_inspect_arena_max = StatsRegisterMaxCounter("detect.inspect_arena_max", tv);
+    det_ctx->counter_inspect_arena_memcap = StatsRegisterCounter("detect.inspect_arena_memcap", tv);
 #ifdef PROFILING
     det_ctx->counter_mpm_list = StatsRegisterAvgCounter("detect.mpm_list", tv);
     det_ctx->counter_nonmpm_list = StatsRegisterAvgCounter("detect.nonmpm_list", tv);
@@ -2473,6 +2682,8 @@ static DetectEngineThreadCtx *DetectEngineThreadCtxInitForReload(
 
     /** alert counter setup */
     det_ctx->counter_alerts = StatsRegisterCounter("detect.alert", tv);
+    det_ctx->counter_inspect_arena_max = StatsRegisterMaxCounter("detect.inspect_arena_max", tv);
+    det_ctx->counter_inspect_arena_memcap = StatsRegisterCounter("detect.inspect_arena_memcap", tv);
 #ifdef PROFILING
     uint16_t counter_mpm_list = StatsRegisterAvgCounter("detect.mpm_list", tv);
     uint16_t counter_nonmpm_list = StatsRegisterAvgCounter("detect.nonmpm_list", tv);
@@ -2540,6 +2751,8 @@ static void DetectEngineThreadCtxFree(DetectEngineThreadCtx *det_ctx)
     if (det_ctx->match_array != NULL)
         SCFree(det_ctx->match_array);
 
+    SCFree(det_ctx->pf_bitmap);
+
     RuleMatchCandidateTxArrayFree(det_ctx);
 
     if (det_ctx->bj_values != NULL)
@@ -2572,6 +2785,7 @@ static void DetectEngineThreadCtxFree(DetectEngineThreadCtx *det_ctx)
     if (det_ctx->multi_inspect.to_clear_queue) {
         SCFree(det_ctx->multi_inspect.to_clear_queue);
     }
+    InspectionBufferArenaFree(&det_ctx->inspect_arena);
 
     DetectEngineThreadCtxDeinitGlobalKeywords(det_ctx);
     if (det_ctx->de_ctx != NULL) {
@@ -3654,6 +3868,12 @@ int DetectEngineReload(const SCInstance *suri)
         return -1;
     }
 
+#ifdef PROFILING
+    /* the new engine orders its rules on the cost file, so write it
+     * with the cost of the rules of the live engine first */
+    SCProfilingRuleDumpCostLive(old_de_ctx->profile_ctx);
+#endif
+
     /* get new detection engine */
     new_de_ctx = DetectEngineCtxInitWithPrefix(prefix);
     if (new_de_ctx == NULL) {
@@ -4075,6 +4295,88 @@ static int DetectEngineTest09(void)
     return result;
 }
 
+/** \test buffers are carved from the arena, after a reset the base block
+ *        is big enough to hold all of them */
+static int DetectEngineInspectArenaTest01(void)
+{
+    InspectionBufferArena arena;
+    memset(&arena, 0, sizeof(arena));
+    InspectionBuffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.arena = &arena;
+
+    uint8_t data[6000];
+    memset(data, 'a', sizeof(data));
+
+    InspectionBufferSetup(&buffer, data, sizeof(data));
+    InspectionBufferCopy(&buffer, data, 10);
+    FAIL_IF(buffer.inspect_len != 10);
+    FAIL_IF(buffer.size != 10);
+    /* no base block yet */
+    FAIL_IF(arena.extra == NULL);
+    InspectionBufferCopy(&buffer, data, sizeof(data));
+    FAIL_IF(buffer.inspect_len != sizeof(data));
+    FAIL_IF(memcmp(buffer.inspect, data, sizeof(data)) != 0);
+    FAIL_IF(arena.total != 16 + 6000);
+
+    InspectionBufferReleaseArena(&buffer);
+    FAIL_IF(buffer.buf != NULL);
+    InspectionBufferArenaReset(&arena);
+    FAIL_IF(arena.extra != NULL);
+    FAIL_IF(arena.size != 8192);
+    FAIL_IF(arena.high_water != 16 + 6000);
+
+    InspectionBufferSetup(&buffer, data, sizeof(data));
+    InspectionBufferCopy(&buffer, data, 10);
+    InspectionBufferCopy(&buffer, data, sizeof(data));
+    FAIL_IF(arena.extra != NULL);
+    FAIL_IF(buffer.buf != arena.base + 16);
+
+    InspectionBufferReleaseArena(&buffer);
+    InspectionBufferFree(&buffer);
+    InspectionBufferArenaFree(&arena);
+    PASS;
+}
+
+/** \test the base block shrinks after many resets using little of it,
+ *        and allocations over the memcap fail */
+static int DetectEngineInspectArenaTest02(void)
+{
+    InspectionBufferArena arena;
+    memset(&arena, 0, sizeof(arena));
+
+    /* grown by a single big tx */
+    FAIL_IF_NULL(InspectionBufferArenaAlloc(&arena, 100000));
+    InspectionBufferArenaReset(&arena);
+    FAIL_IF(arena.size != 102400);
+
+    for (int i = 0; i < INSPECT_ARENA_SHRINK_RESETS - 1; i++) {
+        FAIL_IF_NULL(InspectionBufferArenaAlloc(&arena, 1000));
+        /* a tx using more than a quarter starts counting again */
+        if (i == 10)
+            FAIL_IF_NULL(InspectionBufferArenaAlloc(&arena, 50000));
+        InspectionBufferArenaReset(&arena);
+    }
+    FAIL_IF(arena.size != 102400);
+    for (int i = 0; i < 12; i++) {
+        FAIL_IF(arena.size != 102400);
+        FAIL_IF_NULL(InspectionBufferArenaAlloc(&arena, 6000));
+        InspectionBufferArenaReset(&arena);
+    }
+    FAIL_IF(arena.size != 8192);
+    FAIL_IF(arena.high_water != 100000);
+
+    arena.memcap = 8192;
+    FAIL_IF_NULL(InspectionBufferArenaAlloc(&arena, 5000));
+    FAIL_IF_NOT_NULL(InspectionBufferArenaAlloc(&arena, 4000));
+    FAIL_IF(arena.memcap_hits != 1);
+    FAIL_IF_NULL(InspectionBufferArenaAlloc(&arena, 3000));
+    FAIL_IF(arena.extra != NULL);
+
+    InspectionBufferArenaFree(&arena);
+    PASS;
+}
+
 #endif
 
 void DetectEngineRegisterTests()
@@ -4086,6 +4388,10 @@ void DetectEngineRegisterTests()
     UtRegisterTest("DetectEngineTest04", DetectEngineTest04);
     UtRegisterTest("DetectEngineTest08", DetectEngineTest08);
     UtRegisterTest("DetectEngineTest09", DetectEngineTest09);
+    UtRegisterTest("DetectEngineInspectArenaTest01",
+            DetectEngineInspectArenaTest01);
+    UtRegisterTest("DetectEngineInspectArenaTest02",
+            DetectEngineInspectArenaTest02);
 #endif
     return;
 }
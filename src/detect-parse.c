@@ -31,6 +31,7 @@
 #include "detect-engine-address.h"
 #include "detect-engine-port.h"
 #include "detect-engine-mpm.h"
+#include "detect-engine-content-inspection.h"
 #include "detect-engine-state.h"
 
 #include "detect-content.h"
@@ -1368,6 +1369,7 @@ void SigFree(Signature *s)
     SigMetadataFree(s);
 
     DetectEngineAppInspectionEngineSignatureFree(s);
+    DetectEngineContentInspectionFreePrograms(s);
 
     SCFree(s);
 }
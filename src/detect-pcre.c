@@ -58,6 +58,11 @@
 #include "app-layer-protos.h"
 #include "app-layer-parser.h"
 #include "util-pages.h"
+#include "detect-engine-prefilter.h"
+
+#ifdef BUILD_HYPERSCAN
+#include <hs.h>
+#endif
 
 /* pcre named substring capture supports only 32byte names, A-z0-9 plus _
  * and needs to start with non-numeric. */
@@ -82,6 +87,9 @@ static int pcre_use_jit = 1;
 static int DetectPcreSetup (DetectEngineCtx *, Signature *, const char *);
 static void DetectPcreFree(void *);
 static void DetectPcreRegisterTests(void);
+#ifdef BUILD_HYPERSCAN
+static int PrefilterSetupPcre(DetectEngineCtx *de_ctx, SigGroupHead *sgh);
+#endif
 
 void DetectPcreRegister (void)
 {
@@ -93,6 +101,9 @@ void DetectPcreRegister (void)
     sigmatch_table[DETECT_PCRE].Free  = DetectPcreFree;
     sigmatch_table[DETECT_PCRE].RegisterTests  = DetectPcreRegisterTests;
     sigmatch_table[DETECT_PCRE].flags = (SIGMATCH_QUOTES_OPTIONAL|SIGMATCH_HANDLE_NEGATION);
+#ifdef BUILD_HYPERSCAN
+    sigmatch_table[DETECT_PCRE].SetupPrefilter = PrefilterSetupPcre;
+#endif
 
     intmax_t val = 0;
 
@@ -586,6 +597,11 @@ static DetectPcreData *DetectPcreParse (DetectEngineCtx *de_ctx,
 
     SCLogDebug("DetectPcreParse: \"%s\"", re);
 
+    /* kept for the pcre prefilter */
+    pd->re_str = SCStrdup(re);
+    if (pd->re_str == NULL)
+        goto error;
+
     /* host header */
     if (check_host_header) {
         if (pd->flags & DETECT_PCRE_CASELESS) {
@@ -624,6 +640,7 @@ static DetectPcreData *DetectPcreParse (DetectEngineCtx *de_ctx,
                 "at offset %" PRId32 ": %s", regexstr, eo, eb);
         goto error;
     }
+    pd->opts = opts;
 
     int options = 0;
 #ifdef PCRE_HAVE_JIT
@@ -682,6 +699,8 @@ error:
         pcre_free(pd->re);
     if (pd != NULL && pd->sd != NULL)
         pcre_free_study(pd->sd);
+    if (pd != NULL)
+        SCFree(pd->re_str);
     if (pd)
         SCFree(pd);
     return NULL;
@@ -925,11 +944,324 @@ static void DetectPcreFree(void *ptr)
         pcre_free(pd->re);
     if (pd->sd != NULL)
         pcre_free_study(pd->sd);
+    SCFree(pd->re_str);
 
     SCFree(pd);
     return;
 }
 
+#ifdef BUILD_HYPERSCAN
+/* pcre prefilter (detect.prefilter.pcre): the payload pcre of the rules of
+ * a rule group that have no other prefilter are compiled into a single
+ * Hyperscan database, which is run over the packet payload and the raw
+ * stream. Only the rules whose expression matched are inspected. An
+ * expression Hyperscan doesn't support exactly, e.g. one using back
+ * references, is compiled with HS_FLAG_PREFILTER, which can match more
+ * than the expression but never less. */
+
+/* scratch prototype, grown as databases are compiled and cloned for each
+ * detect thread */
+static hs_scratch_t *g_pcre_hs_scratch_proto = NULL;
+static SCMutex g_pcre_hs_scratch_mutex = SCMUTEX_INITIALIZER;
+
+typedef struct PrefilterPcreCtx_ {
+    hs_database_t *db;
+    /* rule per expression id */
+    SigIntId *sids;
+    uint32_t sids_cnt;
+    /* rules that are candidates for every packet, as their pcre couldn't
+     * be added to the database */
+    SigIntId *always;
+    uint32_t always_cnt;
+    int thread_ctx_id;
+} PrefilterPcreCtx;
+
+typedef struct PrefilterPcreScan_ {
+    const PrefilterPcreCtx *ctx;
+    PrefilterRuleStore *pmq;
+    hs_scratch_t *scratch;
+} PrefilterPcreScan;
+
+/** \internal
+ *  \brief get the Hyperscan flags for a pcre
+ *
+ *  \retval true if the pcre can be prefiltered with these flags
+ */
+static bool DetectPcreHsFlags(const DetectPcreData *pd, unsigned int *hs_flags)
+{
+    if (pd->re_str == NULL || (pd->flags & (DETECT_PCRE_NEGATE|DETECT_PCRE_RELATIVE)))
+        return false;
+
+    /* anchoring, ungreedy and $ only at the end only narrow the match,
+     * so without them the result is a superset. Any other option, like
+     * extended (/x), changes how the expression is read. */
+    const int supported = PCRE_CASELESS | PCRE_DOTALL | PCRE_MULTILINE |
+        PCRE_ANCHORED | PCRE_DOLLAR_ENDONLY | PCRE_UNGREEDY |
+        PCRE_NO_AUTO_CAPTURE;
+    if (pd->opts & ~supported)
+        return false;
+
+    unsigned int flags = HS_FLAG_SINGLEMATCH;
+    if (pd->opts & PCRE_CASELESS)
+        flags |= HS_FLAG_CASELESS;
+    if (pd->opts & PCRE_DOTALL)
+        flags |= HS_FLAG_DOTALL;
+    if (pd->opts & PCRE_MULTILINE)
+        flags |= HS_FLAG_MULTILINE;
+
+    hs_expr_info_t *info = NULL;
+    hs_compile_error_t *err = NULL;
+    if (hs_expression_info(pd->re_str, flags, &info, &err) != HS_SUCCESS) {
+        hs_free_compile_error(err);
+        err = NULL;
+        flags |= HS_FLAG_PREFILTER;
+        if (hs_expression_info(pd->re_str, flags, &info, &err) != HS_SUCCESS) {
+            SCLogDebug("pcre \"%s\" not supported by Hyperscan: %s",
+                    pd->re_str, err ? err->message : "unknown error");
+            hs_free_compile_error(err);
+            return false;
+        }
+    }
+
+    /* an expression that can match an empty buffer matches every packet */
+    const bool ok = (info->min_width > 0);
+    SCFree(info);
+
+    *hs_flags = flags;
+    return ok;
+}
+
+/**
+ *  \brief get the pcre of a rule that can be used as its prefilter
+ *
+ *  \retval sm the first payload pcre that can be prefiltered, or NULL
+ */
+SigMatch *DetectPcreGetPrefilterSm(const Signature *s)
+{
+    for (SigMatch *sm = s->init_data->smlists[DETECT_SM_LIST_PMATCH];
+            sm != NULL; sm = sm->next) {
+        unsigned int flags;
+        if (sm->type == DETECT_PCRE &&
+                DetectPcreHsFlags((const DetectPcreData *)sm->ctx, &flags))
+            return sm;
+    }
+    return NULL;
+}
+
+static int PrefilterPcreMatch(unsigned int id, unsigned long long from,
+        unsigned long long to, unsigned int flags, void *data)
+{
+    PrefilterPcreScan *scan = data;
+    PrefilterAddSids(scan->pmq, &scan->ctx->sids[id], 1);
+    return 0;
+}
+
+static void PrefilterPcreScanBuffer(PrefilterPcreScan *scan,
+        const uint8_t *buf, const uint32_t len)
+{
+    if (len == 0)
+        return;
+
+    if (hs_scan(scan->ctx->db, (const char *)buf, len, 0, scan->scratch,
+                PrefilterPcreMatch, scan) != HS_SUCCESS) {
+        /* can't tell which rules may match */
+        PrefilterAddSids(scan->pmq, scan->ctx->sids, scan->ctx->sids_cnt);
+    }
+}
+
+static int PrefilterPcreStreamFunc(void *cb_data, const uint8_t *data,
+        const uint32_t data_len, const uint64_t data_offset)
+{
+    PrefilterPcreScanBuffer(cb_data, data, data_len);
+    return 0;
+}
+
+static void PrefilterPcre(DetectEngineThreadCtx *det_ctx,
+        Packet *p, const void *pectx)
+{
+    const PrefilterPcreCtx *ctx = (const PrefilterPcreCtx *)pectx;
+
+    if (ctx->always_cnt > 0)
+        PrefilterAddSids(&det_ctx->pmq, ctx->always, ctx->always_cnt);
+    if (ctx->db == NULL)
+        return;
+
+    PrefilterPcreScan scan = { ctx, &det_ctx->pmq,
+        DetectThreadCtxGetKeywordThreadCtx(det_ctx, ctx->thread_ctx_id) };
+    if (scan.scratch == NULL) {
+        PrefilterAddSids(&det_ctx->pmq, ctx->sids, ctx->sids_cnt);
+        return;
+    }
+
+    /* the rules inspect the stream with the inspect depth applied, so
+     * scan the same data */
+    if (p->flags & PKT_DETECT_HAS_STREAMDATA) {
+        uint64_t unused;
+        StreamReassembleRaw(p->flow->protoctx, p,
+                PrefilterPcreStreamFunc, &scan, &unused, true);
+    }
+    PrefilterPcreScanBuffer(&scan, p->payload, p->payload_len);
+}
+
+static void PrefilterPcreFree(void *ptr)
+{
+    PrefilterPcreCtx *ctx = ptr;
+    if (ctx == NULL)
+        return;
+
+    hs_free_database(ctx->db);
+    SCFree(ctx->sids);
+    SCFree(ctx->always);
+    SCFree(ctx);
+}
+
+static void *PrefilterPcreThreadInit(void *data)
+{
+    hs_scratch_t *scratch = NULL;
+
+    SCMutexLock(&g_pcre_hs_scratch_mutex);
+    if (g_pcre_hs_scratch_proto != NULL &&
+        hs_clone_scratch(g_pcre_hs_scratch_proto, &scratch) != HS_SUCCESS) {
+        scratch = NULL;
+    }
+    SCMutexUnlock(&g_pcre_hs_scratch_mutex);
+
+    return scratch;
+}
+
+static void PrefilterPcreThreadFree(void *ptr)
+{
+    hs_free_scratch(ptr);
+}
+
+/** \internal
+ *  \brief compile the prefilter pcre's of the rule group into a single
+ *         database. If that fails all of its rules become candidates
+ *         for every packet.
+ */
+static int PrefilterPcreCompile(DetectEngineCtx *de_ctx, PrefilterPcreCtx *ctx,
+        const char **exprs, const unsigned int *flags)
+{
+    unsigned int ids[ctx->sids_cnt];
+    for (uint32_t i = 0; i < ctx->sids_cnt; i++)
+        ids[i] = i;
+
+    hs_compile_error_t *err = NULL;
+    if (hs_compile_multi(exprs, flags, ids, ctx->sids_cnt, HS_MODE_BLOCK,
+                NULL, &ctx->db, &err) != HS_SUCCESS) {
+        SCLogWarning(SC_ERR_INITIALIZATION, "failed to compile pcre "
+                "prefilter database: %s", err ? err->message : "unknown error");
+        hs_free_compile_error(err);
+        ctx->db = NULL;
+        return -1;
+    }
+
+    SCMutexLock(&g_pcre_hs_scratch_mutex);
+    hs_error_t r = hs_alloc_scratch(ctx->db, &g_pcre_hs_scratch_proto);
+    SCMutexUnlock(&g_pcre_hs_scratch_mutex);
+    if (r != HS_SUCCESS) {
+        hs_free_database(ctx->db);
+        ctx->db = NULL;
+        return -1;
+    }
+
+    ctx->thread_ctx_id = DetectRegisterThreadCtxFuncs(de_ctx, "pcre-prefilter",
+            PrefilterPcreThreadInit, NULL, PrefilterPcreThreadFree, 1);
+    if (ctx->thread_ctx_id == -1) {
+        hs_free_database(ctx->db);
+        ctx->db = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int PrefilterSetupPcre(DetectEngineCtx *de_ctx, SigGroupHead *sgh)
+{
+    uint32_t cnt = 0;
+    for (uint32_t sig = 0; sig < sgh->sig_cnt; sig++) {
+        const Signature *s = sgh->match_array[sig];
+        if (s == NULL || s->init_data->prefilter_sm == NULL ||
+            s->init_data->prefilter_sm->type != DETECT_PCRE)
+            continue;
+        cnt++;
+    }
+    if (cnt == 0)
+        return 0;
+
+    PrefilterPcreCtx *ctx = SCCalloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return -1;
+    ctx->sids = SCCalloc(cnt, sizeof(SigIntId));
+    ctx->always = SCCalloc(cnt, sizeof(SigIntId));
+    const char **exprs = SCCalloc(cnt, sizeof(char *));
+    unsigned int *flags = SCCalloc(cnt, sizeof(unsigned int));
+    if (ctx->sids == NULL || ctx->always == NULL || exprs == NULL || flags == NULL)
+        goto error;
+
+    for (uint32_t sig = 0; sig < sgh->sig_cnt; sig++) {
+        const Signature *s = sgh->match_array[sig];
+        if (s == NULL || s->init_data->prefilter_sm == NULL ||
+            s->init_data->prefilter_sm->type != DETECT_PCRE)
+            continue;
+
+        /* the 'prefilter' keyword can select a pcre we can't use, such as
+         * one on another buffer */
+        const SigMatch *sm = s->init_data->prefilter_sm;
+        unsigned int f;
+        if (SigMatchListSMBelongsTo(s, sm) == DETECT_SM_LIST_PMATCH &&
+            DetectPcreHsFlags((const DetectPcreData *)sm->ctx, &f)) {
+            exprs[ctx->sids_cnt] = ((const DetectPcreData *)sm->ctx)->re_str;
+            flags[ctx->sids_cnt] = f;
+            ctx->sids[ctx->sids_cnt++] = s->num;
+        } else {
+            ctx->always[ctx->always_cnt++] = s->num;
+        }
+    }
+
+    if (ctx->sids_cnt > 0 && PrefilterPcreCompile(de_ctx, ctx, exprs, flags) != 0) {
+        memcpy(ctx->always + ctx->always_cnt, ctx->sids,
+                ctx->sids_cnt * sizeof(SigIntId));
+        ctx->always_cnt += ctx->sids_cnt;
+        ctx->sids_cnt = 0;
+    }
+    SCFree(exprs);
+    SCFree(flags);
+
+    SCLogDebug("sgh %p: %u pcre prefilter rules, %u always inspected",
+            sgh, ctx->sids_cnt, ctx->always_cnt);
+    return PrefilterAppendPayloadEngine(de_ctx, sgh, PrefilterPcre, ctx,
+            PrefilterPcreFree, "pcre");
+
+error:
+    SCFree(exprs);
+    SCFree(flags);
+    PrefilterPcreFree(ctx);
+    return -1;
+}
+
+/**
+ *  \brief free the scratch prototype of the pcre prefilter
+ */
+void DetectPcrePrefilterCleanup(void)
+{
+    SCMutexLock(&g_pcre_hs_scratch_mutex);
+    if (g_pcre_hs_scratch_proto != NULL) {
+        hs_free_scratch(g_pcre_hs_scratch_proto);
+        g_pcre_hs_scratch_proto = NULL;
+    }
+    SCMutexUnlock(&g_pcre_hs_scratch_mutex);
+}
+#else
+SigMatch *DetectPcreGetPrefilterSm(const Signature *s)
+{
+    return NULL;
+}
+
+void DetectPcrePrefilterCleanup(void)
+{
+}
+#endif /* BUILD_HYPERSCAN */
+
 #ifdef UNITTESTS /* UNITTESTS */
 static int g_file_data_buffer_id = 0;
 static int g_http_header_buffer_id = 0;
@@ -3521,6 +3853,110 @@ static int DetectPcreParseCaptureTest(void)
     PASS;
 }
 
+#ifdef BUILD_HYPERSCAN
+/**
+ * \test pcre only rules are prefiltered by the Hyperscan pcre engine,
+ *       negated pcre's stay non-prefilter rules
+ */
+static int DetectPcrePrefilterTest01(void)
+{
+    uint8_t buf1[] = "xxabbbcxx";
+    uint8_t buf2[] = "nothing to see here";
+    ThreadVars th_v;
+    DetectEngineThreadCtx *det_ctx = NULL;
+
+    memset(&th_v, 0, sizeof(th_v));
+
+    DetectEngineCtx *de_ctx = DetectEngineCtxInit();
+    FAIL_IF_NULL(de_ctx);
+    de_ctx->flags |= DE_QUIET;
+    de_ctx->prefilter_pcre = true;
+
+    Signature *s1 = DetectEngineAppendSig(de_ctx, "alert udp any any -> any any "
+            "(pcre:\"/ab+c/\"; sid:1;)");
+    FAIL_IF_NULL(s1);
+    Signature *s2 = DetectEngineAppendSig(de_ctx, "alert udp any any -> any any "
+            "(pcre:\"/(b)\\1+c/\"; sid:2;)");
+    FAIL_IF_NULL(s2);
+    Signature *s3 = DetectEngineAppendSig(de_ctx, "alert udp any any -> any any "
+            "(content:\"xx\"; pcre:\"/^a/R\"; sid:3;)");
+    FAIL_IF_NULL(s3);
+    Signature *s4 = DetectEngineAppendSig(de_ctx, "alert udp any any -> any any "
+            "(pcre:!\"/abbbc/\"; sid:4;)");
+    FAIL_IF_NULL(s4);
+
+    SigGroupBuild(de_ctx);
+    DetectEngineThreadCtxInit(&th_v, (void *)de_ctx, (void *)&det_ctx);
+
+    FAIL_IF_NOT(s1->flags & SIG_FLAG_PREFILTER);
+    FAIL_IF_NOT(s2->flags & SIG_FLAG_PREFILTER);
+    /* prefiltered by its content */
+    FAIL_IF_NOT(s3->flags & SIG_FLAG_PREFILTER);
+    FAIL_IF(s4->flags & SIG_FLAG_PREFILTER);
+
+    Packet *p = UTHBuildPacket(buf1, sizeof(buf1) - 1, IPPROTO_UDP);
+    FAIL_IF_NULL(p);
+    SigMatchSignatures(&th_v, de_ctx, det_ctx, p);
+    FAIL_IF_NOT(PacketAlertCheck(p, 1));
+    FAIL_IF_NOT(PacketAlertCheck(p, 2));
+    FAIL_IF_NOT(PacketAlertCheck(p, 3));
+    FAIL_IF(PacketAlertCheck(p, 4));
+    UTHFreePackets(&p, 1);
+
+    p = UTHBuildPacket(buf2, sizeof(buf2) - 1, IPPROTO_UDP);
+    FAIL_IF_NULL(p);
+    SigMatchSignatures(&th_v, de_ctx, det_ctx, p);
+    FAIL_IF(PacketAlertCheck(p, 1));
+    FAIL_IF(PacketAlertCheck(p, 2));
+    FAIL_IF_NOT(PacketAlertCheck(p, 4));
+    /* only the non-prefilter rule was a candidate */
+    FAIL_IF_NOT(det_ctx->match_array_cnt == 1);
+    UTHFreePackets(&p, 1);
+
+    DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx);
+    DetectEngineCtxFree(de_ctx);
+    PASS;
+}
+
+/**
+ * \test a pcre with the extended modifier isn't prefiltered, as
+ *       Hyperscan would take its whitespace and comment literally,
+ *       and still matches
+ */
+static int DetectPcrePrefilterTest02(void)
+{
+    uint8_t buf[] = "xxabbbcxx";
+    ThreadVars th_v;
+    DetectEngineThreadCtx *det_ctx = NULL;
+
+    memset(&th_v, 0, sizeof(th_v));
+
+    DetectEngineCtx *de_ctx = DetectEngineCtxInit();
+    FAIL_IF_NULL(de_ctx);
+    de_ctx->flags |= DE_QUIET;
+    de_ctx->prefilter_pcre = true;
+
+    Signature *s = DetectEngineAppendSig(de_ctx, "alert udp any any -> any any "
+            "(pcre:\"/a b+ c # abc/x\"; sid:1;)");
+    FAIL_IF_NULL(s);
+
+    SigGroupBuild(de_ctx);
+    DetectEngineThreadCtxInit(&th_v, (void *)de_ctx, (void *)&det_ctx);
+
+    FAIL_IF(s->flags & SIG_FLAG_PREFILTER);
+
+    Packet *p = UTHBuildPacket(buf, sizeof(buf) - 1, IPPROTO_UDP);
+    FAIL_IF_NULL(p);
+    SigMatchSignatures(&th_v, de_ctx, det_ctx, p);
+    FAIL_IF_NOT(PacketAlertCheck(p, 1));
+    UTHFreePackets(&p, 1);
+
+    DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx);
+    DetectEngineCtxFree(de_ctx);
+    PASS;
+}
+#endif /* BUILD_HYPERSCAN */
+
 #endif /* UNITTESTS */
 
 /**
@@ -3609,6 +4045,10 @@ static void DetectPcreRegisterTests(void)
 
     UtRegisterTest("DetectPcreParseHttpHost", DetectPcreParseHttpHost);
     UtRegisterTest("DetectPcreParseCaptureTest", DetectPcreParseCaptureTest);
+#ifdef BUILD_HYPERSCAN
+    UtRegisterTest("DetectPcrePrefilterTest01", DetectPcrePrefilterTest01);
+    UtRegisterTest("DetectPcrePrefilterTest02", DetectPcrePrefilterTest02);
+#endif
 
 #endif /* UNITTESTS */
 }
@@ -43,6 +43,8 @@ typedef struct DetectPcreData_ {
     uint8_t idx;
     uint8_t captypes[DETECT_PCRE_CAPTURE_MAX];
     uint32_t capids[DETECT_PCRE_CAPTURE_MAX];
+    /* the regex as written in the rule, without the options */
+    char *re_str;
 } DetectPcreData;
 
 /* prototypes */
@@ -56,5 +58,8 @@ int DetectPcrePayloadDoMatch(DetectEngineThreadCtx *, Signature *, SigMatch *,
                              Packet *, uint8_t *, uint16_t);
 void DetectPcreRegister (void);
 
+SigMatch *DetectPcreGetPrefilterSm(const Signature *s);
+void DetectPcrePrefilterCleanup(void);
+
 #endif /* __DETECT_PCRE_H__ */
 
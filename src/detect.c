@@ -43,6 +43,7 @@
 #include "detect-engine-proto.h"
 #include "detect-engine-port.h"
 #include "detect-engine-mpm.h"
+#include "detect-engine-nonpf.h"
 #include "detect-engine-iponly.h"
 #include "detect-engine-threshold.h"
 #include "detect-engine-prefilter.h"
@@ -349,19 +350,65 @@ static inline void DetectPrefilterMergeSort(DetectEngineCtx *de_ctx,
     DEBUG_VALIDATE_BUG_ON((det_ctx->pmq.rule_id_array_cnt + det_ctx->non_pf_id_cnt) < det_ctx->match_array_cnt);
 }
 
+/** \internal
+ *  \brief merge the candidates using the thread's bitmap
+ *
+ *  Produces the same match_array as DetectPrefilterMergeSort(), but
+ *  pmq.rule_id_array doesn't need to be sorted. The mpm ids are or'd into
+ *  the bitmap, which drops their duplicates. The non-prefilter ids are
+ *  xor'd, so that a rule on both lists (negated mpm) is dropped as well.
+ *  The words between the lowest and highest id are then walked in order,
+ *  clearing the bitmap for the next packet.
+ */
+static inline void DetectPrefilterMergeBitmap(DetectEngineCtx *de_ctx,
+                                              DetectEngineThreadCtx *det_ctx)
+{
+    uint64_t * const bitmap = det_ctx->pf_bitmap;
+    Signature **sig_array = de_ctx->sig_array;
+    Signature **match_array = det_ctx->match_array;
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+
+    const SigIntId *ids = det_ctx->pmq.rule_id_array;
+    for (uint32_t i = 0; i < det_ctx->pmq.rule_id_array_cnt; i++) {
+        const uint32_t w = ids[i] / 64;
+        bitmap[w] |= 1ULL << (ids[i] % 64);
+        min = MIN(min, w);
+        max = MAX(max, w);
+    }
+    ids = det_ctx->non_pf_id_array;
+    for (uint32_t i = 0; i < det_ctx->non_pf_id_cnt; i++) {
+        const uint32_t w = ids[i] / 64;
+        bitmap[w] ^= 1ULL << (ids[i] % 64);
+        min = MIN(min, w);
+        max = MAX(max, w);
+    }
+
+    for (uint32_t w = min; w <= max && min != UINT32_MAX; w++) {
+        uint64_t bits = bitmap[w];
+        if (bits == 0)
+            continue;
+        bitmap[w] = 0;
+
+        const uint32_t base = w * 64;
+        do {
+            *match_array++ = sig_array[base + __builtin_ctzll(bits)];
+            bits &= bits - 1;
+        } while (bits);
+    }
+
+    det_ctx->match_array_cnt = match_array - det_ctx->match_array;
+
+    DEBUG_VALIDATE_BUG_ON((det_ctx->pmq.rule_id_array_cnt + det_ctx->non_pf_id_cnt) < det_ctx->match_array_cnt);
+}
+
 static inline void
 DetectPrefilterBuildNonPrefilterList(DetectEngineThreadCtx *det_ctx, SignatureMask mask, uint8_t alproto)
 {
-    uint32_t x = 0;
-    for (x = 0; x < det_ctx->non_pf_store_cnt; x++) {
-        /* only if the mask matches this rule can possibly match,
-         * so build the non_mpm array only for match candidates */
-        const SignatureMask rule_mask = det_ctx->non_pf_store_ptr[x].mask;
-        const uint8_t rule_alproto = det_ctx->non_pf_store_ptr[x].alproto;
-        if ((rule_mask & mask) == rule_mask && (rule_alproto == 0 || rule_alproto == alproto)) {
-            det_ctx->non_pf_id_array[det_ctx->non_pf_id_cnt++] = det_ctx->non_pf_store_ptr[x].id;
-        }
-    }
+    /* only if the mask matches this rule can possibly match,
+     * so build the non_mpm array only for match candidates */
+    det_ctx->non_pf_id_cnt = DetectNonPfFilter(det_ctx->non_pf_store_ptr,
+            det_ctx->non_pf_store_cnt, mask, alproto, det_ctx->non_pf_id_array);
 }
 
 /** \internal
@@ -372,16 +419,16 @@ static inline void
 DetectPrefilterSetNonPrefilterList(const Packet *p, DetectEngineThreadCtx *det_ctx, DetectRunScratchpad *scratch)
 {
     if ((p->proto == IPPROTO_TCP) && (p->tcph != NULL) && (p->tcph->th_flags & TH_SYN)) {
-        det_ctx->non_pf_store_ptr = scratch->sgh->non_pf_syn_store_array;
+        det_ctx->non_pf_store_ptr = &scratch->sgh->non_pf_syn_store;
         det_ctx->non_pf_store_cnt = scratch->sgh->non_pf_syn_store_cnt;
     } else {
-        det_ctx->non_pf_store_ptr = scratch->sgh->non_pf_other_store_array;
+        det_ctx->non_pf_store_ptr = &scratch->sgh->non_pf_other_store;
         det_ctx->non_pf_store_cnt = scratch->sgh->non_pf_other_store_cnt;
     }
     SCLogDebug("sgh non_pf ptr %p cnt %u (syn %p/%u, other %p/%u)",
             det_ctx->non_pf_store_ptr, det_ctx->non_pf_store_cnt,
-            scratch->sgh->non_pf_syn_store_array, scratch->sgh->non_pf_syn_store_cnt,
-            scratch->sgh->non_pf_other_store_array, scratch->sgh->non_pf_other_store_cnt);
+            &scratch->sgh->non_pf_syn_store, scratch->sgh->non_pf_syn_store_cnt,
+            &scratch->sgh->non_pf_other_store, scratch->sgh->non_pf_other_store_cnt);
 }
 
 /** \internal
@@ -718,9 +765,22 @@ static inline void DetectRunPrefilterPkt(
     Prefilter(det_ctx, scratch->sgh, p, scratch->flow_flags);
     /* create match list if we have non-pf and/or pf */
     if (det_ctx->non_pf_store_cnt || det_ctx->pmq.rule_id_array_cnt) {
-        PACKET_PROFILING_DETECT_START(p, PROF_DETECT_PF_SORT2);
-        DetectPrefilterMergeSort(de_ctx, det_ctx);
-        PACKET_PROFILING_DETECT_END(p, PROF_DETECT_PF_SORT2);
+        if (scratch->sgh->flags & SIG_GROUP_HEAD_PF_BITMAP) {
+            PREFILTER_MERGE_PROFILING_START;
+            PACKET_PROFILING_DETECT_START(p, PROF_DETECT_PF_SORT2);
+            DetectPrefilterMergeBitmap(de_ctx, det_ctx);
+            PACKET_PROFILING_DETECT_END(p, PROF_DETECT_PF_SORT2);
+            PREFILTER_MERGE_PROFILING_END(det_ctx, PROF_PF_MERGE_BITMAP);
+        } else {
+            PREFILTER_MERGE_PROFILING_START;
+            PACKET_PROFILING_DETECT_START(p, PROF_DETECT_PF_SORT1);
+            PrefilterSortCandidates(det_ctx);
+            PACKET_PROFILING_DETECT_END(p, PROF_DETECT_PF_SORT1);
+            PACKET_PROFILING_DETECT_START(p, PROF_DETECT_PF_SORT2);
+            DetectPrefilterMergeSort(de_ctx, det_ctx);
+            PACKET_PROFILING_DETECT_END(p, PROF_DETECT_PF_SORT2);
+            PREFILTER_MERGE_PROFILING_END(det_ctx, PROF_PF_MERGE_SORT);
+        }
     }
 
 #ifdef PROFILING
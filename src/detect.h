@@ -343,6 +343,31 @@ struct DetectEngineThreadCtx_;// DetectEngineThreadCtx;
  * both growing and shrinking it.
  * Prefilter and inspection will only deal with 'inspect'. */
 
+/* Bump allocator for the data of the inspection buffers of a det_ctx.
+ * It's reset after each tx by InspectionBufferClean(), so the memory of
+ * transforms and multi buffers is reused without going through the
+ * allocator. If the base block runs out, extra blocks are allocated
+ * and at the next reset the base block is grown to what was used. If it
+ * stays mostly unused for many resets it's shrunk again. */
+
+typedef struct InspectionBufferArenaBlock_ {
+    struct InspectionBufferArenaBlock_ *next;
+    uint8_t data[];
+} InspectionBufferArenaBlock;
+
+typedef struct InspectionBufferArena_ {
+    uint8_t *base;
+    uint32_t size;          /**< size of base */
+    uint32_t used;          /**< bytes of base in use */
+    uint32_t total;         /**< bytes in use incl extra blocks */
+    uint32_t high_water;    /**< max of total */
+    uint32_t memcap;        /**< max of total, 0 for no limit */
+    uint32_t memcap_hits;   /**< allocs refused due to memcap */
+    uint32_t low_resets;    /**< resets in a row using little of base */
+    uint32_t low_max;       /**< max of total over those resets */
+    InspectionBufferArenaBlock *extra;
+} InspectionBufferArena;
+
 typedef struct InspectionBuffer {
     const uint8_t *inspect; /**< active pointer, points either to ::buf or ::orig */
     uint64_t inspect_offset;
@@ -355,6 +380,9 @@ typedef struct InspectionBuffer {
 
     uint32_t orig_len;
     const uint8_t *orig;
+
+    /** if set ::buf is carved from this arena instead of the heap */
+    InspectionBufferArena *arena;
 } InspectionBuffer;
 
 /* inspection buffers are kept per tx (in det_ctx), but some protocols
@@ -368,6 +396,7 @@ typedef struct InspectionBufferMultipleForList {
     uint32_t size;      /**< size in number of elements */
     uint32_t max:31;    /**< max id in use in this run */
     uint32_t init:1;    /**< first time used this run. Used for clean logic */
+    InspectionBufferArena *arena;   /**< arena for new buffers */
 } InspectionBufferMultipleForList;
 
 typedef struct DetectEngineTransforms {
@@ -547,6 +576,10 @@ typedef struct Signature_ {
      * their inspect engines. */
     SigMatchData *sm_arrays[DETECT_SM_LIST_MAX];
 
+    /** compiled content inspection programs, keyed by the list they
+     *  were compiled from. See DetectEngineContentInspectionCompile() */
+    struct DetectCiPrograms_ *ci_programs;
+
     /* memory is still owned by the sm_lists/sm_arrays entry */
     const struct DetectFilestoreData_ *filestore_ctx;
 
@@ -764,6 +797,11 @@ typedef struct DetectEngineCtx_ {
 
     HashListTable *mpm_hash_table;
 
+    /* unique mpm ctx's waiting for DetectMpmPrepareQueued() */
+    MpmCtx **mpm_prepare_queue;
+    uint32_t mpm_prepare_queue_cnt;
+    uint32_t mpm_prepare_queue_size;
+
     /* hash table used to cull out duplicate sigs */
     HashListTable *dup_sig_hash_table;
 
@@ -795,6 +833,16 @@ typedef struct DetectEngineCtx_ {
     /* maximum recursion depth for content inspection */
     int inspection_recursion_limit;
 
+    /** compile the content inspection lists into programs */
+    bool inspection_compile;
+
+    /** search the raw stream with the streaming mode of the mpm, if the
+     *  mpm supports it */
+    bool mpm_stream_mode;
+
+    /** memcap of the inspection buffer arena of each thread */
+    uint32_t inspect_arena_memcap;
+
     /* conf parameter that limits the length of the http request body inspected */
     int hcbd_buffer_limit;
     /* conf parameter that limits the length of the http response body inspected */
@@ -864,6 +912,9 @@ typedef struct DetectEngineCtx_ {
 
     /** are we useing just mpm or also other prefilters */
     enum DetectEnginePrefilterSetting prefilter_setting;
+    /** use the payload pcre of rules without other prefilter as their
+     *  prefilter, see detect.prefilter.pcre */
+    bool prefilter_pcre;
 
     HashListTable *dport_hash_table;
 
@@ -939,10 +990,13 @@ typedef struct HttpReassembledBody_ {
 
 #define DETECT_FILESTORE_MAX 15
 
+/** non-prefilter rules of a rule group, as structure of arrays so that
+ *  DetectNonPfFilter() can check a batch of rules at once. The arrays are
+ *  padded to DETECT_NONPF_BATCH entries. */
 typedef struct SignatureNonPrefilterStore_ {
-    SigIntId id;
-    SignatureMask mask;
-    uint8_t alproto;
+    SigIntId *id;
+    SignatureMask *mask;
+    uint8_t *alproto;
 } SignatureNonPrefilterStore;
 
 /** array of TX inspect rule candidates */
@@ -1001,6 +1055,10 @@ typedef struct DetectEngineThreadCtx_ {
 
     /** id for alert counter */
     uint16_t counter_alerts;
+    /** id for the inspection buffer arena high water mark counter */
+    uint16_t counter_inspect_arena_max;
+    /** id for the inspection buffer arena memcap counter */
+    uint16_t counter_inspect_arena_memcap;
 #ifdef PROFILING
     uint16_t counter_mpm_list;
     uint16_t counter_nonmpm_list;
@@ -1026,6 +1084,9 @@ typedef struct DetectEngineThreadCtx_ {
         uint32_t *to_clear_queue;
     } multi_inspect;
 
+    /** memory for the data of the inspect and multi_inspect buffers */
+    InspectionBufferArena inspect_arena;
+
     /* used to discontinue any more matching */
     uint16_t discontinue_matching;
     uint16_t flags;
@@ -1050,10 +1111,14 @@ typedef struct DetectEngineThreadCtx_ {
     /** size in use */
     SigIntId match_array_cnt;
 
+    /** bitmap indexed by signature num for the candidate merge of rule
+     *  groups with SIG_GROUP_HEAD_PF_BITMAP. All zero between packets. */
+    uint64_t *pf_bitmap;
+
     RuleMatchCandidateTx *tx_candidates;
     uint32_t tx_candidates_size;
 
-    SignatureNonPrefilterStore *non_pf_store_ptr;
+    const SignatureNonPrefilterStore *non_pf_store_ptr;
     uint32_t non_pf_store_cnt;
 
     /** pointer to the current mpm ctx that is stored
@@ -1123,6 +1188,8 @@ typedef struct DetectEngineThreadCtx_ {
 
     struct SCProfilePrefilterData_ *prefilter_perf_data;
     int prefilter_perf_size;
+    /** candidate merge counters, indexed by PROF_PF_MERGE_* */
+    struct SCProfilePrefilterMergeData_ *prefilter_merge_perf_data;
 #endif
 } DetectEngineThreadCtx;
 
@@ -1190,6 +1257,8 @@ enum {
 };
 
 #define SIG_GROUP_HEAD_HAVERAWSTREAM    BIT_U32(0)
+/** merge the prefilter candidates using DetectEngineThreadCtx::pf_bitmap */
+#define SIG_GROUP_HEAD_PF_BITMAP        BIT_U32(1)
 #ifdef HAVE_MAGIC
 #define SIG_GROUP_HEAD_HAVEFILEMAGIC    BIT_U32(20)
 #endif
@@ -1306,9 +1375,9 @@ typedef struct SigGroupHead_ {
     /* non prefilter list excluding SYN rules */
     uint32_t non_pf_other_store_cnt;
     uint32_t non_pf_syn_store_cnt;
-    SignatureNonPrefilterStore *non_pf_other_store_array; // size is non_mpm_store_cnt * sizeof(SignatureNonPrefilterStore)
+    SignatureNonPrefilterStore non_pf_other_store; // holds non_pf_other_store_cnt rules
     /* non mpm list including SYN rules */
-    SignatureNonPrefilterStore *non_pf_syn_store_array; // size is non_mpm_syn_store_cnt * sizeof(SignatureNonPrefilterStore)
+    SignatureNonPrefilterStore non_pf_syn_store; // holds non_pf_syn_store_cnt rules
 
     /** the number of signatures in this sgh that have the filestore keyword
      *  set. */
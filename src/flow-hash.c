@@ -36,6 +36,7 @@
 #include "flow-private.h"
 #include "flow-manager.h"
 #include "flow-storage.h"
+#include "flow-partition.h"
 #include "app-layer-parser.h"
 
 #include "util-time.h"
@@ -52,7 +53,7 @@
 SC_ATOMIC_EXTERN(unsigned int, flow_prune_idx);
 SC_ATOMIC_EXTERN(unsigned int, flow_flags);
 
-static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv);
+static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv, const uint32_t hash);
 
 /** \brief compare two raw ipv6 addrs
  *
@@ -377,8 +378,11 @@ static Flow *FlowGetNew(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p)
         return NULL;
     }
 
-    /* get a flow from the spare queue */
-    f = FlowDequeue(&flow_spare_q);
+    /* get a flow from the thread's own spare list or the spare queue */
+    if (dtv != NULL && dtv->flow_partition != NULL)
+        f = FlowPartitionGetSpare(dtv->flow_partition);
+    if (f == NULL)
+        f = FlowDequeue(&flow_spare_q);
     if (f == NULL) {
         /* If we reached the max memcap, we get a used flow */
         if (!(FLOW_CHECK_MEMCAP(sizeof(Flow) + FlowStorageSize()))) {
@@ -394,7 +398,7 @@ static Flow *FlowGetNew(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p)
                 FlowWakeupFlowManagerThread();
             }
 
-            f = FlowGetUsedFlow(tv, dtv);
+            f = FlowGetUsedFlow(tv, dtv, p->flow_hash);
             if (f == NULL) {
                 /* max memcap reached, so increments the counter */
                 if (tv != NULL && dtv != NULL) {
@@ -458,11 +462,80 @@ static Flow *TcpReuseReplace(ThreadVars *tv, DecodeThreadVars *dtv,
     FlowInit(f, p);
     f->flow_hash = hash;
     f->fb = fb;
+    FlowUpdateState(f, FLOW_STATE_NEW);
 
     f->thread_id = thread_id;
     return f;
 }
 
+/** \internal
+ *  \brief get the bucket for a hash value
+ *
+ *  Buckets in the shared flow hash are returned locked. Buckets of a
+ *  thread's private partition are only ever accessed by that thread,
+ *  so they are not locked.
+ */
+static inline FlowBucket *FlowGetBucket(const FlowPartition *fp, const uint32_t hash)
+{
+    if (fp != NULL)
+        return &fp->hash[hash % fp->hash_size];
+
+    FlowBucket *fb = &flow_hash[hash % flow_config.hash_size];
+    FBLOCK_LOCK(fb);
+    return fb;
+}
+
+static inline void FlowReleaseBucket(const FlowPartition *fp, FlowBucket *fb)
+{
+    if (fp == NULL)
+        FBLOCK_UNLOCK(fb);
+}
+
+/** \brief prefetch the hash buckets and flows for a batch of packets
+ *
+ *  Issues the prefetches for the buckets of all packets first, then for
+ *  the first flow in each bucket, so the cache misses of the lookups in
+ *  FlowGetFlowFromHash() overlap instead of being taken one by one.
+ *
+ *  The bucket heads are read without the bucket lock. The values are only
+ *  used as prefetch hints, so a stale pointer is harmless.
+ *
+ *  \param dtv decode thread vars, to find the thread's partition
+ *  \param pkts decoded packets, p->flow_hash set by FlowSetupPacket()
+ *  \param cnt number of packets
+ */
+void FlowPrefetchBatch(const DecodeThreadVars *dtv, Packet **pkts, const uint32_t cnt)
+{
+    const FlowPartition *fp = (dtv != NULL) ? dtv->flow_partition : NULL;
+    FlowBucket * const hash = fp ? fp->hash : flow_hash;
+    const uint32_t hash_size = fp ? fp->hash_size : flow_config.hash_size;
+    FlowBucket *fbs[FLOW_PREFETCH_BATCH];
+    uint32_t done = 0;
+
+    while (done < cnt) {
+        const uint32_t n = MIN(cnt - done, FLOW_PREFETCH_BATCH);
+        uint32_t i;
+
+        for (i = 0; i < n; i++) {
+            const Packet *p = pkts[done + i];
+            if (!(p->flags & PKT_WANTS_FLOW)) {
+                fbs[i] = NULL;
+                continue;
+            }
+            fbs[i] = &hash[p->flow_hash % hash_size];
+            prefetch(fbs[i]);
+        }
+        for (i = 0; i < n; i++) {
+            if (fbs[i] != NULL) {
+                const Flow *f = fbs[i]->head;
+                if (f != NULL)
+                    prefetch(f);
+            }
+        }
+        done += n;
+    }
+}
+
 /** \brief Get Flow for packet
  *
  * Hash retrieval function for flows. Looks up the hash bucket containing the
@@ -486,8 +559,8 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
 
     /* get our hash bucket and lock it */
     const uint32_t hash = p->flow_hash;
-    FlowBucket *fb = &flow_hash[hash % flow_config.hash_size];
-    FBLOCK_LOCK(fb);
+    const FlowPartition *fp = (dtv != NULL) ? dtv->flow_partition : NULL;
+    FlowBucket *fb = FlowGetBucket(fp, hash);
 
     SCLogDebug("fb %p fb->head %p", fb, fb->head);
 
@@ -495,7 +568,7 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
     if (fb->head == NULL) {
         f = FlowGetNew(tv, dtv, p);
         if (f == NULL) {
-            FBLOCK_UNLOCK(fb);
+            FlowReleaseBucket(fp, fb);
             return NULL;
         }
 
@@ -511,7 +584,7 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
 
         FlowReference(dest, f);
 
-        FBLOCK_UNLOCK(fb);
+        FlowReleaseBucket(fp, fb);
         return f;
     }
 
@@ -529,7 +602,7 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
             if (f == NULL) {
                 f = pf->hnext = FlowGetNew(tv, dtv, p);
                 if (f == NULL) {
-                    FBLOCK_UNLOCK(fb);
+                    FlowReleaseBucket(fp, fb);
                     return NULL;
                 }
                 fb->tail = f;
@@ -546,7 +619,7 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
 
                 FlowReference(dest, f);
 
-                FBLOCK_UNLOCK(fb);
+                FlowReleaseBucket(fp, fb);
                 return f;
             }
 
@@ -573,14 +646,14 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
                 if (unlikely(TcpSessionPacketSsnReuse(p, f, f->protoctx) == 1)) {
                     f = TcpReuseReplace(tv, dtv, fb, f, hash, p);
                     if (f == NULL) {
-                        FBLOCK_UNLOCK(fb);
+                        FlowReleaseBucket(fp, fb);
                         return NULL;
                     }
                 }
 
                 FlowReference(dest, f);
 
-                FBLOCK_UNLOCK(fb);
+                FlowReleaseBucket(fp, fb);
                 return f;
             }
         }
@@ -591,14 +664,14 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
     if (unlikely(TcpSessionPacketSsnReuse(p, f, f->protoctx) == 1)) {
         f = TcpReuseReplace(tv, dtv, fb, f, hash, p);
         if (f == NULL) {
-            FBLOCK_UNLOCK(fb);
+            FlowReleaseBucket(fp, fb);
             return NULL;
         }
     }
 
     FlowReference(dest, f);
 
-    FBLOCK_UNLOCK(fb);
+    FlowReleaseBucket(fp, fb);
     return f;
 }
 
@@ -614,38 +687,51 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
  *
  *  \param tv thread vars
  *  \param dtv decode thread vars (for flow log api thread data)
+ *  \param hash hash of the packet we need a flow for. Its bucket is
+ *              skipped as the caller is working on it.
  *
  *  \retval f flow or NULL
  */
-static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv)
+static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv, const uint32_t hash)
 {
-    uint32_t idx = SC_ATOMIC_GET(flow_prune_idx) % flow_config.hash_size;
-    uint32_t cnt = flow_config.hash_size;
+    /* with a private partition we only ever reuse our own flows */
+    FlowPartition *fp = (dtv != NULL) ? dtv->flow_partition : NULL;
+    FlowBucket *buckets = fp ? fp->hash : flow_hash;
+    const uint32_t hash_size = fp ? fp->hash_size : flow_config.hash_size;
+
+    uint32_t idx = (fp ? fp->prune_idx : SC_ATOMIC_GET(flow_prune_idx)) % hash_size;
+    uint32_t cnt = hash_size;
 
     while (cnt--) {
-        if (++idx >= flow_config.hash_size)
+        if (++idx >= hash_size)
             idx = 0;
 
-        FlowBucket *fb = &flow_hash[idx];
+        FlowBucket *fb = &buckets[idx];
 
-        if (FBLOCK_TRYLOCK(fb) != 0)
+        /* shared buckets: the caller holds the lock on its own bucket
+         * so the trylock will skip it */
+        if (fp == NULL) {
+            if (FBLOCK_TRYLOCK(fb) != 0)
+                continue;
+        } else if (idx == hash % hash_size) {
             continue;
+        }
 
         Flow *f = fb->tail;
         if (f == NULL) {
-            FBLOCK_UNLOCK(fb);
+            FlowReleaseBucket(fp, fb);
             continue;
         }
 
         if (FLOWLOCK_TRYWRLOCK(f) != 0) {
-            FBLOCK_UNLOCK(fb);
+            FlowReleaseBucket(fp, fb);
             continue;
         }
 
         /** never prune a flow that is used by a packet or stream msg
          *  we are currently processing in one of the threads */
         if (SC_ATOMIC_GET(f->use_cnt) > 0) {
-            FBLOCK_UNLOCK(fb);
+            FlowReleaseBucket(fp, fb);
             FLOWLOCK_UNLOCK(f);
             continue;
         }
@@ -664,7 +750,7 @@ static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv)
         f->hprev = NULL;
         f->fb = NULL;
         SC_ATOMIC_SET(fb->next_ts, 0);
-        FBLOCK_UNLOCK(fb);
+        FlowReleaseBucket(fp, fb);
 
         int state = SC_ATOMIC_GET(f->flow_state);
         if (state == FLOW_STATE_NEW)
@@ -693,7 +779,10 @@ static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv)
 
         FLOWLOCK_UNLOCK(f);
 
-        (void) SC_ATOMIC_ADD(flow_prune_idx, (flow_config.hash_size - cnt));
+        if (fp != NULL)
+            fp->prune_idx = idx;
+        else
+            (void) SC_ATOMIC_ADD(flow_prune_idx, (flow_config.hash_size - cnt));
         return f;
     }
 
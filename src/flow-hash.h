@@ -76,6 +76,10 @@ typedef struct FlowBucket_ {
 
 Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *, Flow **);
 
+/** max packets FlowPrefetchBatch() works on at once */
+#define FLOW_PREFETCH_BATCH 64
+void FlowPrefetchBatch(const DecodeThreadVars *dtv, Packet **pkts, const uint32_t cnt);
+
 void FlowDisableTcpReuseHandling(void);
 
 #endif /* __FLOW_HASH_H__ */
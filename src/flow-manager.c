@@ -41,6 +41,8 @@
 #include "flow-private.h"
 #include "flow-timeout.h"
 #include "flow-manager.h"
+#include "flow-partition.h"
+#include "flow-wheel.h"
 
 #include "stream-tcp-private.h"
 #include "stream-tcp-reassemble.h"
@@ -122,6 +124,14 @@ typedef struct FlowTimeoutCounters_ {
     uint32_t rows_empty;
     uint32_t rows_busy;
     uint32_t rows_maxlen;
+
+    uint32_t wheel_expired;
+    uint32_t wheel_rescheduled;
+    uint32_t wheel_stale;
+
+    /** seconds between a flow's timeout and its removal */
+    uint32_t lag_max;
+    uint64_t lag_total;
 } FlowTimeoutCounters;
 
 /**
@@ -194,7 +204,7 @@ again:
     return;
 }
 
-/** \internal
+/**
  *  \brief get timeout for flow
  *
  *  \param f flow
@@ -202,7 +212,7 @@ again:
  *
  *  \retval timeout timeout in seconds
  */
-static inline uint32_t FlowGetFlowTimeout(const Flow *f, enum FlowState state)
+uint32_t FlowGetFlowTimeout(const Flow *f, enum FlowState state)
 {
     uint32_t timeout;
     FlowProtoTimeoutPtr flow_timeouts = SC_ATOMIC_GET(flow_timeouts);
@@ -287,6 +297,87 @@ static int FlowManagerFlowTimedOut(Flow *f, struct timeval *ts)
     return 1;
 }
 
+/** \internal
+ *  \brief remove a timed out flow from the hash and pass it to the
+ *         flow recycler
+ *
+ *  Hash row and flow need to be locked. The flow is unlocked on return.
+ *
+ *  \param f flow
+ *  \param state flow state used to decide that the flow timed out
+ *  \param ts timestamp
+ *  \param emergency bool indicating emergency mode
+ *  \param counters ptr to FlowTimeoutCounters structure
+ */
+static void FlowManagerFlowRemove(Flow *f, enum FlowState state,
+        struct timeval *ts, int emergency, FlowTimeoutCounters *counters)
+{
+    /* remove from the hash */
+    if (f->hprev != NULL)
+        f->hprev->hnext = f->hnext;
+    if (f->hnext != NULL)
+        f->hnext->hprev = f->hprev;
+    if (f->fb->head == f)
+        f->fb->head = f->hnext;
+    if (f->fb->tail == f)
+        f->fb->tail = f->hprev;
+
+    f->hnext = NULL;
+    f->hprev = NULL;
+    f->fb = NULL;
+
+    if (f->flags & FLOW_TCP_REUSED)
+        counters->tcp_reuse++;
+
+    if (state == FLOW_STATE_NEW)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_NEW;
+    else if (state == FLOW_STATE_ESTABLISHED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_ESTABLISHED;
+    else if (state == FLOW_STATE_CLOSED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_CLOSED;
+    else if (state == FLOW_STATE_LOCAL_BYPASSED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_BYPASSED;
+    else if (state == FLOW_STATE_CAPTURE_BYPASSED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_BYPASSED;
+
+    if (emergency)
+        f->flow_end_flags |= FLOW_END_FLAG_EMERGENCY;
+    f->flow_end_flags |= FLOW_END_FLAG_TIMEOUT;
+
+    /* how late are we: the flow timed out the second after
+     * lastts + timeout */
+    const int64_t lag = (int64_t)ts->tv_sec -
+        ((int64_t)f->lastts.tv_sec + FlowGetFlowTimeout(f, state) + 1);
+    if (lag > 0) {
+        counters->lag_total += (uint64_t)lag;
+        if ((uint64_t)lag > counters->lag_max)
+            counters->lag_max = (uint32_t)lag;
+    }
+
+    /* no one is referring to this flow, use_cnt 0, removed from hash
+     * so we can unlock it and pass it to the flow recycler */
+    FLOWLOCK_UNLOCK(f);
+    FlowEnqueue(&flow_recycle_q, f);
+
+    switch (state) {
+        case FLOW_STATE_NEW:
+        default:
+            counters->new++;
+            break;
+        case FLOW_STATE_ESTABLISHED:
+            counters->est++;
+            break;
+        case FLOW_STATE_CLOSED:
+            counters->clo++;
+            break;
+        case FLOW_STATE_LOCAL_BYPASSED:
+        case FLOW_STATE_CAPTURE_BYPASSED:
+            counters->byp++;
+            break;
+    }
+    counters->flows_removed++;
+}
+
 /**
  *  \internal
  *
@@ -296,16 +387,24 @@ static int FlowManagerFlowTimedOut(Flow *f, struct timeval *ts)
  *  \param ts timestamp
  *  \param emergency bool indicating emergency mode
  *  \param counters ptr to FlowTimeoutCounters structure
+ *  \param skip_wheel skip the flows that are in the timer wheel
  *
  *  \retval cnt timed out flows
  */
 static uint32_t FlowManagerHashRowTimeout(Flow *f, struct timeval *ts,
-        int emergency, FlowTimeoutCounters *counters, int32_t *next_ts)
+        int emergency, FlowTimeoutCounters *counters, int32_t *next_ts,
+        const int skip_wheel)
 {
     uint32_t cnt = 0;
     uint32_t checked = 0;
 
     do {
+        /* flows in the wheel are timed out by FlowTimeoutWheel() */
+        if (skip_wheel && FlowWheelIsScheduled(f)) {
+            f = f->hprev;
+            continue;
+        }
+
         checked++;
 
         /* check flow timeout based on lastts and state. Both can be
@@ -337,61 +436,8 @@ static uint32_t FlowManagerHashRowTimeout(Flow *f, struct timeval *ts,
         /* check if the flow is fully timed out and
          * ready to be discarded. */
         if (FlowManagerFlowTimedOut(f, ts) == 1) {
-            /* remove from the hash */
-            if (f->hprev != NULL)
-                f->hprev->hnext = f->hnext;
-            if (f->hnext != NULL)
-                f->hnext->hprev = f->hprev;
-            if (f->fb->head == f)
-                f->fb->head = f->hnext;
-            if (f->fb->tail == f)
-                f->fb->tail = f->hprev;
-
-            f->hnext = NULL;
-            f->hprev = NULL;
-
-            if (f->flags & FLOW_TCP_REUSED)
-                counters->tcp_reuse++;
-
-            if (state == FLOW_STATE_NEW)
-                f->flow_end_flags |= FLOW_END_FLAG_STATE_NEW;
-            else if (state == FLOW_STATE_ESTABLISHED)
-                f->flow_end_flags |= FLOW_END_FLAG_STATE_ESTABLISHED;
-            else if (state == FLOW_STATE_CLOSED)
-                f->flow_end_flags |= FLOW_END_FLAG_STATE_CLOSED;
-            else if (state == FLOW_STATE_LOCAL_BYPASSED)
-                f->flow_end_flags |= FLOW_END_FLAG_STATE_BYPASSED;
-            else if (state == FLOW_STATE_CAPTURE_BYPASSED)
-                f->flow_end_flags |= FLOW_END_FLAG_STATE_BYPASSED;
-
-            if (emergency)
-                f->flow_end_flags |= FLOW_END_FLAG_EMERGENCY;
-            f->flow_end_flags |= FLOW_END_FLAG_TIMEOUT;
-
-            /* no one is referring to this flow, use_cnt 0, removed from hash
-             * so we can unlock it and pass it to the flow recycler */
-            FLOWLOCK_UNLOCK(f);
-            FlowEnqueue(&flow_recycle_q, f);
-
+            FlowManagerFlowRemove(f, state, ts, emergency, counters);
             cnt++;
-
-            switch (state) {
-                case FLOW_STATE_NEW:
-                default:
-                    counters->new++;
-                    break;
-                case FLOW_STATE_ESTABLISHED:
-                    counters->est++;
-                    break;
-                case FLOW_STATE_CLOSED:
-                    counters->clo++;
-                    break;
-                case FLOW_STATE_LOCAL_BYPASSED:
-                case FLOW_STATE_CAPTURE_BYPASSED:
-                    counters->byp++;
-                    break;
-            }
-            counters->flows_removed++;
         } else {
             counters->flows_timeout_inuse++;
             FLOWLOCK_UNLOCK(f);
@@ -415,12 +461,14 @@ static uint32_t FlowManagerHashRowTimeout(Flow *f, struct timeval *ts,
  *  \param hash_min min hash index to consider
  *  \param hash_max max hash index to consider
  *  \param counters ptr to FlowTimeoutCounters structure
+ *  \param skip_wheel only consider the flows that are not in the timer
+ *                    wheel
  *
  *  \retval cnt number of timed out flow
  */
 static uint32_t FlowTimeoutHash(struct timeval *ts, uint32_t try_cnt,
         uint32_t hash_min, uint32_t hash_max,
-        FlowTimeoutCounters *counters)
+        FlowTimeoutCounters *counters, const int skip_wheel)
 {
     uint32_t idx = 0;
     uint32_t cnt = 0;
@@ -460,8 +508,13 @@ static uint32_t FlowTimeoutHash(struct timeval *ts, uint32_t try_cnt,
         int32_t next_ts = 0;
 
         /* we have a flow, or more than one */
-        cnt += FlowManagerHashRowTimeout(fb->tail, ts, emergency, counters, &next_ts);
+        cnt += FlowManagerHashRowTimeout(fb->tail, ts, emergency, counters,
+                &next_ts, skip_wheel);
 
+        /* no flows left to check in this row until one is added or
+         * changes state, which resets next_ts */
+        if (skip_wheel && next_ts == 0)
+            next_ts = INT_MAX;
         SC_ATOMIC_SET(fb->next_ts, next_ts);
 
 next:
@@ -474,6 +527,89 @@ next:
     return cnt;
 }
 
+/**
+ *  \internal
+ *
+ *  \brief time out the flows the timer wheel has due
+ *
+ *  Flows that turn out to be still active are rescheduled based on their
+ *  current lastts. Flows that are no longer in the hash are dropped.
+ *
+ *  \param ts timestamp
+ *  \param emergency bool indicating emergency mode
+ *  \param counters ptr to FlowTimeoutCounters structure
+ *
+ *  \retval cnt number of timed out flows
+ */
+static uint32_t FlowTimeoutWheel(struct timeval *ts, int emergency,
+        FlowTimeoutCounters *counters)
+{
+    Flow *flows[FLOW_WHEEL_BATCH];
+    uint32_t cnt = 0;
+    uint32_t n;
+
+    while ((n = FlowWheelGetDue((uint32_t)ts->tv_sec, flows, FLOW_WHEEL_BATCH)) > 0) {
+        for (uint32_t i = 0; i < n; i++) {
+            Flow *f = flows[i];
+
+            /* f->fb is only changed with the row lock held, so if it still
+             * points to the row after we locked it, the flow is in there */
+            FlowBucket *fb = f->fb;
+            if (fb < flow_hash || fb >= flow_hash + flow_config.hash_size) {
+                counters->wheel_stale++;
+                continue;
+            }
+
+            /* before grabbing the row lock, make sure we have at least
+             * 9 packets in the pool */
+            PacketPoolWaitForN(9);
+
+            FBLOCK_LOCK(fb);
+            if (f->fb != fb) {
+                FBLOCK_UNLOCK(fb);
+                counters->wheel_stale++;
+                continue;
+            }
+
+            counters->flows_checked++;
+
+            enum FlowState state = SC_ATOMIC_GET(f->flow_state);
+            int32_t next_ts = 0;
+            if (FlowManagerFlowTimeout(f, state, ts, &next_ts) == 0) {
+                counters->flows_notimeout++;
+                counters->wheel_rescheduled++;
+                FlowWheelScheduleAt(f, (uint32_t)next_ts + 1);
+                FBLOCK_UNLOCK(fb);
+                continue;
+            }
+
+            /* before grabbing the flow lock, make sure we have at least
+             * 3 packets in the pool */
+            PacketPoolWaitForN(3);
+
+            FLOWLOCK_WRLOCK(f);
+
+            counters->flows_timeout++;
+
+            if (FlowManagerFlowTimedOut(f, ts) == 1) {
+                FlowManagerFlowRemove(f, state, ts, emergency, counters);
+                counters->wheel_expired++;
+                cnt++;
+            } else {
+                /* in use or pseudo packets were injected: try again
+                 * in the next second */
+                counters->flows_timeout_inuse++;
+                FLOWLOCK_UNLOCK(f);
+                FlowWheelScheduleAt(f, (uint32_t)ts->tv_sec + 1);
+            }
+
+            FBLOCK_UNLOCK(fb);
+        }
+    }
+
+    return cnt;
+}
+
 /**
  *  \internal
  *
@@ -506,6 +642,7 @@ static uint32_t FlowManagerHashRowCleanup(Flow *f)
 
         f->hnext = NULL;
         f->hprev = NULL;
+        f->fb = NULL;
 
         if (state == FLOW_STATE_NEW)
             f->flow_end_flags |= FLOW_END_FLAG_STATE_NEW;
@@ -533,14 +670,18 @@ static uint32_t FlowManagerHashRowCleanup(Flow *f)
 /**
  *  \brief remove all flows from the hash
  *
+ *  \param hash array of buckets
+ *  \param hash_size number of buckets
+ *
  *  \retval cnt number of removes out flows
  */
-static uint32_t FlowCleanupHash(void){
+static uint32_t FlowCleanupHash(FlowBucket *hash, const uint32_t hash_size)
+{
     uint32_t idx = 0;
     uint32_t cnt = 0;
 
-    for (idx = 0; idx < flow_config.hash_size; idx++) {
-        FlowBucket *fb = &flow_hash[idx];
+    for (idx = 0; idx < hash_size; idx++) {
+        FlowBucket *fb = &hash[idx];
 
         FBLOCK_LOCK(fb);
 
@@ -583,6 +724,13 @@ typedef struct FlowManagerThreadData_ {
     uint16_t flow_mgr_rows_busy;
     uint16_t flow_mgr_rows_maxlen;
 
+    uint16_t flow_mgr_wheel_flows;
+    uint16_t flow_mgr_wheel_expired;
+    uint16_t flow_mgr_wheel_rescheduled;
+    uint16_t flow_mgr_wheel_stale;
+    uint16_t flow_mgr_lag_max;
+    uint16_t flow_mgr_lag_total;
+
 } FlowManagerThreadData;
 
 static TmEcode FlowManagerThreadInit(ThreadVars *t, const void *initdata, void **data)
@@ -634,6 +782,15 @@ static TmEcode FlowManagerThreadInit(ThreadVars *t, const void *initdata, void *
     ftd->flow_mgr_rows_busy = StatsRegisterCounter("flow_mgr.rows_busy", t);
     ftd->flow_mgr_rows_maxlen = StatsRegisterCounter("flow_mgr.rows_maxlen", t);
 
+    if (FlowWheelEnabled()) {
+        ftd->flow_mgr_wheel_flows = StatsRegisterCounter("flow_mgr.wheel_flows", t);
+        ftd->flow_mgr_wheel_expired = StatsRegisterCounter("flow_mgr.wheel_expired", t);
+        ftd->flow_mgr_wheel_rescheduled = StatsRegisterCounter("flow_mgr.wheel_rescheduled", t);
+        ftd->flow_mgr_wheel_stale = StatsRegisterCounter("flow_mgr.wheel_stale", t);
+    }
+    ftd->flow_mgr_lag_max = StatsRegisterCounter("flow_mgr.timeout_lag_max", t);
+    ftd->flow_mgr_lag_total = StatsRegisterCounter("flow_mgr.timeout_lag_total", t);
+
     PacketPoolInit();
     return TM_ECODE_OK;
 }
@@ -686,6 +843,15 @@ static TmEcode FlowManager(ThreadVars *th_v, void *thread_data)
 
                 SCLogDebug("Flow emergency mode entered...");
 
+                /* the wheel has the flows scheduled with the normal
+                 * timeouts. The packet thread that declared the emergency
+                 * sets the flag before it switches the timeouts, so make
+                 * sure the emergency ones are used. */
+                if (FlowWheelEnabled() && ftd->instance == 1) {
+                    FlowTimeoutsEmergency();
+                    FlowWheelReschedule();
+                }
+
                 StatsIncr(th_v, ftd->flow_emerg_mode_enter);
             }
         }
@@ -699,9 +865,27 @@ static TmEcode FlowManager(ThreadVars *th_v, void *thread_data)
         if (ftd->instance == 1)
             FlowUpdateSpareFlows();
 
+        /* threads without packets don't time out the flows in their
+         * partition, so ask them to */
+        if (ftd->instance == 1 && FlowPartitionEnabled() && TimeModeIsLive())
+            FlowPartitionWakeupIdle((uint32_t)ts.tv_sec);
+
         /* try to time out flows */
-        FlowTimeoutCounters counters = { 0, 0, 0, 0, 0,0,0,0,0,0,0,0,0,0,0};
-        FlowTimeoutHash(&ts, 0 /* check all */, ftd->min, ftd->max, &counters);
+        FlowTimeoutCounters counters = { 0, 0, 0, 0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+        if (FlowWheelEnabled()) {
+            /* the wheel is global, so handled by the first manager */
+            if (ftd->instance == 1)
+                FlowTimeoutWheel(&ts, emerg, &counters);
+            /* the wheel was rescheduled with the emergency timeouts when
+             * entering emergency mode, so only the flows that are not in
+             * it are left to check */
+            if (emerg == TRUE)
+                FlowTimeoutHash(&ts, 0 /* check all */, ftd->min, ftd->max,
+                        &counters, 1);
+        } else {
+            FlowTimeoutHash(&ts, 0 /* check all */, ftd->min, ftd->max,
+                    &counters, 0);
+        }
 
 
         if (ftd->instance == 1) {
@@ -735,10 +919,23 @@ static TmEcode FlowManager(ThreadVars *th_v, void *thread_data)
         StatsSetUI64(th_v, ftd->flow_mgr_rows_busy, (uint64_t)counters.rows_busy);
         StatsSetUI64(th_v, ftd->flow_mgr_rows_empty, (uint64_t)counters.rows_empty);
 
+        if (FlowWheelEnabled()) {
+            if (ftd->instance == 1)
+                StatsSetUI64(th_v, ftd->flow_mgr_wheel_flows, (uint64_t)FlowWheelCount());
+            StatsAddUI64(th_v, ftd->flow_mgr_wheel_expired, (uint64_t)counters.wheel_expired);
+            StatsAddUI64(th_v, ftd->flow_mgr_wheel_rescheduled, (uint64_t)counters.wheel_rescheduled);
+            StatsAddUI64(th_v, ftd->flow_mgr_wheel_stale, (uint64_t)counters.wheel_stale);
+        }
+        StatsSetUI64(th_v, ftd->flow_mgr_lag_max, (uint64_t)counters.lag_max);
+        StatsAddUI64(th_v, ftd->flow_mgr_lag_total, counters.lag_total);
+
         uint32_t len = 0;
         FQLOCK_LOCK(&flow_spare_q);
         len = flow_spare_q.len;
         FQLOCK_UNLOCK(&flow_spare_q);
+        /* flows in the spare lists of the partitions are available too */
+        if (FlowPartitionEnabled())
+            len += FlowPartitionGetSpareCount();
         StatsSetUI64(th_v, ftd->flow_mgr_spare, (uint64_t)len);
 
         /* Don't fear, FlowManagerThread is here...
@@ -1020,7 +1217,12 @@ void FlowDisableFlowRecyclerThread(void)
     int cnt = 0;
 
     /* move all flows still in the hash to the recycler queue */
-    FlowCleanupHash();
+    FlowCleanupHash(flow_hash, flow_config.hash_size);
+    /* packet threads are done, so the per thread tables can be
+     * cleaned up from here as well */
+    for (FlowPartition *fp = FlowPartitionGetList(); fp != NULL; fp = fp->next) {
+        FlowCleanupHash(fp->hash, fp->hash_size);
+    }
 
     /* make sure all flows are processed */
     do {
@@ -1365,8 +1567,8 @@ static int FlowMgrTest05 (void)
     struct timeval ts;
     TimeGet(&ts);
     /* try to time out flows */
-    FlowTimeoutCounters counters = { 0, 0, 0, 0, 0,0,0,0,0,0,0,0,0,0,0};
-    FlowTimeoutHash(&ts, 0 /* check all */, 0, flow_config.hash_size, &counters);
+    FlowTimeoutCounters counters = { 0, 0, 0, 0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+    FlowTimeoutHash(&ts, 0 /* check all */, 0, flow_config.hash_size, &counters, 0);
 
     if (flow_recycle_q.len > 0) {
         result = 1;
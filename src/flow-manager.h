@@ -27,6 +27,7 @@
 #define FlowTimeoutsReset() FlowTimeoutsInit()
 void FlowTimeoutsInit(void);
 void FlowTimeoutsEmergency(void);
+uint32_t FlowGetFlowTimeout(const Flow *f, enum FlowState state);
 
 /** flow manager scheduling condition */
 SCCtrlCondT flow_manager_ctrl_cond;
@@ -0,0 +1,598 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ *  \file
+ *
+ *  Per thread flow tables for the workers runmode.
+ *
+ *  Each worker thread owns a private FlowBucket array. Lookups in it
+ *  don't take the bucket lock and the flow manager never walks it, so
+ *  there is no lock traffic and no cache line sharing between the workers
+ *  and the manager. Timeouts are handled by the owning thread: on every
+ *  packet a small slice of rows is checked, so that a full pass over the
+ *  table is done every second (packet time). A thread that doesn't see
+ *  packets is woken up by the flow manager through the capture method's
+ *  pseudo packet injection, and then checks the full table.
+ */
+
+#include "suricata-common.h"
+#include "threads.h"
+#include "decode.h"
+#include "tm-threads.h"
+
+#include "flow.h"
+#include "flow-hash.h"
+#include "flow-util.h"
+#include "flow-private.h"
+#include "flow-manager.h"
+#include "flow-timeout.h"
+#include "flow-partition.h"
+
+#include "output-flow.h"
+#include "tmqh-packetpool.h"
+
+#include "util-debug.h"
+#include "util-unittest.h"
+#include "util-unittest-helper.h"
+
+/** number of rows checked per FlowPartitionTimeout() call */
+#define FLOW_PARTITION_SWEEP_ROWS   64
+/** max number of flows a partition keeps in its local spare list */
+#define FLOW_PARTITION_SPARE_MAX    256
+
+SC_ATOMIC_EXTERN(unsigned int, flow_flags);
+
+static int flow_partitions_enabled = 0;
+
+static SCMutex flow_partitions_lock = SCMUTEX_INITIALIZER;
+static FlowPartition *flow_partitions = NULL;
+
+int FlowPartitionEnabled(void)
+{
+    return flow_partitions_enabled;
+}
+
+/** \brief enable partitioning if configured and the runmode allows it
+ *
+ *  Partitions are only safe if all packets of a flow are processed
+ *  by a single thread. This is the case for the 'workers' and 'single'
+ *  runmodes.
+ */
+void FlowPartitionCheckRunmode(const char *runmode)
+{
+    flow_partitions_enabled = 0;
+
+    if (!flow_config.partitioned)
+        return;
+
+    if (runmode == NULL ||
+        (strcasecmp(runmode, "workers") != 0 && strcasecmp(runmode, "single") != 0))
+    {
+        SCLogWarning(SC_WARN_COMPATIBILITY, "flow.partitioned is only "
+                "supported in the 'workers' and 'single' runmodes, "
+                "using the shared flow table");
+        return;
+    }
+
+    flow_partitions_enabled = 1;
+    SCLogConfig("using partitioned flow tables: %"PRIu32" buckets per thread",
+            flow_config.partition_hash_size);
+}
+
+/** \brief enable partitioning regardless of flow.partitioned
+ *
+ *  Used by runmodes that need every thread to own its flows, like the
+ *  pcap-file 'workers' runmode where each thread reads different files.
+ *  Must be called from the RunModeFunc, after FlowPartitionCheckRunmode.
+ */
+void FlowPartitionEnable(void)
+{
+    if (flow_partitions_enabled)
+        return;
+
+    flow_partitions_enabled = 1;
+    SCLogConfig("using partitioned flow tables: %"PRIu32" buckets per thread",
+            flow_config.partition_hash_size);
+}
+
+/** \brief setup the flow table for a worker thread
+ *
+ *  \retval fp partition or NULL on error
+ */
+FlowPartition *FlowPartitionNew(ThreadVars *tv)
+{
+    const uint32_t hash_size = flow_config.partition_hash_size;
+    const uint64_t size = (uint64_t)hash_size * sizeof(FlowBucket);
+
+    if (!(FLOW_CHECK_MEMCAP(size + sizeof(FlowPartition)))) {
+        SCLogError(SC_ERR_FLOW_INIT, "allocating flow partition failed: "
+                "max flow memcap is smaller than projected hash size. "
+                "Memcap: %"PRIu64", partition size %"PRIu64,
+                SC_ATOMIC_GET(flow_config.memcap), size);
+        return NULL;
+    }
+
+    FlowPartition *fp = SCCalloc(1, sizeof(*fp));
+    if (unlikely(fp == NULL))
+        return NULL;
+
+    fp->hash = SCMallocAligned(size, CLS);
+    if (unlikely(fp->hash == NULL)) {
+        SCFree(fp);
+        return NULL;
+    }
+    memset(fp->hash, 0, size);
+    fp->hash_size = hash_size;
+    fp->tv = tv;
+    SC_ATOMIC_INIT(fp->spare_cnt);
+    SC_ATOMIC_INIT(fp->swept_sec);
+
+    for (uint32_t u = 0; u < hash_size; u++) {
+        FBLOCK_INIT(&fp->hash[u]);
+        SC_ATOMIC_INIT(fp->hash[u].next_ts);
+    }
+    MemcapShardsIncr(&flow_memuse, size + sizeof(FlowPartition));
+
+    fp->counter_pruned = StatsRegisterCounter("flow.partition.pruned", tv);
+    fp->counter_spare = StatsRegisterCounter("flow.partition.spare", tv);
+
+    SCMutexLock(&flow_partitions_lock);
+    fp->next = flow_partitions;
+    flow_partitions = fp;
+    SCMutexUnlock(&flow_partitions_lock);
+
+    SCLogDebug("partition %p with %u buckets", fp, hash_size);
+    return fp;
+}
+
+/** \brief get a flow from the thread local spare list
+ *  \retval f *unlocked* flow or NULL if the list is empty */
+Flow *FlowPartitionGetSpare(FlowPartition *fp)
+{
+    Flow *f = fp->spare;
+    if (f != NULL) {
+        fp->spare = f->lnext;
+        fp->spare_len--;
+        f->lnext = NULL;
+    }
+    return f;
+}
+
+static void FlowPartitionReturnSpare(FlowPartition *fp, Flow *f)
+{
+    if (fp->spare_len < FLOW_PARTITION_SPARE_MAX) {
+        f->lprev = NULL;
+        f->lnext = fp->spare;
+        fp->spare = f;
+        fp->spare_len++;
+    } else {
+        FlowMoveToSpare(f);
+    }
+}
+
+static inline void FlowPartitionSetEndFlags(Flow *f, enum FlowState state,
+        int emergency, int flush)
+{
+    if (state == FLOW_STATE_NEW)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_NEW;
+    else if (state == FLOW_STATE_ESTABLISHED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_ESTABLISHED;
+    else if (state == FLOW_STATE_CLOSED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_CLOSED;
+    else if (state == FLOW_STATE_LOCAL_BYPASSED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_BYPASSED;
+    else if (state == FLOW_STATE_CAPTURE_BYPASSED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_BYPASSED;
+
+    if (emergency)
+        f->flow_end_flags |= FLOW_END_FLAG_EMERGENCY;
+    if (flush)
+        f->flow_end_flags |= FLOW_END_FLAG_SHUTDOWN;
+    else
+        f->flow_end_flags |= FLOW_END_FLAG_TIMEOUT;
+}
+
+/** \internal
+ *  \brief check all flows in a partition row for timeouts
+ *
+ *  Timed out flows are logged and cleaned up right here, in the thread
+ *  that owns them, instead of being handed to the flow recycler.
+ *
+ *  \param flush end all flows, regardless of their timeout
+ *
+ *  \retval cnt number of flows removed from the row
+ */
+static uint32_t FlowPartitionRowTimeout(ThreadVars *tv, DecodeThreadVars *dtv,
+        FlowPartition *fp, FlowBucket *fb, const struct timeval *ts,
+        int emergency, int flush)
+{
+    uint32_t cnt = 0;
+    int32_t next_ts = 0;
+    Flow *f = fb->tail;
+
+    while (f != NULL) {
+        Flow *next_flow = f->hprev;
+
+        const enum FlowState state = SC_ATOMIC_GET(f->flow_state);
+        const int32_t flow_times_out_at =
+            (int32_t)(f->lastts.tv_sec + FlowGetFlowTimeout(f, state));
+        if (!flush && flow_times_out_at >= ts->tv_sec) {
+            if (next_ts == 0 || flow_times_out_at < next_ts)
+                next_ts = flow_times_out_at;
+            f = next_flow;
+            continue;
+        }
+
+        FLOWLOCK_WRLOCK(f);
+
+        /* still referenced by a packet, possibly a pseudo packet we
+         * injected earlier. Revisit this row next time. */
+        if (SC_ATOMIC_GET(f->use_cnt) > 0) {
+            FLOWLOCK_UNLOCK(f);
+            next_ts = (int32_t)ts->tv_sec;
+            f = next_flow;
+            continue;
+        }
+
+        int server = 0, client = 0;
+        if (!(f->flags & FLOW_TIMEOUT_REASSEMBLY_DONE) &&
+                FlowForceReassemblyNeedReassembly(f, &server, &client) == 1)
+        {
+            /* we can't wait for packets here: we'd wait for ourselves */
+            if (PacketPoolHasN(3)) {
+                FlowForceReassemblyForFlow(f, server, client);
+            }
+            FLOWLOCK_UNLOCK(f);
+            next_ts = (int32_t)ts->tv_sec;
+            f = next_flow;
+            continue;
+        }
+
+        /* remove from the hash */
+        if (f->hprev != NULL)
+            f->hprev->hnext = f->hnext;
+        if (f->hnext != NULL)
+            f->hnext->hprev = f->hprev;
+        if (fb->head == f)
+            fb->head = f->hnext;
+        if (fb->tail == f)
+            fb->tail = f->hprev;
+        f->hnext = NULL;
+        f->hprev = NULL;
+        f->fb = NULL;
+
+        FlowPartitionSetEndFlags(f, state, emergency, flush);
+
+        /* invoke flow log api */
+        if (dtv->output_flow_thread_data)
+            (void)OutputFlowLog(tv, dtv->output_flow_thread_data, f);
+
+        FlowClearMemory(f, f->protomap);
+        FLOWLOCK_UNLOCK(f);
+
+        FlowPartitionReturnSpare(fp, f);
+        cnt++;
+
+        f = next_flow;
+    }
+
+    SC_ATOMIC_SET(fb->next_ts, fb->tail ? next_ts : INT_MAX);
+    return cnt;
+}
+
+/** \internal
+ *  \brief check 'rows' rows of the partition, starting at sweep_idx */
+static void FlowPartitionSweep(ThreadVars *tv, DecodeThreadVars *dtv,
+        FlowPartition *fp, const struct timeval *ts, uint32_t rows,
+        const int emergency, const int flush)
+{
+    uint32_t cnt = 0;
+
+    while (rows--) {
+        FlowBucket *fb = &fp->hash[fp->sweep_idx];
+        if (++fp->sweep_idx >= fp->hash_size)
+            fp->sweep_idx = 0;
+
+        if (!flush && SC_ATOMIC_GET(fb->next_ts) > (int32_t)ts->tv_sec)
+            continue;
+        if (fb->tail == NULL) {
+            SC_ATOMIC_SET(fb->next_ts, INT_MAX);
+            continue;
+        }
+        cnt += FlowPartitionRowTimeout(tv, dtv, fp, fb, ts, emergency, flush);
+    }
+
+    if (cnt > 0) {
+        StatsAddUI64(tv, fp->counter_pruned, (uint64_t)cnt);
+        StatsSetUI64(tv, fp->counter_spare, (uint64_t)fp->spare_len);
+    }
+    if (SC_ATOMIC_GET(fp->spare_cnt) != fp->spare_len)
+        SC_ATOMIC_SET(fp->spare_cnt, fp->spare_len);
+}
+
+/** \brief time out flows in the thread's partition
+ *
+ *  Checks FLOW_PARTITION_SWEEP_ROWS rows per call. Each time the packet
+ *  time enters a new second a new pass over the table is started. In
+ *  emergency mode passes are restarted as soon as they complete.
+ *
+ *  \warning must be called without any flow locked by this thread
+ */
+void FlowPartitionTimeout(ThreadVars *tv, DecodeThreadVars *dtv,
+        const struct timeval *ts)
+{
+    FlowPartition *fp = dtv->flow_partition;
+    const int emergency = (SC_ATOMIC_GET(flow_flags) & FLOW_EMERGENCY) != 0;
+
+    if ((uint32_t)ts->tv_sec != fp->sweep_sec ||
+            (emergency && fp->sweep_left == 0)) {
+        fp->sweep_sec = (uint32_t)ts->tv_sec;
+        fp->sweep_left = fp->hash_size;
+        SC_ATOMIC_SET(fp->swept_sec, fp->sweep_sec);
+    }
+    if (fp->sweep_left == 0)
+        return;
+
+    uint32_t rows = MIN(fp->sweep_left, FLOW_PARTITION_SWEEP_ROWS);
+    fp->sweep_left -= rows;
+    FlowPartitionSweep(tv, dtv, fp, ts, rows, emergency, 0);
+}
+
+/** \brief time out flows in the whole partition
+ *
+ *  Used when the thread is idle, see FlowPartitionWakeupIdle(). The
+ *  current pass is completed by this. After FlowPartitionRequestFlush()
+ *  all flows are ended instead.
+ *
+ *  \warning must be called without any flow locked by this thread
+ */
+void FlowPartitionTimeoutAll(ThreadVars *tv, DecodeThreadVars *dtv,
+        const struct timeval *ts)
+{
+    FlowPartition *fp = dtv->flow_partition;
+    const int emergency = (SC_ATOMIC_GET(flow_flags) & FLOW_EMERGENCY) != 0;
+    const int flush = fp->flush;
+
+    fp->flush = 0;
+    fp->sweep_sec = (uint32_t)ts->tv_sec;
+    fp->sweep_left = 0;
+    SC_ATOMIC_SET(fp->swept_sec, fp->sweep_sec);
+    FlowPartitionSweep(tv, dtv, fp, ts, fp->hash_size, emergency, flush);
+}
+
+/** \brief have the next check of the whole partition of the calling
+ *         thread end all of its flows
+ *
+ *  Used at the end of an input, like a pcap file, so that the output of
+ *  its flows is written before the input is done. The caller then passes
+ *  a pseudo packet without a flow through its pipeline, on which the
+ *  flow worker calls FlowPartitionTimeoutAll(). Flows that still need
+ *  reassembly get pseudo packets in that pass, and are ended by the
+ *  next one.
+ *
+ *  \retval 1 flush requested, 0 no partition or no flows left in it
+ */
+int FlowPartitionRequestFlush(ThreadVars *tv)
+{
+    FlowPartition *fp = NULL;
+
+    SCMutexLock(&flow_partitions_lock);
+    for (fp = flow_partitions; fp != NULL; fp = fp->next) {
+        if (fp->tv == tv)
+            break;
+    }
+    SCMutexUnlock(&flow_partitions_lock);
+    if (fp == NULL)
+        return 0;
+
+    /* the partition is owned by this thread, so no row locks are needed */
+    for (uint32_t u = 0; u < fp->hash_size; u++) {
+        if (fp->hash[u].tail != NULL) {
+            fp->flush = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** \brief ask the threads that didn't check their partition in the last
+ *         second to inject a pseudo packet, on which they check their
+ *         whole partition. Called by the flow manager.
+ *
+ *  Capture methods inject the packet from their idle path, so busy
+ *  threads are not affected.
+ */
+void FlowPartitionWakeupIdle(uint32_t now)
+{
+    SCMutexLock(&flow_partitions_lock);
+    for (FlowPartition *fp = flow_partitions; fp != NULL; fp = fp->next) {
+        if (SC_ATOMIC_GET(fp->swept_sec) + 1 < now)
+            TmThreadsSetFlag(fp->tv, THV_CAPTURE_INJECT_PKT);
+    }
+    SCMutexUnlock(&flow_partitions_lock);
+}
+
+/** \brief number of flows in the spare lists of all partitions, as last
+ *         published by their threads */
+uint32_t FlowPartitionGetSpareCount(void)
+{
+    uint32_t cnt = 0;
+
+    SCMutexLock(&flow_partitions_lock);
+    for (FlowPartition *fp = flow_partitions; fp != NULL; fp = fp->next) {
+        cnt += SC_ATOMIC_GET(fp->spare_cnt);
+    }
+    SCMutexUnlock(&flow_partitions_lock);
+    return cnt;
+}
+
+FlowPartition *FlowPartitionGetList(void)
+{
+    return flow_partitions;
+}
+
+/** \brief free all partitions
+ *  \warning Not thread safe, to be called from FlowShutdown() */
+void FlowPartitionShutdown(void)
+{
+    FlowPartition *fp = flow_partitions;
+    while (fp != NULL) {
+        FlowPartition *next = fp->next;
+
+        for (uint32_t u = 0; u < fp->hash_size; u++) {
+            Flow *f = fp->hash[u].head;
+            while (f != NULL) {
+                Flow *n = f->hnext;
+                uint8_t proto_map = FlowGetProtoMapping(f->proto);
+                FlowClearMemory(f, proto_map);
+                FlowFree(f);
+                f = n;
+            }
+            FBLOCK_DESTROY(&fp->hash[u]);
+            SC_ATOMIC_DESTROY(fp->hash[u].next_ts);
+        }
+        SC_ATOMIC_DESTROY(fp->spare_cnt);
+        SC_ATOMIC_DESTROY(fp->swept_sec);
+
+        Flow *f;
+        while ((f = FlowPartitionGetSpare(fp)) != NULL) {
+            FlowFree(f);
+        }
+
+        MemcapShardsDecr(&flow_memuse,
+                (uint64_t)fp->hash_size * sizeof(FlowBucket) + sizeof(FlowPartition));
+        SCFreeAligned(fp->hash);
+        SCFree(fp);
+        fp = next;
+    }
+    flow_partitions = NULL;
+    flow_partitions_enabled = 0;
+}
+
+/* UNITTESTS */
+#ifdef UNITTESTS
+
+/** \test flow is created in the thread's partition, not in the shared
+ *        hash, and is timed out by the owning thread */
+static int FlowPartitionTest01(void)
+{
+    ThreadVars tv;
+    DecodeThreadVars dtv;
+    memset(&tv, 0, sizeof(tv));
+    memset(&dtv, 0, sizeof(dtv));
+
+    FlowInitConfig(FLOW_QUIET);
+    flow_config.partition_hash_size = 1024;
+
+    dtv.flow_partition = FlowPartitionNew(&tv);
+    FAIL_IF_NULL(dtv.flow_partition);
+    FlowPartition *fp = dtv.flow_partition;
+
+    Packet *p = UTHBuildPacket((uint8_t *)"test", 4, IPPROTO_UDP);
+    FAIL_IF_NULL(p);
+    FlowSetupPacket(p);
+    FlowHandlePacket(&tv, &dtv, p);
+    FAIL_IF_NULL(p->flow);
+    Flow *f = p->flow;
+    FLOWLOCK_UNLOCK(f);
+
+    FlowBucket *fb = &fp->hash[p->flow_hash % fp->hash_size];
+    FAIL_IF_NOT(fb->head == f);
+    FAIL_IF_NOT(f->fb == fb);
+    FAIL_IF_NOT(flow_hash[p->flow_hash % flow_config.hash_size].head == NULL);
+
+    /* flow is still referenced by the packet, so it can't time out */
+    struct timeval ts = p->ts;
+    ts.tv_sec += 3600;
+    for (uint32_t u = 0; u < fp->hash_size / 64 + 1; u++) {
+        FlowPartitionTimeout(&tv, &dtv, &ts);
+    }
+    FAIL_IF_NOT(fb->head == f);
+
+    FlowDeReference(&p->flow);
+    ts.tv_sec++;
+    for (uint32_t u = 0; u < fp->hash_size / 64 + 1; u++) {
+        FlowPartitionTimeout(&tv, &dtv, &ts);
+    }
+    FAIL_IF_NOT(fb->head == NULL);
+    FAIL_IF_NOT(fp->spare_len == 1);
+    FAIL_IF_NOT(FlowPartitionGetSpareCount() == 1);
+
+    UTHFreePacket(p);
+    FlowShutdown();
+    PASS;
+}
+
+/** \test an idle thread is asked to check its partition, and does so
+ *        in one go */
+static int FlowPartitionTest02(void)
+{
+    ThreadVars tv;
+    DecodeThreadVars dtv;
+    memset(&tv, 0, sizeof(tv));
+    memset(&dtv, 0, sizeof(dtv));
+
+    FlowInitConfig(FLOW_QUIET);
+    flow_config.partition_hash_size = 1024;
+
+    dtv.flow_partition = FlowPartitionNew(&tv);
+    FAIL_IF_NULL(dtv.flow_partition);
+    FlowPartition *fp = dtv.flow_partition;
+
+    Packet *p = UTHBuildPacket((uint8_t *)"test", 4, IPPROTO_UDP);
+    FAIL_IF_NULL(p);
+    FlowSetupPacket(p);
+    FlowHandlePacket(&tv, &dtv, p);
+    FAIL_IF_NULL(p->flow);
+    Flow *f = p->flow;
+    FLOWLOCK_UNLOCK(f);
+    FlowDeReference(&p->flow);
+
+    FlowBucket *fb = &fp->hash[p->flow_hash % fp->hash_size];
+    FAIL_IF_NOT(fb->head == f);
+
+    /* swept in this second, so no wakeup needed */
+    struct timeval ts = p->ts;
+    FlowPartitionTimeout(&tv, &dtv, &ts);
+    FlowPartitionWakeupIdle((uint32_t)ts.tv_sec + 1);
+    FAIL_IF(TmThreadsCheckFlag(&tv, THV_CAPTURE_INJECT_PKT));
+
+    /* no packets for an hour */
+    ts.tv_sec += 3600;
+    FlowPartitionWakeupIdle((uint32_t)ts.tv_sec);
+    FAIL_IF_NOT(TmThreadsCheckFlag(&tv, THV_CAPTURE_INJECT_PKT));
+
+    FlowPartitionTimeoutAll(&tv, &dtv, &ts);
+    FAIL_IF_NOT(fb->head == NULL);
+    FAIL_IF_NOT(FlowPartitionGetSpareCount() == 1);
+    FAIL_IF_NOT(SC_ATOMIC_GET(fp->swept_sec) == (uint32_t)ts.tv_sec);
+
+    UTHFreePacket(p);
+    FlowShutdown();
+    PASS;
+}
+
+#endif /* UNITTESTS */
+
+void FlowPartitionRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("FlowPartitionTest01", FlowPartitionTest01);
+    UtRegisterTest("FlowPartitionTest02", FlowPartitionTest02);
+#endif /* UNITTESTS */
+}
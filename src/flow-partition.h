@@ -0,0 +1,93 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ *  \file
+ */
+
+#ifndef __FLOW_PARTITION_H__
+#define __FLOW_PARTITION_H__
+
+#include "flow-hash.h"
+
+/** Per thread ("partitioned") flow table.
+ *
+ *  In the workers runmode every flow is only ever seen by the thread
+ *  that created it, so that thread can own a private flow hash. The
+ *  buckets of a partition are never locked and are never walked by the
+ *  flow manager: the owning thread times out its own flows as part of
+ *  the packet loop. Threads that don't get packets are asked by the flow
+ *  manager to inject a pseudo packet, on which they check their whole
+ *  table. Flows are still regular Flow objects taken from and returned to
+ *  the global spare queue, so the Flow API is unchanged. */
+typedef struct FlowPartition_ {
+    FlowBucket *hash;
+    uint32_t hash_size;
+
+    /** thread owning the partition */
+    ThreadVars *tv;
+
+    /** timeout sweep state: next row to check, rows left in the current
+     *  pass and the packet time (sec) at which the pass was started. */
+    uint32_t sweep_idx;
+    uint32_t sweep_left;
+    uint32_t sweep_sec;
+
+    /** row to start from when forcefully reusing a flow */
+    uint32_t prune_idx;
+
+    /** set by FlowPartitionRequestFlush(): the next check of the whole
+     *  table ends all flows */
+    int flush;
+
+    /** thread local spare flows, linked through Flow::lnext */
+    Flow *spare;
+    uint32_t spare_len;
+
+    /** read by the flow manager: spare_len and the time (sec) of the
+     *  last sweep, updated by the owning thread when it sweeps */
+    SC_ATOMIC_DECLARE(uint32_t, spare_cnt);
+    SC_ATOMIC_DECLARE(uint32_t, swept_sec);
+
+    uint16_t counter_pruned;
+    uint16_t counter_spare;
+
+    /** list of all partitions, used at shutdown */
+    struct FlowPartition_ *next;
+} FlowPartition;
+
+int FlowPartitionEnabled(void);
+void FlowPartitionCheckRunmode(const char *runmode);
+void FlowPartitionEnable(void);
+
+FlowPartition *FlowPartitionNew(ThreadVars *tv);
+Flow *FlowPartitionGetSpare(FlowPartition *fp);
+void FlowPartitionTimeout(ThreadVars *tv, DecodeThreadVars *dtv,
+        const struct timeval *ts);
+void FlowPartitionTimeoutAll(ThreadVars *tv, DecodeThreadVars *dtv,
+        const struct timeval *ts);
+int FlowPartitionRequestFlush(ThreadVars *tv);
+
+void FlowPartitionWakeupIdle(uint32_t now);
+uint32_t FlowPartitionGetSpareCount(void);
+
+FlowPartition *FlowPartitionGetList(void);
+void FlowPartitionShutdown(void);
+
+void FlowPartitionRegisterTests(void);
+
+#endif /* __FLOW_PARTITION_H__ */
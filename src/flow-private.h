@@ -28,6 +28,7 @@
 #include "flow-queue.h"
 
 #include "util-atomic.h"
+#include "util-memcap-shards.h"
 
 /* global flow flags */
 
@@ -96,8 +97,8 @@ FlowQueue flow_recycle_q;
 FlowBucket *flow_hash;
 FlowConfig flow_config;
 
-/** flow memuse counter (atomic), for enforcing memcap limit */
-SC_ATOMIC_DECLARE(uint64_t, flow_memuse);
+/** flow memuse accounting, for enforcing memcap limit */
+MemcapShards flow_memuse;
 
 #endif /* __FLOW_PRIVATE_H__ */
 
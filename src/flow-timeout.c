@@ -40,6 +40,7 @@
 #include "flow-private.h"
 #include "flow-manager.h"
 #include "flow-timeout.h"
+#include "flow-partition.h"
 #include "pkt-var.h"
 #include "host.h"
 
@@ -420,12 +421,13 @@ done:
  * - be robust in case of future changes
  * - locking overhead if neglectable when no other thread fights us
  *
- * \param q The queue to process flows from.
+ * \param hash array of buckets to process flows from
+ * \param hash_size number of buckets in hash
  */
-static inline void FlowForceReassemblyForHash(void)
+static inline void FlowForceReassemblyForHash(FlowBucket *hash, const uint32_t hash_size)
 {
-    for (uint32_t idx = 0; idx < flow_config.hash_size; idx++) {
-        FlowBucket *fb = &flow_hash[idx];
+    for (uint32_t idx = 0; idx < hash_size; idx++) {
+        FlowBucket *fb = &hash[idx];
 
         PacketPoolWaitForN(9);
         FBLOCK_LOCK(fb);
@@ -470,6 +472,12 @@ static inline void FlowForceReassemblyForHash(void)
 void FlowForceReassembly(void)
 {
     /* Carry out flow reassembly for unattended flows */
-    FlowForceReassemblyForHash();
+    FlowForceReassemblyForHash(flow_hash, flow_config.hash_size);
+
+    /* and for the flows in the per thread tables. The owning threads
+     * no longer do lookups at this point, so the buckets are stable. */
+    for (FlowPartition *fp = FlowPartitionGetList(); fp != NULL; fp = fp->next) {
+        FlowForceReassemblyForHash(fp->hash, fp->hash_size);
+    }
     return;
 }
@@ -30,6 +30,7 @@
 #include "flow-private.h"
 #include "flow-util.h"
 #include "flow-var.h"
+#include "flow-wheel.h"
 #include "app-layer.h"
 
 #include "util-var.h"
@@ -57,11 +58,13 @@ Flow *FlowAlloc(void)
         return NULL;
     }
 
-    (void) SC_ATOMIC_ADD(flow_memuse, size);
+    MemcapShardsIncr(&flow_memuse, size);
 
-    f = SCMalloc(size);
+    /* cache line aligned, so that the part used in hash lookups
+     * is in a single line. See FLOW_HOT_SIZE. */
+    f = SCMallocAligned(size, CLS);
     if (unlikely(f == NULL)) {
-        (void)SC_ATOMIC_SUB(flow_memuse, size);
+        MemcapShardsDecr(&flow_memuse, size);
         return NULL;
     }
     memset(f, 0, size);
@@ -79,11 +82,12 @@ Flow *FlowAlloc(void)
  */
 void FlowFree(Flow *f)
 {
+    FlowWheelRemove(f);
     FLOW_DESTROY(f);
-    SCFree(f);
+    SCFreeAligned(f);
 
     size_t size = sizeof(Flow) + FlowStorageSize();
-    (void) SC_ATOMIC_SUB(flow_memuse, size);
+    MemcapShardsDecr(&flow_memuse, size);
 }
 
 /**
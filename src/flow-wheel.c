@@ -0,0 +1,609 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ *  \file
+ *
+ *  Timer wheel for flow timeouts.
+ *
+ *  Instead of walking the full flow hash every second, the flow manager
+ *  only looks at the flows that are scheduled to time out in the current
+ *  second. The wheel has two levels of 256 slots: level 0 has a slot per
+ *  second, level 1 a slot per 256 seconds. Level 1 slots are cascaded into
+ *  level 0 when the wheel reaches them. Deadlines further out than the
+ *  wheel can hold are clamped and simply rescheduled when they come up.
+ *
+ *  Flows are (re)scheduled when they are added to the hash and on state
+ *  changes, but not for every packet: updates to Flow::lastts only move
+ *  the real deadline further out, so the manager rechecks the flow when
+ *  its slot comes up and reschedules it if it's still active. Entries are
+ *  also removed lazily: a flow that left the hash is dropped from the
+ *  wheel when its slot is processed.
+ *
+ *  The wheel itself is only used by the flow manager. Packet threads don't
+ *  take the wheel lock: they store the requested second in the flow and
+ *  push the flow on a lock free list, that the manager moves into the
+ *  wheel before it looks for due flows. A flow is on the list at most once,
+ *  later requests only lower the requested second.
+ *
+ *  Lock order is: hash row, flow, wheel.
+ */
+
+#include "suricata-common.h"
+#include "threads.h"
+
+#include "flow.h"
+#include "flow-hash.h"
+#include "flow-util.h"
+#include "flow-private.h"
+#include "flow-manager.h"
+#include "flow-wheel.h"
+
+#include "util-debug.h"
+#include "util-unittest.h"
+
+#define FLOW_WHEEL_BITS     8
+#define FLOW_WHEEL_SLOTS    (1 << FLOW_WHEEL_BITS)
+#define FLOW_WHEEL_MASK     (FLOW_WHEEL_SLOTS - 1)
+/** max distance in seconds between now and a deadline */
+#define FLOW_WHEEL_RANGE    (FLOW_WHEEL_SLOTS * FLOW_WHEEL_SLOTS)
+
+typedef struct FlowWheel_ {
+    SCMutex m;
+
+    /** second of the level 0 slot that is currently being processed.
+     *  0 if the wheel is not yet in use. */
+    uint32_t cur;
+    /** number of flows in the wheel */
+    uint32_t cnt;
+
+    /** level 0 slots followed by the level 1 slots. Flows are linked
+     *  through Flow::wnext/wprev, Flow::wslot is the slot index + 1. */
+    Flow *slots[FLOW_WHEEL_SLOTS * 2];
+} FlowWheel;
+
+static FlowWheel flow_wheel;
+static int flow_wheel_enabled = 0;
+/** flows with a pending request, pushed by the packet threads */
+static Flow *flow_wheel_requests = NULL;
+
+int FlowWheelEnabled(void)
+{
+    return flow_wheel_enabled;
+}
+
+void FlowWheelInit(void)
+{
+    memset(&flow_wheel, 0, sizeof(flow_wheel));
+    SCMutexInit(&flow_wheel.m, NULL);
+    flow_wheel_requests = NULL;
+    flow_wheel_enabled = 1;
+}
+
+void FlowWheelDestroy(void)
+{
+    if (!flow_wheel_enabled)
+        return;
+
+    flow_wheel_enabled = 0;
+    SCMutexDestroy(&flow_wheel.m);
+}
+
+static inline void FlowWheelLink(FlowWheel *w, Flow *f, const uint32_t slot)
+{
+    f->wprev = NULL;
+    f->wnext = w->slots[slot];
+    if (f->wnext != NULL)
+        f->wnext->wprev = f;
+    w->slots[slot] = f;
+    f->wslot = (uint16_t)(slot + 1);
+    w->cnt++;
+}
+
+static inline void FlowWheelUnlink(FlowWheel *w, Flow *f)
+{
+    const uint32_t slot = f->wslot - 1;
+
+    if (f->wprev != NULL)
+        f->wprev->wnext = f->wnext;
+    else
+        w->slots[slot] = f->wnext;
+    if (f->wnext != NULL)
+        f->wnext->wprev = f->wprev;
+
+    f->wnext = NULL;
+    f->wprev = NULL;
+    f->wslot = 0;
+    w->cnt--;
+}
+
+/** \internal
+ *  \brief add a flow to the wheel, wheel needs to be locked */
+static void FlowWheelInsert(FlowWheel *w, Flow *f, uint32_t sec)
+{
+    if (unlikely(w->cur == 0))
+        w->cur = sec > 1 ? sec - 1 : 1;
+
+    /* past deadlines are handled in the next second, too far out ones
+     * are clamped and rescheduled when they come up */
+    if (sec <= w->cur)
+        sec = w->cur + 1;
+    else if (sec - w->cur >= FLOW_WHEEL_RANGE)
+        sec = w->cur + FLOW_WHEEL_RANGE - 1;
+
+    f->wheel_ts = sec;
+
+    uint32_t slot;
+    if (sec - w->cur < FLOW_WHEEL_SLOTS)
+        slot = sec & FLOW_WHEEL_MASK;
+    else
+        slot = FLOW_WHEEL_SLOTS + ((sec >> FLOW_WHEEL_BITS) & FLOW_WHEEL_MASK);
+
+    FlowWheelLink(w, f, slot);
+}
+
+/** \internal
+ *  \brief move the flows of the level 1 slot starting at 'sec' into
+ *         the level 0 slots */
+static void FlowWheelCascade(FlowWheel *w, const uint32_t sec)
+{
+    const uint32_t slot = FLOW_WHEEL_SLOTS + ((sec >> FLOW_WHEEL_BITS) & FLOW_WHEEL_MASK);
+
+    Flow *f = w->slots[slot];
+    w->slots[slot] = NULL;
+
+    while (f != NULL) {
+        Flow *next = f->wnext;
+        w->cnt--;
+
+        if (f->wheel_ts < sec)
+            f->wheel_ts = sec;
+        FlowWheelLink(w, f, f->wheel_ts & FLOW_WHEEL_MASK);
+
+        f = next;
+    }
+}
+
+/** \internal
+ *  \brief time jumped further than the wheel can hold: reinsert all
+ *         flows relative to the new time */
+static void FlowWheelRebase(FlowWheel *w, const uint32_t now)
+{
+    Flow *list = NULL;
+
+    for (uint32_t u = 0; u < FLOW_WHEEL_SLOTS * 2; u++) {
+        Flow *f = w->slots[u];
+        while (f != NULL) {
+            Flow *next = f->wnext;
+            f->wnext = list;
+            list = f;
+            f = next;
+        }
+        w->slots[u] = NULL;
+    }
+    w->cnt = 0;
+    w->cur = now - 1;
+
+    while (list != NULL) {
+        Flow *next = list->wnext;
+        FlowWheelInsert(w, list, list->wheel_ts);
+        list = next;
+    }
+}
+
+/** \internal
+ *  \brief schedule a flow, wheel needs to be locked. If the flow is
+ *         already scheduled earlier it's left alone. */
+static void FlowWheelScheduleLocked(FlowWheel *w, Flow *f, uint32_t sec)
+{
+    if (f->wslot != 0) {
+        if (f->wheel_ts <= sec)
+            return;
+        FlowWheelUnlink(w, f);
+    }
+    FlowWheelInsert(w, f, sec);
+}
+
+/** \internal
+ *  \brief move the requests of the packet threads into the wheel,
+ *         wheel needs to be locked */
+static void FlowWheelDrainRequests(FlowWheel *w)
+{
+    Flow *f = __atomic_exchange_n(&flow_wheel_requests, NULL, __ATOMIC_ACQUIRE);
+    while (f != NULL) {
+        /* read the link before clearing the request: after that the
+         * flow can be pushed again */
+        Flow *next = f->wreq_next;
+        const uint32_t sec = __atomic_exchange_n(&f->wheel_req, 0, __ATOMIC_ACQ_REL);
+        if (sec != 0)
+            FlowWheelScheduleLocked(w, f, sec);
+        f = next;
+    }
+}
+
+/** \internal
+ *  \brief request a flow to be scheduled at 'sec' without taking the
+ *         wheel lock, the manager moves it into the wheel */
+static void FlowWheelRequest(Flow *f, uint32_t sec)
+{
+    uint32_t old = __atomic_load_n(&f->wheel_req, __ATOMIC_RELAXED);
+    do {
+        if (old != 0 && old <= sec)
+            return;
+    } while (!__atomic_compare_exchange_n(&f->wheel_req, &old, sec, 1,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    /* a request was pending already, so the flow is on the list */
+    if (old != 0)
+        return;
+
+    Flow *head = __atomic_load_n(&flow_wheel_requests, __ATOMIC_RELAXED);
+    do {
+        f->wreq_next = head;
+    } while (!__atomic_compare_exchange_n(&flow_wheel_requests, &head, f, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/** \brief schedule a flow to be checked at time 'sec'
+ *
+ *  If the flow is already scheduled earlier it's left alone. Takes the
+ *  wheel lock, so only for use by the flow manager.
+ */
+void FlowWheelScheduleAt(Flow *f, uint32_t sec)
+{
+    FlowWheel *w = &flow_wheel;
+
+    SCMutexLock(&w->m);
+    FlowWheelScheduleLocked(w, f, sec);
+    SCMutexUnlock(&w->m);
+}
+
+/** \internal
+ *  \brief second a flow is due based on its state, last activity and
+ *         the current timeouts */
+static inline uint32_t FlowWheelDeadline(Flow *f)
+{
+    const uint32_t base = f->lastts.tv_sec ? (uint32_t)f->lastts.tv_sec :
+                                             (uint32_t)f->startts.tv_sec;
+    const uint32_t timeout = FlowGetFlowTimeout(f, SC_ATOMIC_GET(f->flow_state));
+
+    /* the manager considers a flow timed out once the time has passed
+     * lastts + timeout, so it's due the second after that */
+    return base + timeout + 1;
+}
+
+/** \brief schedule a flow based on its state and last activity
+ *
+ *  Called with the flow locked, by the packet threads. Flows that are not
+ *  in the global flow hash are ignored: the flows of a partition are timed
+ *  out by the thread that owns them.
+ */
+void FlowWheelSchedule(Flow *f)
+{
+    if (!flow_wheel_enabled)
+        return;
+    if (f->fb < flow_hash || f->fb >= flow_hash + flow_config.hash_size)
+        return;
+
+    FlowWheelRequest(f, FlowWheelDeadline(f));
+}
+
+/** \brief reschedule the flows in the wheel using the current timeouts
+ *
+ *  Called by the flow manager when it enters emergency mode. The flows
+ *  were scheduled with the normal timeouts, this moves them to the earlier
+ *  second the emergency timeouts give them. Flows are never moved to a
+ *  later second.
+ *
+ *  Flows are removed from the wheel before they are freed, so with the
+ *  wheel locked lastts and the state can be read the same way the manager
+ *  reads them with only the hash row locked.
+ *
+ *  \retval cnt number of flows that were moved
+ */
+uint32_t FlowWheelReschedule(void)
+{
+    FlowWheel *w = &flow_wheel;
+    Flow *list = NULL;
+    uint32_t cnt = 0;
+
+    SCMutexLock(&w->m);
+    FlowWheelDrainRequests(w);
+
+    for (uint32_t u = 0; u < FLOW_WHEEL_SLOTS * 2 && w->cnt > 0; u++) {
+        Flow *f = w->slots[u];
+        while (f != NULL) {
+            Flow *next = f->wnext;
+            const uint32_t sec = FlowWheelDeadline(f);
+            if (sec < f->wheel_ts) {
+                FlowWheelUnlink(w, f);
+                f->wheel_ts = sec;
+                f->wnext = list;
+                list = f;
+            }
+            f = next;
+        }
+    }
+
+    /* insert after the walk, so moved flows aren't visited again */
+    while (list != NULL) {
+        Flow *next = list->wnext;
+        FlowWheelInsert(w, list, list->wheel_ts);
+        list = next;
+        cnt++;
+    }
+    SCMutexUnlock(&w->m);
+
+    return cnt;
+}
+
+/** \brief remove a flow from the wheel, used before freeing it */
+void FlowWheelRemove(Flow *f)
+{
+    if (f->wslot == 0 && __atomic_load_n(&f->wheel_req, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    SCMutexLock(&flow_wheel.m);
+    /* a pending request still links the flow on the request list */
+    if (f->wheel_req != 0)
+        FlowWheelDrainRequests(&flow_wheel);
+    if (f->wslot != 0)
+        FlowWheelUnlink(&flow_wheel, f);
+    SCMutexUnlock(&flow_wheel.m);
+}
+
+/** \brief get flows that are due for a timeout check
+ *
+ *  Advances the wheel up to 'now'. The returned flows are removed from
+ *  the wheel. They are not locked and may no longer be in the hash.
+ *
+ *  \param now current time (sec)
+ *  \param flows array to store the flows in
+ *  \param max size of the array
+ *
+ *  \retval cnt number of flows returned, 0 if nothing is due
+ */
+uint32_t FlowWheelGetDue(uint32_t now, Flow **flows, uint32_t max)
+{
+    FlowWheel *w = &flow_wheel;
+    uint32_t cnt = 0;
+
+    SCMutexLock(&w->m);
+    FlowWheelDrainRequests(w);
+    if (unlikely(w->cur == 0)) {
+        w->cur = now;
+    } else if (now > w->cur && now - w->cur >= FLOW_WHEEL_RANGE) {
+        FlowWheelRebase(w, now);
+    }
+
+    while (cnt < max) {
+        Flow *f = w->slots[w->cur & FLOW_WHEEL_MASK];
+        if (f != NULL) {
+            FlowWheelUnlink(w, f);
+            flows[cnt++] = f;
+            continue;
+        }
+
+        if (w->cur >= now)
+            break;
+
+        w->cur++;
+        if ((w->cur & FLOW_WHEEL_MASK) == 0)
+            FlowWheelCascade(w, w->cur);
+    }
+    SCMutexUnlock(&w->m);
+
+    return cnt;
+}
+
+/** \brief number of flows in the wheel */
+uint32_t FlowWheelCount(void)
+{
+    SCMutexLock(&flow_wheel.m);
+    uint32_t cnt = flow_wheel.cnt;
+    SCMutexUnlock(&flow_wheel.m);
+    return cnt;
+}
+
+/* UNITTESTS */
+#ifdef UNITTESTS
+
+static uint32_t FlowWheelTestDue(uint32_t now)
+{
+    Flow *flows[8];
+    uint32_t n, cnt = 0;
+
+    while ((n = FlowWheelGetDue(now, flows, 8)) > 0) {
+        cnt += n;
+    }
+    return cnt;
+}
+
+/** \test flows come out of the wheel in the second they are due, also
+ *        when they have to be cascaded from level 1 */
+static int FlowWheelTest01(void)
+{
+    Flow f1, f2, f3;
+    memset(&f1, 0, sizeof(f1));
+    memset(&f2, 0, sizeof(f2));
+    memset(&f3, 0, sizeof(f3));
+
+    FlowWheelInit();
+
+    FAIL_IF_NOT(FlowWheelGetDue(1000, NULL, 0) == 0);
+    FlowWheelScheduleAt(&f1, 1010);
+    FlowWheelScheduleAt(&f2, 1300);
+    FlowWheelScheduleAt(&f3, 1000 + 3600);
+    FAIL_IF_NOT(FlowWheelCount() == 3);
+
+    FAIL_IF_NOT(FlowWheelTestDue(1009) == 0);
+    FAIL_IF_NOT(FlowWheelTestDue(1010) == 1);
+    FAIL_IF_NOT(f1.wslot == 0);
+    FAIL_IF_NOT(FlowWheelTestDue(1299) == 0);
+    FAIL_IF_NOT(FlowWheelTestDue(1300) == 1);
+    FAIL_IF_NOT(f2.wslot == 0);
+    FAIL_IF_NOT(FlowWheelTestDue(4599) == 0);
+    FAIL_IF_NOT(FlowWheelTestDue(4600) == 1);
+    FAIL_IF_NOT(FlowWheelCount() == 0);
+
+    FlowWheelDestroy();
+    PASS;
+}
+
+/** \test rescheduling only moves flows to an earlier slot, removal
+ *        and large time jumps */
+static int FlowWheelTest02(void)
+{
+    Flow f1, f2;
+    memset(&f1, 0, sizeof(f1));
+    memset(&f2, 0, sizeof(f2));
+
+    FlowWheelInit();
+
+    FAIL_IF_NOT(FlowWheelGetDue(1000, NULL, 0) == 0);
+    FlowWheelScheduleAt(&f1, 1100);
+    FlowWheelScheduleAt(&f1, 1200);
+    FAIL_IF_NOT(f1.wheel_ts == 1100);
+    FlowWheelScheduleAt(&f1, 1050);
+    FAIL_IF_NOT(f1.wheel_ts == 1050);
+    FAIL_IF_NOT(FlowWheelCount() == 1);
+
+    /* past deadline is due in the next second */
+    FlowWheelScheduleAt(&f2, 900);
+    FAIL_IF_NOT(f2.wheel_ts == 1001);
+    FlowWheelRemove(&f2);
+    FAIL_IF_NOT(f2.wslot == 0);
+    FAIL_IF_NOT(FlowWheelCount() == 1);
+
+    /* deadline beyond the wheel range is clamped */
+    FlowWheelScheduleAt(&f2, 1000 + 1000000);
+    FAIL_IF_NOT(f2.wheel_ts == 1000 + FLOW_WHEEL_RANGE - 1);
+
+    /* time jumps way ahead: everything is due */
+    FAIL_IF_NOT(FlowWheelTestDue(1000 + 10000000) == 2);
+    FAIL_IF_NOT(FlowWheelCount() == 0);
+
+    FlowWheelDestroy();
+    PASS;
+}
+
+/** \test requests of the packet threads are moved into the wheel by
+ *        the manager, only the earliest request of a flow counts */
+static int FlowWheelTest03(void)
+{
+    Flow f1, f2;
+    memset(&f1, 0, sizeof(f1));
+    memset(&f2, 0, sizeof(f2));
+
+    FlowWheelInit();
+
+    FAIL_IF_NOT(FlowWheelGetDue(1000, NULL, 0) == 0);
+    FlowWheelRequest(&f1, 1100);
+    FlowWheelRequest(&f1, 1050);
+    FlowWheelRequest(&f1, 1200);
+    FlowWheelRequest(&f2, 1020);
+    FAIL_IF_NOT(f1.wheel_req == 1050);
+    FAIL_IF_NOT(f1.wslot == 0);
+    FAIL_IF_NOT(FlowWheelCount() == 0);
+
+    /* picked up by the manager */
+    FAIL_IF_NOT(FlowWheelGetDue(1000, NULL, 0) == 0);
+    FAIL_IF_NOT(f1.wheel_req == 0);
+    FAIL_IF_NOT(f1.wheel_ts == 1050);
+    FAIL_IF_NOT(FlowWheelCount() == 2);
+
+    /* a later request doesn't move a flow that is scheduled earlier */
+    FlowWheelRequest(&f1, 1080);
+    FAIL_IF_NOT(FlowWheelGetDue(1000, NULL, 0) == 0);
+    FAIL_IF_NOT(f1.wheel_ts == 1050);
+
+    /* a pending request is dropped when the flow is removed */
+    FlowWheelRequest(&f2, 1010);
+    FlowWheelRemove(&f2);
+    FAIL_IF_NOT(f2.wslot == 0);
+    FAIL_IF_NOT(f2.wheel_req == 0);
+    FAIL_IF_NOT(flow_wheel_requests == NULL);
+
+    FAIL_IF_NOT(FlowWheelTestDue(1049) == 0);
+    FAIL_IF_NOT(FlowWheelTestDue(1050) == 1);
+    FAIL_IF_NOT(FlowWheelCount() == 0);
+
+    FlowWheelDestroy();
+    PASS;
+}
+
+/** \test on entering emergency mode flows move to the second their
+ *        emergency timeout gives them, but never to a later one */
+static int FlowWheelTest04(void)
+{
+    Flow f1, f2, f3;
+    memset(&f1, 0, sizeof(f1));
+    memset(&f2, 0, sizeof(f2));
+    memset(&f3, 0, sizeof(f3));
+
+    const FlowProtoTimeout normal = flow_timeouts_normal[FLOW_PROTO_DEFAULT];
+    const FlowProtoTimeout emerg = flow_timeouts_emerg[FLOW_PROTO_DEFAULT];
+    flow_timeouts_normal[FLOW_PROTO_DEFAULT].new_timeout = 100;
+    flow_timeouts_emerg[FLOW_PROTO_DEFAULT].new_timeout = 10;
+    flow_timeouts_normal[FLOW_PROTO_DEFAULT].est_timeout = 1000;
+    flow_timeouts_emerg[FLOW_PROTO_DEFAULT].est_timeout = 50;
+
+    f1.protomap = f2.protomap = f3.protomap = FLOW_PROTO_DEFAULT;
+    f1.lastts.tv_sec = f2.lastts.tv_sec = f3.lastts.tv_sec = 1000;
+    SC_ATOMIC_SET(f3.flow_state, FLOW_STATE_ESTABLISHED);
+
+    FlowTimeoutsInit();
+    FlowWheelInit();
+
+    FAIL_IF_NOT(FlowWheelGetDue(1000, NULL, 0) == 0);
+    FlowWheelScheduleAt(&f1, 1101);
+    /* already rechecked sooner, e.g. because it was in use */
+    FlowWheelScheduleAt(&f2, 1005);
+    FlowWheelScheduleAt(&f3, 2001);
+    FAIL_IF_NOT(FlowWheelReschedule() == 0);
+
+    FlowTimeoutsEmergency();
+    FAIL_IF_NOT(FlowWheelReschedule() == 2);
+    FAIL_IF_NOT(f1.wheel_ts == 1011);
+    FAIL_IF_NOT(f2.wheel_ts == 1005);
+    FAIL_IF_NOT(f3.wheel_ts == 1051);
+    FAIL_IF_NOT(FlowWheelCount() == 3);
+
+    FAIL_IF_NOT(FlowWheelTestDue(1005) == 1);
+    FAIL_IF_NOT(FlowWheelTestDue(1010) == 0);
+    FAIL_IF_NOT(FlowWheelTestDue(1011) == 1);
+    FAIL_IF_NOT(FlowWheelTestDue(1051) == 1);
+    FAIL_IF_NOT(FlowWheelCount() == 0);
+
+    FlowWheelDestroy();
+    FlowTimeoutsReset();
+    flow_timeouts_normal[FLOW_PROTO_DEFAULT] = normal;
+    flow_timeouts_emerg[FLOW_PROTO_DEFAULT] = emerg;
+    PASS;
+}
+
+#endif /* UNITTESTS */
+
+void FlowWheelRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("FlowWheelTest01", FlowWheelTest01);
+    UtRegisterTest("FlowWheelTest02", FlowWheelTest02);
+    UtRegisterTest("FlowWheelTest03", FlowWheelTest03);
+    UtRegisterTest("FlowWheelTest04", FlowWheelTest04);
+#endif /* UNITTESTS */
+}
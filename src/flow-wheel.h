@@ -0,0 +1,54 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ */
+
+#ifndef __FLOW_WHEEL_H__
+#define __FLOW_WHEEL_H__
+
+#include "flow.h"
+
+/** number of flows handed to the flow manager per FlowWheelGetDue() call */
+#define FLOW_WHEEL_BATCH    256
+
+void FlowWheelInit(void);
+void FlowWheelDestroy(void);
+int FlowWheelEnabled(void);
+
+void FlowWheelSchedule(Flow *f);
+void FlowWheelScheduleAt(Flow *f, uint32_t sec);
+void FlowWheelRemove(Flow *f);
+uint32_t FlowWheelReschedule(void);
+
+/** \brief check if a flow is in the wheel or has a request pending
+ *
+ *  Without the wheel lock this is only a hint.
+ */
+static inline int FlowWheelIsScheduled(const Flow *f)
+{
+    return __atomic_load_n(&f->wslot, __ATOMIC_RELAXED) != 0 ||
+           __atomic_load_n(&f->wheel_req, __ATOMIC_RELAXED) != 0;
+}
+
+uint32_t FlowWheelGetDue(uint32_t now, Flow **flows, uint32_t max);
+uint32_t FlowWheelCount(void);
+
+void FlowWheelRegisterTests(void);
+
+#endif /* __FLOW_WHEEL_H__ */
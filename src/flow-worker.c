@@ -44,6 +44,7 @@
 #include "util-validate.h"
 
 #include "flow-util.h"
+#include "flow-partition.h"
 
 typedef DetectEngineThreadCtx *DetectEngineThreadCtxPtr;
 
@@ -81,6 +82,29 @@ static inline TmEcode FlowUpdate(Packet *p)
     }
 }
 
+/** \internal
+ *  \brief run the timeout logic for the thread's private flow table
+ *
+ *  Called after the packet's flow has been unlocked. Pseudo packets of
+ *  a flow are skipped, they are injected by the timeout logic itself.
+ *  A pseudo packet without a flow is injected by the capture method when
+ *  it's idle, on those the whole table is checked.
+ */
+static inline void FlowWorkerPartitionTimeout(ThreadVars *tv,
+        FlowWorkerThreadData *fw, const Packet *p)
+{
+    if (fw->dtv->flow_partition == NULL)
+        return;
+
+    if (!(PKT_IS_PSEUDOPKT(p))) {
+        FlowPartitionTimeout(tv, fw->dtv, &p->ts);
+    } else if (p->flow == NULL) {
+        struct timeval ts;
+        TimeGet(&ts);
+        FlowPartitionTimeoutAll(tv, fw->dtv, &ts);
+    }
+}
+
 static TmEcode FlowWorkerThreadDeinit(ThreadVars *tv, void *data);
 
 static TmEcode FlowWorkerThreadInit(ThreadVars *tv, const void *initdata, void **data)
@@ -98,6 +122,16 @@ static TmEcode FlowWorkerThreadInit(ThreadVars *tv, const void *initdata, void *
         return TM_ECODE_FAILED;
     }
 
+    /* setup our private flow table. It's owned by the flow engine
+     * and freed at FlowShutdown(). */
+    if (FlowPartitionEnabled()) {
+        fw->dtv->flow_partition = FlowPartitionNew(tv);
+        if (fw->dtv->flow_partition == NULL) {
+            FlowWorkerThreadDeinit(tv, fw);
+            return TM_ECODE_FAILED;
+        }
+    }
+
     /* setup TCP */
     if (StreamTcpThreadInit(tv, NULL, &fw->stream_thread_ptr) != TM_ECODE_OK) {
         FlowWorkerThreadDeinit(tv, fw);
@@ -162,6 +196,18 @@ static TmEcode FlowWorkerThreadDeinit(ThreadVars *tv, void *data)
 TmEcode Detect(ThreadVars *tv, Packet *p, void *data, PacketQueue *pq, PacketQueue *postpq);
 TmEcode StreamTcp (ThreadVars *, Packet *, void *, PacketQueue *, PacketQueue *);
 
+/** \brief prefetch the flow table for a batch of decoded packets and
+ *         compute their TCP checksums while the prefetches complete
+ *
+ *  Called by TmThreadsSlotProcessPktBatch() before FlowWorker() is
+ *  called for each of the packets. */
+static void FlowWorkerPrefetch(ThreadVars *tv, Packet **pkts, uint32_t cnt, void *data)
+{
+    FlowWorkerThreadData *fw = data;
+    FlowPrefetchBatch(fw->dtv, pkts, cnt);
+    StreamTcpChecksumBatch(pkts, cnt);
+}
+
 static TmEcode FlowWorker(ThreadVars *tv, Packet *p, void *data, PacketQueue *preq, PacketQueue *unused)
 {
     FlowWorkerThreadData *fw = data;
@@ -183,6 +229,7 @@ static TmEcode FlowWorker(ThreadVars *tv, Packet *p, void *data, PacketQueue *pr
             DEBUG_ASSERT_FLOW_LOCKED(p->flow);
             if (FlowUpdate(p) == TM_ECODE_DONE) {
                 FLOWLOCK_UNLOCK(p->flow);
+                FlowWorkerPartitionTimeout(tv, fw, p);
                 return TM_ECODE_OK;
             }
         }
@@ -280,6 +327,7 @@ static TmEcode FlowWorker(ThreadVars *tv, Packet *p, void *data, PacketQueue *pr
         FLOWLOCK_UNLOCK(p->flow);
     }
 
+    FlowWorkerPartitionTimeout(tv, fw, p);
     return TM_ECODE_OK;
 }
 
@@ -327,6 +375,7 @@ void TmModuleFlowWorkerRegister (void)
     tmm_modules[TMM_FLOWWORKER].name = "FlowWorker";
     tmm_modules[TMM_FLOWWORKER].ThreadInit = FlowWorkerThreadInit;
     tmm_modules[TMM_FLOWWORKER].Func = FlowWorker;
+    tmm_modules[TMM_FLOWWORKER].PktPrefetch = FlowWorkerPrefetch;
     tmm_modules[TMM_FLOWWORKER].ThreadDeinit = FlowWorkerThreadDeinit;
     tmm_modules[TMM_FLOWWORKER].ThreadExitPrintStats = FlowWorkerExitPrintStats;
     tmm_modules[TMM_FLOWWORKER].cap_flags = 0;
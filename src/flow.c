@@ -44,6 +44,8 @@
 #include "flow-manager.h"
 #include "flow-storage.h"
 #include "flow-bypass.h"
+#include "flow-partition.h"
+#include "flow-wheel.h"
 
 #include "stream-tcp-private.h"
 #include "stream-tcp-reassemble.h"
@@ -63,6 +65,10 @@
 
 #include "app-layer-parser.h"
 
+/* compile time check that the part of the Flow that hash chain walks
+ * look at fits in a single (64 byte) cache line */
+typedef char FlowHotSizeCheck[(FLOW_HOT_SIZE <= 64) ? 1 : -1];
+
 #define FLOW_DEFAULT_EMERGENCY_RECOVERY 30
 
 //#define FLOW_DEFAULT_HASHSIZE    262144
@@ -97,7 +103,7 @@ extern int run_mode;
  */
 int FlowSetMemcap(uint64_t size)
 {
-    if ((uint64_t)SC_ATOMIC_GET(flow_memuse) < size) {
+    if ((uint64_t)MemcapShardsGetMemuse(&flow_memuse) < size) {
         SC_ATOMIC_SET(flow_config.memcap, size);
         return 1;
     }
@@ -118,7 +124,7 @@ uint64_t FlowGetMemcap(void)
 
 uint64_t FlowGetMemuse(void)
 {
-    uint64_t memusecopy = SC_ATOMIC_GET(flow_memuse);
+    uint64_t memusecopy = MemcapShardsGetMemuse(&flow_memuse);
     return memusecopy;
 }
 
@@ -149,6 +155,10 @@ int FlowUpdateSpareFlows(void)
     FQLOCK_LOCK(&flow_spare_q);
     len = flow_spare_q.len;
     FQLOCK_UNLOCK(&flow_spare_q);
+    /* the spare lists of the partitions count towards prealloc, only
+     * the global queue can be trimmed */
+    if (FlowPartitionEnabled())
+        len += FlowPartitionGetSpareCount();
 
     if (len < flow_config.prealloc) {
         toalloc = flow_config.prealloc - len;
@@ -515,7 +525,7 @@ void FlowInitConfig(char quiet)
 
     memset(&flow_config,  0, sizeof(flow_config));
     SC_ATOMIC_INIT(flow_flags);
-    SC_ATOMIC_INIT(flow_memuse);
+    MemcapShardsInit(&flow_memuse, MEMCAP_SHARDS_FLOW, 0);
     SC_ATOMIC_INIT(flow_prune_idx);
     SC_ATOMIC_INIT(flow_config.memcap);
     FlowQueueInit(&flow_spare_q);
@@ -588,6 +598,27 @@ void FlowInitConfig(char quiet)
             flow_config.prealloc = configval;
         }
     }
+    int partitioned = 0;
+    if (ConfGetBool("flow.partitioned", &partitioned) == 1 && partitioned == 1) {
+        flow_config.partitioned = 1;
+    }
+    flow_config.partition_hash_size = flow_config.hash_size;
+    if ((ConfGet("flow.partition-hash-size", &conf_val)) == 1)
+    {
+        if (conf_val == NULL) {
+            SCLogError(SC_ERR_INVALID_YAML_CONF_ENTRY,"Invalid value for flow.partition-hash-size: NULL");
+            exit(EXIT_FAILURE);
+        }
+
+        if (ByteExtractStringUint32(&configval, 10, strlen(conf_val),
+                                    conf_val) > 0 && configval > 0) {
+            flow_config.partition_hash_size = configval;
+        }
+    }
+    int timer_wheel = 0;
+    if (ConfGetBool("flow.timer-wheel", &timer_wheel) == 1 && timer_wheel == 1) {
+        flow_config.timer_wheel = 1;
+    }
     SCLogDebug("Flow config from suricata.yaml: memcap: %"PRIu64", hash-size: "
                "%"PRIu32", prealloc: %"PRIu32, SC_ATOMIC_GET(flow_config.memcap),
                flow_config.hash_size, flow_config.prealloc);
@@ -615,22 +646,29 @@ void FlowInitConfig(char quiet)
         FBLOCK_INIT(&flow_hash[i]);
         SC_ATOMIC_INIT(flow_hash[i].next_ts);
     }
-    (void) SC_ATOMIC_ADD(flow_memuse, (flow_config.hash_size * sizeof(FlowBucket)));
+    MemcapShardsIncr(&flow_memuse, (flow_config.hash_size * sizeof(FlowBucket)));
 
     if (quiet == FALSE) {
         SCLogConfig("allocated %"PRIu64" bytes of memory for the flow hash... "
                   "%" PRIu32 " buckets of size %" PRIuMAX "",
-                  SC_ATOMIC_GET(flow_memuse), flow_config.hash_size,
+                  MemcapShardsGetMemuse(&flow_memuse), flow_config.hash_size,
                   (uintmax_t)sizeof(FlowBucket));
     }
 
+    if (flow_config.timer_wheel) {
+        FlowWheelInit();
+        if (quiet == FALSE) {
+            SCLogConfig("using the timer wheel for flow timeouts");
+        }
+    }
+
     /* pre allocate flows */
     for (i = 0; i < flow_config.prealloc; i++) {
         if (!(FLOW_CHECK_MEMCAP(sizeof(Flow) + FlowStorageSize()))) {
             SCLogError(SC_ERR_FLOW_INIT, "preallocating flows failed: "
                     "max flow memcap reached. Memcap %"PRIu64", "
                     "Memuse %"PRIu64".", SC_ATOMIC_GET(flow_config.memcap),
-                    ((uint64_t)SC_ATOMIC_GET(flow_memuse) + (uint64_t)sizeof(Flow)));
+                    ((uint64_t)MemcapShardsGetMemuse(&flow_memuse) + (uint64_t)sizeof(Flow)));
             exit(EXIT_FAILURE);
         }
 
@@ -647,7 +685,7 @@ void FlowInitConfig(char quiet)
         SCLogConfig("preallocated %" PRIu32 " flows of size %" PRIuMAX "",
                 flow_spare_q.len, (uintmax_t)(sizeof(Flow) + + FlowStorageSize()));
         SCLogConfig("flow memory usage: %"PRIu64" bytes, maximum: %"PRIu64,
-                SC_ATOMIC_GET(flow_memuse), SC_ATOMIC_GET(flow_config.memcap));
+                MemcapShardsGetMemuse(&flow_memuse), SC_ATOMIC_GET(flow_config.memcap));
     }
 
     FlowInitFlowProto();
@@ -679,6 +717,9 @@ void FlowShutdown(void)
         FlowFree(f);
     }
 
+    /* per thread flow tables */
+    FlowPartitionShutdown();
+
     /* clear and free the hash */
     if (flow_hash != NULL) {
         /* clean up flow mutexes */
@@ -701,13 +742,15 @@ void FlowShutdown(void)
         SCFreeAligned(flow_hash);
         flow_hash = NULL;
     }
-    (void) SC_ATOMIC_SUB(flow_memuse, flow_config.hash_size * sizeof(FlowBucket));
+    MemcapShardsDecr(&flow_memuse, flow_config.hash_size * sizeof(FlowBucket));
     FlowQueueDestroy(&flow_spare_q);
     FlowQueueDestroy(&flow_recycle_q);
 
+    FlowWheelDestroy();
+
     SC_ATOMIC_DESTROY(flow_config.memcap);
     SC_ATOMIC_DESTROY(flow_prune_idx);
-    SC_ATOMIC_DESTROY(flow_memuse);
+    MemcapShardsDestroy(&flow_memuse);
     SC_ATOMIC_DESTROY(flow_flags);
     return;
 }
@@ -1107,6 +1150,10 @@ void FlowUpdateState(Flow *f, enum FlowState s)
         /* and reset the flow buckup next_ts value so that the flow manager
          * has to revisit this row */
         SC_ATOMIC_SET(f->fb->next_ts, 0);
+
+        /* the new state may time out sooner than the one the flow
+         * was scheduled for */
+        FlowWheelSchedule(f);
     }
 }
 
@@ -1319,6 +1366,28 @@ static int FlowTest09 (void)
     return result;
 }
 
+/**
+ *  \test  Test that the fields used in hash chain walks are in the first
+ *          cache line of a flow and that flows are cache line aligned.
+ */
+static int FlowTest10 (void)
+{
+    FAIL_IF(FLOW_HOT_SIZE > 64);
+    FAIL_IF(offsetof(Flow, src) != 0);
+    FAIL_IF(offsetof(Flow, dst) + sizeof(FlowAddress) > 64);
+    FAIL_IF(offsetof(Flow, vlan_id) + sizeof(((Flow *)0)->vlan_id) > 64);
+    FAIL_IF(offsetof(Flow, flags) + sizeof(uint32_t) > 64);
+    FAIL_IF(offsetof(Flow, hnext) + sizeof(Flow *) > 64);
+
+    FlowInitConfig(FLOW_QUIET);
+    Flow *f = FlowAlloc();
+    FAIL_IF_NULL(f);
+    FAIL_IF(((uintptr_t)f % CLS) != 0);
+    FlowFree(f);
+    FlowShutdown();
+    PASS;
+}
+
 #endif /* UNITTESTS */
 
 /**
@@ -1336,6 +1405,8 @@ void FlowRegisterTests (void)
                    FlowTest08);
     UtRegisterTest("FlowTest09 -- Test flow Allocations when it reach memcap",
                    FlowTest09);
+    UtRegisterTest("FlowTest10 -- Test flow hot fields are in one cache line",
+                   FlowTest10);
 
     FlowMgrRegisterTests();
     RegisterFlowStorageTests();
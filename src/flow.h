@@ -272,6 +272,13 @@ typedef struct FlowCnf_
     uint32_t emerg_timeout_est;
     uint32_t emergency_recovery;
 
+    /** per worker thread flow tables (workers runmode only) */
+    int partitioned;
+    uint32_t partition_hash_size;
+
+    /** use the timer wheel instead of walking the hash for timeouts */
+    int timer_wheel;
+
     SC_ATOMIC_DECLARE(uint64_t, memcap);
 } FlowConfig;
 
@@ -325,7 +332,11 @@ typedef uint16_t FlowThreadId;
 typedef struct Flow_
 {
     /* flow "header", used for hashing and flow lookup. Static after init,
-     * so safe to look at without lock */
+     * so safe to look at without lock.
+     *
+     * The header together with the flags and the hash list pointer is all
+     * a hash chain walk in FlowGetFlowFromHash() touches for flows that
+     * don't match. It's kept in the first cache line, see FLOW_HOT_SIZE. */
     FlowAddress src, dst;
     union {
         Port sp;        /**< tcp/udp source port */
@@ -346,19 +357,32 @@ typedef struct Flow_
     uint16_t vlan_id[2];
     uint8_t vlan_idx;
 
-    /** Incoming interface */
-    const struct LiveDevice_ *livedev;
+    /** mapping to Flow's protocol specific protocols for timeouts
+        and state and free functions. */
+    uint8_t protomap;
+
+    uint32_t flags;         /**< generic flags */
+
+    /** hash list pointer, protected by fb->s */
+    struct Flow_ *hnext; /* hash list */
 
     /** flow hash - the flow hash before hash table size mod. */
     uint32_t flow_hash;
 
+    /* end of flow "header" */
+
+    /** hash list pointers, protected by fb->s */
+    struct Flow_ *hprev;
+    struct FlowBucket_ *fb;
+
+    /** Incoming interface */
+    const struct LiveDevice_ *livedev;
+
     /* time stamp of last update (last packet). Set/updated under the
      * flow and flow hash row locks, safe to read under either the
      * flow lock or flow hash row lock. */
     struct timeval lastts;
 
-    /* end of flow "header" */
-
     SC_ATOMIC_DECLARE(FlowStateType, flow_state);
 
     /** how many pkts and stream msgs are using the flow *right now*. This
@@ -376,8 +400,6 @@ typedef struct Flow_
     uint32_t probing_parser_toserver_alproto_masks;
     uint32_t probing_parser_toclient_alproto_masks;
 
-    uint32_t flags;         /**< generic flags */
-
     uint16_t file_flags;    /**< file tracking/extraction flags */
     /* coccinelle: Flow:file_flags:FLOWFILE_ */
 
@@ -399,10 +421,6 @@ typedef struct Flow_
     /** protocol specific data pointer, e.g. for TcpSession */
     void *protoctx;
 
-    /** mapping to Flow's protocol specific protocols for timeouts
-        and state and free functions. */
-    uint8_t protomap;
-
     uint8_t flow_end_flags;
     /* coccinelle: Flow:flow_end_flags:FLOW_END_FLAG_ */
 
@@ -447,10 +465,18 @@ typedef struct Flow_
     /* pointer to the var list */
     GenericVar *flowvar;
 
-    /** hash list pointers, protected by fb->s */
-    struct Flow_ *hnext; /* hash list */
-    struct Flow_ *hprev;
-    struct FlowBucket_ *fb;
+
+    /** timer wheel list pointers, protected by the wheel lock */
+    struct Flow_ *wnext;
+    struct Flow_ *wprev;
+    /** second the flow is scheduled in the wheel */
+    uint32_t wheel_ts;
+    /** wheel slot + 1, 0 if not in the wheel */
+    uint16_t wslot;
+    /** second requested by a packet thread, 0 if no request is pending.
+     *  Requests are handed to the manager through a lock free list. */
+    uint32_t wheel_req;
+    struct Flow_ *wreq_next;
 
     /** queue list pointers, protected by queue mutex */
     struct Flow_ *lnext; /* list */
@@ -463,6 +489,10 @@ typedef struct Flow_
     uint64_t tosrcbytecnt;
 } Flow;
 
+/** size of the part of the Flow that is used in hash chain walks. Flows
+ *  are allocated cache line aligned, so this has to fit in one line. */
+#define FLOW_HOT_SIZE (offsetof(Flow, flow_hash) + sizeof(uint32_t))
+
 enum FlowState {
     FLOW_STATE_NEW = 0,
     FLOW_STATE_ESTABLISHED,
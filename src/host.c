@@ -59,7 +59,7 @@ static uint16_t g_host_size = sizeof(Host);
  */
 int HostSetMemcap(uint64_t size)
 {
-    if ((uint64_t)SC_ATOMIC_GET(host_memuse) < size) {
+    if ((uint64_t)MemcapShardsGetMemuse(&host_memuse) < size) {
         SC_ATOMIC_SET(host_config.memcap, size);
         return 1;
     }
@@ -85,7 +85,7 @@ uint64_t HostGetMemcap(void)
  */
 uint64_t HostGetMemuse(void)
 {
-    uint64_t memuse = SC_ATOMIC_GET(host_memuse);
+    uint64_t memuse = MemcapShardsGetMemuse(&host_memuse);
     return memuse;
 }
 
@@ -105,7 +105,7 @@ Host *HostAlloc(void)
     if (!(HOST_CHECK_MEMCAP(g_host_size))) {
         return NULL;
     }
-    (void) SC_ATOMIC_ADD(host_memuse, g_host_size);
+    MemcapShardsIncr(&host_memuse, g_host_size);
 
     Host *h = SCMalloc(g_host_size);
     if (unlikely(h == NULL))
@@ -129,7 +129,7 @@ void HostFree(Host *h)
         SC_ATOMIC_DESTROY(h->use_cnt);
         SCMutexDestroy(&h->m);
         SCFree(h);
-        (void) SC_ATOMIC_SUB(host_memuse, g_host_size);
+        MemcapShardsDecr(&host_memuse, g_host_size);
     }
 }
 
@@ -174,7 +174,7 @@ void HostInitConfig(char quiet)
     memset(&host_config,  0, sizeof(host_config));
     //SC_ATOMIC_INIT(flow_flags);
     SC_ATOMIC_INIT(host_counter);
-    SC_ATOMIC_INIT(host_memuse);
+    MemcapShardsInit(&host_memuse, MEMCAP_SHARDS_HOST, 0);
     SC_ATOMIC_INIT(host_prune_idx);
     SC_ATOMIC_INIT(host_config.memcap);
     HostQueueInit(&host_spare_q);
@@ -245,12 +245,12 @@ void HostInitConfig(char quiet)
     for (i = 0; i < host_config.hash_size; i++) {
         HRLOCK_INIT(&host_hash[i]);
     }
-    (void) SC_ATOMIC_ADD(host_memuse, (host_config.hash_size * sizeof(HostHashRow)));
+    MemcapShardsIncr(&host_memuse, (host_config.hash_size * sizeof(HostHashRow)));
 
     if (quiet == FALSE) {
         SCLogConfig("allocated %"PRIu64" bytes of memory for the host hash... "
                   "%" PRIu32 " buckets of size %" PRIuMAX "",
-                  SC_ATOMIC_GET(host_memuse), host_config.hash_size,
+                  MemcapShardsGetMemuse(&host_memuse), host_config.hash_size,
                   (uintmax_t)sizeof(HostHashRow));
     }
 
@@ -260,7 +260,7 @@ void HostInitConfig(char quiet)
             SCLogError(SC_ERR_HOST_INIT, "preallocating hosts failed: "
                     "max host memcap reached. Memcap %"PRIu64", "
                     "Memuse %"PRIu64".", SC_ATOMIC_GET(host_config.memcap),
-                    ((uint64_t)SC_ATOMIC_GET(host_memuse) + g_host_size));
+                    ((uint64_t)MemcapShardsGetMemuse(&host_memuse) + g_host_size));
             exit(EXIT_FAILURE);
         }
 
@@ -276,7 +276,7 @@ void HostInitConfig(char quiet)
         SCLogConfig("preallocated %" PRIu32 " hosts of size %" PRIu16 "",
                 host_spare_q.len, g_host_size);
         SCLogConfig("host memory usage: %"PRIu64" bytes, maximum: %"PRIu64,
-                SC_ATOMIC_GET(host_memuse), SC_ATOMIC_GET(host_config.memcap));
+                MemcapShardsGetMemuse(&host_memuse), SC_ATOMIC_GET(host_config.memcap));
     }
 
     return;
@@ -291,7 +291,7 @@ void HostPrintStats (void)
         hostbits_added, hostbits_removed, hostbits_memuse_max);
 #endif /* HOSTBITS_STATS */
     SCLogPerf("host memory usage: %"PRIu64" bytes, maximum: %"PRIu64,
-            SC_ATOMIC_GET(host_memuse), SC_ATOMIC_GET(host_config.memcap));
+            MemcapShardsGetMemuse(&host_memuse), SC_ATOMIC_GET(host_config.memcap));
     return;
 }
 
@@ -325,11 +325,11 @@ void HostShutdown(void)
         SCFreeAligned(host_hash);
         host_hash = NULL;
     }
-    (void) SC_ATOMIC_SUB(host_memuse, host_config.hash_size * sizeof(HostHashRow));
+    MemcapShardsDecr(&host_memuse, host_config.hash_size * sizeof(HostHashRow));
     HostQueueDestroy(&host_spare_q);
 
     SC_ATOMIC_DESTROY(host_prune_idx);
-    SC_ATOMIC_DESTROY(host_memuse);
+    MemcapShardsDestroy(&host_memuse);
     SC_ATOMIC_DESTROY(host_counter);
     SC_ATOMIC_DESTROY(host_config.memcap);
     //SC_ATOMIC_DESTROY(flow_flags);
@@ -26,6 +26,7 @@
 
 #include "decode.h"
 #include "util-storage.h"
+#include "util-memcap-shards.h"
 
 /** Spinlocks or Mutex for the flow buckets. */
 //#define HRLOCK_SPIN
@@ -107,7 +108,7 @@ typedef struct HostConfig_ {
  *  \retval 0 no fit
  */
 #define HOST_CHECK_MEMCAP(size) \
-    ((((uint64_t)SC_ATOMIC_GET(host_memuse) + (uint64_t)(size)) <= SC_ATOMIC_GET(host_config.memcap)))
+    MemcapShardsCheck(&host_memuse, (uint64_t)(size), SC_ATOMIC_GET(host_config.memcap))
 
 #define HostIncrUsecnt(h) \
     (void)SC_ATOMIC_ADD((h)->use_cnt, 1)
@@ -129,7 +130,7 @@ typedef struct HostConfig_ {
     } while (0)
 
 HostConfig host_config;
-SC_ATOMIC_DECLARE(uint64_t,host_memuse);
+MemcapShards host_memuse;
 SC_ATOMIC_DECLARE(uint32_t,host_counter);
 SC_ATOMIC_DECLARE(uint32_t,host_prune_idx);
 
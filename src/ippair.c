@@ -58,7 +58,7 @@ static uint16_t g_ippair_size = sizeof(IPPair);
  */
 int IPPairSetMemcap(uint64_t size)
 {
-    if ((uint64_t)SC_ATOMIC_GET(ippair_memuse) < size) {
+    if ((uint64_t)MemcapShardsGetMemuse(&ippair_memuse) < size) {
         SC_ATOMIC_SET(ippair_config.memcap, size);
         return 1;
     }
@@ -84,7 +84,7 @@ uint64_t IPPairGetMemcap(void)
  */
 uint64_t IPPairGetMemuse(void)
 {
-    uint64_t memusecopy = SC_ATOMIC_GET(ippair_memuse);
+    uint64_t memusecopy = MemcapShardsGetMemuse(&ippair_memuse);
     return memusecopy;
 }
 
@@ -105,7 +105,7 @@ IPPair *IPPairAlloc(void)
         return NULL;
     }
 
-    (void) SC_ATOMIC_ADD(ippair_memuse, g_ippair_size);
+    MemcapShardsIncr(&ippair_memuse, g_ippair_size);
 
     IPPair *h = SCMalloc(g_ippair_size);
     if (unlikely(h == NULL))
@@ -129,7 +129,7 @@ void IPPairFree(IPPair *h)
         SC_ATOMIC_DESTROY(h->use_cnt);
         SCMutexDestroy(&h->m);
         SCFree(h);
-        (void) SC_ATOMIC_SUB(ippair_memuse, g_ippair_size);
+        MemcapShardsDecr(&ippair_memuse, g_ippair_size);
     }
 }
 
@@ -170,7 +170,7 @@ void IPPairInitConfig(char quiet)
     memset(&ippair_config,  0, sizeof(ippair_config));
     //SC_ATOMIC_INIT(flow_flags);
     SC_ATOMIC_INIT(ippair_counter);
-    SC_ATOMIC_INIT(ippair_memuse);
+    MemcapShardsInit(&ippair_memuse, MEMCAP_SHARDS_IPPAIR, 0);
     SC_ATOMIC_INIT(ippair_prune_idx);
     SC_ATOMIC_INIT(ippair_config.memcap);
     IPPairQueueInit(&ippair_spare_q);
@@ -241,12 +241,12 @@ void IPPairInitConfig(char quiet)
     for (i = 0; i < ippair_config.hash_size; i++) {
         HRLOCK_INIT(&ippair_hash[i]);
     }
-    (void) SC_ATOMIC_ADD(ippair_memuse, (ippair_config.hash_size * sizeof(IPPairHashRow)));
+    MemcapShardsIncr(&ippair_memuse, (ippair_config.hash_size * sizeof(IPPairHashRow)));
 
     if (quiet == FALSE) {
         SCLogConfig("allocated %"PRIu64" bytes of memory for the ippair hash... "
                   "%" PRIu32 " buckets of size %" PRIuMAX "",
-                  SC_ATOMIC_GET(ippair_memuse), ippair_config.hash_size,
+                  MemcapShardsGetMemuse(&ippair_memuse), ippair_config.hash_size,
                   (uintmax_t)sizeof(IPPairHashRow));
     }
 
@@ -256,7 +256,7 @@ void IPPairInitConfig(char quiet)
             SCLogError(SC_ERR_IPPAIR_INIT, "preallocating ippairs failed: "
                     "max ippair memcap reached. Memcap %"PRIu64", "
                     "Memuse %"PRIu64".", SC_ATOMIC_GET(ippair_config.memcap),
-                    ((uint64_t)SC_ATOMIC_GET(ippair_memuse) + g_ippair_size));
+                    ((uint64_t)MemcapShardsGetMemuse(&ippair_memuse) + g_ippair_size));
             exit(EXIT_FAILURE);
         }
 
@@ -272,7 +272,7 @@ void IPPairInitConfig(char quiet)
         SCLogConfig("preallocated %" PRIu32 " ippairs of size %" PRIu16 "",
                 ippair_spare_q.len, g_ippair_size);
         SCLogConfig("ippair memory usage: %"PRIu64" bytes, maximum: %"PRIu64,
-                SC_ATOMIC_GET(ippair_memuse), SC_ATOMIC_GET(ippair_config.memcap));
+                MemcapShardsGetMemuse(&ippair_memuse), SC_ATOMIC_GET(ippair_config.memcap));
     }
 
     return;
@@ -287,7 +287,7 @@ void IPPairPrintStats (void)
         ippairbits_added, ippairbits_removed, ippairbits_memuse_max);
 #endif /* IPPAIRBITS_STATS */
     SCLogPerf("ippair memory usage: %"PRIu64" bytes, maximum: %"PRIu64,
-            SC_ATOMIC_GET(ippair_memuse), SC_ATOMIC_GET(ippair_config.memcap));
+            MemcapShardsGetMemuse(&ippair_memuse), SC_ATOMIC_GET(ippair_config.memcap));
     return;
 }
 
@@ -321,11 +321,11 @@ void IPPairShutdown(void)
         SCFreeAligned(ippair_hash);
         ippair_hash = NULL;
     }
-    (void) SC_ATOMIC_SUB(ippair_memuse, ippair_config.hash_size * sizeof(IPPairHashRow));
+    MemcapShardsDecr(&ippair_memuse, ippair_config.hash_size * sizeof(IPPairHashRow));
     IPPairQueueDestroy(&ippair_spare_q);
 
     SC_ATOMIC_DESTROY(ippair_prune_idx);
-    SC_ATOMIC_DESTROY(ippair_memuse);
+    MemcapShardsDestroy(&ippair_memuse);
     SC_ATOMIC_DESTROY(ippair_counter);
     SC_ATOMIC_DESTROY(ippair_config.memcap);
     //SC_ATOMIC_DESTROY(flow_flags);
@@ -26,6 +26,7 @@
 
 #include "decode.h"
 #include "util-storage.h"
+#include "util-memcap-shards.h"
 
 /** Spinlocks or Mutex for the flow buckets. */
 //#define HRLOCK_SPIN
@@ -104,7 +105,7 @@ typedef struct IPPairConfig_ {
  *  \retval 0 no fit
  */
 #define IPPAIR_CHECK_MEMCAP(size) \
-    ((((uint64_t)SC_ATOMIC_GET(ippair_memuse) + (uint64_t)(size)) <= SC_ATOMIC_GET(ippair_config.memcap)))
+    MemcapShardsCheck(&ippair_memuse, (uint64_t)(size), SC_ATOMIC_GET(ippair_config.memcap))
 
 #define IPPairIncrUsecnt(h) \
     (void)SC_ATOMIC_ADD((h)->use_cnt, 1)
@@ -126,7 +127,7 @@ typedef struct IPPairConfig_ {
     } while (0)
 
 IPPairConfig ippair_config;
-SC_ATOMIC_DECLARE(uint64_t,ippair_memuse);
+MemcapShards ippair_memuse;
 SC_ATOMIC_DECLARE(uint32_t,ippair_counter);
 SC_ATOMIC_DECLARE(uint32_t,ippair_prune_idx);
 
@@ -259,7 +259,8 @@ struct StreamLogData {
     Flow *f;
 };
 
-static int StreamLogFunc(void *cb_data, const uint8_t *data, const uint32_t data_len)
+static int StreamLogFunc(void *cb_data, const uint8_t *data, const uint32_t data_len,
+        const uint64_t data_offset)
 {
     struct StreamLogData *log = cb_data;
 
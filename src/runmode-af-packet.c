@@ -223,29 +223,44 @@ static void *ParseAFPConfig(const char *iface)
             aconf->flags |= AFP_MMAP_LOCKED;
         }
 
+        int block_lease = 0;
+        (void)ConfGetChildValueBoolWithDefault(if_root, if_default,
+                                               "block-lease", &block_lease);
+
         if (ConfGetChildValueBoolWithDefault(if_root, if_default,
                                              "tpacket-v3", (int *)&boolval) == 1)
         {
             if (boolval) {
-                if (strcasecmp(RunmodeGetActive(), "workers") == 0) {
+                /* with block leases, blocks can be held by other threads
+                 * so v3 isn't limited to workers */
+                if (block_lease || strcasecmp(RunmodeGetActive(), "workers") == 0) {
 #ifdef HAVE_TPACKET_V3
                     SCLogConfig("Enabling tpacket v3 capture on iface %s",
                             aconf->iface);
                     aconf->flags |= AFP_TPACKET_V3;
+                    if (block_lease) {
+                        SCLogConfig("Enabling block lease on iface %s",
+                                aconf->iface);
+                        aconf->flags |= AFP_BLOCK_LEASE;
+                    }
 #else
                     SCLogNotice("System too old for tpacket v3 switching to v2");
                     aconf->flags &= ~AFP_TPACKET_V3;
 #endif
                 } else {
                     SCLogWarning(SC_ERR_RUNMODE,
-                            "tpacket v3 is only implemented for 'workers' runmode."
-                            " Switching to tpacket v2.");
+                            "tpacket v3 is only implemented for 'workers' runmode"
+                            " without block-lease. Switching to tpacket v2.");
                     aconf->flags &= ~AFP_TPACKET_V3;
                 }
             } else {
                 aconf->flags &= ~AFP_TPACKET_V3;
             }
         }
+        if (block_lease && !(aconf->flags & AFP_TPACKET_V3)) {
+            SCLogWarning(SC_ERR_INVALID_ARGUMENT, "block-lease on iface %s "
+                    "needs tpacket-v3, ignoring", aconf->iface);
+        }
 
         (void)ConfGetChildValueBoolWithDefault(if_root, if_default,
                                                "use-emergency-flush", (int *)&boolval);
@@ -0,0 +1,371 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \ingroup afxdp
+ *
+ * @{
+ */
+
+/**
+ * \file
+ *
+ * AF_XDP runmode
+ *
+ */
+
+#include "suricata-common.h"
+#include "config.h"
+#include "tm-threads.h"
+#include "conf.h"
+#include "runmodes.h"
+#include "runmode-af-xdp.h"
+#include "output.h"
+
+#include "util-debug.h"
+#include "util-time.h"
+#include "util-cpu.h"
+#include "util-affinity.h"
+#include "util-device.h"
+#include "util-runmodes.h"
+#include "util-ioctl.h"
+
+#include "source-af-xdp.h"
+
+#ifdef HAVE_AF_XDP
+#include <linux/if_link.h>
+#endif
+
+const char *RunModeAFXDPGetDefaultMode(void)
+{
+    return "workers";
+}
+
+void RunModeIdsAFXDPRegister(void)
+{
+    RunModeRegisterNewRunMode(RUNMODE_AFXDP_DEV, "single",
+            "Single threaded AF_XDP mode",
+            RunModeIdsAFXDPSingle);
+    RunModeRegisterNewRunMode(RUNMODE_AFXDP_DEV, "workers",
+            "Workers AF_XDP mode, each thread does all"
+            " tasks from acquisition to logging",
+            RunModeIdsAFXDPWorkers);
+    RunModeRegisterNewRunMode(RUNMODE_AFXDP_DEV, "autofp",
+            "Multi threaded AF_XDP mode.  Packets from "
+            "each flow are assigned to a single detect "
+            "thread.",
+            RunModeIdsAFXDPAutoFp);
+    return;
+}
+
+#ifdef HAVE_AF_XDP
+
+static void AFXDPDerefConfig(void *conf)
+{
+    AFXDPIfaceConfig *pfp = (AFXDPIfaceConfig *)conf;
+    /* config is used only once but cost of this low. */
+    if (SC_ATOMIC_SUB(pfp->ref, 1) == 0) {
+        SCFree(pfp);
+    }
+}
+
+/**
+ * \brief extract information from config file
+ *
+ * The returned structure will be freed by the thread init function.
+ * It is shared by all threads of the interface, each thread takes the
+ * next queue id from it.
+ *
+ * \return a AFXDPIfaceConfig corresponding to the interface name
+ */
+static void *ParseAFXDPConfig(const char *iface)
+{
+    ConfNode *if_root = NULL;
+    ConfNode *if_default = NULL;
+    const char *tmpstr = NULL;
+    intmax_t value;
+    int boolval = 0;
+
+    if (iface == NULL) {
+        return NULL;
+    }
+
+    AFXDPIfaceConfig *aconf = SCMalloc(sizeof(*aconf));
+    if (unlikely(aconf == NULL)) {
+        return NULL;
+    }
+    memset(aconf, 0, sizeof(*aconf));
+
+    strlcpy(aconf->iface, iface, sizeof(aconf->iface));
+    aconf->threads = 0;
+    aconf->bind_mode = AFXDP_BIND_MODE_AUTO;
+    aconf->xdp_mode = XDP_FLAGS_SKB_MODE;
+    aconf->ring_size = AFXDP_DEFAULT_RING_SIZE;
+    aconf->frame_size = AFXDP_DEFAULT_FRAME_SIZE;
+    aconf->promisc = 1;
+    aconf->checksum_mode = CHECKSUM_VALIDATION_AUTO;
+    aconf->DerefFunc = AFXDPDerefConfig;
+    SC_ATOMIC_INIT(aconf->queue_id);
+    SC_ATOMIC_INIT(aconf->ref);
+    (void) SC_ATOMIC_ADD(aconf->ref, 1);
+
+    if (ConfGet("bpf-filter", &tmpstr) == 1) {
+        if (strlen(tmpstr) > 0) {
+            aconf->bpf_filter = tmpstr;
+            SCLogInfo("Going to use command-line provided bpf filter '%s'",
+                    aconf->bpf_filter);
+        }
+    }
+
+    /* Find initial node */
+    ConfNode *afxdp_node = ConfGetNode("af-xdp");
+    if (afxdp_node == NULL) {
+        SCLogInfo("Unable to find af-xdp config using default values");
+        goto finalize;
+    }
+
+    if_root = ConfFindDeviceConfig(afxdp_node, iface);
+    if_default = ConfFindDeviceConfig(afxdp_node, "default");
+
+    if (if_root == NULL && if_default == NULL) {
+        SCLogInfo("Unable to find af-xdp config for "
+                "interface \"%s\" or \"default\", using default values",
+                iface);
+        goto finalize;
+
+    /* If there is no setting for current interface use default one as main iface */
+    } else if (if_root == NULL) {
+        if_root = if_default;
+        if_default = NULL;
+    }
+
+    if (ConfGetChildValueWithDefault(if_root, if_default, "threads", &tmpstr) == 1) {
+        if (strcmp(tmpstr, "auto") == 0) {
+            aconf->threads = 0;
+        } else {
+            aconf->threads = atoi(tmpstr);
+        }
+    }
+
+    if (ConfGetChildValueWithDefault(if_root, if_default, "bind-mode", &tmpstr) == 1) {
+        if (strcmp(tmpstr, "auto") == 0) {
+            aconf->bind_mode = AFXDP_BIND_MODE_AUTO;
+        } else if (strcmp(tmpstr, "copy") == 0) {
+            aconf->bind_mode = AFXDP_BIND_MODE_COPY;
+        } else if (strcmp(tmpstr, "zero-copy") == 0) {
+            aconf->bind_mode = AFXDP_BIND_MODE_ZEROCOPY;
+        } else {
+            SCLogWarning(SC_ERR_INVALID_ARGUMENT, "Invalid bind-mode '%s' "
+                    "for %s (valid are auto, copy, zero-copy)", tmpstr, iface);
+        }
+    }
+
+    if (ConfGetChildValueWithDefault(if_root, if_default, "xdp-mode", &tmpstr) == 1) {
+        if (strcmp(tmpstr, "soft") == 0) {
+            aconf->xdp_mode = XDP_FLAGS_SKB_MODE;
+        } else if (strcmp(tmpstr, "driver") == 0) {
+            aconf->xdp_mode = XDP_FLAGS_DRV_MODE;
+        } else if (strcmp(tmpstr, "hw") == 0) {
+            aconf->xdp_mode = XDP_FLAGS_HW_MODE;
+        } else {
+            SCLogWarning(SC_ERR_INVALID_ARGUMENT, "Invalid xdp-mode '%s' "
+                    "for %s (valid are soft, driver, hw)", tmpstr, iface);
+        }
+    }
+
+    if (ConfGetChildValueIntWithDefault(if_root, if_default, "ring-size", &value) == 1) {
+        if (value <= 0 || (value & (value - 1)) != 0) {
+            SCLogWarning(SC_ERR_INVALID_ARGUMENT, "ring-size for %s must be "
+                    "a power of 2, using %u", iface, AFXDP_DEFAULT_RING_SIZE);
+        } else {
+            aconf->ring_size = (uint32_t)value;
+        }
+    }
+
+    if (ConfGetChildValueIntWithDefault(if_root, if_default, "frame-size", &value) == 1) {
+        if (value != 2048 && value != 4096) {
+            SCLogWarning(SC_ERR_INVALID_ARGUMENT, "frame-size for %s must be "
+                    "2048 or 4096, using %u", iface, AFXDP_DEFAULT_FRAME_SIZE);
+        } else {
+            aconf->frame_size = (uint32_t)value;
+        }
+    }
+
+    /* command line value has precedence */
+    if (aconf->bpf_filter == NULL) {
+        if (ConfGetChildValueWithDefault(if_root, if_default, "bpf-filter", &tmpstr) == 1) {
+            if (strlen(tmpstr) > 0) {
+                aconf->bpf_filter = tmpstr;
+                SCLogInfo("Going to use bpf filter %s", aconf->bpf_filter);
+            }
+        }
+    }
+
+    (void)ConfGetChildValueBoolWithDefault(if_root, if_default, "disable-promisc", &boolval);
+    if (boolval) {
+        SCLogInfo("Disabling promiscuous mode on iface %s", aconf->iface);
+        aconf->promisc = 0;
+    }
+
+    if (ConfGetChildValueWithDefault(if_root, if_default, "checksum-checks", &tmpstr) == 1) {
+        if (strcmp(tmpstr, "auto") == 0) {
+            aconf->checksum_mode = CHECKSUM_VALIDATION_AUTO;
+        } else if (ConfValIsTrue(tmpstr)) {
+            aconf->checksum_mode = CHECKSUM_VALIDATION_ENABLE;
+        } else if (ConfValIsFalse(tmpstr)) {
+            aconf->checksum_mode = CHECKSUM_VALIDATION_DISABLE;
+        } else {
+            SCLogWarning(SC_ERR_INVALID_ARGUMENT, "Invalid value for "
+                    "checksum-checks for %s", iface);
+        }
+    }
+
+finalize:
+    /* one thread per rx queue */
+    if (aconf->threads <= 0) {
+        aconf->threads = GetIfaceRSSQueuesNum(aconf->iface);
+    }
+    if (aconf->threads <= 0) {
+        aconf->threads = 1;
+    }
+
+    if (LiveGetOffload() == 0) {
+        (void)GetIfaceOffloading(aconf->iface, 1, 1);
+    } else {
+        DisableIfaceOffloading(LiveGetDevice(aconf->iface), 1, 1);
+    }
+
+    SC_ATOMIC_RESET(aconf->ref);
+    (void) SC_ATOMIC_ADD(aconf->ref, aconf->threads);
+    SCLogPerf("Using %d threads for interface %s", aconf->threads, aconf->iface);
+
+    return aconf;
+}
+
+static int AFXDPConfigGetThreadsCount(void *conf)
+{
+    AFXDPIfaceConfig *aconf = (AFXDPIfaceConfig *)conf;
+    return aconf->threads;
+}
+
+#endif /* HAVE_AF_XDP */
+
+int RunModeIdsAFXDPAutoFp(void)
+{
+    SCEnter();
+
+#ifdef HAVE_AF_XDP
+    int ret;
+    const char *live_dev = NULL;
+
+    RunModeInitialize();
+
+    TimeModeSetLive();
+
+    (void)ConfGet("af-xdp.live-interface", &live_dev);
+
+    SCLogDebug("live_dev %s", live_dev);
+
+    ret = RunModeSetLiveCaptureAutoFp(
+                              ParseAFXDPConfig,
+                              AFXDPConfigGetThreadsCount,
+                              "ReceiveAFXDP",
+                              "DecodeAFXDP", thread_name_autofp,
+                              live_dev);
+    if (ret != 0) {
+        SCLogError(SC_ERR_RUNMODE, "Unable to start runmode");
+        exit(EXIT_FAILURE);
+    }
+
+    SCLogDebug("RunModeIdsAFXDPAutoFp initialised");
+#endif /* HAVE_AF_XDP */
+
+    SCReturnInt(0);
+}
+
+/**
+ * \brief Single thread version of the AF_XDP processing.
+ */
+int RunModeIdsAFXDPSingle(void)
+{
+    SCEnter();
+
+#ifdef HAVE_AF_XDP
+    int ret;
+    const char *live_dev = NULL;
+
+    RunModeInitialize();
+    TimeModeSetLive();
+
+    (void)ConfGet("af-xdp.live-interface", &live_dev);
+
+    ret = RunModeSetLiveCaptureSingle(
+                                    ParseAFXDPConfig,
+                                    AFXDPConfigGetThreadsCount,
+                                    "ReceiveAFXDP",
+                                    "DecodeAFXDP", thread_name_single,
+                                    live_dev);
+    if (ret != 0) {
+        SCLogError(SC_ERR_RUNMODE, "Unable to start runmode");
+        exit(EXIT_FAILURE);
+    }
+
+    SCLogDebug("RunModeIdsAFXDPSingle initialised");
+
+#endif /* HAVE_AF_XDP */
+    SCReturnInt(0);
+}
+
+/**
+ * \brief Workers version of the AF_XDP processing.
+ *
+ * Start N threads with each thread doing all the work, one thread
+ * per queue of the interface.
+ */
+int RunModeIdsAFXDPWorkers(void)
+{
+    SCEnter();
+
+#ifdef HAVE_AF_XDP
+    int ret;
+    const char *live_dev = NULL;
+
+    RunModeInitialize();
+    TimeModeSetLive();
+
+    (void)ConfGet("af-xdp.live-interface", &live_dev);
+
+    ret = RunModeSetLiveCaptureWorkers(
+                                    ParseAFXDPConfig,
+                                    AFXDPConfigGetThreadsCount,
+                                    "ReceiveAFXDP",
+                                    "DecodeAFXDP", thread_name_workers,
+                                    live_dev);
+    if (ret != 0) {
+        SCLogError(SC_ERR_RUNMODE, "Unable to start runmode");
+        exit(EXIT_FAILURE);
+    }
+
+    SCLogDebug("RunModeIdsAFXDPWorkers initialised");
+
+#endif /* HAVE_AF_XDP */
+    SCReturnInt(0);
+}
+
+/**
+ * @}
+ */
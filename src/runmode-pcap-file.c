@@ -20,10 +20,13 @@
 #include "conf.h"
 #include "runmodes.h"
 #include "runmode-pcap-file.h"
+#include "runmode-unix-socket.h"
 #include "output.h"
 
 #include "detect-engine.h"
+#include "flow-partition.h"
 #include "source-pcap-file.h"
+#include "source-pcap-file-directory-helper.h"
 
 #include "util-debug.h"
 #include "util-time.h"
@@ -52,6 +55,11 @@ void RunModeFilePcapRegister(void)
                               "the same flow can be processed by any detect "
                               "thread",
                               RunModeFilePcapAutoFp);
+    RunModeRegisterNewRunMode(RUNMODE_PCAP_FILE, "workers",
+                              "Workers pcap file mode, the files of a "
+                              "directory are sharded over multiple reader "
+                              "threads that each run the full pipeline",
+                              RunModeFilePcapWorkers);
 
     return;
 }
@@ -129,6 +137,122 @@ int RunModeFilePcapSingle(void)
     return 0;
 }
 
+/**
+ * \brief Workers version of the Pcap file processing.
+ *
+ * Each worker thread reads, decodes and inspects its own share of the
+ * files of a directory. Files are sorted by modification time and name,
+ * and file i goes to worker i % readers, so the assignment does not depend
+ * on thread scheduling. Every worker owns a private flow table, so a flow
+ * only ever sees packets from the files of a single worker. The output of
+ * a file is held back until the files before it are written, so the logs
+ * are in the order of the files.
+ */
+int RunModeFilePcapWorkers(void)
+{
+    const char *file = NULL;
+    char tname[TM_THREAD_NAME_MAX];
+
+    if (ConfGet("pcap-file.file", &file) == 0) {
+        SCLogError(SC_ERR_RUNMODE, "Failed retrieving pcap-file from Conf");
+        exit(EXIT_FAILURE);
+    }
+
+    RunModeInitialize();
+    TimeModeSetOffline();
+
+    PcapFileGlobalInit();
+
+    intmax_t readers = 0;
+    if (ConfGetInt("pcap-file.readers", &readers) != 1 || readers <= 0) {
+        readers = TmThreadGetNbThreads(WORKER_CPU_SET);
+        if (readers == 0)
+            readers = UtilCpuGetNumProcessorsOnline() * threading_detect_ratio;
+    }
+    if (readers < 1)
+        readers = 1;
+    if (readers > 1024)
+        readers = 1024;
+
+    /* a single file can't be sharded, and in continuous mode every reader
+     * would see a different listing of the directory */
+    DIR *directory = NULL;
+    if (PcapDetermineDirectoryOrFile((char *)file, &directory) != TM_ECODE_OK ||
+            directory == NULL) {
+        readers = 1;
+    } else {
+        closedir(directory);
+
+        int should_loop = 0;
+        if (readers > 1 && ConfGetBool("pcap-file.continuous", &should_loop) == 1 &&
+                should_loop == 1) {
+            SCLogWarning(SC_WARN_COMPATIBILITY, "pcap-file.continuous is not "
+                    "supported with multiple readers, using a single reader");
+            readers = 1;
+        }
+    }
+    if (RunModeUnixSocketIsActive())
+        readers = 1;
+#ifndef TLS
+    /* the file name and the ordering of the output are per thread */
+    if (readers > 1) {
+        SCLogWarning(SC_WARN_COMPATIBILITY, "multiple pcap-file readers need "
+                "thread local storage support, using a single reader");
+        readers = 1;
+    }
+#endif
+
+    PcapFileSetReaders((uint16_t)readers);
+    if (readers > 1)
+        FlowPartitionEnable();
+    SCLogConfig("pcap-file: %"PRIuMAX" reader thread(s)", (uintmax_t)readers);
+
+    for (int thread = 0; thread < readers; thread++) {
+        snprintf(tname, sizeof(tname), "%s#%02d", thread_name_workers, thread + 1);
+
+        ThreadVars *tv = TmThreadCreatePacketHandler(tname,
+                                                     "packetpool", "packetpool",
+                                                     "packetpool", "packetpool",
+                                                     "pktacqloop");
+        if (tv == NULL) {
+            SCLogError(SC_ERR_RUNMODE, "threading setup failed");
+            exit(EXIT_FAILURE);
+        }
+
+        TmModule *tm_module = TmModuleGetByName("ReceivePcapFile");
+        if (tm_module == NULL) {
+            SCLogError(SC_ERR_RUNMODE, "TmModuleGetByName failed for ReceivePcap");
+            exit(EXIT_FAILURE);
+        }
+        TmSlotSetFuncAppend(tv, tm_module, file);
+
+        tm_module = TmModuleGetByName("DecodePcapFile");
+        if (tm_module == NULL) {
+            SCLogError(SC_ERR_RUNMODE, "TmModuleGetByName DecodePcap failed");
+            exit(EXIT_FAILURE);
+        }
+        TmSlotSetFuncAppend(tv, tm_module, NULL);
+
+        tm_module = TmModuleGetByName("FlowWorker");
+        if (tm_module == NULL) {
+            SCLogError(SC_ERR_RUNMODE, "TmModuleGetByName for FlowWorker failed");
+            exit(EXIT_FAILURE);
+        }
+        TmSlotSetFuncAppend(tv, tm_module, NULL);
+
+        TmThreadSetCPU(tv, WORKER_CPU_SET);
+
+        /* threads are spawned one at a time, so they take their reader
+         * id in this order */
+        if (TmThreadSpawn(tv) != TM_ECODE_OK) {
+            SCLogError(SC_ERR_RUNMODE, "TmThreadSpawn failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return 0;
+}
+
 /**
  * \brief RunModeFilePcapAutoFp set up the following thread packet handlers:
  *        - Receive thread (from pcap file)
@@ -40,11 +40,14 @@
 #include "detect-engine-tag.h"
 #include "detect-engine-modbus.h"
 #include "detect-fast-pattern.h"
+#include "detect-pcre.h"
 #include "flow.h"
 #include "flow-timeout.h"
 #include "flow-manager.h"
 #include "flow-var.h"
 #include "flow-bit.h"
+#include "flow-partition.h"
+#include "flow-wheel.h"
 #include "pkt-var.h"
 
 #include "host.h"
@@ -90,6 +93,9 @@
 #include "util-bloomfilter.h"
 #include "util-bloomfilter-counting.h"
 #include "util-pool.h"
+#include "util-slab-thread.h"
+#include "util-memcap-shards.h"
+#include "util-checksum-simd.h"
 #include "util-byte.h"
 #include "util-proto-name.h"
 #include "util-memrchr.h"
@@ -102,8 +108,12 @@
 #include "conf.h"
 #include "conf-yaml-loader.h"
 #include "tmqh-flow.h"
+#include "tmqh-ring.h"
+#include "tmqh-packetpool.h"
 #include "defrag.h"
 #include "detect-engine-siggroup.h"
+#include "detect-engine-nonpf.h"
+#include "source-pcap-file-mmap-helper.h"
 
 #include "util-streaming-buffer.h"
 #include "util-lua.h"
@@ -133,12 +143,16 @@ static void RegisterUnittests(void)
     SigRegisterTests();
     SCReputationRegisterTests();
     TmModuleRegisterTests();
+    TmThreadsRegisterTests();
     SigTableRegisterTests();
     HashTableRegisterTests();
     HashListTableRegisterTests();
     BloomFilterRegisterTests();
     BloomFilterCountingRegisterTests();
     PoolRegisterTests();
+    SlabThreadRegisterTests();
+    MemcapShardsRegisterTests();
+    ChecksumSimdRegisterTests();
     ByteRegisterTests();
     MpmRegisterTests();
     FlowBitRegisterTests();
@@ -159,17 +173,23 @@ static void RegisterUnittests(void)
     DecodeGRERegisterTests();
     DecodeAsn1RegisterTests();
     DecodeMPLSRegisterTests();
+    PcapFileMmapRegisterTests();
     AppLayerProtoDetectUnittestsRegister();
     ConfRegisterTests();
     ConfYamlRegisterTests();
     TmqhFlowRegisterTests();
+    TmqhRingRegisterTests();
+    TmqhPacketpoolRegisterTests();
     FlowRegisterTests();
+    FlowPartitionRegisterTests();
+    FlowWheelRegisterTests();
     HostRegisterUnittests();
     IPPairRegisterUnittests();
     SCSigRegisterSignatureOrderingTests();
     SCRadixRegisterTests();
     DefragRegisterTests();
     SigGroupHeadRegisterTests();
+    DetectNonPfRegisterTests();
     SCHInfoRegisterTests();
     SCRuleVarsRegisterTests();
     AppLayerParserRegisterUnittests();
@@ -290,6 +310,7 @@ void RunUnittests(int list_unittests, const char *regex_arg)
         UtCleanup();
 #ifdef BUILD_HYPERSCAN
         MpmHSGlobalCleanup();
+        DetectPcrePrefilterCleanup();
 #endif
         if (failed) {
             exit(EXIT_FAILURE);
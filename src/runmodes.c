@@ -53,6 +53,7 @@
 #include "tmqh-flow.h"
 #include "flow-manager.h"
 #include "flow-bypass.h"
+#include "flow-partition.h"
 #include "counters.h"
 
 int debuglog_enabled = 0;
@@ -151,6 +152,12 @@ static const char *RunModeTranslateModeToName(int runmode)
             return "WINDIVERT";
 #else
             return "WINDIVERT(DISABLED)";
+#endif
+        case RUNMODE_AFXDP_DEV:
+#ifdef HAVE_AF_XDP
+            return "AF_XDP_DEV";
+#else
+            return "AF_XDP_DEV(DISABLED)";
 #endif
         default:
             SCLogError(SC_ERR_UNKNOWN_RUN_MODE, "Unknown runtime mode. Aborting");
@@ -225,6 +232,7 @@ void RunModeRegisterRunModes(void)
     RunModeIdsNflogRegister();
     RunModeUnixSocketRegister();
     RunModeIpsWinDivertRegister();
+    RunModeIdsAFXDPRegister();
 #ifdef UNITTESTS
     UtRunModeRegister();
 #endif
@@ -335,6 +343,9 @@ void RunModeDispatch(int runmode, const char *custom_mode)
                 custom_mode = RunModeIpsWinDivertGetDefaultMode();
                 break;
 #endif
+            case RUNMODE_AFXDP_DEV:
+                custom_mode = RunModeAFXDPGetDefaultMode();
+                break;
             default:
                 SCLogError(SC_ERR_UNKNOWN_RUN_MODE, "Unknown runtime mode. Aborting");
                 exit(EXIT_FAILURE);
@@ -375,6 +386,7 @@ void RunModeDispatch(int runmode, const char *custom_mode)
     if (strcasecmp(active_runmode, "autofp") == 0) {
         TmqhFlowPrintAutofpHandler();
     }
+    FlowPartitionCheckRunmode(active_runmode);
 
     mode->RunModeFunc();
 
@@ -163,8 +163,15 @@ TmEcode NoAFPSupportExit(ThreadVars *tv, const void *initdata, void **data)
 #define AFP_STATE_UP 1
 
 #define AFP_RECONNECT_TIMEOUT 500000
+
+/** max number of frames of a TPACKET_V3 block that are passed to the
+ *  pipeline as one batch */
+#define AFP_V3_BATCH_SIZE 64
 #define AFP_DOWN_COUNTER_INTERVAL 40
 
+/** time to wait when the next block is still leased, in usec */
+#define AFP_BLOCK_BUSY_WAIT 100
+
 #define POLL_TIMEOUT 100
 
 #ifndef TP_STATUS_USER_BUSY
@@ -176,6 +183,10 @@ TmEcode NoAFPSupportExit(ThreadVars *tv, const void *initdata, void **data)
 #define TP_STATUS_VLAN_VALID (1 << 4)
 #endif
 
+#ifndef TP_STATUS_CSUM_VALID
+#define TP_STATUS_CSUM_VALID (1 << 7)
+#endif
+
 enum {
     AFP_READ_OK,
     AFP_READ_FAILURE,
@@ -200,6 +211,41 @@ union thdr {
 static int AFPBypassCallback(Packet *p);
 static int AFPXDPBypassCallback(Packet *p);
 
+#ifdef HAVE_TPACKET_V3
+struct AFPBlockLeases_;
+
+/**
+ * \brief lease of a TPACKET_V3 block
+ *
+ * In block lease mode packets point into the block and the block is only
+ * given back to the kernel when the last of them is released, which can
+ * happen on any thread.
+ */
+typedef struct AFPBlockLease_ {
+    struct tpacket_block_desc *pbd;
+    struct AFPBlockLeases_ *ctx;
+    uint64_t start;     /**< time the block was taken, in usec */
+    uint32_t refcnt;    /**< packets of the block in use, +1 while walking */
+    uint8_t active;     /**< set until the block is given back */
+} AFPBlockLease;
+
+/**
+ * \brief leases for all the blocks of a ring
+ *
+ * The hold time stats are updated by the threads releasing the blocks
+ * and collected by the capture thread. The structure lives as long as
+ * the ring mapping, as packets may still reference it when the capture
+ * thread goes down.
+ */
+typedef struct AFPBlockLeases_ {
+    uint64_t released;
+    uint64_t hold_usecs;
+    uint64_t hold_max;
+    uint32_t nr;
+    AFPBlockLease blocks[];
+} AFPBlockLeases;
+#endif
+
 #define MAX_MAPS 32
 /**
  * \brief Structure to hold thread specific variables.
@@ -236,6 +282,12 @@ typedef struct AFPThreadVars_
     uint16_t capture_kernel_drops;
     uint16_t capture_errors;
 
+    /* block lease counters */
+    uint16_t capture_blocks_released;
+    uint16_t capture_block_hold_usecs;
+    uint16_t capture_block_hold_max;
+    uint16_t capture_block_busy;
+
     /* handle state */
     uint8_t afp_state;
     uint8_t copy_mode;
@@ -290,6 +342,11 @@ typedef struct AFPThreadVars_
     unsigned int ring_buflen;
     uint8_t *ring_buf;
 
+#ifdef HAVE_TPACKET_V3
+    /* block leases, NULL if not in block lease mode */
+    AFPBlockLeases *leases;
+#endif
+
     uint8_t xdp_mode;
 
 } AFPThreadVars;
@@ -572,6 +629,17 @@ static inline void AFPDumpCounters(AFPThreadVars *ptv)
         (void) SC_ATOMIC_ADD(ptv->livedev->pkts, (uint64_t) kstats.tp_packets);
     }
 #endif
+#ifdef HAVE_TPACKET_V3
+    if (ptv->leases != NULL) {
+        AFPBlockLeases *l = ptv->leases;
+        StatsAddUI64(ptv->tv, ptv->capture_blocks_released,
+                __atomic_exchange_n(&l->released, 0, __ATOMIC_RELAXED));
+        StatsAddUI64(ptv->tv, ptv->capture_block_hold_usecs,
+                __atomic_exchange_n(&l->hold_usecs, 0, __ATOMIC_RELAXED));
+        StatsSetUI64(ptv->tv, ptv->capture_block_hold_max,
+                __atomic_exchange_n(&l->hold_max, 0, __ATOMIC_RELAXED));
+    }
+#endif
 }
 
 /**
@@ -699,6 +767,10 @@ static int AFPRead(AFPThreadVars *ptv)
         if (aux_checksum && (aux->tp_status & TP_STATUS_CSUMNOTREADY)) {
             p->flags |= PKT_IGNORE_CHECKSUM;
         }
+        /* checksum verified by the NIC, no need to compute it */
+        if (aux->tp_status & TP_STATUS_CSUM_VALID) {
+            p->flags |= PKT_L4_CSUM_VALID;
+        }
         break;
     }
 
@@ -825,6 +897,38 @@ cleanup:
 }
 
 #ifdef HAVE_TPACKET_V3
+static inline uint64_t AFPBlockLeaseTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** \internal
+ *  \brief drop a reference to a leased block
+ *
+ *  The last reference gives the block back to the kernel.
+ */
+static void AFPBlockLeaseReturn(AFPBlockLease *lease)
+{
+    if (__atomic_sub_fetch(&lease->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    AFPBlockLeases *ctx = lease->ctx;
+    const uint64_t held = AFPBlockLeaseTime() - lease->start;
+    __atomic_add_fetch(&ctx->released, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ctx->hold_usecs, held, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&ctx->hold_max, __ATOMIC_RELAXED);
+    while (held > max && !__atomic_compare_exchange_n(&ctx->hold_max,
+                &max, held, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    __atomic_store_n(&lease->pbd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+            __ATOMIC_RELEASE);
+    /* only now the capture thread may look at the block again */
+    __atomic_store_n(&lease->active, 0, __ATOMIC_RELEASE);
+}
+
 static void AFPReleasePacketV3(Packet *p)
 {
     /* Need to be in copy mode and need to detect early release
@@ -832,6 +936,14 @@ static void AFPReleasePacketV3(Packet *p)
     if ((p->afp_v.copy_mode != AFP_COPY_MODE_NONE) && !PKT_IS_PSEUDOPKT(p)) {
         AFPWritePacket(p, TPACKET_V3);
     }
+    if (p->afp_v.lease != NULL) {
+        /* the ring stays mapped until the last packet dropped its socket
+         * reference, so the lease is given back even if the socket went
+         * down */
+        AFPBlockLeaseReturn(p->afp_v.lease);
+        (void)AFPDerefSocket(p->afp_v.mpeer);
+        AFPV_CLEANUP(&p->afp_v);
+    }
     PacketFreeOrRelease(p);
 }
 #endif
@@ -1003,6 +1115,10 @@ static int AFPReadFromRing(AFPThreadVars *ptv)
                 p->flags |= PKT_IGNORE_CHECKSUM;
             }
         }
+        /* checksum verified by the NIC, no need to compute it */
+        if (h.h2->tp_status & TP_STATUS_CSUM_VALID) {
+            p->flags |= PKT_L4_CSUM_VALID;
+        }
         if (h.h2->tp_status & TP_STATUS_LOSING) {
             emergency_flush = 1;
             AFPDumpCounters(ptv);
@@ -1039,7 +1155,14 @@ static inline void AFPFlushBlock(struct tpacket_block_desc *pbd)
     pbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
 }
 
-static inline int AFPParsePacketV3(AFPThreadVars *ptv, struct tpacket_block_desc *pbd, struct tpacket3_hdr *ppd)
+/** \internal
+ *  \brief setup a packet for a frame of a block
+ *
+ *  The packet is not processed here, AFPWalkBlock() hands the packets
+ *  of a block to the rest of the pipeline in batches.
+ */
+static inline int AFPParsePacketV3(AFPThreadVars *ptv, AFPBlockLease *lease,
+        struct tpacket3_hdr *ppd, Packet **rp)
 {
     Packet *p = PacketGetFromQueueOrAlloc();
     if (p == NULL) {
@@ -1080,6 +1203,10 @@ static inline int AFPParsePacketV3(AFPThreadVars *ptv, struct tpacket_block_desc
         p->ReleasePacket = AFPReleasePacketV3;
         p->afp_v.mpeer = ptv->mpeer;
         AFPRefSocket(ptv->mpeer);
+        if (lease != NULL) {
+            __atomic_add_fetch(&lease->refcnt, 1, __ATOMIC_RELAXED);
+            p->afp_v.lease = lease;
+        }
 
         p->afp_v.copy_mode = ptv->copy_mode;
         if (p->afp_v.copy_mode != AFP_COPY_MODE_NONE) {
@@ -1116,39 +1243,62 @@ static inline int AFPParsePacketV3(AFPThreadVars *ptv, struct tpacket_block_desc
             p->flags |= PKT_IGNORE_CHECKSUM;
         }
     }
-
-    if (TmThreadsSlotProcessPkt(ptv->tv, ptv->slot, p) != TM_ECODE_OK) {
-        TmqhOutputPacketpool(ptv->tv, p);
-        SCReturnInt(AFP_SURI_FAILURE);
+    /* checksum verified by the NIC, no need to compute it */
+    if (ppd->tp_status & TP_STATUS_CSUM_VALID) {
+        p->flags |= PKT_L4_CSUM_VALID;
     }
 
+    *rp = p;
     SCReturnInt(AFP_READ_OK);
 }
 
-static inline int AFPWalkBlock(AFPThreadVars *ptv, struct tpacket_block_desc *pbd)
+/** \internal
+ *  \brief pass a batch of packets to the rest of the pipeline */
+static inline void AFPProcessBatch(AFPThreadVars *ptv, Packet **pkts, uint32_t cnt)
+{
+    if (cnt == 0)
+        return;
+
+    /* on failure the packets are returned to the pool */
+    (void)TmThreadsSlotProcessPktBatch(ptv->tv, ptv->slot, pkts, cnt);
+}
+
+static inline int AFPWalkBlock(AFPThreadVars *ptv, struct tpacket_block_desc *pbd,
+        AFPBlockLease *lease)
 {
     int num_pkts = pbd->hdr.bh1.num_pkts, i;
     uint8_t *ppd;
     int ret = 0;
+    Packet *pkts[AFP_V3_BATCH_SIZE];
+    uint32_t cnt = 0;
 
     ppd = (uint8_t *)pbd + pbd->hdr.bh1.offset_to_first_pkt;
     for (i = 0; i < num_pkts; ++i) {
-        ret = AFPParsePacketV3(ptv, pbd,
-                               (struct tpacket3_hdr *)ppd);
+        Packet *p = NULL;
+        ret = AFPParsePacketV3(ptv, lease,
+                               (struct tpacket3_hdr *)ppd, &p);
         switch (ret) {
             case AFP_READ_OK:
+                pkts[cnt++] = p;
                 break;
             case AFP_SURI_FAILURE:
                 /* Internal error but let's just continue and
                  * treat thenext packet */
                 break;
             case AFP_READ_FAILURE:
+                AFPProcessBatch(ptv, pkts, cnt);
                 SCReturnInt(AFP_READ_FAILURE);
             default:
+                AFPProcessBatch(ptv, pkts, cnt);
                 SCReturnInt(ret);
         }
+        if (cnt == AFP_V3_BATCH_SIZE) {
+            AFPProcessBatch(ptv, pkts, cnt);
+            cnt = 0;
+        }
         ppd = ppd + ((struct tpacket3_hdr *)ppd)->tp_next_offset;
     }
+    AFPProcessBatch(ptv, pkts, cnt);
 
     SCReturnInt(AFP_READ_OK);
 }
@@ -1178,18 +1328,40 @@ static int AFPReadFromRingV3(AFPThreadVars *ptv)
 
         pbd = (struct tpacket_block_desc *) ptv->ring.v3[ptv->frame_offset].iov_base;
 
+        AFPBlockLease *lease = NULL;
+        if (ptv->leases != NULL) {
+            lease = &ptv->leases->blocks[ptv->frame_offset];
+            /* packets of the block are still in use: the ring is too
+             * small for the time packets spend in the pipeline */
+            if (__atomic_load_n(&lease->active, __ATOMIC_ACQUIRE)) {
+                StatsIncr(ptv->tv, ptv->capture_block_busy);
+                usleep(AFP_BLOCK_BUSY_WAIT);
+                SCReturnInt(AFP_READ_OK);
+            }
+        }
+
         /* block is not ready to be read */
         if ((pbd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
             SCReturnInt(AFP_READ_OK);
         }
 
-        ret = AFPWalkBlock(ptv, pbd);
-        if (unlikely(ret != AFP_READ_OK)) {
+        if (lease != NULL) {
+            /* the walk holds a reference so the block isn't given back
+             * before all its packets are set up */
+            lease->active = 1;
+            lease->refcnt = 1;
+            lease->start = AFPBlockLeaseTime();
+
+            ret = AFPWalkBlock(ptv, pbd, lease);
+            AFPBlockLeaseReturn(lease);
+        } else {
+            ret = AFPWalkBlock(ptv, pbd, NULL);
             AFPFlushBlock(pbd);
+        }
+        if (unlikely(ret != AFP_READ_OK)) {
             SCReturnInt(ret);
         }
 
-        AFPFlushBlock(pbd);
         ptv->frame_offset = (ptv->frame_offset + 1) % ptv->req.v3.tp_block_nr;
         /* return to maintenance task after one loop on the ring */
         if (ptv->frame_offset == 0) {
@@ -1235,6 +1407,25 @@ static int AFPDerefSocket(AFPPeer* peer)
     return 1;
 }
 
+/**
+ * \brief unmap the ring of a socket that went down
+ *
+ * Only to be called once no packet references the ring anymore.
+ */
+static void AFPReleaseRing(AFPThreadVars *ptv)
+{
+    if (ptv->ring_buf != NULL) {
+        munmap(ptv->ring_buf, ptv->ring_buflen);
+        ptv->ring_buf = NULL;
+    }
+#ifdef HAVE_TPACKET_V3
+    if (ptv->leases != NULL) {
+        SCFree(ptv->leases);
+        ptv->leases = NULL;
+    }
+#endif
+}
+
 static void AFPSwitchState(AFPThreadVars *ptv, int state)
 {
     ptv->afp_state = state;
@@ -1246,7 +1437,7 @@ static void AFPSwitchState(AFPThreadVars *ptv, int state)
     if (state == AFP_STATE_DOWN) {
 #ifdef HAVE_TPACKET_V3
         if (ptv->flags & AFP_TPACKET_V3) {
-            if (!ptv->ring.v3) {
+            if (ptv->ring.v3) {
                 SCFree(ptv->ring.v3);
                 ptv->ring.v3 = NULL;
             }
@@ -1264,10 +1455,12 @@ static void AFPSwitchState(AFPThreadVars *ptv, int state)
             /* we need to wait for all packets to return data */
             if (SC_ATOMIC_SUB(ptv->mpeer->sock_usage, 1) == 0) {
                 SCLogDebug("Cleaning socket connected to '%s'", ptv->iface);
-                munmap(ptv->ring_buf, ptv->ring_buflen);
                 close(ptv->socket);
                 ptv->socket = -1;
+                AFPReleaseRing(ptv);
             }
+            /* otherwise the last packet closes the socket, and the ring
+             * and its leases are released by AFPTryReopen() */
         }
     }
     if (state == AFP_STATE_UP) {
@@ -1440,6 +1633,8 @@ static int AFPTryReopen(AFPThreadVars *ptv)
     if (SC_ATOMIC_GET(ptv->mpeer->sock_usage) != 0) {
         return -1;
     }
+    /* all packets are released, the old ring can go */
+    AFPReleaseRing(ptv);
 
     int afp_activate_r = AFPCreateSocket(ptv, ptv->iface, 0);
     if (afp_activate_r != 0) {
@@ -1932,6 +2127,7 @@ static int AFPSetupRing(AFPThreadVars *ptv, char *devname)
     if (ptv->ring_buf == MAP_FAILED) {
         SCLogError(SC_ERR_MEM_ALLOC, "Unable to mmap, error %s",
                    strerror(errno));
+        ptv->ring_buf = NULL;
         goto mmap_err;
     }
 #ifdef HAVE_TPACKET_V3
@@ -1945,6 +2141,19 @@ static int AFPSetupRing(AFPThreadVars *ptv, char *devname)
             ptv->ring.v3[i].iov_base = ptv->ring_buf + (i * ptv->req.v3.tp_block_size);
             ptv->ring.v3[i].iov_len = ptv->req.v3.tp_block_size;
         }
+        if (ptv->flags & AFP_BLOCK_LEASE) {
+            ptv->leases = SCCalloc(1, sizeof(AFPBlockLeases) +
+                    ptv->req.v3.tp_block_nr * sizeof(AFPBlockLease));
+            if (ptv->leases == NULL) {
+                SCLogError(SC_ERR_MEM_ALLOC, "Unable to malloc block leases");
+                goto postmmap_err;
+            }
+            ptv->leases->nr = ptv->req.v3.tp_block_nr;
+            for (i = 0; i < ptv->req.v3.tp_block_nr; ++i) {
+                ptv->leases->blocks[i].pbd = ptv->ring.v3[i].iov_base;
+                ptv->leases->blocks[i].ctx = ptv->leases;
+            }
+        }
     } else {
 #endif
         /* allocate a ring for each frame header pointer*/
@@ -1973,10 +2182,17 @@ static int AFPSetupRing(AFPThreadVars *ptv, char *devname)
 
 postmmap_err:
     munmap(ptv->ring_buf, ptv->ring_buflen);
+    ptv->ring_buf = NULL;
     if (ptv->ring.v2)
         SCFree(ptv->ring.v2);
     if (ptv->ring.v3)
         SCFree(ptv->ring.v3);
+#ifdef HAVE_TPACKET_V3
+    if (ptv->leases) {
+        SCFree(ptv->leases);
+        ptv->leases = NULL;
+    }
+#endif
 mmap_err:
     /* Packet mmap does the cleaning when socket is closed */
     return AFP_FATAL_ERROR;
@@ -2219,6 +2435,12 @@ socket_err:
             SCFree(ptv->ring.v3);
             ptv->ring.v3 = NULL;
         }
+#ifdef HAVE_TPACKET_V3
+        if (ptv->leases) {
+            SCFree(ptv->leases);
+            ptv->leases = NULL;
+        }
+#endif
     } else {
         if (ptv->ring.v2) {
             SCFree(ptv->ring.v2);
@@ -2602,6 +2824,16 @@ TmEcode ReceiveAFPThreadInit(ThreadVars *tv, const void *initdata, void **data)
     ptv->capture_errors = StatsRegisterCounter("capture.errors",
             ptv->tv);
 #endif
+    if (ptv->flags & AFP_BLOCK_LEASE) {
+        ptv->capture_blocks_released = StatsRegisterCounter(
+                "capture.afpacket.blocks_released", ptv->tv);
+        ptv->capture_block_hold_usecs = StatsRegisterCounter(
+                "capture.afpacket.block_hold_usecs", ptv->tv);
+        ptv->capture_block_hold_max = StatsRegisterMaxCounter(
+                "capture.afpacket.block_hold_max_usecs", ptv->tv);
+        ptv->capture_block_busy = StatsRegisterCounter(
+                "capture.afpacket.block_busy", ptv->tv);
+    }
 
     ptv->copy_mode = afpconfig->copy_mode;
     if (ptv->copy_mode != AFP_COPY_MODE_NONE) {
@@ -53,6 +53,7 @@
 #define AFP_MMAP_LOCKED (1<<6)
 #define AFP_BYPASS   (1<<7)
 #define AFP_XDPBYPASS   (1<<8)
+#define AFP_BLOCK_LEASE (1<<9)
 
 #define AFP_COPY_MODE_NONE  0
 #define AFP_COPY_MODE_TAP   1
@@ -137,10 +138,13 @@ typedef struct AFPPacketVars_
     uint8_t copy_mode;
     int v4_map_fd;
     int v6_map_fd;
+    /** TPACKET_V3 block lease the packet data lives in */
+    void *lease;
 } AFPPacketVars;
 
 #define AFPV_CLEANUP(afpv) do {           \
     (afpv)->relptr = NULL;                \
+    (afpv)->lease = NULL;                 \
     (afpv)->copy_mode = 0;                \
     (afpv)->peer = NULL;                  \
     (afpv)->mpeer = NULL;                 \
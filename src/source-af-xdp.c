@@ -0,0 +1,940 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ *  \defgroup afxdp AF_XDP running mode
+ *
+ *  @{
+ */
+
+/**
+ * \file
+ *
+ * AF_XDP socket acquisition support
+ *
+ * Each receive thread binds an AF_XDP socket to one queue of the
+ * interface. The socket has its own UMEM: a block of frames the kernel
+ * writes packets into. Frames are handed to the kernel through the fill
+ * ring and come back, holding a packet, through the rx ring.
+ *
+ * Packets point into their frame (PacketSetData()), there is no copy.
+ * When a packet is released its frame goes on a free list, from where the
+ * receive thread puts it back on the fill ring. The free list and the fill
+ * ring are only touched by the receive thread. In autofp mode the release
+ * can happen on another thread, those frames are pushed on a lock free
+ * return stack that the receive thread takes over as a whole. Every
+ * packet holds a reference to the UMEM, so the UMEM is only freed once
+ * the last packet pointing into it is released, even if the receive
+ * thread went away before that.
+ *
+ * The socket is only used for receiving, IPS mode is not supported.
+ */
+
+#include "suricata-common.h"
+
+#ifdef HAVE_AF_XDP
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <bpf/xsk.h>
+#endif /* HAVE_AF_XDP */
+
+#include "suricata.h"
+#include "decode.h"
+#include "threads.h"
+#include "threadvars.h"
+#include "tm-threads.h"
+#include "conf.h"
+#include "util-bpf.h"
+#include "util-debug.h"
+#include "util-device.h"
+#include "util-error.h"
+#include "util-privs.h"
+#include "util-optimize.h"
+#include "util-checksum.h"
+#include "util-ioctl.h"
+
+#include "tmqh-packetpool.h"
+#include "source-af-xdp.h"
+#include "runmodes.h"
+
+#ifndef HAVE_AF_XDP
+
+/**
+ * \brief this function prints an error message and exits.
+ */
+static TmEcode NoAFXDPSupportExit(ThreadVars *tv, const void *initdata, void **data)
+{
+    SCLogError(SC_ERR_NO_AF_XDP, "Error creating thread %s: you do not have "
+            "support for AF_XDP enabled, please recompile with "
+            "--enable-ebpf and a libbpf that provides xsk.h", tv->name);
+    exit(EXIT_FAILURE);
+}
+
+void TmModuleReceiveAFXDPRegister(void)
+{
+    tmm_modules[TMM_RECEIVEAFXDP].name = "ReceiveAFXDP";
+    tmm_modules[TMM_RECEIVEAFXDP].ThreadInit = NoAFXDPSupportExit;
+    tmm_modules[TMM_RECEIVEAFXDP].flags = TM_FLAG_RECEIVE_TM;
+}
+
+/**
+ * \brief Registration Function for DecodeAFXDP.
+ */
+void TmModuleDecodeAFXDPRegister(void)
+{
+    tmm_modules[TMM_DECODEAFXDP].name = "DecodeAFXDP";
+    tmm_modules[TMM_DECODEAFXDP].ThreadInit = NoAFXDPSupportExit;
+    tmm_modules[TMM_DECODEAFXDP].flags = TM_FLAG_DECODE_TM;
+}
+
+#else /* We have AF_XDP support */
+
+#define POLL_TIMEOUT 100
+#define POLL_EVENTS (POLLHUP|POLLRDHUP|POLLERR|POLLNVAL)
+
+/** max number of packets taken from the rx ring at once */
+#define AFXDP_RX_BATCH  64
+
+/** time between attempts to bind a new socket after an error, in usec */
+#define AFXDP_RECONNECT_TIMEOUT 500000
+/** log a failed attempt only every N times */
+#define AFXDP_DOWN_COUNTER_INTERVAL 40
+
+/** AFXDPTryReopen() return values */
+#define AFXDP_REOPEN_OK     0
+#define AFXDP_REOPEN_RETRY  -1
+#define AFXDP_REOPEN_FATAL  -2
+
+typedef struct AFXDPUmem_ {
+    struct xsk_umem *umem;
+    struct xsk_ring_prod fq;    /**< fill ring: frames for the kernel */
+    struct xsk_ring_cons cq;    /**< completion ring, unused as we don't tx */
+    void *area;
+    uint64_t size;
+    uint32_t frame_size;
+    uint32_t nframes;
+    /** receive thread, the only one touching the free list and fill ring */
+    pthread_t owner;
+
+    /* frames of released packets, to be put back on the fill ring. Owned
+     * by the receive thread. */
+    uint64_t *free_frames;
+    uint32_t free_cnt;
+
+    /* one reference for the receive thread and one per frame held by a
+     * packet, so the UMEM outlives the socket and the thread while
+     * packets still point into it. Atomic. */
+    uint32_t refcnt;
+
+    /* frames released by other threads: stack of frame numbers + 1,
+     * linked through return_next, 0 ends it. return_head is atomic. */
+    uint32_t return_head;
+    uint32_t *return_next;
+} AFXDPUmem;
+
+/**
+ * \brief Module thread local variables.
+ */
+typedef struct AFXDPThreadVars_
+{
+    /* suricata internals */
+    TmSlot *slot;
+    ThreadVars *tv;
+    LiveDevice *livedev;
+
+    AFXDPUmem *umem;
+    struct xsk_socket *xsk;
+    struct xsk_ring_cons rx;
+    int fd;
+    /* socket was torn down after an error, to be bound again */
+    int down;
+    uint32_t down_count;
+
+    char iface[AFXDP_IFACE_NAME_LENGTH];
+    uint32_t queue_id;
+    uint32_t ring_size;
+    uint32_t frame_size;
+    uint32_t xdp_flags;
+    int bind_mode;
+    int promisc;
+    ChecksumValidationMode checksum_mode;
+    struct bpf_program bpf_prog;
+
+    /* counters */
+    uint64_t pkts;              /**< taken from the rx ring */
+    uint64_t bytes;
+    uint64_t errors;            /**< frames dropped for lack of a packet */
+    /** last XDP_STATISTICS of the socket, the kernel counts per socket */
+    struct xdp_statistics kstats;
+    uint16_t capture_kernel_packets;
+    uint16_t capture_kernel_drops;
+    uint16_t capture_errors;
+    uint16_t capture_fill_ring_empty;
+} AFXDPThreadVars;
+
+/**
+ * \brief put all frames from the free list on the fill ring
+ *
+ * Only called from the receive thread, the fill ring is single producer.
+ */
+static void AFXDPRefillFillRing(AFXDPThreadVars *xtv)
+{
+    AFXDPUmem *u = xtv->umem;
+    uint32_t idx = 0;
+
+    /* take over the frames released by other threads */
+    if (__atomic_load_n(&u->return_head, __ATOMIC_RELAXED) != 0) {
+        uint32_t f = __atomic_exchange_n(&u->return_head, 0, __ATOMIC_ACQUIRE);
+        while (f != 0) {
+            u->free_frames[u->free_cnt++] = (uint64_t)(f - 1) * u->frame_size;
+            f = u->return_next[f - 1];
+        }
+    }
+
+    uint32_t n = xsk_prod_nb_free(&u->fq, u->free_cnt);
+    if (n > u->free_cnt)
+        n = u->free_cnt;
+    if (n > 0 && xsk_ring_prod__reserve(&u->fq, n, &idx) == n) {
+        for (uint32_t i = 0; i < n; i++) {
+            *xsk_ring_prod__fill_addr(&u->fq, idx++) =
+                u->free_frames[--u->free_cnt];
+        }
+        xsk_ring_prod__submit(&u->fq, n);
+    }
+
+#ifdef XDP_USE_NEED_WAKEUP
+    /* the driver ran out of fill ring entries and stopped, kick it. If it
+     * is running there is no need for a syscall. */
+    if (xsk_ring_prod__needs_wakeup(&u->fq)) {
+        (void)recvfrom(xtv->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+#endif
+}
+
+/** \brief give a frame back from the receive thread, it's put on the
+ *         fill ring by AFXDPRefillFillRing() */
+static inline void AFXDPFreeFrame(AFXDPUmem *u, uint64_t addr)
+{
+    u->free_frames[u->free_cnt++] = addr;
+}
+
+/** \brief give a frame back from another thread: push it on the return
+ *         stack */
+static void AFXDPReturnFrame(AFXDPUmem *u, uint64_t addr)
+{
+    const uint32_t f = (uint32_t)(addr / u->frame_size) + 1;
+    uint32_t head = __atomic_load_n(&u->return_head, __ATOMIC_RELAXED);
+    do {
+        u->return_next[f - 1] = head;
+    } while (!__atomic_compare_exchange_n(&u->return_head, &head, f,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void AFXDPUmemFree(AFXDPUmem *u)
+{
+    if (u->umem != NULL)
+        xsk_umem__delete(u->umem);
+    if (u->area != NULL)
+        free(u->area);
+    if (u->free_frames != NULL)
+        SCFree(u->free_frames);
+    if (u->return_next != NULL)
+        SCFree(u->return_next);
+    SCFree(u);
+}
+
+/** \brief drop a reference to a UMEM, the last one frees it
+ *
+ *  The socket bound to the UMEM must be gone before the receive thread
+ *  drops its reference.
+ */
+static void AFXDPUmemDeref(AFXDPUmem *u)
+{
+    if (__atomic_sub_fetch(&u->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        AFXDPUmemFree(u);
+}
+
+/** \brief create the UMEM of the receive thread, called from it */
+static int AFXDPUmemCreate(AFXDPThreadVars *xtv)
+{
+    AFXDPUmem *u = SCMalloc(sizeof(*u));
+    if (unlikely(u == NULL))
+        return -1;
+    memset(u, 0, sizeof(*u));
+
+    u->nframes = xtv->ring_size * 2;
+    u->frame_size = xtv->frame_size;
+    u->size = (uint64_t)u->nframes * u->frame_size;
+    u->owner = pthread_self();
+    u->refcnt = 1;
+
+    if (posix_memalign(&u->area, getpagesize(), u->size) != 0) {
+        SCLogError(SC_ERR_MEM_ALLOC, "Unable to allocate %"PRIu64" bytes "
+                "of UMEM for %s", u->size, xtv->iface);
+        u->area = NULL;
+        AFXDPUmemFree(u);
+        return -1;
+    }
+
+    struct xsk_umem_config cfg = {
+        .fill_size = xtv->ring_size,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = u->frame_size,
+        .frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+    };
+    int r = xsk_umem__create(&u->umem, u->area, u->size, &u->fq, &u->cq, &cfg);
+    if (r != 0) {
+        SCLogError(SC_ERR_AF_XDP_CREATE, "Unable to create UMEM for %s: %s",
+                xtv->iface, strerror(-r));
+        u->umem = NULL;
+        AFXDPUmemFree(u);
+        return -1;
+    }
+
+    u->free_frames = SCMalloc(u->nframes * sizeof(uint64_t));
+    u->return_next = SCMalloc(u->nframes * sizeof(uint32_t));
+    if (unlikely(u->free_frames == NULL || u->return_next == NULL)) {
+        AFXDPUmemFree(u);
+        return -1;
+    }
+    /* all frames start out free */
+    for (uint32_t i = 0; i < u->nframes; i++) {
+        u->free_frames[i] = (uint64_t)i * u->frame_size;
+    }
+    u->free_cnt = u->nframes;
+
+    xtv->umem = u;
+    return 0;
+}
+
+/**
+ * \brief bind a socket to our queue, using the UMEM of the thread
+ *
+ * \retval 0 on success, -errno on failure
+ */
+static int AFXDPSocketCreate(AFXDPThreadVars *xtv, int verbose)
+{
+    struct xsk_socket_config cfg = {
+        .rx_size = xtv->ring_size,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .libbpf_flags = 0,
+        .xdp_flags = xtv->xdp_flags,
+        .bind_flags = 0,
+    };
+
+    if (xtv->bind_mode == AFXDP_BIND_MODE_COPY) {
+        cfg.bind_flags |= XDP_COPY;
+    } else if (xtv->bind_mode == AFXDP_BIND_MODE_ZEROCOPY) {
+        cfg.bind_flags |= XDP_ZEROCOPY;
+    }
+#ifdef XDP_USE_NEED_WAKEUP
+    cfg.bind_flags |= XDP_USE_NEED_WAKEUP;
+#endif
+
+    /* without tx ring, libbpf loads its default XDP program redirecting
+     * the queue to our socket */
+    int r = xsk_socket__create(&xtv->xsk, xtv->iface, xtv->queue_id,
+            xtv->umem->umem, &xtv->rx, NULL, &cfg);
+    if (r != 0) {
+        if (!verbose)
+            return r;
+        SCLogError(SC_ERR_AF_XDP_CREATE, "Unable to create AF_XDP socket for "
+                "%s queue %u (%s mode): %s", xtv->iface, xtv->queue_id,
+                xtv->bind_mode == AFXDP_BIND_MODE_COPY ? "copy" :
+                xtv->bind_mode == AFXDP_BIND_MODE_ZEROCOPY ? "zero-copy" : "auto",
+                strerror(-r));
+        return r;
+    }
+    xtv->fd = xsk_socket__fd(xtv->xsk);
+
+    SCLogConfig("%s: AF_XDP socket bound to queue %u, %u frames of %u bytes",
+            xtv->iface, xtv->queue_id, xtv->umem->nframes, xtv->frame_size);
+    return 0;
+}
+
+/**
+ * \brief update the capture counters from the socket's XDP_STATISTICS
+ *
+ * The kernel doesn't count the packets it delivers, so like
+ * PACKET_STATISTICS' tp_packets, capture.kernel_packets is the packets
+ * we took from the rx ring plus the ones the kernel dropped. Drops are
+ * packets that didn't fit the rx ring, had an invalid descriptor or
+ * were dropped for other reasons (like finding no frame in copy mode).
+ * capture.afxdp.fill_ring_empty counts the times the driver found the
+ * fill ring empty: we don't give frames back fast enough.
+ */
+static inline void AFXDPDumpCounters(AFXDPThreadVars *xtv)
+{
+    uint64_t drops = 0;
+    uint64_t fill_empty = 0;
+
+    if (xtv->fd != -1) {
+        struct xdp_statistics stats;
+        socklen_t len = sizeof(stats);
+        memset(&stats, 0, sizeof(stats));
+
+        /* kernels before 5.9 only fill in the first three fields */
+        if (getsockopt(xtv->fd, SOL_XDP, XDP_STATISTICS, &stats, &len) == 0) {
+            drops = (stats.rx_dropped - xtv->kstats.rx_dropped) +
+                (stats.rx_invalid_descs - xtv->kstats.rx_invalid_descs) +
+                (stats.rx_ring_full - xtv->kstats.rx_ring_full);
+            fill_empty = stats.rx_fill_ring_empty_descs -
+                xtv->kstats.rx_fill_ring_empty_descs;
+            xtv->kstats = stats;
+        }
+    }
+
+    StatsAddUI64(xtv->tv, xtv->capture_kernel_packets, xtv->pkts + drops);
+    StatsAddUI64(xtv->tv, xtv->capture_kernel_drops, drops);
+    StatsAddUI64(xtv->tv, xtv->capture_errors, xtv->errors);
+    StatsAddUI64(xtv->tv, xtv->capture_fill_ring_empty, fill_empty);
+    (void) SC_ATOMIC_ADD(xtv->livedev->drop, drops + xtv->errors);
+    (void) SC_ATOMIC_ADD(xtv->livedev->pkts, xtv->pkts + drops);
+    xtv->errors = 0;
+    xtv->pkts = 0;
+}
+
+/**
+ * \brief Init function for ReceiveAFXDP.
+ * \param tv pointer to ThreadVars
+ * \param initdata pointer to the interface passed from the user
+ * \param data pointer gets populated with AFXDPThreadVars
+ */
+static TmEcode ReceiveAFXDPThreadInit(ThreadVars *tv, const void *initdata, void **data)
+{
+    SCEnter();
+    AFXDPIfaceConfig *aconf = (AFXDPIfaceConfig *)initdata;
+
+    if (initdata == NULL) {
+        SCLogError(SC_ERR_INVALID_ARGUMENT, "initdata == NULL");
+        SCReturnInt(TM_ECODE_FAILED);
+    }
+
+    AFXDPThreadVars *xtv = SCMalloc(sizeof(*xtv));
+    if (unlikely(xtv == NULL)) {
+        SCLogError(SC_ERR_MEM_ALLOC, "Memory allocation failed");
+        goto error;
+    }
+    memset(xtv, 0, sizeof(*xtv));
+
+    xtv->tv = tv;
+    xtv->fd = -1;
+    strlcpy(xtv->iface, aconf->iface, sizeof(xtv->iface));
+    xtv->queue_id = SC_ATOMIC_ADD(aconf->queue_id, 1) - 1;
+    xtv->xdp_flags = aconf->xdp_mode;
+    xtv->bind_mode = aconf->bind_mode;
+    xtv->ring_size = aconf->ring_size;
+    xtv->frame_size = aconf->frame_size;
+    xtv->promisc = aconf->promisc;
+    xtv->checksum_mode = aconf->checksum_mode;
+
+    xtv->livedev = LiveGetDevice(aconf->iface);
+    if (xtv->livedev == NULL) {
+        SCLogError(SC_ERR_INVALID_VALUE, "Unable to find Live device");
+        goto error_xtv;
+    }
+
+    if (xtv->promisc) {
+        int if_flags = GetIfaceFlags(xtv->iface);
+        if (if_flags != -1 && (if_flags & IFF_PROMISC) == 0) {
+            SetIfaceFlags(xtv->iface, if_flags | IFF_PROMISC);
+        }
+    }
+
+    if (AFXDPUmemCreate(xtv) != 0) {
+        goto error_xtv;
+    }
+    if (AFXDPSocketCreate(xtv, 1) != 0) {
+        goto error_umem;
+    }
+    AFXDPRefillFillRing(xtv);
+
+    /* basic counters */
+    xtv->capture_kernel_packets = StatsRegisterCounter("capture.kernel_packets",
+            xtv->tv);
+    xtv->capture_kernel_drops = StatsRegisterCounter("capture.kernel_drops",
+            xtv->tv);
+    xtv->capture_errors = StatsRegisterCounter("capture.errors",
+            xtv->tv);
+    xtv->capture_fill_ring_empty = StatsRegisterCounter(
+            "capture.afxdp.fill_ring_empty", xtv->tv);
+
+    if (aconf->bpf_filter) {
+        SCLogConfig("Using BPF '%s' on iface '%s'",
+                  aconf->bpf_filter, xtv->iface);
+        char errbuf[PCAP_ERRBUF_SIZE];
+        if (SCBPFCompile(default_packet_size,  /* snaplen_arg */
+                    LINKTYPE_ETHERNET,    /* linktype_arg */
+                    &xtv->bpf_prog,       /* program */
+                    aconf->bpf_filter,    /* const char *buf */
+                    1,                    /* optimize */
+                    PCAP_NETMASK_UNKNOWN,  /* mask */
+                    errbuf,
+                    sizeof(errbuf)) == -1)
+        {
+            SCLogError(SC_ERR_AF_XDP_CREATE, "Failed to compile BPF \"%s\": %s",
+                   aconf->bpf_filter,
+                   errbuf);
+            goto error_socket;
+        }
+    }
+
+    *data = (void *)xtv;
+    aconf->DerefFunc(aconf);
+    SCReturnInt(TM_ECODE_OK);
+
+error_socket:
+    xsk_socket__delete(xtv->xsk);
+error_umem:
+    AFXDPUmemDeref(xtv->umem);
+error_xtv:
+    SCFree(xtv);
+error:
+    aconf->DerefFunc(aconf);
+    SCReturnInt(TM_ECODE_FAILED);
+}
+
+/**
+ * \brief Packet release routine: the frame goes back to the kernel.
+ * \param p Packet.
+ */
+static void AFXDPReleasePacket(Packet *p)
+{
+    AFXDPUmem *u = (AFXDPUmem *)p->afxdp_v.umem;
+
+    /* in workers mode the receive thread releases its own packets */
+    if (pthread_equal(pthread_self(), u->owner)) {
+        AFXDPFreeFrame(u, p->afxdp_v.addr);
+    } else {
+        AFXDPReturnFrame(u, p->afxdp_v.addr);
+    }
+    /* the receive thread may be gone already */
+    AFXDPUmemDeref(u);
+
+    PacketFreeOrRelease(p);
+}
+
+/**
+ * \brief wrap a received frame in a Packet
+ *
+ * \retval p packet or NULL if the frame was filtered or we failed to get
+ *         a packet, in which case the frame is freed
+ */
+static inline Packet *AFXDPParseFrame(AFXDPThreadVars *xtv, const struct xdp_desc *desc,
+        const struct timeval *ts)
+{
+    AFXDPUmem *u = xtv->umem;
+    uint8_t *data = xsk_umem__get_data(u->area, desc->addr);
+
+    xtv->pkts++;
+    xtv->bytes += desc->len;
+
+    if (xtv->bpf_prog.bf_len) {
+        struct pcap_pkthdr pkthdr = { {0, 0}, desc->len, desc->len };
+        if (pcap_offline_filter(&xtv->bpf_prog, &pkthdr, data) == 0) {
+            AFXDPFreeFrame(u, desc->addr);
+            return NULL;
+        }
+    }
+
+    Packet *p = PacketGetFromQueueOrAlloc();
+    if (unlikely(p == NULL)) {
+        AFXDPFreeFrame(u, desc->addr);
+        xtv->errors++;
+        return NULL;
+    }
+
+    PKT_SET_SRC(p, PKT_SRC_WIRE);
+    p->livedev = xtv->livedev;
+    p->datalink = LINKTYPE_ETHERNET;
+    p->ts = *ts;
+
+    if (PacketSetData(p, data, desc->len) == -1) {
+        TmqhOutputPacketpool(xtv->tv, p);
+        AFXDPFreeFrame(u, desc->addr);
+        return NULL;
+    }
+    p->ReleasePacket = AFXDPReleasePacket;
+    p->afxdp_v.umem = u;
+    p->afxdp_v.addr = desc->addr;
+    __atomic_add_fetch(&u->refcnt, 1, __ATOMIC_RELAXED);
+
+    /* We only check for checksum disable */
+    if (xtv->checksum_mode == CHECKSUM_VALIDATION_DISABLE) {
+        p->flags |= PKT_IGNORE_CHECKSUM;
+    } else if (xtv->checksum_mode == CHECKSUM_VALIDATION_AUTO) {
+        if (xtv->livedev->ignore_checksum) {
+            p->flags |= PKT_IGNORE_CHECKSUM;
+        } else if (ChecksumAutoModeCheck(xtv->pkts,
+                    SC_ATOMIC_GET(xtv->livedev->pkts),
+                    SC_ATOMIC_GET(xtv->livedev->invalid_checksums))) {
+            xtv->livedev->ignore_checksum = 1;
+            p->flags |= PKT_IGNORE_CHECKSUM;
+        }
+    }
+
+    SCLogDebug("pktlen: %" PRIu32 " (pkt %p, pkt data %p)",
+            GET_PKT_LEN(p), p, GET_PKT_DATA(p));
+    return p;
+}
+
+/**
+ * \brief take the packets from the rx ring and run them through the
+ *        pipeline as a batch
+ */
+static void AFXDPReadRx(AFXDPThreadVars *xtv, uint32_t rcvd, uint32_t idx)
+{
+    Packet *pkts[AFXDP_RX_BATCH];
+    uint32_t cnt = 0;
+    struct timeval ts;
+
+    gettimeofday(&ts, NULL);
+
+    for (uint32_t i = 0; i < rcvd; i++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&xtv->rx, idx++);
+
+        Packet *p = AFXDPParseFrame(xtv, desc, &ts);
+        if (p != NULL)
+            pkts[cnt++] = p;
+    }
+    /* the descriptors are done with, the frames are ours until the
+     * packets are released */
+    xsk_ring_cons__release(&xtv->rx, rcvd);
+
+    if (cnt > 0) {
+        /* on failure the packets are returned to the pool */
+        (void)TmThreadsSlotProcessPktBatch(xtv->tv, xtv->slot, pkts, cnt);
+    }
+}
+
+/**
+ * \brief tear the socket down after an error
+ *
+ * The UMEM goes with it, packets still in the pipeline keep it around
+ * until they are released. AFXDPTryReopen() binds a new socket.
+ */
+static void AFXDPSocketDown(AFXDPThreadVars *xtv)
+{
+    AFXDPDumpCounters(xtv);
+
+    if (xtv->xsk != NULL) {
+        xsk_socket__delete(xtv->xsk);
+        xtv->xsk = NULL;
+    }
+    xtv->fd = -1;
+    if (xtv->umem != NULL) {
+        AFXDPUmemDeref(xtv->umem);
+        xtv->umem = NULL;
+    }
+    memset(&xtv->kstats, 0, sizeof(xtv->kstats));
+    xtv->down = 1;
+    xtv->down_count = 0;
+}
+
+/**
+ * \brief try to bind a new socket after AFXDPSocketDown()
+ *
+ * \retval AFXDP_REOPEN_OK socket is up again
+ * \retval AFXDP_REOPEN_RETRY failed, try again later
+ * \retval AFXDP_REOPEN_FATAL failed in a way that won't get better
+ */
+static int AFXDPTryReopen(AFXDPThreadVars *xtv)
+{
+    xtv->down_count++;
+
+    if (xtv->umem == NULL && AFXDPUmemCreate(xtv) != 0) {
+        return AFXDP_REOPEN_FATAL;
+    }
+
+    int r = AFXDPSocketCreate(xtv, 0);
+    if (r != 0) {
+        /* the driver or our privileges won't change */
+        if (r == -EOPNOTSUPP || r == -EPERM) {
+            SCLogError(SC_ERR_AF_XDP_CREATE, "Unable to bind AF_XDP socket "
+                    "for %s queue %u again: %s", xtv->iface, xtv->queue_id,
+                    strerror(-r));
+            return AFXDP_REOPEN_FATAL;
+        }
+        if (xtv->down_count % AFXDP_DOWN_COUNTER_INTERVAL == 0) {
+            SCLogWarning(SC_ERR_AF_XDP_CREATE, "Can not bind AF_XDP socket "
+                    "for %s queue %u: %s", xtv->iface, xtv->queue_id,
+                    strerror(-r));
+        }
+        return AFXDP_REOPEN_RETRY;
+    }
+
+    xtv->down = 0;
+    AFXDPRefillFillRing(xtv);
+    SCLogInfo("AF_XDP socket of '%s' queue %u is back", xtv->iface,
+            xtv->queue_id);
+    return AFXDP_REOPEN_OK;
+}
+
+/**
+ *  \brief Main AF_XDP reading loop function
+ */
+static TmEcode ReceiveAFXDPLoop(ThreadVars *tv, void *data, void *slot)
+{
+    SCEnter();
+
+    TmSlot *s = (TmSlot *)slot;
+    AFXDPThreadVars *xtv = (AFXDPThreadVars *)data;
+    struct pollfd fds;
+
+    xtv->slot = s->slot_next;
+    fds.fd = xtv->fd;
+    fds.events = POLLIN;
+
+    for(;;) {
+        if (unlikely(suricata_ctl_flags != 0)) {
+            break;
+        }
+
+        /* socket went down after an error, bind a new one */
+        if (unlikely(xtv->down)) {
+            int r = AFXDP_REOPEN_RETRY;
+            do {
+                usleep(AFXDP_RECONNECT_TIMEOUT);
+                if (suricata_ctl_flags != 0)
+                    break;
+                r = AFXDPTryReopen(xtv);
+            } while (r == AFXDP_REOPEN_RETRY);
+
+            if (suricata_ctl_flags != 0)
+                break;
+            if (r == AFXDP_REOPEN_FATAL) {
+                SCLogError(SC_ERR_AF_XDP_READ, "Giving up on AF_XDP socket "
+                        "of iface '%s' queue %u", xtv->iface, xtv->queue_id);
+                SCReturnInt(TM_ECODE_FAILED);
+            }
+            fds.fd = xtv->fd;
+        }
+
+        /* make sure we have packets in the packet pool, to prevent us
+         * from alloc'ing packets at line rate */
+        PacketPoolWait();
+
+        AFXDPRefillFillRing(xtv);
+
+        uint32_t idx = 0;
+        const uint32_t rcvd = xsk_ring_cons__peek(&xtv->rx, AFXDP_RX_BATCH, &idx);
+        if (rcvd > 0) {
+            AFXDPReadRx(xtv, rcvd, idx);
+            StatsSyncCountersIfSignalled(tv);
+            continue;
+        }
+
+        /* rx ring is empty, wait for the kernel */
+        int r = poll(&fds, 1, POLL_TIMEOUT);
+        if (r < 0) {
+            /* error */
+            if (errno != EINTR) {
+                SCLogError(SC_ERR_AF_XDP_READ,
+                           "Error polling AF_XDP socket of iface '%s': (%d) %s",
+                           xtv->iface, errno, strerror(errno));
+                AFXDPSocketDown(xtv);
+            }
+            continue;
+
+        } else if (r == 0) {
+            /* sync counters */
+            AFXDPDumpCounters(xtv);
+            StatsSyncCountersIfSignalled(tv);
+
+            /* poll timed out, lets see if we need to inject a fake packet  */
+            TmThreadsCaptureInjectPacket(tv, xtv->slot, NULL);
+            continue;
+        }
+
+        if (unlikely(fds.revents & POLL_EVENTS)) {
+            if (fds.revents & POLLNVAL) {
+                SCLogError(SC_ERR_AF_XDP_READ,
+                        "Invalid polling request");
+            } else if (fds.revents & POLLERR) {
+                int err = 0;
+                socklen_t errlen = sizeof(err);
+                if (getsockopt(xtv->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 &&
+                        err == 0)
+                    continue; /* what, no error? */
+                SCLogError(SC_ERR_AF_XDP_READ,
+                        "Error reading AF_XDP socket of iface '%s': (%d) %s",
+                        xtv->iface, err, strerror(err));
+            } else {
+                SCLogWarning(SC_ERR_AF_XDP_READ,
+                        "AF_XDP socket of iface '%s' hung up", xtv->iface);
+            }
+            AFXDPSocketDown(xtv);
+            continue;
+        }
+
+        AFXDPDumpCounters(xtv);
+        StatsSyncCountersIfSignalled(tv);
+    }
+
+    AFXDPDumpCounters(xtv);
+    StatsSyncCountersIfSignalled(tv);
+    SCReturnInt(TM_ECODE_OK);
+}
+
+/**
+ * \brief This function prints stats to the screen at exit.
+ * \param tv pointer to ThreadVars
+ * \param data pointer that gets cast into AFXDPThreadVars for xtv
+ */
+static void ReceiveAFXDPThreadExitStats(ThreadVars *tv, void *data)
+{
+    SCEnter();
+    AFXDPThreadVars *xtv = (AFXDPThreadVars *)data;
+
+    AFXDPDumpCounters(xtv);
+    SCLogPerf("(%s) Kernel: Packets %" PRIu64 ", dropped %" PRIu64 ", bytes %" PRIu64 "",
+              tv->name,
+              StatsGetLocalCounterValue(tv, xtv->capture_kernel_packets),
+              StatsGetLocalCounterValue(tv, xtv->capture_kernel_drops),
+              xtv->bytes);
+}
+
+/**
+ * \brief
+ * \param tv
+ * \param data Pointer to AFXDPThreadVars.
+ */
+static TmEcode ReceiveAFXDPThreadDeinit(ThreadVars *tv, void *data)
+{
+    SCEnter();
+
+    AFXDPThreadVars *xtv = (AFXDPThreadVars *)data;
+
+    if (xtv->xsk != NULL) {
+        xsk_socket__delete(xtv->xsk);
+        xtv->xsk = NULL;
+    }
+    /* packets still in the pipeline keep the UMEM around */
+    if (xtv->umem != NULL) {
+        AFXDPUmemDeref(xtv->umem);
+        xtv->umem = NULL;
+    }
+    if (xtv->bpf_prog.bf_insns) {
+        SCBPFFree(&xtv->bpf_prog);
+    }
+
+    SCFree(xtv);
+
+    SCReturnInt(TM_ECODE_OK);
+}
+
+/**
+ * \brief Prepare AF_XDP decode thread.
+ * \param tv Thread local avariables.
+ * \param initdata Thread config.
+ * \param data Pointer to DecodeThreadVars placed here.
+ */
+static TmEcode DecodeAFXDPThreadInit(ThreadVars *tv, const void *initdata, void **data)
+{
+    SCEnter();
+
+    DecodeThreadVars *dtv = DecodeThreadVarsAlloc(tv);
+    if (dtv == NULL)
+        SCReturnInt(TM_ECODE_FAILED);
+
+    DecodeRegisterPerfCounters(dtv, tv);
+
+    *data = (void *)dtv;
+
+    SCReturnInt(TM_ECODE_OK);
+}
+
+/**
+ * \brief This function passes off to link type decoders.
+ *
+ * \param t pointer to ThreadVars
+ * \param p pointer to the current packet
+ * \param data pointer that gets cast into DecodeThreadVars
+ * \param pq pointer to the current PacketQueue
+ * \param postpq
+ */
+static TmEcode DecodeAFXDP(ThreadVars *tv, Packet *p, void *data, PacketQueue *pq, PacketQueue *postpq)
+{
+    SCEnter();
+
+    DecodeThreadVars *dtv = (DecodeThreadVars *)data;
+
+    /* XXX HACK: flow timeout can call us for injected pseudo packets
+     *           see bug: https://redmine.openinfosecfoundation.org/issues/1107 */
+    if (p->flags & PKT_PSEUDO_STREAM_END)
+        SCReturnInt(TM_ECODE_OK);
+
+    /* update counters */
+    DecodeUpdatePacketCounters(tv, dtv, p);
+
+    DecodeEthernet(tv, dtv, p, GET_PKT_DATA(p), GET_PKT_LEN(p), pq);
+
+    PacketDecodeFinalize(tv, dtv, p);
+
+    SCReturnInt(TM_ECODE_OK);
+}
+
+/**
+ * \brief
+ * \param tv
+ * \param data Pointer to DecodeThreadVars.
+ */
+static TmEcode DecodeAFXDPThreadDeinit(ThreadVars *tv, void *data)
+{
+    SCEnter();
+
+    if (data != NULL)
+        DecodeThreadVarsFree(tv, data);
+
+    SCReturnInt(TM_ECODE_OK);
+}
+
+/**
+ * \brief Registration Function for ReceiveAFXDP.
+ */
+void TmModuleReceiveAFXDPRegister(void)
+{
+    tmm_modules[TMM_RECEIVEAFXDP].name = "ReceiveAFXDP";
+    tmm_modules[TMM_RECEIVEAFXDP].ThreadInit = ReceiveAFXDPThreadInit;
+    tmm_modules[TMM_RECEIVEAFXDP].PktAcqLoop = ReceiveAFXDPLoop;
+    tmm_modules[TMM_RECEIVEAFXDP].ThreadExitPrintStats = ReceiveAFXDPThreadExitStats;
+    tmm_modules[TMM_RECEIVEAFXDP].ThreadDeinit = ReceiveAFXDPThreadDeinit;
+    tmm_modules[TMM_RECEIVEAFXDP].cap_flags = SC_CAP_NET_RAW | SC_CAP_NET_ADMIN;
+    tmm_modules[TMM_RECEIVEAFXDP].flags = TM_FLAG_RECEIVE_TM;
+}
+
+/**
+ * \brief Registration Function for DecodeAFXDP.
+ */
+void TmModuleDecodeAFXDPRegister(void)
+{
+    tmm_modules[TMM_DECODEAFXDP].name = "DecodeAFXDP";
+    tmm_modules[TMM_DECODEAFXDP].ThreadInit = DecodeAFXDPThreadInit;
+    tmm_modules[TMM_DECODEAFXDP].Func = DecodeAFXDP;
+    tmm_modules[TMM_DECODEAFXDP].ThreadDeinit = DecodeAFXDPThreadDeinit;
+    tmm_modules[TMM_DECODEAFXDP].cap_flags = 0;
+    tmm_modules[TMM_DECODEAFXDP].flags = TM_FLAG_DECODE_TM;
+}
+
+#endif /* HAVE_AF_XDP */
+
+/**
+ * @}
+ */
@@ -0,0 +1,69 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ */
+
+#ifndef __SOURCE_AF_XDP_H__
+#define __SOURCE_AF_XDP_H__
+
+#define AFXDP_IFACE_NAME_LENGTH     48
+
+/* bind modes */
+enum {
+    AFXDP_BIND_MODE_AUTO,       /**< zero copy if the driver supports it */
+    AFXDP_BIND_MODE_COPY,       /**< XDP_COPY, works on any device (veth) */
+    AFXDP_BIND_MODE_ZEROCOPY,   /**< XDP_ZEROCOPY, fail if not supported */
+};
+
+#define AFXDP_DEFAULT_RING_SIZE     2048
+#define AFXDP_DEFAULT_FRAME_SIZE    2048
+
+typedef struct AFXDPIfaceConfig_
+{
+    char iface[AFXDP_IFACE_NAME_LENGTH];
+    /* number of threads, one per queue starting at queue 0 */
+    int threads;
+    int bind_mode;
+    /* XDP_FLAGS_* used to attach the XDP program */
+    uint32_t xdp_mode;
+    /* size of the rx and fill rings, the umem holds twice as many frames */
+    uint32_t ring_size;
+    uint32_t frame_size;
+    int promisc;
+    ChecksumValidationMode checksum_mode;
+    const char *bpf_filter;
+
+    /* next queue id to bind a thread to */
+    SC_ATOMIC_DECLARE(unsigned int, queue_id);
+    SC_ATOMIC_DECLARE(unsigned int, ref);
+    void (*DerefFunc)(void *);
+} AFXDPIfaceConfig;
+
+typedef struct AFXDPPacketVars_
+{
+    /* AFXDPUmem holding the frame, referenced by the packet */
+    void *umem;
+    /* umem address of the frame holding the packet data */
+    uint64_t addr;
+} AFXDPPacketVars;
+
+void TmModuleReceiveAFXDPRegister(void);
+void TmModuleDecodeAFXDPRegister(void);
+
+#endif /* __SOURCE_AF_XDP_H__ */
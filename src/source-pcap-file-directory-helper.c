@@ -26,11 +26,13 @@
 #include "source-pcap-file-directory-helper.h"
 #include "runmode-unix-socket.h"
 #include "util-mem.h"
+#include "util-logopenfile.h"
 #include "source-pcap-file.h"
 
 static void GetTime(struct timespec *tm);
 static void CopyTime(struct timespec *from, struct timespec *to);
 static int CompareTimes(struct timespec *left, struct timespec *right);
+static int ComparePendingFiles(PendingFile *left, PendingFile *right);
 static TmEcode PcapRunStatus(PcapFileDirectoryVars *);
 static TmEcode PcapDirectoryFailure(PcapFileDirectoryVars *ptv);
 static TmEcode PcapDirectoryDone(PcapFileDirectoryVars *ptv);
@@ -258,6 +260,18 @@ int PcapDirectoryGetModifiedTime(char const *file, struct timespec *out)
     return ret;
 }
 
+/**
+ * Order files by modified time, using the name for files with the same
+ * time so that the order doesn't depend on the order of readdir.
+ */
+int ComparePendingFiles(PendingFile *left, PendingFile *right)
+{
+    int r = CompareTimes(&left->modified_time, &right->modified_time);
+    if (r != 0)
+        return r;
+    return strcmp(left->filename, right->filename);
+}
+
 TmEcode PcapDirectoryInsertFile(PcapFileDirectoryVars *pv,
                                 PendingFile *file_to_add
 ) {
@@ -286,7 +300,7 @@ TmEcode PcapDirectoryInsertFile(PcapFileDirectoryVars *pv,
     } else {
         file_to_compare = TAILQ_FIRST(&pv->directory_content);
         while(file_to_compare != NULL) {
-            if (CompareTimes(&file_to_add->modified_time, &file_to_compare->modified_time) < 0) {
+            if (ComparePendingFiles(file_to_add, file_to_compare) < 0) {
                 TAILQ_INSERT_BEFORE(file_to_compare, file_to_add, next);
                 file_to_compare = NULL;
             } else {
@@ -427,8 +441,18 @@ TmEcode PcapDirectoryDispatchForTimeRange(PcapFileDirectoryVars *pv,
                 SCLogWarning(SC_ERR_PCAP_DISPATCH, "Current file was null");
             } else if (unlikely(current_file->filename == NULL)) {
                 SCLogWarning(SC_ERR_PCAP_DISPATCH, "Current file filename was null");
+            } else if (pv->shared->readers > 1 &&
+                    (pv->shard_pos % pv->shared->readers) != pv->shared->reader_id) {
+                SCLogDebug("Skipping file %s, it belongs to another reader",
+                           current_file->filename);
+                pv->shard_pos++;
+                CleanupPendingFile(current_file);
             } else {
                 SCLogDebug("Processing file %s", current_file->filename);
+                /* with multiple readers the output is written in the
+                 * order of the files */
+                const bool ordered = pv->shared->readers > 1;
+                const uint64_t pos = pv->shard_pos++;
 
                 PcapFileFileVars *pftv = SCMalloc(sizeof(PcapFileFileVars));
                 if (unlikely(pftv == NULL)) {
@@ -445,10 +469,15 @@ TmEcode PcapDirectoryDispatchForTimeRange(PcapFileDirectoryVars *pv,
                 }
                 pftv->shared = pv->shared;
 
+                if (ordered)
+                    LogFileOrderBegin(pos);
+
                 if (InitPcapFile(pftv) == TM_ECODE_FAILED) {
                     SCLogWarning(SC_ERR_PCAP_DISPATCH,
                                  "Failed to init pcap file %s, skipping",
                                  current_file->filename);
+                    if (ordered)
+                        LogFileOrderCommit();
                     CleanupPendingFile(current_file);
                     CleanupPcapFileFileVars(pftv);
                     status = TM_ECODE_OK;
@@ -457,6 +486,11 @@ TmEcode PcapDirectoryDispatchForTimeRange(PcapFileDirectoryVars *pv,
 
                     status = PcapFileDispatch(pftv);
 
+                    if (ordered) {
+                        PcapFileFlushFlows(pv->shared);
+                        LogFileOrderCommit();
+                    }
+
                     CleanupPcapFileFileVars(pftv);
 
                     if (status == TM_ECODE_FAILED) {
@@ -541,6 +575,12 @@ TmEcode PcapDirectoryDispatch(PcapFileDirectoryVars *ptv)
 
     StatsSyncCountersIfSignalled(ptv->shared->tv);
 
+    /* files of this reader that were not read will never be written,
+     * don't let the other readers wait for them */
+    if (ptv->shared->readers > 1 &&
+            (status == TM_ECODE_FAILED || (suricata_ctl_flags & SURICATA_STOP)))
+        LogFileOrderStop();
+
     if (status == TM_ECODE_FAILED) {
         SCLogError(SC_ERR_PCAP_DISPATCH, "Directory %s run mode failed", ptv->filename);
         status = PcapDirectoryFailure(ptv);
@@ -47,6 +47,9 @@ typedef struct PcapFileDirectoryVars_
     time_t poll_interval;
 
     TAILQ_HEAD(PendingFiles, PendingFile_) directory_content;
+    /** position of the next file in the sorted listing, used to pick
+     *  the files of this reader */
+    uint64_t shard_pos;
 
     PcapFileSharedVars *shared;
 } PcapFileDirectoryVars;
@@ -27,6 +27,7 @@
 #include "util-checksum.h"
 #include "util-profiling.h"
 #include "source-pcap-file.h"
+#include "flow-partition.h"
 
 extern int max_pending_packets;
 extern PcapFileGlobalVars pcap_g;
@@ -36,6 +37,11 @@ static void PcapFileCallbackLoop(char *user, struct pcap_pkthdr *h, u_char *pkt)
 void CleanupPcapFileFileVars(PcapFileFileVars *pfv)
 {
     if (pfv != NULL) {
+        if (pfv->map != NULL) {
+            /* packets still in flight keep the mapping alive */
+            PcapFileMmapDeref(pfv->map);
+            pfv->map = NULL;
+        }
         if (pfv->pcap_handle != NULL) {
             pcap_close(pfv->pcap_handle);
             pfv->pcap_handle = NULL;
@@ -56,14 +62,48 @@ void CleanupPcapFileFileVars(PcapFileFileVars *pfv)
     }
 }
 
+/**
+ * \brief checksum handling and passing the packet on, shared by the
+ *        libpcap and the mmap reader
+ *
+ * \retval 0 ok, -1 if the pipeline failed
+ */
+static int PcapFileProcessPacket(PcapFileFileVars *ptv, Packet *p)
+{
+    /* We only check for checksum disable */
+    if (ptv->shared->checksum_mode == CHECKSUM_VALIDATION_DISABLE) {
+        p->flags |= PKT_IGNORE_CHECKSUM;
+    } else if (ptv->shared->checksum_mode == CHECKSUM_VALIDATION_AUTO &&
+            ptv->shared->cnt <= CHECKSUM_SAMPLE_COUNT) {
+        uint64_t cnt = SC_ATOMIC_ADD(pcap_g.cnt, 1) + 1;
+        if (ChecksumAutoModeCheck(ptv->shared->cnt, cnt,
+                                  SC_ATOMIC_GET(pcap_g.invalid_checksums))) {
+            ptv->shared->checksum_mode = CHECKSUM_VALIDATION_DISABLE;
+            p->flags |= PKT_IGNORE_CHECKSUM;
+        }
+    }
+
+    PACKET_PROFILING_TMM_END(p, TMM_RECEIVEPCAPFILE);
+
+    if (TmThreadsSlotProcessPkt(ptv->shared->tv, ptv->shared->slot, p) != TM_ECODE_OK) {
+        ptv->shared->cb_result = TM_ECODE_FAILED;
+        return -1;
+    }
+    return 0;
+}
+
 void PcapFileCallbackLoop(char *user, struct pcap_pkthdr *h, u_char *pkt)
 {
     SCEnter();
 
     PcapFileFileVars *ptv = (PcapFileFileVars *)user;
-    Packet *p = PacketGetFromQueueOrAlloc();
 
+    ptv->shared->pkts++;
+    ptv->shared->bytes += h->caplen;
+
+    Packet *p = PacketGetFromQueueOrAlloc();
     if (unlikely(p == NULL)) {
+        ptv->shared->drops++;
         SCReturn;
     }
     PACKET_PROFILING_TMM_START(p, TMM_RECEIVEPCAPFILE);
@@ -73,43 +113,147 @@ void PcapFileCallbackLoop(char *user, struct pcap_pkthdr *h, u_char *pkt)
     p->ts.tv_usec = h->ts.tv_usec;
     SCLogDebug("p->ts.tv_sec %"PRIuMAX"", (uintmax_t)p->ts.tv_sec);
     p->datalink = ptv->datalink;
-    p->pcap_cnt = ++pcap_g.cnt;
+    p->pcap_cnt = ++ptv->shared->cnt;
 
     p->pcap_v.tenant_id = ptv->shared->tenant_id;
-    ptv->shared->pkts++;
-    ptv->shared->bytes += h->caplen;
 
     if (unlikely(PacketCopyData(p, pkt, h->caplen))) {
-        TmqhOutputPacketpool(ptv->shared->tv, p);
         PACKET_PROFILING_TMM_END(p, TMM_RECEIVEPCAPFILE);
+        TmqhOutputPacketpool(ptv->shared->tv, p);
+        ptv->shared->drops++;
         SCReturn;
     }
 
-    /* We only check for checksum disable */
-    if (pcap_g.checksum_mode == CHECKSUM_VALIDATION_DISABLE) {
-        p->flags |= PKT_IGNORE_CHECKSUM;
-    } else if (pcap_g.checksum_mode == CHECKSUM_VALIDATION_AUTO) {
-        if (ChecksumAutoModeCheck(ptv->shared->pkts, p->pcap_cnt,
-                                  SC_ATOMIC_GET(pcap_g.invalid_checksums))) {
-            pcap_g.checksum_mode = CHECKSUM_VALIDATION_DISABLE;
-            p->flags |= PKT_IGNORE_CHECKSUM;
+    if (PcapFileProcessPacket(ptv, p) < 0) {
+        pcap_breakloop(ptv->pcap_handle);
+    }
+
+    SCReturn;
+}
+
+/**
+ * \brief Packet release routine for packets pointing into a mapped file
+ */
+static void PcapFileMmapReleasePacket(Packet *p)
+{
+    PcapFileMmap *m = (PcapFileMmap *)p->pcap_v.map;
+    const uint32_t chunk = p->pcap_v.map_chunk;
+    p->pcap_v.map = NULL;
+
+    PacketFreeOrRelease(p);
+    PcapFileMmapDerefPacket(m, chunk);
+}
+
+/**
+ * \brief wrap a packet of a mapped file, without copying it
+ *
+ * \retval 0 ok or packet skipped, -1 if the pipeline failed
+ */
+static int PcapFileMmapPacket(PcapFileFileVars *ptv, PcapFileMmapPkt *pkt)
+{
+    if (ptv->filter.bf_len) {
+        struct pcap_pkthdr h = { pkt->ts, pkt->caplen, pkt->len };
+        if (pcap_offline_filter(&ptv->filter, &h, pkt->data) == 0) {
+            ptv->shared->filtered++;
+            return 0;
         }
     }
 
-    PACKET_PROFILING_TMM_END(p, TMM_RECEIVEPCAPFILE);
+    ptv->shared->pkts++;
+    ptv->shared->bytes += pkt->caplen;
 
-    if (TmThreadsSlotProcessPkt(ptv->shared->tv, ptv->shared->slot, p) != TM_ECODE_OK) {
-        pcap_breakloop(ptv->pcap_handle);
-        ptv->shared->cb_result = TM_ECODE_FAILED;
+    Packet *p = PacketGetFromQueueOrAlloc();
+    if (unlikely(p == NULL)) {
+        ptv->shared->drops++;
+        return 0;
     }
+    PACKET_PROFILING_TMM_START(p, TMM_RECEIVEPCAPFILE);
 
-    SCReturn;
+    PKT_SET_SRC(p, PKT_SRC_WIRE);
+    p->ts = pkt->ts;
+    p->datalink = pkt->linktype;
+    p->pcap_cnt = ++ptv->shared->cnt;
+
+    p->pcap_v.tenant_id = ptv->shared->tenant_id;
+
+    if (unlikely(PacketSetData(p, pkt->data, pkt->caplen) == -1)) {
+        PACKET_PROFILING_TMM_END(p, TMM_RECEIVEPCAPFILE);
+        TmqhOutputPacketpool(ptv->shared->tv, p);
+        ptv->shared->drops++;
+        return 0;
+    }
+    p->pcap_v.map_chunk = PcapFileMmapRefPacket(ptv->map, pkt);
+    p->pcap_v.map = ptv->map;
+    p->ReleasePacket = PcapFileMmapReleasePacket;
+
+    return PcapFileProcessPacket(ptv, p);
 }
 
+/**
+ *  \brief PCAP file reading loop for the native mmap reader
+ */
+static TmEcode PcapFileDispatchMmap(PcapFileFileVars *ptv)
+{
+    TmEcode loop_result = TM_ECODE_OK;
+
+    while (loop_result == TM_ECODE_OK) {
+        if (suricata_ctl_flags & SURICATA_STOP) {
+            SCReturnInt(TM_ECODE_OK);
+        }
+
+        /* make sure we have at least one packet in the packet pool, to prevent
+         * us from alloc'ing packets at line rate */
+        PacketPoolWait();
+
+        for (int i = 0; i < 64; i++) {
+            PcapFileMmapPkt pkt;
+            int r = PcapFileMmapNext(ptv->map, &pkt);
+            if (unlikely(r < 0)) {
+                SCLogError(SC_ERR_PCAP_DISPATCH, "error reading %s", ptv->filename);
+                loop_result = TM_ECODE_DONE;
+                break;
+            } else if (unlikely(r == 0)) {
+                SCLogInfo("pcap file %s end of file reached", ptv->filename);
+                ptv->shared->files++;
+                loop_result = TM_ECODE_DONE;
+                break;
+            }
+
+            if (unlikely(pkt.linktype != ptv->datalink && ptv->filter.bf_len)) {
+                SCLogError(SC_ERR_BPF, "bpf filter can't be applied to "
+                           "datalink %d packets in %s", pkt.linktype, ptv->filename);
+                loop_result = TM_ECODE_DONE;
+                break;
+            }
+
+            if (PcapFileMmapPacket(ptv, &pkt) < 0) {
+                SCLogError(SC_ERR_PCAP_DISPATCH,
+                           "Pcap callback PcapFileMmapPacket failed for %s", ptv->filename);
+                loop_result = TM_ECODE_FAILED;
+                break;
+            }
+        }
+        StatsSyncCountersIfSignalled(ptv->shared->tv);
+    }
+
+    SCReturnInt(loop_result);
+}
+
+/* file being read, only set with a single reader */
 char pcap_filename[PATH_MAX] = "unknown";
+#ifdef TLS
+/* file read by the current thread. With multiple readers the loggers run
+ * in the reader threads, so this is the file the packet came from. The
+ * runmode only allows multiple readers with TLS support. */
+static __thread char pcap_thread_filename[PATH_MAX];
+#endif
 
 const char *PcapFileGetFilename(void)
 {
+#ifdef TLS
+    if (pcap_thread_filename[0] != '\0')
+        return pcap_thread_filename;
+#endif
     return pcap_filename;
 }
 
@@ -123,7 +267,15 @@ TmEcode PcapFileDispatch(PcapFileFileVars *ptv)
     int packet_q_len = 64;
     int r;
     TmEcode loop_result = TM_ECODE_OK;
-    strlcpy(pcap_filename, ptv->filename, sizeof(pcap_filename));
+    if (ptv->shared->readers == 1)
+        strlcpy(pcap_filename, ptv->filename, sizeof(pcap_filename));
+#ifdef TLS
+    strlcpy(pcap_thread_filename, ptv->filename, sizeof(pcap_thread_filename));
+#endif
+
+    if (ptv->map != NULL) {
+        SCReturnInt(PcapFileDispatchMmap(ptv));
+    }
 
     while (loop_result == TM_ECODE_OK) {
         if (suricata_ctl_flags & SURICATA_STOP) {
@@ -160,6 +312,24 @@ TmEcode PcapFileDispatch(PcapFileFileVars *ptv)
     SCReturnInt(loop_result);
 }
 
+void PcapFileFlushFlows(PcapFileSharedVars *shared)
+{
+    /* a pass may only queue reassembly for a flow, the next ends it */
+    for (int pass = 0; pass < 4; pass++) {
+        if (FlowPartitionRequestFlush(shared->tv) == 0)
+            break;
+
+        Packet *p = PacketGetFromQueueOrAlloc();
+        if (unlikely(p == NULL))
+            break;
+        p->flags |= PKT_PSEUDO_STREAM_END;
+        if (TmThreadsSlotProcessPkt(shared->tv, shared->slot, p) != TM_ECODE_OK) {
+            TmqhOutputPacketpool(shared->tv, p);
+            break;
+        }
+    }
+}
+
 TmEcode InitPcapFile(PcapFileFileVars *pfv)
 {
     char errbuf[PCAP_ERRBUF_SIZE] = "";
@@ -169,10 +339,25 @@ TmEcode InitPcapFile(PcapFileFileVars *pfv)
         SCReturnInt(TM_ECODE_FAILED);
     }
 
-    pfv->pcap_handle = pcap_open_offline(pfv->filename, errbuf);
-    if (pfv->pcap_handle == NULL) {
-        SCLogError(SC_ERR_FOPEN, "%s", errbuf);
-        SCReturnInt(TM_ECODE_FAILED);
+    if (pfv->shared != NULL && pfv->shared->use_mmap) {
+        pfv->map = PcapFileMmapOpen(pfv->filename);
+    }
+    if (pfv->map != NULL) {
+        SCLogDebug("reading %s using mmap", pfv->filename);
+        /* a dead handle to compile the bpf filter against */
+        pfv->pcap_handle = pcap_open_dead(pfv->map->linktype,
+                pfv->map->snaplen ? (int)pfv->map->snaplen : 65535);
+        if (pfv->pcap_handle == NULL) {
+            SCLogError(SC_ERR_MEM_ALLOC, "failed to setup pcap handle for %s",
+                       pfv->filename);
+            SCReturnInt(TM_ECODE_FAILED);
+        }
+    } else {
+        pfv->pcap_handle = pcap_open_offline(pfv->filename, errbuf);
+        if (pfv->pcap_handle == NULL) {
+            SCLogError(SC_ERR_FOPEN, "%s", errbuf);
+            SCReturnInt(TM_ECODE_FAILED);
+        }
     }
 
     if (pfv->shared != NULL && pfv->shared->bpf_string != NULL) {
@@ -23,15 +23,24 @@
 
 #include "suricata-common.h"
 #include "tm-threads.h"
+#include "source-pcap-file-mmap-helper.h"
 
 #ifndef __SOURCE_PCAP_FILE_HELPER_H__
 #define __SOURCE_PCAP_FILE_HELPER_H__
 
 typedef struct PcapFileGlobalVars_ {
-    uint64_t cnt; /** packet counter */
+    /** packets of all readers, only counted up to CHECKSUM_SAMPLE_COUNT
+     *  packets per reader for the checksum auto mode */
+    SC_ATOMIC_DECLARE(uint64_t, cnt);
     ChecksumValidationMode conf_checksum_mode;
-    ChecksumValidationMode checksum_mode;
     SC_ATOMIC_DECLARE(unsigned int, invalid_checksums);
+
+    /** number of reader threads the files are sharded over */
+    uint16_t readers;
+    /** readers that were set up, used to hand out reader ids */
+    SC_ATOMIC_DECLARE(unsigned int, readers_init);
+    /** readers still reading, the last one to finish stops the engine */
+    SC_ATOMIC_DECLARE(unsigned int, readers_active);
 } PcapFileGlobalVars;
 
 /**
@@ -46,14 +55,29 @@ typedef struct PcapFileSharedVars_
     struct timespec last_processed;
 
     bool should_delete;
+    /** read files using the native mmap reader when possible */
+    bool use_mmap;
 
     ThreadVars *tv;
     TmSlot *slot;
 
+    /** this reader handles the files at positions where
+     *  pos % readers == reader_id */
+    uint16_t reader_id;
+    uint16_t readers;
+
+    /** packet counter of this reader, sets pcap_cnt */
+    uint64_t cnt;
+    ChecksumValidationMode checksum_mode;
+
     /* counters */
     uint64_t pkts;
     uint64_t bytes;
     uint64_t files;
+    /** packets that couldn't be passed on, e.g. no packet available */
+    uint64_t drops;
+    /** packets rejected by the bpf filter, only known to the mmap reader */
+    uint64_t filtered;
 
     uint8_t done;
     uint32_t errs;
@@ -69,6 +93,8 @@ typedef struct PcapFileFileVars_
 {
     char *filename;
     pcap_t *pcap_handle;
+    /** native reader, if set pcap_handle is only used for the bpf filter */
+    PcapFileMmap *map;
 
     int datalink;
     struct bpf_program filter;
@@ -100,6 +126,13 @@ TmEcode InitPcapFile(PcapFileFileVars *pfv);
  */
 void CleanupPcapFileFileVars(PcapFileFileVars *pfv);
 
+/**
+ * End the flows of the reader's flow partition, so that their output
+ * is written before the file is done.
+ * @param shared Reader whose flows are to be ended
+ */
+void PcapFileFlushFlows(PcapFileSharedVars *shared);
+
 /**
  * Determine if a datalink type is valid, setting a decoder function if valid.
  * @param datalink Datalink type to validate
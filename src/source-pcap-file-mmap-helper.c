@@ -0,0 +1,735 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Native pcap and pcapng file reader.
+ *
+ * The file is mapped into memory and packets point straight into the
+ * mapping, so there are no read() calls and no copies. The mapping is
+ * reference counted: every packet handed to the pipeline holds a
+ * reference, so the file can be closed while packets are in flight.
+ *
+ * Files libpcap can read but this reader can't (compressed files, other
+ * formats) are left to libpcap: PcapFileMmapOpen() returns NULL for them.
+ */
+
+#include "suricata-common.h"
+#include "source-pcap-file-mmap-helper.h"
+#include "util-byte.h"
+#include "util-unittest.h"
+
+#define PCAP_MAGIC              0xa1b2c3d4
+#define PCAP_MAGIC_NSEC         0xa1b23c4d
+#define PCAP_FILE_HDR_LEN       24
+#define PCAP_REC_HDR_LEN        16
+/** LT_LINKTYPE() in libpcap: the upper bits carry FCS info */
+#define PCAP_LINKTYPE_MASK      0x03ffffff
+
+#define PCAPNG_BLOCK_SHB        0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB        0x00000001
+#define PCAPNG_BLOCK_SPB        0x00000003
+#define PCAPNG_BLOCK_EPB        0x00000006
+#define PCAPNG_BOM              0x1a2b3c4d
+/** type, length and trailing length */
+#define PCAPNG_BLOCK_OVERHEAD   12
+#define PCAPNG_SHB_MIN_LEN      28
+#define PCAPNG_IDB_MIN_LEN      20
+#define PCAPNG_EPB_MIN_LEN      32
+#define PCAPNG_SPB_MIN_LEN      16
+
+#define PCAPNG_OPT_END          0
+#define PCAPNG_OPT_IF_TSRESOL   9
+#define PCAPNG_OPT_IF_TSOFFSET  14
+
+/** hand consumed parts of the mapping back to the kernel in steps of
+ *  this size, a multiple of any page size. In flight packets are counted
+ *  per step. */
+#define PCAP_MMAP_DROP_STEP     (64 * 1024 * 1024ULL)
+
+static const uint64_t pow10_table[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+static inline uint16_t Get16(const PcapFileMmap *m, const uint8_t *b)
+{
+    uint16_t v;
+    memcpy(&v, b, sizeof(v));
+    return m->swapped ? SCByteSwap16(v) : v;
+}
+
+static inline uint32_t Get32(const PcapFileMmap *m, const uint8_t *b)
+{
+    uint32_t v;
+    memcpy(&v, b, sizeof(v));
+    return m->swapped ? SCByteSwap32(v) : v;
+}
+
+static inline uint64_t Get64(const PcapFileMmap *m, const uint8_t *b)
+{
+    uint64_t v;
+    memcpy(&v, b, sizeof(v));
+    return m->swapped ? SCByteSwap64(v) : v;
+}
+
+static int PcapFileMmapTruncated(PcapFileMmap *m)
+{
+    SCLogWarning(SC_ERR_PCAP_DISPATCH, "pcap file truncated at offset %"PRIu64
+            ", ignoring the last %"PRIu64" bytes", m->pos, m->size - m->pos);
+    m->pos = m->size;
+    return 0;
+}
+
+/** \brief let the kernel drop the pages we're done with
+ *
+ *  MADV_SEQUENTIAL already makes readahead aggressive, this keeps the
+ *  resident size of the mapping bounded for very large files.
+ *
+ *  On a private mapping MADV_DONTNEED also discards the pages the engine
+ *  wrote to, so a part is only dropped once the reader is past it and
+ *  none of its packets are in flight anymore. Parts are dropped in
+ *  order, so a packet running into the next part keeps that one mapped
+ *  as well. */
+static void PcapFileMmapDropBehind(PcapFileMmap *m)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_DONTNEED)
+    if (!m->mapped || m->chunks == NULL)
+        return;
+    while (m->pos >= m->dropped + PCAP_MMAP_DROP_STEP) {
+        const uint32_t chunk = (uint32_t)(m->dropped / PCAP_MMAP_DROP_STEP);
+        if (SC_ATOMIC_GET(m->chunks[chunk].pkts) != 0)
+            break;
+        (void)madvise(m->base + m->dropped, PCAP_MMAP_DROP_STEP, MADV_DONTNEED);
+        m->dropped += PCAP_MMAP_DROP_STEP;
+    }
+#endif
+}
+
+/**
+ * \brief convert a pcapng timestamp using the resolution of its interface
+ */
+static void PcapNgTimestamp(const PcapFileMmapIface *iface, uint64_t t,
+        struct timeval *tv)
+{
+    uint64_t sec, usec;
+
+    if (iface->tsresol_bin) {
+        uint32_t r = iface->tsresol;
+        sec = t >> r;
+        uint64_t frac = t & ((1ULL << r) - 1);
+        /* keep frac * 1000000 from overflowing */
+        if (r > 40) {
+            frac >>= (r - 40);
+            r = 40;
+        }
+        usec = (frac * 1000000ULL) >> r;
+    } else {
+        const uint64_t units = pow10_table[iface->tsresol];
+        sec = t / units;
+        const uint64_t frac = t % units;
+        if (iface->tsresol >= 6)
+            usec = frac / (units / 1000000ULL);
+        else
+            usec = frac * (1000000ULL / units);
+    }
+
+    tv->tv_sec = (time_t)((int64_t)sec + iface->tsoffset);
+    tv->tv_usec = (suseconds_t)usec;
+}
+
+/**
+ * \brief add the interface of an Interface Description Block
+ */
+static int PcapNgParseIdb(PcapFileMmap *m, const uint8_t *b, uint32_t blen)
+{
+    if (blen < PCAPNG_IDB_MIN_LEN) {
+        SCLogError(SC_ERR_PCAP_DISPATCH, "pcapng interface block too short");
+        return -1;
+    }
+
+    if (m->ifaces_cnt == m->ifaces_size) {
+        uint32_t size = m->ifaces_size ? m->ifaces_size * 2 : 4;
+        PcapFileMmapIface *ifaces = SCRealloc(m->ifaces, size * sizeof(*ifaces));
+        if (unlikely(ifaces == NULL))
+            return -1;
+        m->ifaces = ifaces;
+        m->ifaces_size = size;
+    }
+
+    PcapFileMmapIface *iface = &m->ifaces[m->ifaces_cnt];
+    memset(iface, 0, sizeof(*iface));
+    iface->linktype = Get16(m, b + 8);
+    iface->snaplen = Get32(m, b + 12);
+    iface->tsresol = 6;
+
+    /* options, up to the trailing block length */
+    const uint32_t end = blen - 4;
+    uint32_t off = 16;
+    while (off + 4 <= end) {
+        const uint16_t code = Get16(m, b + off);
+        const uint16_t olen = Get16(m, b + off + 2);
+        off += 4;
+        if (code == PCAPNG_OPT_END || olen > end - off)
+            break;
+
+        if (code == PCAPNG_OPT_IF_TSRESOL && olen >= 1) {
+            iface->tsresol_bin = (b[off] & 0x80) != 0;
+            iface->tsresol = b[off] & 0x7f;
+        } else if (code == PCAPNG_OPT_IF_TSOFFSET && olen >= 8) {
+            iface->tsoffset = (int64_t)Get64(m, b + off);
+        }
+        off += ((uint32_t)olen + 3) & ~3U;
+    }
+
+    if ((iface->tsresol_bin && iface->tsresol > 63) ||
+        (!iface->tsresol_bin && iface->tsresol > 19))
+    {
+        SCLogError(SC_ERR_PCAP_DISPATCH, "pcapng interface %u has unsupported "
+                "timestamp resolution %u", m->ifaces_cnt, iface->tsresol);
+        return -1;
+    }
+
+    if (m->ifaces_cnt == 0 && m->linktype == -1) {
+        m->linktype = iface->linktype;
+        m->snaplen = iface->snaplen;
+    }
+    m->ifaces_cnt++;
+    return 0;
+}
+
+/**
+ * \brief walk the blocks up to the next packet block
+ *
+ * Section and interface blocks are processed, other blocks are skipped.
+ * The packet block is not consumed.
+ *
+ * \retval 1 packet block at m->pos, type and len set
+ * \retval 0 end of file
+ * \retval -1 malformed file
+ */
+static int PcapNgNextPacketBlock(PcapFileMmap *m, uint32_t *type, uint32_t *len)
+{
+    while (m->pos < m->size) {
+        const uint64_t left = m->size - m->pos;
+        const uint8_t *b = m->base + m->pos;
+
+        if (left < PCAPNG_BLOCK_OVERHEAD)
+            return PcapFileMmapTruncated(m);
+
+        /* the section header block type reads the same in both byte
+         * orders and sets the byte order for the rest of the section */
+        uint32_t btype;
+        memcpy(&btype, b, sizeof(btype));
+        if (btype == PCAPNG_BLOCK_SHB) {
+            if (left < PCAPNG_SHB_MIN_LEN)
+                return PcapFileMmapTruncated(m);
+            uint32_t bom;
+            memcpy(&bom, b + 8, sizeof(bom));
+            if (bom == PCAPNG_BOM) {
+                m->swapped = false;
+            } else if (bom == SCByteSwap32(PCAPNG_BOM)) {
+                m->swapped = true;
+            } else {
+                SCLogError(SC_ERR_PCAP_DISPATCH, "pcapng section header with "
+                        "invalid byte order magic at offset %"PRIu64, m->pos);
+                return -1;
+            }
+            /* interface ids are per section */
+            m->ifaces_cnt = 0;
+        } else {
+            btype = Get32(m, b);
+        }
+
+        const uint32_t blen = Get32(m, b + 4);
+        if (blen > left)
+            return PcapFileMmapTruncated(m);
+        if (blen < PCAPNG_BLOCK_OVERHEAD || (blen & 3) != 0) {
+            SCLogError(SC_ERR_PCAP_DISPATCH, "pcapng block with invalid "
+                    "length %u at offset %"PRIu64, blen, m->pos);
+            return -1;
+        }
+
+        switch (btype) {
+            case PCAPNG_BLOCK_IDB:
+                if (PcapNgParseIdb(m, b, blen) < 0)
+                    return -1;
+                break;
+            case PCAPNG_BLOCK_EPB:
+            case PCAPNG_BLOCK_SPB:
+                *type = btype;
+                *len = blen;
+                return 1;
+            default:
+                break;
+        }
+        m->pos += blen;
+    }
+    return 0;
+}
+
+static int PcapNgNext(PcapFileMmap *m, PcapFileMmapPkt *pkt)
+{
+    uint32_t btype = 0, blen = 0;
+
+    int r = PcapNgNextPacketBlock(m, &btype, &blen);
+    if (r <= 0)
+        return r;
+
+    uint8_t *b = m->base + m->pos;
+    const PcapFileMmapIface *iface;
+
+    if (btype == PCAPNG_BLOCK_EPB) {
+        if (blen < PCAPNG_EPB_MIN_LEN)
+            goto malformed;
+        const uint32_t ifid = Get32(m, b + 8);
+        if (ifid >= m->ifaces_cnt)
+            goto malformed;
+        iface = &m->ifaces[ifid];
+
+        const uint64_t t = ((uint64_t)Get32(m, b + 12) << 32) | Get32(m, b + 16);
+        PcapNgTimestamp(iface, t, &pkt->ts);
+        pkt->caplen = Get32(m, b + 20);
+        pkt->len = Get32(m, b + 24);
+        if (pkt->caplen > blen - PCAPNG_EPB_MIN_LEN)
+            goto malformed;
+        pkt->data = b + 28;
+    } else {
+        /* simple packet block: interface 0, no timestamp */
+        if (blen < PCAPNG_SPB_MIN_LEN || m->ifaces_cnt == 0)
+            goto malformed;
+        iface = &m->ifaces[0];
+
+        pkt->ts = m->last_ts;
+        pkt->len = Get32(m, b + 8);
+        pkt->caplen = MIN(pkt->len, blen - PCAPNG_SPB_MIN_LEN);
+        if (iface->snaplen > 0 && pkt->caplen > iface->snaplen)
+            pkt->caplen = iface->snaplen;
+        pkt->data = b + 12;
+    }
+    pkt->linktype = iface->linktype;
+    m->last_ts = pkt->ts;
+
+    m->pos += blen;
+    return 1;
+
+malformed:
+    SCLogError(SC_ERR_PCAP_DISPATCH, "malformed pcapng packet block at "
+            "offset %"PRIu64, m->pos);
+    return -1;
+}
+
+static int PcapNext(PcapFileMmap *m, PcapFileMmapPkt *pkt)
+{
+    const uint64_t left = m->size - m->pos;
+    if (left == 0)
+        return 0;
+    if (left < PCAP_REC_HDR_LEN)
+        return PcapFileMmapTruncated(m);
+
+    uint8_t *b = m->base + m->pos;
+    const uint32_t ts_sec = Get32(m, b);
+    const uint32_t ts_frac = Get32(m, b + 4);
+    pkt->caplen = Get32(m, b + 8);
+    pkt->len = Get32(m, b + 12);
+    if (pkt->caplen > left - PCAP_REC_HDR_LEN)
+        return PcapFileMmapTruncated(m);
+
+    pkt->ts.tv_sec = (time_t)ts_sec;
+    pkt->ts.tv_usec = (suseconds_t)(m->nsec ? ts_frac / 1000 : ts_frac);
+    pkt->data = b + PCAP_REC_HDR_LEN;
+    pkt->linktype = m->linktype;
+
+    m->pos += PCAP_REC_HDR_LEN + pkt->caplen;
+    return 1;
+}
+
+/**
+ * \brief get the next packet from the file
+ *
+ * \retval 1 packet, pkt is set
+ * \retval 0 end of file
+ * \retval -1 malformed file
+ */
+int PcapFileMmapNext(PcapFileMmap *m, PcapFileMmapPkt *pkt)
+{
+    int r;
+    if (m->format == PCAP_MMAP_FORMAT_PCAPNG)
+        r = PcapNgNext(m, pkt);
+    else
+        r = PcapNext(m, pkt);
+
+    if (r == 1)
+        PcapFileMmapDropBehind(m);
+    return r;
+}
+
+static int PcapFileMmapParseHeader(PcapFileMmap *m)
+{
+    uint32_t magic;
+    memcpy(&magic, m->base, sizeof(magic));
+
+    if (magic == PCAPNG_BLOCK_SHB) {
+        m->format = PCAP_MMAP_FORMAT_PCAPNG;
+        m->linktype = -1;
+
+        /* process the header blocks so the linktype of the first
+         * interface is known before the first packet */
+        uint32_t btype, blen;
+        if (PcapNgNextPacketBlock(m, &btype, &blen) < 0)
+            return -1;
+        if (m->linktype == -1) {
+            SCLogError(SC_ERR_PCAP_DISPATCH, "pcapng file has no interfaces");
+            return -1;
+        }
+        return 0;
+    }
+
+    m->format = PCAP_MMAP_FORMAT_PCAP;
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+        m->swapped = false;
+    } else if (magic == SCByteSwap32(PCAP_MAGIC) ||
+               magic == SCByteSwap32(PCAP_MAGIC_NSEC)) {
+        m->swapped = true;
+    } else {
+        /* not something we can read, libpcap may */
+        return -1;
+    }
+    if (m->size < PCAP_FILE_HDR_LEN)
+        return -1;
+
+    m->nsec = Get32(m, m->base) == PCAP_MAGIC_NSEC;
+    m->snaplen = Get32(m, m->base + 16);
+    m->linktype = (int)(Get32(m, m->base + 20) & PCAP_LINKTYPE_MASK);
+    m->pos = PCAP_FILE_HDR_LEN;
+    return 0;
+}
+
+/**
+ * \brief setup a reader for a pcap or pcapng file in memory
+ *
+ * \retval m reader, holding a single reference, or NULL if the format is
+ *         not supported or invalid
+ */
+PcapFileMmap *PcapFileMmapOpenBuffer(uint8_t *buf, uint64_t size)
+{
+    if (buf == NULL || size < 4)
+        return NULL;
+
+    PcapFileMmap *m = SCCalloc(1, sizeof(*m));
+    if (unlikely(m == NULL))
+        return NULL;
+    m->base = buf;
+    m->size = size;
+    SC_ATOMIC_INIT(m->refcnt);
+    SC_ATOMIC_SET(m->refcnt, 1);
+
+    if (PcapFileMmapParseHeader(m) < 0) {
+        if (m->ifaces != NULL)
+            SCFree(m->ifaces);
+        SCFree(m);
+        return NULL;
+    }
+    return m;
+}
+
+/**
+ * \brief map a pcap or pcapng file and setup a reader for it
+ *
+ * The mapping is private and writable, pages are only copied if the
+ * engine modifies a packet.
+ *
+ * \retval m reader or NULL if the file should be read using libpcap
+ */
+PcapFileMmap *PcapFileMmapOpen(const char *filename)
+{
+#ifdef HAVE_SYS_MMAN_H
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 4 ||
+            (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+        close(fd);
+        return NULL;
+    }
+
+    const size_t size = (size_t)st.st_size;
+    uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        SCLogDebug("mmap of %s failed: %s", filename, strerror(errno));
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    (void)madvise(base, size, MADV_SEQUENTIAL);
+#endif
+
+    PcapFileMmap *m = PcapFileMmapOpenBuffer(base, size);
+    if (m == NULL) {
+        munmap(base, size);
+        return NULL;
+    }
+    m->mapped = true;
+
+    m->chunks_cnt = (uint32_t)((size + PCAP_MMAP_DROP_STEP - 1) / PCAP_MMAP_DROP_STEP);
+    m->chunks = SCCalloc(m->chunks_cnt, sizeof(*m->chunks));
+    if (unlikely(m->chunks == NULL)) {
+        /* read the file without dropping pages */
+        m->chunks_cnt = 0;
+    }
+    for (uint32_t i = 0; i < m->chunks_cnt; i++) {
+        SC_ATOMIC_INIT(m->chunks[i].pkts);
+    }
+    return m;
+#else
+    return NULL;
+#endif
+}
+
+void PcapFileMmapRef(PcapFileMmap *m)
+{
+    (void)SC_ATOMIC_ADD(m->refcnt, 1);
+}
+
+/**
+ * \brief drop a reference, the last one unmaps the file
+ */
+void PcapFileMmapDeref(PcapFileMmap *m)
+{
+    if (SC_ATOMIC_SUB(m->refcnt, 1) != 0)
+        return;
+
+#ifdef HAVE_SYS_MMAN_H
+    if (m->mapped)
+        munmap(m->base, (size_t)m->size);
+#endif
+    if (m->chunks != NULL) {
+        for (uint32_t i = 0; i < m->chunks_cnt; i++) {
+            SC_ATOMIC_DESTROY(m->chunks[i].pkts);
+        }
+        SCFree(m->chunks);
+    }
+    if (m->ifaces != NULL)
+        SCFree(m->ifaces);
+    SC_ATOMIC_DESTROY(m->refcnt);
+    SCFree(m);
+}
+
+/**
+ * \brief take a reference for a packet pointing into the mapping
+ *
+ * \retval chunk part of the mapping the packet is in, to pass to
+ *         PcapFileMmapDerefPacket()
+ */
+uint32_t PcapFileMmapRefPacket(PcapFileMmap *m, const PcapFileMmapPkt *pkt)
+{
+    const uint32_t chunk = (uint32_t)((uint64_t)(pkt->data - m->base) / PCAP_MMAP_DROP_STEP);
+
+    PcapFileMmapRef(m);
+    if (chunk < m->chunks_cnt)
+        (void)SC_ATOMIC_ADD(m->chunks[chunk].pkts, 1);
+    return chunk;
+}
+
+/**
+ * \brief drop the reference of a packet once it's done with its data
+ */
+void PcapFileMmapDerefPacket(PcapFileMmap *m, uint32_t chunk)
+{
+    if (chunk < m->chunks_cnt)
+        (void)SC_ATOMIC_SUB(m->chunks[chunk].pkts, 1);
+    PcapFileMmapDeref(m);
+}
+
+#ifdef UNITTESTS
+static void Put16(uint8_t *b, uint16_t v, bool swap)
+{
+    if (swap)
+        v = SCByteSwap16(v);
+    memcpy(b, &v, sizeof(v));
+}
+
+static void Put32(uint8_t *b, uint32_t v, bool swap)
+{
+    if (swap)
+        v = SCByteSwap32(v);
+    memcpy(b, &v, sizeof(v));
+}
+
+/** \test classic pcap with nanosecond timestamps in both byte orders */
+static int PcapFileMmapTest01(void)
+{
+    for (int swap = 0; swap < 2; swap++) {
+        uint8_t buf[PCAP_FILE_HDR_LEN + PCAP_REC_HDR_LEN + 4 + 6];
+        memset(buf, 0, sizeof(buf));
+
+        Put32(buf, PCAP_MAGIC_NSEC, swap);
+        Put32(buf + 16, 65535, swap);
+        Put32(buf + 20, 1, swap);
+
+        uint8_t *rec = buf + PCAP_FILE_HDR_LEN;
+        Put32(rec, 1000, swap);
+        Put32(rec + 4, 123456789, swap);
+        Put32(rec + 8, 4, swap);
+        Put32(rec + 12, 60, swap);
+        memcpy(rec + 16, "\x01\x02\x03\x04", 4);
+        /* last record is truncated */
+        Put32(rec + 20, 1001, swap);
+
+        PcapFileMmap *m = PcapFileMmapOpenBuffer(buf, sizeof(buf));
+        FAIL_IF_NULL(m);
+        FAIL_IF(m->format != PCAP_MMAP_FORMAT_PCAP);
+        FAIL_IF(m->linktype != 1);
+
+        PcapFileMmapPkt pkt;
+        FAIL_IF(PcapFileMmapNext(m, &pkt) != 1);
+        FAIL_IF(pkt.ts.tv_sec != 1000);
+        FAIL_IF(pkt.ts.tv_usec != 123456);
+        FAIL_IF(pkt.caplen != 4);
+        FAIL_IF(pkt.len != 60);
+        FAIL_IF(pkt.data != rec + 16);
+        FAIL_IF(pkt.linktype != 1);
+
+        FAIL_IF(PcapFileMmapNext(m, &pkt) != 0);
+        PcapFileMmapDeref(m);
+    }
+    PASS;
+}
+
+/** \test pcapng with an enhanced packet block using a nanosecond
+ *        interface and a simple packet block */
+static int PcapFileMmapTest02(void)
+{
+    uint8_t buf[28 + 32 + 36 + 20];
+    memset(buf, 0, sizeof(buf));
+    uint8_t *b = buf;
+
+    /* section header */
+    Put32(b, PCAPNG_BLOCK_SHB, false);
+    Put32(b + 4, 28, false);
+    Put32(b + 8, PCAPNG_BOM, false);
+    Put16(b + 12, 1, false);
+    Put32(b + 24, 28, false);
+    b += 28;
+
+    /* interface, linktype 101 (raw), if_tsresol 9 */
+    Put32(b, PCAPNG_BLOCK_IDB, false);
+    Put32(b + 4, 32, false);
+    Put16(b + 8, 101, false);
+    Put32(b + 12, 1500, false);
+    Put16(b + 16, PCAPNG_OPT_IF_TSRESOL, false);
+    Put16(b + 18, 1, false);
+    b[20] = 9;
+    Put16(b + 24, PCAPNG_OPT_END, false);
+    Put32(b + 28, 32, false);
+    b += 32;
+
+    /* enhanced packet, 4 bytes of data */
+    const uint64_t t = 5ULL * 1000000000ULL + 7000ULL;
+    Put32(b, PCAPNG_BLOCK_EPB, false);
+    Put32(b + 4, 36, false);
+    Put32(b + 12, (uint32_t)(t >> 32), false);
+    Put32(b + 16, (uint32_t)t, false);
+    Put32(b + 20, 4, false);
+    Put32(b + 24, 4, false);
+    memcpy(b + 28, "\x45\x00\x00\x14", 4);
+    Put32(b + 32, 36, false);
+    uint8_t *epb_data = b + 28;
+    b += 36;
+
+    /* simple packet, 4 bytes of data */
+    Put32(b, PCAPNG_BLOCK_SPB, false);
+    Put32(b + 4, 20, false);
+    Put32(b + 8, 4, false);
+    Put32(b + 16, 20, false);
+
+    PcapFileMmap *m = PcapFileMmapOpenBuffer(buf, sizeof(buf));
+    FAIL_IF_NULL(m);
+    FAIL_IF(m->format != PCAP_MMAP_FORMAT_PCAPNG);
+    FAIL_IF(m->linktype != 101);
+
+    PcapFileMmapPkt pkt;
+    FAIL_IF(PcapFileMmapNext(m, &pkt) != 1);
+    FAIL_IF(pkt.ts.tv_sec != 5);
+    FAIL_IF(pkt.ts.tv_usec != 7);
+    FAIL_IF(pkt.caplen != 4);
+    FAIL_IF(pkt.data != epb_data);
+    FAIL_IF(pkt.linktype != 101);
+
+    FAIL_IF(PcapFileMmapNext(m, &pkt) != 1);
+    FAIL_IF(pkt.ts.tv_sec != 5);
+    FAIL_IF(pkt.caplen != 4);
+
+    FAIL_IF(PcapFileMmapNext(m, &pkt) != 0);
+    PcapFileMmapDeref(m);
+    PASS;
+}
+
+/** \test binary timestamp resolution and unknown interfaces */
+static int PcapFileMmapTest03(void)
+{
+    PcapFileMmapIface iface;
+    memset(&iface, 0, sizeof(iface));
+    iface.tsresol_bin = true;
+    iface.tsresol = 20;
+    iface.tsoffset = 10;
+
+    struct timeval tv;
+    PcapNgTimestamp(&iface, (3ULL << 20) | (1ULL << 19), &tv);
+    FAIL_IF(tv.tv_sec != 13);
+    FAIL_IF(tv.tv_usec != 500000);
+
+    /* a packet for interface 1 of a section with one interface */
+    uint8_t buf[28 + 20 + 32];
+    memset(buf, 0, sizeof(buf));
+    Put32(buf, PCAPNG_BLOCK_SHB, true);
+    Put32(buf + 4, 28, true);
+    Put32(buf + 8, PCAPNG_BOM, true);
+    Put32(buf + 24, 28, true);
+    Put32(buf + 28, PCAPNG_BLOCK_IDB, true);
+    Put32(buf + 32, 20, true);
+    Put16(buf + 36, 1, true);
+    Put32(buf + 44, 20, true);
+    Put32(buf + 48, PCAPNG_BLOCK_EPB, true);
+    Put32(buf + 52, 32, true);
+    Put32(buf + 56, 1, true);
+    Put32(buf + 76, 32, true);
+
+    PcapFileMmap *m = PcapFileMmapOpenBuffer(buf, sizeof(buf));
+    FAIL_IF_NULL(m);
+    FAIL_IF(m->linktype != 1);
+    PcapFileMmapPkt pkt;
+    FAIL_IF(PcapFileMmapNext(m, &pkt) != -1);
+    PcapFileMmapDeref(m);
+    PASS;
+}
+#endif /* UNITTESTS */
+
+void PcapFileMmapRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("PcapFileMmapTest01", PcapFileMmapTest01);
+    UtRegisterTest("PcapFileMmapTest02", PcapFileMmapTest02);
+    UtRegisterTest("PcapFileMmapTest03", PcapFileMmapTest03);
+#endif
+}
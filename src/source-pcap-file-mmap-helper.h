@@ -0,0 +1,105 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Native pcap and pcapng file reader working on a mmap of the file
+ */
+
+#ifndef __SOURCE_PCAP_FILE_MMAP_HELPER_H__
+#define __SOURCE_PCAP_FILE_MMAP_HELPER_H__
+
+enum PcapFileMmapFormat {
+    PCAP_MMAP_FORMAT_PCAP,
+    PCAP_MMAP_FORMAT_PCAPNG,
+};
+
+/** pcapng interface, from an Interface Description Block */
+typedef struct PcapFileMmapIface_ {
+    int linktype;
+    uint32_t snaplen;
+    /** if_tsresol: units per second are 10^tsresol, or 2^tsresol if
+     *  tsresol_bin is set */
+    uint8_t tsresol;
+    bool tsresol_bin;
+    /** if_tsoffset in seconds */
+    int64_t tsoffset;
+} PcapFileMmapIface;
+
+/** packets in flight in a part of the mapping, see
+ *  PcapFileMmapRefPacket() */
+typedef struct PcapFileMmapChunk_ {
+    SC_ATOMIC_DECLARE(unsigned int, pkts);
+} PcapFileMmapChunk;
+
+/** a packet in the file, data points into the mapping */
+typedef struct PcapFileMmapPkt_ {
+    struct timeval ts;
+    uint8_t *data;
+    uint32_t caplen;
+    uint32_t len;
+    int linktype;
+} PcapFileMmapPkt;
+
+typedef struct PcapFileMmap_ {
+    uint8_t *base;
+    uint64_t size;
+    /** offset of the next record or block */
+    uint64_t pos;
+    /** part of the mapping that was handed back to the kernel */
+    uint64_t dropped;
+    /** in flight packets per part of the mapping, so that parts are
+     *  only handed back once no packet points into them anymore */
+    PcapFileMmapChunk *chunks;
+    uint32_t chunks_cnt;
+    /** set if the mapping is ours to unmap */
+    bool mapped;
+
+    enum PcapFileMmapFormat format;
+    /** file (section) byte order differs from ours */
+    bool swapped;
+    /** classic pcap with nanosecond timestamps */
+    bool nsec;
+
+    /** linktype of the first interface, the linktype of a pcap file */
+    int linktype;
+    uint32_t snaplen;
+
+    /** interfaces of the current pcapng section */
+    PcapFileMmapIface *ifaces;
+    uint32_t ifaces_cnt;
+    uint32_t ifaces_size;
+
+    /** timestamp of the last packet, used for Simple Packet Blocks */
+    struct timeval last_ts;
+
+    /** reader + in flight packets pointing into the mapping */
+    SC_ATOMIC_DECLARE(unsigned int, refcnt);
+} PcapFileMmap;
+
+PcapFileMmap *PcapFileMmapOpen(const char *filename);
+PcapFileMmap *PcapFileMmapOpenBuffer(uint8_t *buf, uint64_t size);
+int PcapFileMmapNext(PcapFileMmap *m, PcapFileMmapPkt *pkt);
+void PcapFileMmapRef(PcapFileMmap *m);
+void PcapFileMmapDeref(PcapFileMmap *m);
+uint32_t PcapFileMmapRefPacket(PcapFileMmap *m, const PcapFileMmapPkt *pkt);
+void PcapFileMmapDerefPacket(PcapFileMmap *m, uint32_t chunk);
+
+void PcapFileMmapRegisterTests(void);
+
+#endif /* __SOURCE_PCAP_FILE_MMAP_HELPER_H__ */
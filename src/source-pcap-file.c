@@ -29,6 +29,7 @@
 #include "source-pcap-file-directory-helper.h"
 #include "flow-manager.h"
 #include "util-checksum.h"
+#include "util-logopenfile.h"
 
 extern int max_pending_packets;
 PcapFileGlobalVars pcap_g;
@@ -139,11 +140,45 @@ void TmModuleDecodePcapFileRegister (void)
 void PcapFileGlobalInit()
 {
     memset(&pcap_g, 0x00, sizeof(pcap_g));
+    SC_ATOMIC_INIT(pcap_g.cnt);
     SC_ATOMIC_INIT(pcap_g.invalid_checksums);
+    SC_ATOMIC_INIT(pcap_g.readers_init);
+    SC_ATOMIC_INIT(pcap_g.readers_active);
+    pcap_g.readers = 1;
+    SC_ATOMIC_SET(pcap_g.readers_active, 1);
+
+    /* parsed once here, the readers each keep their own mode */
+    const char *tmpstring = NULL;
+    if (ConfGet("pcap-file.checksum-checks", &tmpstring) != 1) {
+        pcap_g.conf_checksum_mode = CHECKSUM_VALIDATION_AUTO;
+    } else {
+        if (strcmp(tmpstring, "auto") == 0) {
+            pcap_g.conf_checksum_mode = CHECKSUM_VALIDATION_AUTO;
+        } else if (ConfValIsTrue(tmpstring)){
+            pcap_g.conf_checksum_mode = CHECKSUM_VALIDATION_ENABLE;
+        } else if (ConfValIsFalse(tmpstring)) {
+            pcap_g.conf_checksum_mode = CHECKSUM_VALIDATION_DISABLE;
+        }
+    }
+
+    LogFileOrderInit();
+}
+
+/** \brief set the number of reader threads, called by the runmode
+ *          before the readers are spawned */
+void PcapFileSetReaders(uint16_t readers)
+{
+    pcap_g.readers = readers > 0 ? readers : 1;
+    SC_ATOMIC_SET(pcap_g.readers_active, pcap_g.readers);
 }
 
 TmEcode PcapFileExit(TmEcode status, struct timespec *last_processed)
 {
+    /* with multiple readers, only the last one done stops the engine */
+    if (SC_ATOMIC_SUB(pcap_g.readers_active, 1) > 0) {
+        SCReturnInt(status);
+    }
+
     if(RunModeUnixSocketIsActive()) {
         status = UnixSocketPcapFile(status, last_processed);
         SCReturnInt(status);
@@ -193,7 +228,6 @@ TmEcode ReceivePcapFileThreadInit(ThreadVars *tv, const void *initdata, void **d
     SCEnter();
 
     TmEcode status = TM_ECODE_OK;
-    const char *tmpstring = NULL;
     const char *tmp_bpf_string = NULL;
 
     if (initdata == NULL) {
@@ -209,6 +243,9 @@ TmEcode ReceivePcapFileThreadInit(ThreadVars *tv, const void *initdata, void **d
     memset(ptv, 0, sizeof(PcapFileThreadVars));
     memset(&ptv->shared.last_processed, 0, sizeof(struct timespec));
 
+    ptv->shared.reader_id = (uint16_t)(SC_ATOMIC_ADD(pcap_g.readers_init, 1) - 1);
+    ptv->shared.readers = pcap_g.readers;
+
     intmax_t tenant = 0;
     if (ConfGetInt("pcap-file.tenant-id", &tenant) == 1) {
         if (tenant > 0 && tenant < UINT_MAX) {
@@ -238,6 +275,12 @@ TmEcode ReceivePcapFileThreadInit(ThreadVars *tv, const void *initdata, void **d
         ptv->shared.should_delete = should_delete == 1;
     }
 
+    int use_mmap = 1;
+    if (ConfGetBool("pcap-file.mmap", &use_mmap) != 1) {
+        use_mmap = 1;
+    }
+    ptv->shared.use_mmap = use_mmap == 1;
+
     DIR *directory = NULL;
     SCLogDebug("checking file or directory %s", (char*)initdata);
     if(PcapDetermineDirectoryOrFile((char *)initdata, &directory) == TM_ECODE_FAILED) {
@@ -331,18 +374,7 @@ TmEcode ReceivePcapFileThreadInit(ThreadVars *tv, const void *initdata, void **d
         ptv->behavior.directory = pv;
     }
 
-    if (ConfGet("pcap-file.checksum-checks", &tmpstring) != 1) {
-        pcap_g.conf_checksum_mode = CHECKSUM_VALIDATION_AUTO;
-    } else {
-        if (strcmp(tmpstring, "auto") == 0) {
-            pcap_g.conf_checksum_mode = CHECKSUM_VALIDATION_AUTO;
-        } else if (ConfValIsTrue(tmpstring)){
-            pcap_g.conf_checksum_mode = CHECKSUM_VALIDATION_ENABLE;
-        } else if (ConfValIsFalse(tmpstring)) {
-            pcap_g.conf_checksum_mode = CHECKSUM_VALIDATION_DISABLE;
-        }
-    }
-    pcap_g.checksum_mode = pcap_g.conf_checksum_mode;
+    ptv->shared.checksum_mode = pcap_g.conf_checksum_mode;
 
     ptv->shared.tv = tv;
     *data = (void *)ptv;
@@ -357,9 +389,10 @@ void ReceivePcapFileThreadExitStats(ThreadVars *tv, void *data)
         PcapFileThreadVars *ptv = (PcapFileThreadVars *)data;
 
         if (pcap_g.conf_checksum_mode == CHECKSUM_VALIDATION_AUTO &&
-            pcap_g.cnt < CHECKSUM_SAMPLE_COUNT &&
+            SC_ATOMIC_GET(pcap_g.cnt) < CHECKSUM_SAMPLE_COUNT &&
             SC_ATOMIC_GET(pcap_g.invalid_checksums)) {
-            uint64_t chrate = pcap_g.cnt / SC_ATOMIC_GET(pcap_g.invalid_checksums);
+            uint64_t chrate = SC_ATOMIC_GET(pcap_g.cnt) /
+                SC_ATOMIC_GET(pcap_g.invalid_checksums);
             if (chrate < CHECKSUM_INVALID_RATIO)
                 SCLogWarning(SC_ERR_INVALID_CHECKSUM,
                          "1/%" PRIu64 "th of packets have an invalid checksum,"
@@ -376,6 +409,11 @@ void ReceivePcapFileThreadExitStats(ThreadVars *tv, void *data)
             ptv->shared.pkts,
             ptv->shared.bytes
         );
+        if (ptv->shared.drops > 0 || ptv->shared.filtered > 0) {
+            SCLogNotice("Pcap-file module dropped %" PRIu64 " packets, "
+                    "%" PRIu64 " packets rejected by the bpf filter",
+                    ptv->shared.drops, ptv->shared.filtered);
+        }
     }
 }
 
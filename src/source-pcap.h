@@ -40,6 +40,10 @@ char *PcapLiveGetDevice(int);
 typedef struct PcapPacketVars_
 {
     uint32_t tenant_id;
+    /** pcap file mode: mapped file the packet data points into */
+    void *map;
+    /** pcap file mode: part of the mapping the packet data is in */
+    uint32_t map_chunk;
 } PcapPacketVars;
 
 /** needs to be able to contain Windows adapter id's, so
@@ -175,6 +175,26 @@ static int DoInsertSegment (TcpStream *stream, TcpSegment *seg, TcpSegment **dup
         SCLogDebug("empty tree, inserting seg %p seq %" PRIu32 ", "
                    "len %" PRIu32 "", seg, seg->seq, TCP_SEG_LEN(seg));
         TCPSEG_RB_INSERT(&stream->seg_tree, seg);
+        stream->seg_tree_tail = seg;
+        stream->segs_right_edge = SEG_SEQ_RIGHT_EDGE(seg);
+        return 0;
+    }
+
+    /* fast track for in order data: the segment starts at or after the
+     * right edge of all segments, so it can't overlap and it goes after
+     * the last segment. Hang it off the tail instead of walking the tree. */
+    if (SEQ_GEQ(seg->seq, stream->segs_right_edge)) {
+        TcpSegment *tail = stream->seg_tree_tail;
+        if (tail == NULL)
+            tail = RB_MAX(TCPSEG, &stream->seg_tree);
+        SCLogDebug("in order, appending seg %p seq %" PRIu32 " after %p",
+                seg, seg->seq, tail);
+        DEBUG_VALIDATE_BUG_ON(TCPSEG_RB_NEXT(tail) != NULL);
+        RB_SET(seg, tail, rb);
+        RB_RIGHT(tail, rb) = seg;
+        RB_AUGMENT(tail);
+        TCPSEG_RB_INSERT_COLOR(&stream->seg_tree, seg);
+        stream->seg_tree_tail = seg;
         stream->segs_right_edge = SEG_SEQ_RIGHT_EDGE(seg);
         return 0;
     }
@@ -190,6 +210,9 @@ static int DoInsertSegment (TcpStream *stream, TcpSegment *seg, TcpSegment **dup
     } else {
         if (SEQ_GT(SEG_SEQ_RIGHT_EDGE(seg), stream->segs_right_edge))
             stream->segs_right_edge = SEG_SEQ_RIGHT_EDGE(seg);
+        if (stream->seg_tree_tail != NULL &&
+                TcpSegmentCompare(seg, stream->seg_tree_tail) > 0)
+            stream->seg_tree_tail = seg;
 
         /* insert succeeded, now check if we overlap with someone */
         if (CheckOverlap(&stream->seg_tree, seg) == true) {
@@ -786,6 +809,8 @@ static inline uint64_t GetLeftEdge(TcpSession *ssn, TcpStream *stream)
 
 static void StreamTcpRemoveSegmentFromStream(TcpStream *stream, TcpSegment *seg)
 {
+    if (seg == stream->seg_tree_tail)
+        stream->seg_tree_tail = TCPSEG_RB_PREV(seg);
     RB_REMOVE(TCPSEG, &stream->seg_tree, seg);
 }
 
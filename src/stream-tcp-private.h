@@ -27,7 +27,7 @@
 #include "tree.h"
 #include "decode.h"
 #include "util-pool.h"
-#include "util-pool-thread.h"
+#include "util-slab-thread.h"
 #include "util-streaming-buffer.h"
 
 #define STREAMTCP_QUEUE_FLAG_TS     0x01
@@ -59,7 +59,7 @@ RB_HEAD(TCPSACK, StreamTcpSackRecord);
 RB_PROTOTYPE(TCPSACK, StreamTcpSackRecord, rb, TcpSackCompare);
 
 typedef struct TcpSegment {
-    PoolThreadReserved res;
+    SlabThreadReserved res;
     uint16_t payload_len;       /**< actual size of the payload */
     uint32_t seq;
     RB_ENTRY(TcpSegment) __attribute__((__packed__)) rb;
@@ -120,11 +120,16 @@ typedef struct TcpStream_ {
 
     StreamingBuffer sb;
     struct TCPSEG seg_tree;         /**< red black tree of TCP segments. Data is stored in TcpStream::sb */
+    TcpSegment *seg_tree_tail;      /**< last segment in seg_tree, so in order segments are appended
+                                     *   without walking the tree. NULL if not known. */
     uint32_t segs_right_edge;
 
     uint32_t sack_size;             /**< combined size of the SACK ranges currently in our tree. Updated
                                      *   at INSERT/REMOVE time. */
     struct TCPSACK sack_tree;       /**< red back tree of TCP SACK records. */
+
+    struct MpmStreamState_ *mpm_state; /**< streaming mpm state of the raw stream,
+                                        *   see detect.mpm-stream-mode */
 } TcpStream;
 
 #define STREAM_BASE_OFFSET(stream)  ((stream)->sb.stream_offset)
@@ -255,7 +260,7 @@ enum
 }
 
 typedef struct TcpSession_ {
-    PoolThreadReserved res;
+    SlabThreadReserved res;
     uint8_t state:4;                        /**< tcp state from state enum */
     uint8_t pstate:4;                       /**< previous state */
     uint8_t queue_len;                      /**< length of queue list below */
@@ -40,6 +40,7 @@
 #include "tm-threads.h"
 
 #include "util-pool.h"
+#include "util-memcap-shards.h"
 #include "util-unittest.h"
 #include "util-print.h"
 #include "util-host-os-info.h"
@@ -72,12 +73,12 @@ static uint64_t segment_pool_memuse = 0;
 static uint64_t segment_pool_memcnt = 0;
 #endif
 
-static PoolThread *segment_thread_pool = NULL;
+static SlabThread *segment_thread_pool = NULL;
 /* init only, protect initializing and growing pool */
 static SCMutex segment_thread_pool_mutex = SCMUTEX_INITIALIZER;
 
 /* Memory use counter */
-SC_ATOMIC_DECLARE(uint64_t, ra_memuse);
+static MemcapShards ra_memuse;
 
 /* prototypes */
 TcpSegment *StreamTcpGetSegment(ThreadVars *tv, TcpReassemblyThreadCtx *);
@@ -86,7 +87,7 @@ void StreamTcpReassemblePseudoPacketCreate(TcpStream *, Packet *, PacketQueue *)
 
 void StreamTcpReassembleInitMemuse(void)
 {
-    SC_ATOMIC_INIT(ra_memuse);
+    MemcapShardsInit(&ra_memuse, MEMCAP_SHARDS_REASSEMBLY, 0);
 }
 
 /**
@@ -97,7 +98,7 @@ void StreamTcpReassembleInitMemuse(void)
  */
 void StreamTcpReassembleIncrMemuse(uint64_t size)
 {
-    (void) SC_ATOMIC_ADD(ra_memuse, size);
+    MemcapShardsIncr(&ra_memuse, size);
     SCLogDebug("REASSEMBLY %"PRIu64", incr %"PRIu64, StreamTcpReassembleMemuseGlobalCounter(), size);
     return;
 }
@@ -111,17 +112,18 @@ void StreamTcpReassembleIncrMemuse(uint64_t size)
 void StreamTcpReassembleDecrMemuse(uint64_t size)
 {
 #ifdef UNITTESTS
-    uint64_t presize = SC_ATOMIC_GET(ra_memuse);
+    uint64_t presize = 0;
     if (RunmodeIsUnittests()) {
+        presize = MemcapShardsGetMemuse(&ra_memuse);
         BUG_ON(presize > UINT_MAX);
     }
 #endif
 
-    (void) SC_ATOMIC_SUB(ra_memuse, size);
+    MemcapShardsDecr(&ra_memuse, size);
 
 #ifdef UNITTESTS
     if (RunmodeIsUnittests()) {
-        uint64_t postsize = SC_ATOMIC_GET(ra_memuse);
+        uint64_t postsize = MemcapShardsGetMemuse(&ra_memuse);
         BUG_ON(postsize > presize);
     }
 #endif
@@ -131,7 +133,7 @@ void StreamTcpReassembleDecrMemuse(uint64_t size)
 
 uint64_t StreamTcpReassembleMemuseGlobalCounter(void)
 {
-    uint64_t smemuse = SC_ATOMIC_GET(ra_memuse);
+    uint64_t smemuse = MemcapShardsGetMemuse(&ra_memuse);
     return smemuse;
 }
 
@@ -146,10 +148,9 @@ uint64_t StreamTcpReassembleMemuseGlobalCounter(void)
 int StreamTcpReassembleCheckMemcap(uint64_t size)
 {
     uint64_t memcapcopy = SC_ATOMIC_GET(stream_config.reassembly_memcap);
-    if (memcapcopy == 0 ||
-        (uint64_t)((uint64_t)size + SC_ATOMIC_GET(ra_memuse)) <= memcapcopy)
+    if (memcapcopy == 0)
         return 1;
-    return 0;
+    return MemcapShardsCheck(&ra_memuse, size, memcapcopy);
 }
 
 /**
@@ -159,7 +160,7 @@ int StreamTcpReassembleCheckMemcap(uint64_t size)
  */
 int StreamTcpReassembleSetMemcap(uint64_t size)
 {
-    if (size == 0 || (uint64_t)SC_ATOMIC_GET(ra_memuse) < size) {
+    if (size == 0 || StreamTcpReassembleMemuseGlobalCounter() < size) {
         SC_ATOMIC_SET(stream_config.reassembly_memcap, size);
         return 1;
     }
@@ -238,21 +239,6 @@ static void ReassembleFree(void *ptr, size_t size)
     StreamTcpReassembleDecrMemuse(size);
 }
 
-/** \brief alloc a tcp segment pool entry */
-static void *TcpSegmentPoolAlloc(void)
-{
-    if (StreamTcpReassembleCheckMemcap((uint32_t)sizeof(TcpSegment)) == 0) {
-        return NULL;
-    }
-
-    TcpSegment *seg = NULL;
-
-    seg = SCMalloc(sizeof (TcpSegment));
-    if (unlikely(seg == NULL))
-        return NULL;
-    return seg;
-}
-
 static int TcpSegmentPoolInit(void *data, void *initdata)
 {
     TcpSegment *seg = (TcpSegment *) data;
@@ -304,7 +290,7 @@ void StreamTcpSegmentReturntoPool(TcpSegment *seg)
     if (seg == NULL)
         return;
 
-    PoolThreadReturn(segment_thread_pool, seg);
+    SlabThreadReturn(segment_thread_pool, seg);
 }
 
 /**
@@ -320,6 +306,7 @@ void StreamTcpReturnStreamSegments (TcpStream *stream)
         RB_REMOVE(TCPSEG, &stream->seg_tree, seg);
         StreamTcpSegmentReturntoPool(seg);
     }
+    stream->seg_tree_tail = NULL;
 }
 
 #ifdef UNITTESTS
@@ -412,7 +399,7 @@ void StreamTcpReassembleFree(char quiet)
 {
     SCMutexLock(&segment_thread_pool_mutex);
     if (segment_thread_pool != NULL) {
-        PoolThreadFree(segment_thread_pool);
+        SlabThreadFree(segment_thread_pool);
         segment_thread_pool = NULL;
     }
     SCMutexUnlock(&segment_thread_pool_mutex);
@@ -440,28 +427,19 @@ TcpReassemblyThreadCtx *StreamTcpReassembleInitThreadCtx(ThreadVars *tv)
 
     SCMutexLock(&segment_thread_pool_mutex);
     if (segment_thread_pool == NULL) {
-        segment_thread_pool = PoolThreadInit(1, /* thread */
-                0, /* unlimited */
-                stream_config.prealloc_segments,
+        segment_thread_pool = SlabThreadInit(stream_config.prealloc_segments,
                 sizeof(TcpSegment),
-                TcpSegmentPoolAlloc,
                 TcpSegmentPoolInit, NULL,
-                TcpSegmentPoolCleanup, NULL);
+                TcpSegmentPoolCleanup);
         ra_ctx->segment_thread_pool_id = 0;
         SCLogDebug("pool size %d, thread segment_thread_pool_id %d",
-                PoolThreadSize(segment_thread_pool),
+                SlabThreadSize(segment_thread_pool),
                 ra_ctx->segment_thread_pool_id);
     } else {
         /* grow segment_thread_pool until we have a element for our thread id */
-        ra_ctx->segment_thread_pool_id = PoolThreadGrow(segment_thread_pool,
-                0, /* unlimited */
-                stream_config.prealloc_segments,
-                sizeof(TcpSegment),
-                TcpSegmentPoolAlloc,
-                TcpSegmentPoolInit, NULL,
-                TcpSegmentPoolCleanup, NULL);
+        ra_ctx->segment_thread_pool_id = SlabThreadGrow(segment_thread_pool);
         SCLogDebug("pool size %d, thread segment_thread_pool_id %d",
-                PoolThreadSize(segment_thread_pool),
+                SlabThreadSize(segment_thread_pool),
                 ra_ctx->segment_thread_pool_id);
     }
     SCMutexUnlock(&segment_thread_pool_mutex);
@@ -1140,72 +1118,6 @@ int StreamTcpReassembleAppLayer (ThreadVars *tv, TcpReassemblyThreadCtx *ra_ctx,
     return ReassembleUpdateAppLayer(tv, ra_ctx, ssn, stream, p, dir);
 }
 
-/** \internal
- *  \brief get stream data from offset
- *  \param offset stream offset */
-static int GetRawBuffer(TcpStream *stream, const uint8_t **data, uint32_t *data_len,
-        StreamingBufferBlock **iter, uint64_t offset, uint64_t *data_offset)
-{
-    const uint8_t *mydata;
-    uint32_t mydata_len;
-    if (RB_EMPTY(&stream->sb.sbb_tree)) {
-        SCLogDebug("getting one blob for offset %"PRIu64, offset);
-
-        uint64_t roffset = offset;
-        if (offset)
-            StreamingBufferGetDataAtOffset(&stream->sb, &mydata, &mydata_len, offset);
-        else {
-            StreamingBufferGetData(&stream->sb, &mydata, &mydata_len, &roffset);
-        }
-
-        *data = mydata;
-        *data_len = mydata_len;
-        *data_offset = roffset;
-    } else {
-        SCLogDebug("multiblob %s. Want offset %"PRIu64,
-                *iter == NULL ? "starting" : "continuing", offset);
-        if (*iter == NULL) {
-            StreamingBufferBlock key = { .offset = offset, .len = 0 };
-            *iter = SBB_RB_FIND_INCLUSIVE(&stream->sb.sbb_tree, &key);
-            SCLogDebug("*iter %p", *iter);
-        }
-        if (*iter == NULL) {
-            SCLogDebug("no data");
-            *data = NULL;
-            *data_len = 0;
-            *data_offset = 0;
-            return 0;
-        }
-        SCLogDebug("getting multiple blobs. Iter %p, %"PRIu64"/%u", *iter, (*iter)->offset, (*iter)->len);
-
-        StreamingBufferSBBGetData(&stream->sb, (*iter), &mydata, &mydata_len);
-        SCLogDebug("mydata %p", mydata);
-
-        if ((*iter)->offset < offset) {
-            uint64_t delta = offset - (*iter)->offset;
-            if (delta < mydata_len) {
-                *data = mydata + delta;
-                *data_len = mydata_len - delta;
-                *data_offset = offset;
-            } else {
-                SCLogDebug("no data (yet)");
-                *data = NULL;
-                *data_len = 0;
-                *data_offset = 0;
-            }
-
-        } else {
-            *data = mydata;
-            *data_len = mydata_len;
-            *data_offset = (*iter)->offset;
-        }
-
-        *iter = SBB_RB_NEXT(*iter);
-        SCLogDebug("*iter %p", *iter);
-    }
-    return 0;
-}
-
 /** \brief does the stream engine have data to inspect?
  *
  *  Returns true if there is data to inspect. In IDS case this is
@@ -1469,7 +1381,7 @@ static int StreamReassembleRawInline(TcpSession *ssn, const Packet *p,
     }
 
     /* run the callback */
-    r = Callback(cb_data, mydata, mydata_len);
+    r = Callback(cb_data, mydata, mydata_len, mydata_offset);
     BUG_ON(r < 0);
 
     if (return_progress) {
@@ -1543,7 +1455,6 @@ static int StreamReassembleRawDo(TcpSession *ssn, TcpStream *stream,
     SCEnter();
     int r = 0;
 
-    StreamingBufferBlock *iter = NULL;
     uint64_t progress = progress_in;
     uint64_t last_ack_abs = STREAM_BASE_OFFSET(stream); /* absolute right edge of ack'd data */
 
@@ -1578,75 +1489,86 @@ static int StreamReassembleRawDo(TcpSession *ssn, TcpStream *stream,
         SCLogDebug("last_ack_abs %"PRIu64, last_ack_abs);
     }
 
-    /* loop through available buffers. On no packet loss we'll have a single
-     * iteration. On missing data we'll walk the blocks */
+    /* walk the regions of data from our progress onwards. They point into
+     * the buffer, so nothing is copied. On no packet loss we'll have a single
+     * region. On missing data we'll get one per block. */
+    StreamingBufferRegion regions[8];
+    const uint32_t max_regions = sizeof(regions) / sizeof(regions[0]);
+    uint64_t offset = progress;
     while (1) {
-        const uint8_t *mydata;
-        uint32_t mydata_len;
-        uint64_t mydata_offset = 0;
-
-        GetRawBuffer(stream, &mydata, &mydata_len, &iter, progress, &mydata_offset);
-        if (mydata_len == 0) {
+        const uint32_t cnt = StreamingBufferGetRegions(&stream->sb, offset,
+                regions, max_regions);
+        if (cnt == 0) {
             SCLogDebug("no data");
             break;
         }
-        //PrintRawDataFp(stdout, mydata, mydata_len);
 
-        SCLogDebug("raw progress %"PRIu64, progress);
-        SCLogDebug("stream %p data in buffer %p of len %u and offset %"PRIu64,
-                stream, &stream->sb, mydata_len, progress);
+        for (uint32_t i = 0; i < cnt; i++) {
+            const uint8_t *mydata = regions[i].data;
+            uint32_t mydata_len = regions[i].data_len;
+            const uint64_t mydata_offset = regions[i].stream_offset;
 
-        if (eof) {
-            // inspect all remaining data, ack'd or not
-        } else {
-            if (last_ack_abs < progress) {
-                SCLogDebug("nothing to do");
-                goto end;
-            }
+            //PrintRawDataFp(stdout, mydata, mydata_len);
 
-            SCLogDebug("last_ack_abs %"PRIu64", raw_progress %"PRIu64, last_ack_abs, progress);
-            SCLogDebug("raw_progress + mydata_len %"PRIu64", last_ack_abs %"PRIu64, progress + mydata_len, last_ack_abs);
+            SCLogDebug("raw progress %"PRIu64, progress);
+            SCLogDebug("stream %p data in buffer %p of len %u and offset %"PRIu64,
+                    stream, &stream->sb, mydata_len, progress);
+
+            if (eof) {
+                // inspect all remaining data, ack'd or not
+            } else {
+                if (last_ack_abs < progress) {
+                    SCLogDebug("nothing to do");
+                    goto end;
+                }
+
+                SCLogDebug("last_ack_abs %"PRIu64", raw_progress %"PRIu64, last_ack_abs, progress);
+                SCLogDebug("raw_progress + mydata_len %"PRIu64", last_ack_abs %"PRIu64, progress + mydata_len, last_ack_abs);
+
+                /* see if the buffer contains unack'd data as well */
+                if (progress + mydata_len > last_ack_abs) {
+                    uint32_t check = mydata_len;
+                    mydata_len = last_ack_abs - progress;
+                    BUG_ON(check < mydata_len);
+                    SCLogDebug("data len adjusted to %u to make sure only ACK'd "
+                            "data is considered", mydata_len);
+                }
 
-            /* see if the buffer contains unack'd data as well */
-            if (progress + mydata_len > last_ack_abs) {
-                uint32_t check = mydata_len;
-                mydata_len = last_ack_abs - progress;
-                BUG_ON(check < mydata_len);
-                SCLogDebug("data len adjusted to %u to make sure only ACK'd "
-                        "data is considered", mydata_len);
             }
+            if (mydata_len == 0)
+                goto end;
 
-        }
-        if (mydata_len == 0)
-            break;
+            SCLogDebug("data %p len %u", mydata, mydata_len);
 
-        SCLogDebug("data %p len %u", mydata, mydata_len);
+            /* we have data. */
+            r = Callback(cb_data, mydata, mydata_len, mydata_offset);
+            BUG_ON(r < 0);
 
-        /* we have data. */
-        r = Callback(cb_data, mydata, mydata_len);
-        BUG_ON(r < 0);
+            if (mydata_offset == progress) {
+                SCLogDebug("progress %"PRIu64" increasing with data len %u to %"PRIu64,
+                        progress, mydata_len, progress_in + mydata_len);
 
-        if (mydata_offset == progress) {
-            SCLogDebug("progress %"PRIu64" increasing with data len %u to %"PRIu64,
-                    progress, mydata_len, progress_in + mydata_len);
+                progress += mydata_len;
+                SCLogDebug("raw progress now %"PRIu64, progress);
 
-            progress += mydata_len;
-            SCLogDebug("raw progress now %"PRIu64, progress);
+            /* data is beyond the progress we'd like, and before last ack. Gap. */
+            } else if (mydata_offset > progress && mydata_offset < last_ack_abs) {
+                SCLogDebug("GAP: data is missing from %"PRIu64" (%u bytes), setting to first data we have: %"PRIu64, progress, (uint32_t)(mydata_offset - progress), mydata_offset);
+                SCLogDebug("last_ack_abs %"PRIu64, last_ack_abs);
+                progress = mydata_offset;
+                SCLogDebug("raw progress now %"PRIu64, progress);
 
-        /* data is beyond the progress we'd like, and before last ack. Gap. */
-        } else if (mydata_offset > progress && mydata_offset < last_ack_abs) {
-            SCLogDebug("GAP: data is missing from %"PRIu64" (%u bytes), setting to first data we have: %"PRIu64, progress, (uint32_t)(mydata_offset - progress), mydata_offset);
-            SCLogDebug("last_ack_abs %"PRIu64, last_ack_abs);
-            progress = mydata_offset;
-            SCLogDebug("raw progress now %"PRIu64, progress);
+            } else {
+                SCLogDebug("not increasing progress, data gap => mydata_offset "
+                           "%"PRIu64" != progress %"PRIu64, mydata_offset, progress);
+            }
 
-        } else {
-            SCLogDebug("not increasing progress, data gap => mydata_offset "
-                       "%"PRIu64" != progress %"PRIu64, mydata_offset, progress);
+            if (r == 1)
+                goto end;
         }
-
-        if (iter == NULL || r == 1)
+        if (cnt < max_regions)
             break;
+        offset = regions[cnt - 1].stream_offset + regions[cnt - 1].data_len;
     }
 end:
     *progress_out = progress;
@@ -1809,7 +1731,7 @@ int StreamTcpReassembleHandleSegment(ThreadVars *tv, TcpReassemblyThreadCtx *ra_
  */
 TcpSegment *StreamTcpGetSegment(ThreadVars *tv, TcpReassemblyThreadCtx *ra_ctx)
 {
-    TcpSegment *seg = (TcpSegment *) PoolThreadGetById(segment_thread_pool, ra_ctx->segment_thread_pool_id);
+    TcpSegment *seg = (TcpSegment *) SlabThreadGetById(segment_thread_pool, ra_ctx->segment_thread_pool_id);
     SCLogDebug("seg we return is %p", seg);
     if (seg == NULL) {
         /* Increment the counter to show that we are not able to serve the
@@ -2856,15 +2778,15 @@ static int StreamTcpReassembleTest40 (void)
 static int StreamTcpReassembleTest44(void)
 {
     StreamTcpInitConfig(TRUE);
-    uint32_t memuse = SC_ATOMIC_GET(ra_memuse);
+    uint32_t memuse = StreamTcpReassembleMemuseGlobalCounter();
     StreamTcpReassembleIncrMemuse(500);
-    FAIL_IF(SC_ATOMIC_GET(ra_memuse) != (memuse+500));
+    FAIL_IF(StreamTcpReassembleMemuseGlobalCounter() != (memuse+500));
     StreamTcpReassembleDecrMemuse(500);
-    FAIL_IF(SC_ATOMIC_GET(ra_memuse) != memuse);
+    FAIL_IF(StreamTcpReassembleMemuseGlobalCounter() != memuse);
     FAIL_IF(StreamTcpReassembleCheckMemcap(500) != 1);
     FAIL_IF(StreamTcpReassembleCheckMemcap((1 + memuse + SC_ATOMIC_GET(stream_config.reassembly_memcap))) != 0);
     StreamTcpFreeConfig(TRUE);
-    FAIL_IF(SC_ATOMIC_GET(ra_memuse) != 0);
+    FAIL_IF(StreamTcpReassembleMemuseGlobalCounter() != 0);
     PASS;
 }
 
@@ -44,7 +44,8 @@
 #include "tm-threads.h"
 
 #include "util-pool.h"
-#include "util-pool-thread.h"
+#include "util-slab-thread.h"
+#include "util-memcap-shards.h"
 #include "util-checksum.h"
 #include "util-unittest.h"
 #include "util-print.h"
@@ -111,23 +112,23 @@ static int StreamTcpStateDispatch(ThreadVars *tv, Packet *p,
 
 extern int g_detect_disabled;
 
-static PoolThread *ssn_pool = NULL;
+static SlabThread *ssn_pool = NULL;
 static SCMutex ssn_pool_mutex = SCMUTEX_INITIALIZER; /**< init only, protect initializing and growing pool */
 #ifdef DEBUG
 static uint64_t ssn_pool_cnt = 0; /** counts ssns, protected by ssn_pool_mutex */
 #endif
 
 uint64_t StreamTcpReassembleMemuseGlobalCounter(void);
-SC_ATOMIC_DECLARE(uint64_t, st_memuse);
+static MemcapShards st_memuse;
 
 void StreamTcpInitMemuse(void)
 {
-    SC_ATOMIC_INIT(st_memuse);
+    MemcapShardsInit(&st_memuse, MEMCAP_SHARDS_STREAM, 0);
 }
 
 void StreamTcpIncrMemuse(uint64_t size)
 {
-    (void) SC_ATOMIC_ADD(st_memuse, size);
+    MemcapShardsIncr(&st_memuse, size);
     SCLogDebug("STREAM %"PRIu64", incr %"PRIu64, StreamTcpMemuseCounter(), size);
     return;
 }
@@ -135,17 +136,18 @@ void StreamTcpIncrMemuse(uint64_t size)
 void StreamTcpDecrMemuse(uint64_t size)
 {
 #ifdef DEBUG_VALIDATION
-    uint64_t presize = SC_ATOMIC_GET(st_memuse);
+    uint64_t presize = 0;
     if (RunmodeIsUnittests()) {
+        presize = MemcapShardsGetMemuse(&st_memuse);
         BUG_ON(presize > UINT_MAX);
     }
 #endif
 
-    (void) SC_ATOMIC_SUB(st_memuse, size);
+    MemcapShardsDecr(&st_memuse, size);
 
 #ifdef DEBUG_VALIDATION
     if (RunmodeIsUnittests()) {
-        uint64_t postsize = SC_ATOMIC_GET(st_memuse);
+        uint64_t postsize = MemcapShardsGetMemuse(&st_memuse);
         BUG_ON(postsize > presize);
     }
 #endif
@@ -155,7 +157,7 @@ void StreamTcpDecrMemuse(uint64_t size)
 
 uint64_t StreamTcpMemuseCounter(void)
 {
-    uint64_t memusecopy = SC_ATOMIC_GET(st_memuse);
+    uint64_t memusecopy = MemcapShardsGetMemuse(&st_memuse);
     return memusecopy;
 }
 
@@ -168,9 +170,9 @@ uint64_t StreamTcpMemuseCounter(void)
 int StreamTcpCheckMemcap(uint64_t size)
 {
     uint64_t memcapcopy = SC_ATOMIC_GET(stream_config.memcap);
-    if (memcapcopy == 0 || size + SC_ATOMIC_GET(st_memuse) <= memcapcopy)
+    if (memcapcopy == 0)
         return 1;
-    return 0;
+    return MemcapShardsCheck(&st_memuse, size, memcapcopy);
 }
 
 /**
@@ -180,7 +182,7 @@ int StreamTcpCheckMemcap(uint64_t size)
  */
 int StreamTcpSetMemcap(uint64_t size)
 {
-    if (size == 0 || (uint64_t)SC_ATOMIC_GET(st_memuse) < size) {
+    if (size == 0 || MemcapShardsGetMemuse(&st_memuse) < size) {
         SC_ATOMIC_SET(stream_config.memcap, size);
         return 1;
     }
@@ -205,6 +207,8 @@ void StreamTcpStreamCleanup(TcpStream *stream)
         StreamTcpSackFreeList(stream);
         StreamTcpReturnStreamSegments(stream);
         StreamingBufferClear(&stream->sb);
+        MpmStreamStateFree(stream->mpm_state);
+        stream->mpm_state = NULL;
     }
 }
 
@@ -256,11 +260,11 @@ void StreamTcpSessionClear(void *ssnptr)
     StreamTcpSessionCleanup(ssn);
 
     /* HACK: don't loose track of thread id */
-    PoolThreadReserved a = ssn->res;
+    SlabThreadReserved a = ssn->res;
     memset(ssn, 0, sizeof(TcpSession));
     ssn->res = a;
 
-    PoolThreadReturn(ssn_pool, ssn);
+    SlabThreadReturn(ssn_pool, ssn);
 #ifdef DEBUG
     SCMutexLock(&ssn_pool_mutex);
     ssn_pool_cnt--;
@@ -294,25 +298,11 @@ void StreamTcpSessionPktFree (Packet *p)
     SCReturn;
 }
 
-/** \brief Stream alloc function for the Pool
- *  \retval ptr void ptr to TcpSession structure with all vars set to 0/NULL
- */
-static void *StreamTcpSessionPoolAlloc(void)
+static int StreamTcpSessionPoolInit(void *data, void* initdata)
 {
-    void *ptr = NULL;
-
     if (StreamTcpCheckMemcap((uint32_t)sizeof(TcpSession)) == 0)
-        return NULL;
-
-    ptr = SCMalloc(sizeof(TcpSession));
-    if (unlikely(ptr == NULL))
-        return NULL;
-
-    return ptr;
-}
+        return 0;
 
-static int StreamTcpSessionPoolInit(void *data, void* initdata)
-{
     memset(data, 0, sizeof(TcpSession));
     StreamTcpIncrMemuse((uint64_t)sizeof(TcpSession));
 
@@ -653,13 +643,10 @@ void StreamTcpInitConfig(char quiet)
     if (RunmodeIsUnittests()) {
         SCMutexLock(&ssn_pool_mutex);
         if (ssn_pool == NULL) {
-            ssn_pool = PoolThreadInit(1, /* thread */
-                    0, /* unlimited */
-                    stream_config.prealloc_sessions,
+            ssn_pool = SlabThreadInit(stream_config.prealloc_sessions,
                     sizeof(TcpSession),
-                    StreamTcpSessionPoolAlloc,
                     StreamTcpSessionPoolInit, NULL,
-                    StreamTcpSessionPoolCleanup, NULL);
+                    StreamTcpSessionPoolCleanup);
         }
         SCMutexUnlock(&ssn_pool_mutex);
     }
@@ -675,7 +662,7 @@ void StreamTcpFreeConfig(char quiet)
 
     SCMutexLock(&ssn_pool_mutex);
     if (ssn_pool != NULL) {
-        PoolThreadFree(ssn_pool);
+        SlabThreadFree(ssn_pool);
         ssn_pool = NULL;
     }
     SCMutexUnlock(&ssn_pool_mutex);
@@ -698,7 +685,7 @@ static TcpSession *StreamTcpNewSession (Packet *p, int id)
     TcpSession *ssn = (TcpSession *)p->flow->protoctx;
 
     if (ssn == NULL) {
-        p->flow->protoctx = PoolThreadGetById(ssn_pool, id);
+        p->flow->protoctx = SlabThreadGetById(ssn_pool, (uint16_t)id);
 #ifdef DEBUG
         SCMutexLock(&ssn_pool_mutex);
         if (p->flow->protoctx != NULL)
@@ -4905,21 +4892,11 @@ error:
     SCReturnInt(-1);
 }
 
-/**
- *  \brief  Function to validate the checksum of the received packet. If the
- *          checksum is invalid, packet will be dropped, as the end system will
- *          also drop the packet.
- *
- *  \param  p       Packet of which checksum has to be validated
- *  \retval  1 if the checksum is valid, otherwise 0
+/** \internal
+ *  \brief compute the TCP checksum of a packet, unless it's known already
  */
-static inline int StreamTcpValidateChecksum(Packet *p)
+static inline void StreamTcpComputeChecksum(Packet *p)
 {
-    int ret = 1;
-
-    if (p->flags & PKT_IGNORE_CHECKSUM)
-        return ret;
-
     if (p->level4_comp_csum == -1) {
         if (PKT_IS_IPV4(p)) {
             p->level4_comp_csum = TCPChecksum(p->ip4h->s_ip_addrs,
@@ -4935,6 +4912,24 @@ static inline int StreamTcpValidateChecksum(Packet *p)
                                                 p->tcph->th_sum);
         }
     }
+}
+
+/**
+ *  \brief  Function to validate the checksum of the received packet. If the
+ *          checksum is invalid, packet will be dropped, as the end system will
+ *          also drop the packet.
+ *
+ *  \param  p       Packet of which checksum has to be validated
+ *  \retval  1 if the checksum is valid, otherwise 0
+ */
+static inline int StreamTcpValidateChecksum(Packet *p)
+{
+    int ret = 1;
+
+    if (p->flags & PKT_IGNORE_CHECKSUM)
+        return ret;
+
+    StreamTcpComputeChecksum(p);
 
     if (p->level4_comp_csum != 0) {
         ret = 0;
@@ -4948,6 +4943,26 @@ static inline int StreamTcpValidateChecksum(Packet *p)
     return ret;
 }
 
+/**
+ *  \brief compute the TCP checksums of a batch of decoded packets
+ *
+ *  Done for the whole batch before the packets go through the flow
+ *  worker one by one, so the checksums are not computed while holding
+ *  the flow lock. StreamTcpValidateChecksum() uses the stored result.
+ */
+void StreamTcpChecksumBatch(Packet **pkts, const uint32_t cnt)
+{
+    if (!(stream_config.flags & STREAMTCP_INIT_FLAG_CHECKSUM_VALIDATION))
+        return;
+
+    for (uint32_t i = 0; i < cnt; i++) {
+        Packet *p = pkts[i];
+        if (PKT_IS_TCP(p) &&
+                !(p->flags & (PKT_IGNORE_CHECKSUM|PKT_PSEUDO_STREAM_END)))
+            StreamTcpComputeChecksum(p);
+    }
+}
+
 /** \internal
  *  \brief check if a packet is a valid stream started
  *  \retval bool true/false */
@@ -5180,25 +5195,16 @@ TmEcode StreamTcpThreadInit(ThreadVars *tv, void *initdata, void **data)
 
     SCMutexLock(&ssn_pool_mutex);
     if (ssn_pool == NULL) {
-        ssn_pool = PoolThreadInit(1, /* thread */
-                0, /* unlimited */
-                stream_config.prealloc_sessions,
+        ssn_pool = SlabThreadInit(stream_config.prealloc_sessions,
                 sizeof(TcpSession),
-                StreamTcpSessionPoolAlloc,
                 StreamTcpSessionPoolInit, NULL,
-                StreamTcpSessionPoolCleanup, NULL);
+                StreamTcpSessionPoolCleanup);
         stt->ssn_pool_id = 0;
-        SCLogDebug("pool size %d, thread ssn_pool_id %d", PoolThreadSize(ssn_pool), stt->ssn_pool_id);
+        SCLogDebug("pool size %d, thread ssn_pool_id %d", SlabThreadSize(ssn_pool), stt->ssn_pool_id);
     } else {
         /* grow ssn_pool until we have a element for our thread id */
-        stt->ssn_pool_id = PoolThreadGrow(ssn_pool,
-                0, /* unlimited */
-                stream_config.prealloc_sessions,
-                sizeof(TcpSession),
-                StreamTcpSessionPoolAlloc,
-                StreamTcpSessionPoolInit, NULL,
-                StreamTcpSessionPoolCleanup, NULL);
-        SCLogDebug("pool size %d, thread ssn_pool_id %d", PoolThreadSize(ssn_pool), stt->ssn_pool_id);
+        stt->ssn_pool_id = SlabThreadGrow(ssn_pool);
+        SCLogDebug("pool size %d, thread ssn_pool_id %d", SlabThreadSize(ssn_pool), stt->ssn_pool_id);
     }
     SCMutexUnlock(&ssn_pool_mutex);
     if (stt->ssn_pool_id < 0 || ssn_pool == NULL) {
@@ -8626,7 +8632,7 @@ static int StreamTcpTest23(void)
     SCFree(p);
     FLOW_DESTROY(&f);
     StreamTcpUTDeinit(stt.ra_ctx);
-    FAIL_IF(SC_ATOMIC_GET(st_memuse) > 0);
+    FAIL_IF(StreamTcpMemuseCounter() > 0);
     PASS;
 }
 
@@ -8692,7 +8698,7 @@ static int StreamTcpTest24(void)
     SCFree(p);
     FLOW_DESTROY(&f);
     StreamTcpUTDeinit(stt.ra_ctx);
-    FAIL_IF(SC_ATOMIC_GET(st_memuse) > 0);
+    FAIL_IF(StreamTcpMemuseCounter() > 0);
     PASS;
 }
 
@@ -8983,13 +8989,13 @@ static int StreamTcpTest28(void)
     StreamTcpThread stt;
     StreamTcpUTInit(&stt.ra_ctx);
 
-    uint32_t memuse = SC_ATOMIC_GET(st_memuse);
+    uint32_t memuse = StreamTcpMemuseCounter();
 
     StreamTcpIncrMemuse(500);
-    FAIL_IF(SC_ATOMIC_GET(st_memuse) != (memuse+500));
+    FAIL_IF(StreamTcpMemuseCounter() != (memuse+500));
 
     StreamTcpDecrMemuse(500);
-    FAIL_IF(SC_ATOMIC_GET(st_memuse) != memuse);
+    FAIL_IF(StreamTcpMemuseCounter() != memuse);
 
     FAIL_IF(StreamTcpCheckMemcap(500) != 1);
 
@@ -8997,7 +9003,7 @@ static int StreamTcpTest28(void)
 
     StreamTcpUTDeinit(stt.ra_ctx);
 
-    FAIL_IF(SC_ATOMIC_GET(st_memuse) != 0);
+    FAIL_IF(StreamTcpMemuseCounter() != 0);
     PASS;
 }
 
@@ -127,7 +127,10 @@ int StreamTcpSegmentForEach(const Packet *p, uint8_t flag,
 void StreamTcpReassembleConfigEnableOverlapCheck(void);
 void TcpSessionSetReassemblyDepth(TcpSession *ssn, uint32_t size);
 
-typedef int (*StreamReassembleRawFunc)(void *data, const uint8_t *input, const uint32_t input_len);
+/** \brief raw reassembly callback
+ *  \param input_offset absolute stream offset of the first byte of input */
+typedef int (*StreamReassembleRawFunc)(void *data, const uint8_t *input,
+        const uint32_t input_len, const uint64_t input_offset);
 
 int StreamReassembleLog(TcpSession *ssn, TcpStream *stream,
         StreamReassembleRawFunc Callback, void *cb_data,
@@ -190,6 +193,8 @@ void StreamTcpStreamCleanup(TcpStream *stream);
 int StreamTcpBypassEnabled(void);
 int StreamTcpInlineDropInvalid(void);
 int StreamTcpInlineMode(void);
+/* compute the TCP checksums of a batch of packets */
+void StreamTcpChecksumBatch(Packet **pkts, const uint32_t cnt);
 
 int TcpSessionPacketSsnReuse(const Packet *p, const Flow *f, const void *tcp_ssn);
 
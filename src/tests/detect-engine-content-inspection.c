@@ -34,16 +34,20 @@
     Flow f;                                             \
     memset(&f, 0, sizeof(f));
 
+/* runs the test against both the compiled and the recursive inspection */
 #define TEST_RUN(buf, buflen, sig, match, steps)                                            \
-{                                                                                           \
+for (int compile = 0; compile < 2; compile++) {                                             \
     DetectEngineCtx *de_ctx = DetectEngineCtxInit();                                        \
     FAIL_IF_NULL(de_ctx);                                                                   \
+    de_ctx->inspection_compile = (compile == 1);                                            \
     DetectEngineThreadCtx *det_ctx = NULL;                                                  \
     char rule[2048];                                                                        \
     snprintf(rule, sizeof(rule), "alert tcp any any -> any any (%s sid:1; rev:1;)", (sig)); \
     Signature *s = DetectEngineAppendSig(de_ctx, rule);                                     \
     FAIL_IF_NULL(s);                                                                        \
     SigGroupBuild(de_ctx);                                                                  \
+    FAIL_IF_NOT((DetectCiProgramGet(s, s->sm_arrays[DETECT_SM_LIST_PMATCH]) != NULL) ==     \
+            (compile == 1));                                                                \
     DetectEngineThreadCtxInit(&tv, (void *)de_ctx, (void *)&det_ctx);                       \
     FAIL_IF_NULL(det_ctx);                                                                  \
     int r = DetectEngineContentInspection(de_ctx, det_ctx,                                  \
@@ -5072,6 +5072,178 @@ end:
     return result;
 }
 
+/** \test bitmap and sort based candidate merges produce the same
+ *        match_array, including dups and rules on both lists */
+static int SigTestPrefilterMerge01(void)
+{
+    Signature sigs[200];
+    Signature *sig_array[200];
+    Signature *match_sort[200];
+    Signature *match_bitmap[200];
+    uint64_t bitmap[(200 + 63) / 64];
+    SigIntId mpm[] = { 150, 3, 70, 3, 64, 199, 70, 5 };
+    SigIntId mpm_copy[sizeof(mpm) / sizeof(mpm[0])];
+    /* 70 and 5 are negated mpm rules, on both lists */
+    SigIntId non_pf[] = { 1, 5, 63, 70, 128 };
+
+    memset(sigs, 0, sizeof(sigs));
+    memset(bitmap, 0, sizeof(bitmap));
+    for (int i = 0; i < 200; i++) {
+        sigs[i].num = i;
+        sig_array[i] = &sigs[i];
+    }
+
+    DetectEngineCtx de_ctx;
+    memset(&de_ctx, 0, sizeof(de_ctx));
+    de_ctx.sig_array = sig_array;
+    de_ctx.sig_array_len = 200;
+
+    DetectEngineThreadCtx det_ctx;
+    memset(&det_ctx, 0, sizeof(det_ctx));
+    det_ctx.pf_bitmap = bitmap;
+    det_ctx.non_pf_id_array = non_pf;
+    det_ctx.non_pf_id_cnt = sizeof(non_pf) / sizeof(non_pf[0]);
+
+    memcpy(mpm_copy, mpm, sizeof(mpm));
+    det_ctx.pmq.rule_id_array = mpm_copy;
+    det_ctx.pmq.rule_id_array_cnt = sizeof(mpm) / sizeof(mpm[0]);
+    det_ctx.match_array = match_sort;
+    PrefilterSortCandidates(&det_ctx);
+    DetectPrefilterMergeSort(&de_ctx, &det_ctx);
+    const uint32_t sort_cnt = det_ctx.match_array_cnt;
+    FAIL_IF(sort_cnt != 7);
+
+    memcpy(mpm_copy, mpm, sizeof(mpm));
+    det_ctx.match_array = match_bitmap;
+    DetectPrefilterMergeBitmap(&de_ctx, &det_ctx);
+    FAIL_IF(det_ctx.match_array_cnt != sort_cnt);
+    FAIL_IF(memcmp(match_sort, match_bitmap, sort_cnt * sizeof(Signature *)) != 0);
+
+    /* bitmap must be clear for the next packet */
+    for (size_t i = 0; i < sizeof(bitmap) / sizeof(bitmap[0]); i++) {
+        FAIL_IF(bitmap[i] != 0);
+    }
+    PASS;
+}
+
+#define MERGE_SIGS 1024
+
+/** \internal
+ *  \brief run both candidate merges on the same input and compare the
+ *         resulting match_arrays element by element
+ *
+ *  \param non_pf sorted list without dups, as DetectNonPfFilter() builds it
+ *
+ *  \retval 1 same result and the bitmap is clear afterwards, 0 otherwise
+ */
+static int SigTestPrefilterMergeCompare(const SigIntId *mpm, uint32_t mpm_cnt,
+        SigIntId *non_pf, uint32_t non_pf_cnt)
+{
+    static Signature sigs[MERGE_SIGS];
+    static Signature *sig_array[MERGE_SIGS];
+    static Signature *match_sort[2 * MERGE_SIGS];
+    static Signature *match_bitmap[2 * MERGE_SIGS];
+    static SigIntId mpm_copy[4 * MERGE_SIGS];
+    static uint64_t bitmap[MERGE_SIGS / 64];
+
+    if (mpm_cnt > sizeof(mpm_copy) / sizeof(mpm_copy[0]))
+        return 0;
+
+    memset(sigs, 0, sizeof(sigs));
+    memset(bitmap, 0, sizeof(bitmap));
+    for (int i = 0; i < MERGE_SIGS; i++) {
+        sigs[i].num = i;
+        sig_array[i] = &sigs[i];
+    }
+
+    DetectEngineCtx de_ctx;
+    memset(&de_ctx, 0, sizeof(de_ctx));
+    de_ctx.sig_array = sig_array;
+    de_ctx.sig_array_len = MERGE_SIGS;
+
+    DetectEngineThreadCtx det_ctx;
+    memset(&det_ctx, 0, sizeof(det_ctx));
+    det_ctx.pf_bitmap = bitmap;
+    det_ctx.non_pf_id_array = non_pf;
+    det_ctx.non_pf_id_cnt = non_pf_cnt;
+
+    if (mpm_cnt > 0)
+        memcpy(mpm_copy, mpm, mpm_cnt * sizeof(SigIntId));
+    det_ctx.pmq.rule_id_array = mpm_copy;
+    det_ctx.pmq.rule_id_array_cnt = mpm_cnt;
+    det_ctx.match_array = match_sort;
+    PrefilterSortCandidates(&det_ctx);
+    DetectPrefilterMergeSort(&de_ctx, &det_ctx);
+    const uint32_t sort_cnt = det_ctx.match_array_cnt;
+
+    /* the bitmap merge doesn't need sorted input */
+    if (mpm_cnt > 0)
+        memcpy(mpm_copy, mpm, mpm_cnt * sizeof(SigIntId));
+    det_ctx.match_array = match_bitmap;
+    DetectPrefilterMergeBitmap(&de_ctx, &det_ctx);
+    if (det_ctx.match_array_cnt != sort_cnt)
+        return 0;
+    for (uint32_t i = 0; i < sort_cnt; i++) {
+        if (match_sort[i] != match_bitmap[i])
+            return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(bitmap) / sizeof(bitmap[0]); i++) {
+        if (bitmap[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/** \test bitmap and sort based merges on generated input: duplicate
+ *        heavy mpm lists, lists that largely overlap and ids that are
+ *        several bitmap words apart */
+static int SigTestPrefilterMerge02(void)
+{
+    static SigIntId mpm[4 * MERGE_SIGS];
+    static SigIntId non_pf[MERGE_SIGS];
+    uint32_t seed = 1;
+
+    /* sparse ids, gaps of several words and a word boundary on each side */
+    SigIntId sparse_mpm[] = { 1000, 63, 64, 1000, 511, 127, 63, 1023 };
+    SigIntId sparse_non_pf[] = { 0, 64, 320, 1023 };
+    FAIL_IF_NOT(SigTestPrefilterMergeCompare(sparse_mpm, 8, sparse_non_pf, 4));
+
+    /* only one of the lists */
+    FAIL_IF_NOT(SigTestPrefilterMergeCompare(sparse_mpm, 8, NULL, 0));
+    FAIL_IF_NOT(SigTestPrefilterMergeCompare(NULL, 0, sparse_non_pf, 4));
+
+    /* every id on both lists, so every rule is a negated mpm match */
+    for (uint32_t i = 0; i < MERGE_SIGS; i++) {
+        mpm[i] = (SigIntId)(MERGE_SIGS - 1 - i);
+        non_pf[i] = (SigIntId)i;
+    }
+    FAIL_IF_NOT(SigTestPrefilterMergeCompare(mpm, MERGE_SIGS, non_pf, MERGE_SIGS));
+
+    for (int round = 0; round < 64; round++) {
+        /* a small range of ids for the even rounds, so the mpm list is
+         * mostly dups and overlaps the non-pf list; the full range with
+         * wide gaps for the odd ones */
+        const uint32_t range = (round % 2) ? MERGE_SIGS : 96;
+        const uint32_t mpm_cnt = 1 + (round * 61) % (4 * MERGE_SIGS - 1);
+
+        for (uint32_t i = 0; i < mpm_cnt; i++) {
+            seed = seed * 1103515245 + 12345;
+            mpm[i] = (SigIntId)((seed >> 8) % range);
+        }
+        uint32_t non_pf_cnt = 0;
+        for (uint32_t i = 0; i < range; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (((seed >> 8) % 4) == 0)
+                non_pf[non_pf_cnt++] = (SigIntId)i;
+        }
+        FAIL_IF_NOT(SigTestPrefilterMergeCompare(mpm, mpm_cnt, non_pf, non_pf_cnt));
+    }
+    PASS;
+}
+
+#undef MERGE_SIGS
+
 /** \test almost identical patterns */
 static int SigTestBug01(void)
 {
@@ -5426,6 +5598,8 @@ void SigRegisterTests(void)
 
     UtRegisterTest("SigTestPorts01", SigTestPorts01);
     UtRegisterTest("SigTestBug01", SigTestBug01);
+    UtRegisterTest("SigTestPrefilterMerge01", SigTestPrefilterMerge01);
+    UtRegisterTest("SigTestPrefilterMerge02", SigTestPrefilterMerge02);
 
     DetectEngineContentInspectionRegisterTests();
 }
@@ -708,6 +708,37 @@ static int StreamTcpReassembleTest32(void)
     OVERLAP_END;
 }
 
+/** \test in order segments are appended after the tail, out of order
+ *        ones go through the tree and leave the tail alone */
+static int StreamTcpReassembleTest33(void)
+{
+    OVERLAP_START(0, OS_POLICY_BSD);
+    OVERLAP_STEP(1, "AA", 2, "AA", 2);
+    FAIL_IF(stream->seg_tree_tail == NULL);
+    OVERLAP_STEP(3, "BB", 2, "AABB", 4);
+    OVERLAP_STEP(7, "DD", 2, "AABB\0\0DD", 8);
+    FAIL_IF(stream->seg_tree_tail->seq != stream->isn + 7);
+    OVERLAP_STEP(5, "CC", 2, "AABBCCDD", 8);
+    FAIL_IF(stream->seg_tree_tail != RB_MAX(TCPSEG, &stream->seg_tree));
+    FAIL_IF(stream->seg_tree_tail->seq != stream->isn + 7);
+    OVERLAP_STEP(9, "EE", 2, "AABBCCDDEE", 10);
+    FAIL_IF(stream->seg_tree_tail != RB_MAX(TCPSEG, &stream->seg_tree));
+
+    uint32_t cnt = 0;
+    uint32_t next_seq = stream->isn + 1;
+    TcpSegment *seg;
+    RB_FOREACH(seg, TCPSEG, &stream->seg_tree) {
+        FAIL_IF(seg->seq != next_seq);
+        next_seq += TCP_SEG_LEN(seg);
+        cnt++;
+    }
+    FAIL_IF(cnt != 5);
+
+    StreamTcpReturnStreamSegments(stream);
+    FAIL_IF(stream->seg_tree_tail != NULL);
+    OVERLAP_END;
+}
+
 void StreamTcpListRegisterTests(void)
 {
     UtRegisterTest("StreamTcpReassembleTest01 -- BSD policy",
@@ -729,5 +760,7 @@ void StreamTcpListRegisterTests(void)
             StreamTcpReassembleTest31);
     UtRegisterTest("StreamTcpReassembleTest32",
             StreamTcpReassembleTest32);
+    UtRegisterTest("StreamTcpReassembleTest33",
+            StreamTcpReassembleTest33);
 
 }
@@ -31,7 +31,8 @@ struct TestReassembleRawCallbackData {
     const uint32_t expect_data_len;
 };
 
-static int TestReassembleRawCallback(void *cb_data, const uint8_t *data, const uint32_t data_len)
+static int TestReassembleRawCallback(void *cb_data, const uint8_t *data, const uint32_t data_len,
+        const uint64_t data_offset)
 {
     struct TestReassembleRawCallbackData *cb = cb_data;
 
@@ -187,6 +188,75 @@ static int StreamTcpReassembleRawTest08 (void)
     RAWREASSEMBLY_END;
 }
 
+struct TestReassembleRegionsCallbackData {
+    uint32_t cnt;
+    uint64_t offset[16];
+    uint32_t len[16];
+    const uint8_t *data[16];
+};
+
+static int TestReassembleRegionsCallback(void *cb_data, const uint8_t *data,
+        const uint32_t data_len, const uint64_t data_offset)
+{
+    struct TestReassembleRegionsCallbackData *cb = cb_data;
+    if (cb->cnt == 16)
+        return -1;
+    cb->offset[cb->cnt] = data_offset;
+    cb->len[cb->cnt] = data_len;
+    cb->data[cb->cnt] = data;
+    cb->cnt++;
+    return 0;
+}
+
+/** \test IDS raw reassembly walks all blocks of a stream with gaps, more
+ *        than fit in a single batch of regions, in order and without
+ *        copying the data */
+static int StreamTcpReassembleRawTest09 (void)
+{
+    TcpReassemblyThreadCtx *ra_ctx = NULL;
+    TcpSession ssn;
+    ThreadVars tv;
+    memset(&tv, 0, sizeof(tv));
+
+    StreamTcpUTInit(&ra_ctx);
+    StreamTcpUTSetupSession(&ssn);
+    StreamTcpUTSetupStream(&ssn.client, 1);
+    TcpStream *stream = &ssn.client;
+
+    /* 10 blocks of 2 bytes with a 1 byte gap between them */
+    for (uint32_t i = 0; i < 10; i++) {
+        uint8_t payload[2] = { 'A' + i, 'A' + i };
+        FAIL_IF(StreamTcpUTAddPayload(&tv, ra_ctx, &ssn, stream,
+                    2 + i * 3, payload, sizeof(payload)) != 0);
+    }
+    stream->last_ack = 32;
+
+    struct TestReassembleRegionsCallbackData cb;
+    memset(&cb, 0, sizeof(cb));
+    uint64_t progress = 0;
+    FAIL_IF(StreamReassembleLog(&ssn, stream, TestReassembleRegionsCallback,
+                &cb, 0, &progress, true) != 0);
+
+    FAIL_IF(cb.cnt != 10);
+    const uint8_t *buf;
+    uint32_t buf_len;
+    uint64_t buf_offset;
+    StreamingBufferGetData(&stream->sb, &buf, &buf_len, &buf_offset);
+    for (uint32_t i = 0; i < 10; i++) {
+        FAIL_IF(cb.offset[i] != i * 3);
+        FAIL_IF(cb.len[i] != 2);
+        FAIL_IF(cb.data[i][0] != 'A' + i || cb.data[i][1] != 'A' + i);
+        /* points into the stream buffer */
+        FAIL_IF(cb.data[i] != buf + (cb.offset[i] - buf_offset));
+    }
+    /* the gap moved the progress to the second block */
+    FAIL_IF(progress != 3);
+
+    StreamTcpUTClearSession(&ssn);
+    StreamTcpUTDeinit(ra_ctx);
+    PASS;
+}
+
 static void StreamTcpReassembleRawRegisterTests(void)
 {
     UtRegisterTest("StreamTcpReassembleRawTest01",
@@ -205,4 +275,6 @@ static void StreamTcpReassembleRawRegisterTests(void)
                    StreamTcpReassembleRawTest07);
     UtRegisterTest("StreamTcpReassembleRawTest08",
                    StreamTcpReassembleRawTest08);
+    UtRegisterTest("StreamTcpReassembleRawTest09",
+                   StreamTcpReassembleRawTest09);
 }
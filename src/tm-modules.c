@@ -232,6 +232,8 @@ const char * TmModuleTmmIdToString(TmmId id)
         CASE_CODE (TMM_DETECTLOADER);
         CASE_CODE (TMM_RECEIVENETMAP);
         CASE_CODE (TMM_DECODENETMAP);
+        CASE_CODE (TMM_RECEIVEAFXDP);
+        CASE_CODE (TMM_DECODEAFXDP);
         CASE_CODE (TMM_RECEIVEWINDIVERT);
         CASE_CODE (TMM_VERDICTWINDIVERT);
         CASE_CODE (TMM_DECODEWINDIVERT);
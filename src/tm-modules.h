@@ -51,6 +51,10 @@ typedef struct TmModule_ {
     /** the packet processing function */
     TmEcode (*Func)(ThreadVars *, Packet *, void *, PacketQueue *, PacketQueue *);
 
+    /** optional: called with a batch of decoded packets before Func is
+     *  called for each of them. See TmThreadsSlotProcessPktBatch(). */
+    void (*PktPrefetch)(ThreadVars *, Packet **, uint32_t, void *);
+
     TmEcode (*PktAcqLoop)(ThreadVars *, void *, void *);
 
     /** terminates the capture loop in PktAcqLoop */
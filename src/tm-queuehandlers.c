@@ -34,6 +34,7 @@
 #include "tmqh-nfq.h"
 #include "tmqh-packetpool.h"
 #include "tmqh-flow.h"
+#include "tmqh-ring.h"
 
 void TmqhSetup (void)
 {
@@ -42,12 +43,15 @@ void TmqhSetup (void)
     TmqhSimpleRegister();
     TmqhNfqRegister();
     TmqhPacketpoolRegister();
+    /* before flow: it uses the rings if they are enabled */
+    TmqhRingRegister();
     TmqhFlowRegister();
 }
 
 /** \brief Clean up registration time allocs */
 void TmqhCleanup(void)
 {
+    TmqhRingCleanup();
 }
 
 Tmqh* TmqhGetQueueHandlerByName(const char *name)
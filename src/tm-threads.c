@@ -34,6 +34,7 @@
 #include "tm-queuehandlers.h"
 #include "tm-threads.h"
 #include "tmqh-packetpool.h"
+#include "tmqh-ring.h"
 #include "threads.h"
 #include "util-debug.h"
 #include "util-privs.h"
@@ -108,6 +109,93 @@ void TmThreadsUnsetFlag(ThreadVars *tv, uint16_t flag)
     SC_ATOMIC_AND(tv->flags, ~flag);
 }
 
+/** \internal
+ *  \brief call the slot function for a packet
+ *
+ *  Packets the slot function creates (e.g. tunnel packets from decode)
+ *  are left in the slot's pre_pq.
+ */
+static inline TmEcode TmThreadsSlotCall(ThreadVars *tv, Packet *p, TmSlot *s)
+{
+    TmEcode r;
+
+    TmSlotFunc SlotFunc = SC_ATOMIC_GET(s->SlotFunc);
+    PACKET_PROFILING_TMM_START(p, s->tm_id);
+
+    if (unlikely(s->id == 0)) {
+        r = SlotFunc(tv, p, SC_ATOMIC_GET(s->slot_data), &s->slot_pre_pq, &s->slot_post_pq);
+    } else {
+        r = SlotFunc(tv, p, SC_ATOMIC_GET(s->slot_data), &s->slot_pre_pq, NULL);
+    }
+
+    PACKET_PROFILING_TMM_END(p, s->tm_id);
+
+    /* handle error */
+    if (unlikely(r == TM_ECODE_FAILED)) {
+        /* Encountered error.  Return packets to packetpool and return */
+        TmqhReleasePacketsToPacketPool(&s->slot_pre_pq);
+
+        SCMutexLock(&s->slot_post_pq.mutex_q);
+        TmqhReleasePacketsToPacketPool(&s->slot_post_pq);
+        SCMutexUnlock(&s->slot_post_pq.mutex_q);
+
+        TmThreadsSetFlag(tv, THV_FAILED);
+        return TM_ECODE_FAILED;
+    }
+    return TM_ECODE_OK;
+}
+
+/** \internal
+ *  \brief pass packets from the slot's pre_pq through the slots
+ *         following 's'
+ *
+ *  \param cnt number of packets to take from the pre_pq, oldest first
+ */
+static inline TmEcode TmThreadsSlotRunPrePq(ThreadVars *tv, TmSlot *s, uint32_t cnt)
+{
+    TmEcode r;
+    Packet *extra_p;
+
+    while (cnt-- > 0 && s->slot_pre_pq.top != NULL) {
+        extra_p = PacketDequeue(&s->slot_pre_pq);
+        if (unlikely(extra_p == NULL))
+            continue;
+
+        /* see if we need to process the packet */
+        if (s->slot_next != NULL) {
+            r = TmThreadsSlotVarRun(tv, extra_p, s->slot_next);
+            if (unlikely(r == TM_ECODE_FAILED)) {
+                TmqhReleasePacketsToPacketPool(&s->slot_pre_pq);
+
+                SCMutexLock(&s->slot_post_pq.mutex_q);
+                TmqhReleasePacketsToPacketPool(&s->slot_post_pq);
+                SCMutexUnlock(&s->slot_post_pq.mutex_q);
+
+                TmqhOutputPacketpool(tv, extra_p);
+                TmThreadsSetFlag(tv, THV_FAILED);
+                return TM_ECODE_FAILED;
+            }
+        }
+        tv->tmqh_out(tv, extra_p);
+    }
+
+    return TM_ECODE_OK;
+}
+
+/** \internal
+ *  \brief run a single slot for a packet
+ *
+ *  Packets the slot function creates (e.g. tunnel packets from decode)
+ *  are passed through the slots following 's' right away.
+ */
+static inline TmEcode TmThreadsSlotRun(ThreadVars *tv, Packet *p, TmSlot *s)
+{
+    if (unlikely(TmThreadsSlotCall(tv, p, s) == TM_ECODE_FAILED))
+        return TM_ECODE_FAILED;
+
+    return TmThreadsSlotRunPrePq(tv, s, UINT32_MAX);
+}
+
 /**
  * \brief Separate run function so we can call it recursively.
  *
@@ -116,61 +204,114 @@ void TmThreadsUnsetFlag(ThreadVars *tv, uint16_t flag)
 TmEcode TmThreadsSlotVarRun(ThreadVars *tv, Packet *p,
                                           TmSlot *slot)
 {
-    TmEcode r;
     TmSlot *s;
-    Packet *extra_p;
 
     for (s = slot; s != NULL; s = s->slot_next) {
-        TmSlotFunc SlotFunc = SC_ATOMIC_GET(s->SlotFunc);
-        PACKET_PROFILING_TMM_START(p, s->tm_id);
-
-        if (unlikely(s->id == 0)) {
-            r = SlotFunc(tv, p, SC_ATOMIC_GET(s->slot_data), &s->slot_pre_pq, &s->slot_post_pq);
-        } else {
-            r = SlotFunc(tv, p, SC_ATOMIC_GET(s->slot_data), &s->slot_pre_pq, NULL);
-        }
-
-        PACKET_PROFILING_TMM_END(p, s->tm_id);
+        if (unlikely(TmThreadsSlotRun(tv, p, s) == TM_ECODE_FAILED))
+            return TM_ECODE_FAILED;
+    }
 
-        /* handle error */
-        if (unlikely(r == TM_ECODE_FAILED)) {
-            /* Encountered error.  Return packets to packetpool and return */
-            TmqhReleasePacketsToPacketPool(&s->slot_pre_pq);
+    return TM_ECODE_OK;
+}
 
-            SCMutexLock(&s->slot_post_pq.mutex_q);
-            TmqhReleasePacketsToPacketPool(&s->slot_post_pq);
-            SCMutexUnlock(&s->slot_post_pq.mutex_q);
+/**
+ *  \brief Process a batch of packets, e.g. a block from a capture source.
+ *
+ *  The first slot (normally decode) is run for all packets of the batch.
+ *  Then the modules in the remaining slots that have a PktPrefetch
+ *  callback get to see the whole batch, so they can issue prefetches for
+ *  the data they are about to touch. Only then the remaining slots are run
+ *  for each of the packets, in order.
+ *
+ *  Packets the first slot creates for a packet, like tunnel packets, are
+ *  held back until it's that packet's turn. They are then run right
+ *  before it, the same way TmThreadsSlotProcessPkt() would run them.
+ *  Batches larger than TM_PKT_BATCH_MAX are split.
+ *
+ *  \param s first slot to run, normally the one after the receive slot
+ *  \param pkts packets
+ *  \param cnt number of packets
+ *
+ *  \retval TM_ECODE_OK or TM_ECODE_FAILED. On failure all packets of the
+ *          batch have been returned to the packet pool.
+ */
+TmEcode TmThreadsSlotProcessPktBatch(ThreadVars *tv, TmSlot *s,
+        Packet **pkts, const uint32_t cnt)
+{
+    uint32_t i, j;
+    uint32_t extra_cnt[TM_PKT_BATCH_MAX];
+
+    if (s == NULL || s->slot_next == NULL) {
+        for (i = 0; i < cnt; i++) {
+            /* on failure the packet is already returned to the pool */
+            if (TmThreadsSlotProcessPkt(tv, s, pkts[i]) != TM_ECODE_OK) {
+                for (j = i + 1; j < cnt; j++)
+                    TmqhOutputPacketpool(tv, pkts[j]);
+                return TM_ECODE_FAILED;
+            }
+        }
+        return TM_ECODE_OK;
+    }
 
-            TmThreadsSetFlag(tv, THV_FAILED);
-            return TM_ECODE_FAILED;
+    if (cnt > TM_PKT_BATCH_MAX) {
+        for (i = 0; i < cnt; i += TM_PKT_BATCH_MAX) {
+            const uint32_t n = MIN(cnt - i, TM_PKT_BATCH_MAX);
+            if (TmThreadsSlotProcessPktBatch(tv, s, pkts + i, n) != TM_ECODE_OK) {
+                for (j = i + n; j < cnt; j++)
+                    TmqhOutputPacketpool(tv, pkts[j]);
+                return TM_ECODE_FAILED;
+            }
         }
+        return TM_ECODE_OK;
+    }
 
-        /* handle new packets */
-        while (s->slot_pre_pq.top != NULL) {
-            extra_p = PacketDequeue(&s->slot_pre_pq);
-            if (unlikely(extra_p == NULL))
-                continue;
+    for (i = 0; i < cnt; i++) {
+        const uint32_t pre_len = s->slot_pre_pq.len;
+        if (unlikely(TmThreadsSlotCall(tv, pkts[i], s) == TM_ECODE_FAILED)) {
+            for (j = 0; j < cnt; j++)
+                TmqhOutputPacketpool(tv, pkts[j]);
+            goto error;
+        }
+        extra_cnt[i] = s->slot_pre_pq.len - pre_len;
+    }
 
-            /* see if we need to process the packet */
-            if (s->slot_next != NULL) {
-                r = TmThreadsSlotVarRun(tv, extra_p, s->slot_next);
-                if (unlikely(r == TM_ECODE_FAILED)) {
-                    TmqhReleasePacketsToPacketPool(&s->slot_pre_pq);
+    for (TmSlot *slot = s->slot_next; slot != NULL; slot = slot->slot_next) {
+        TmModule *tm = TmModuleGetById(slot->tm_id);
+        if (tm != NULL && tm->PktPrefetch != NULL) {
+            tm->PktPrefetch(tv, pkts, cnt, SC_ATOMIC_GET(slot->slot_data));
+        }
+    }
 
-                    SCMutexLock(&s->slot_post_pq.mutex_q);
-                    TmqhReleasePacketsToPacketPool(&s->slot_post_pq);
-                    SCMutexUnlock(&s->slot_post_pq.mutex_q);
+    for (i = 0; i < cnt; i++) {
+        if (unlikely(TmThreadsSlotRunPrePq(tv, s, extra_cnt[i]) == TM_ECODE_FAILED) ||
+            unlikely(TmThreadsSlotVarRun(tv, pkts[i], s->slot_next) == TM_ECODE_FAILED))
+        {
+            for (j = i; j < cnt; j++)
+                TmqhOutputPacketpool(tv, pkts[j]);
+            goto error;
+        }
+        tv->tmqh_out(tv, pkts[i]);
 
-                    TmqhOutputPacketpool(tv, extra_p);
-                    TmThreadsSetFlag(tv, THV_FAILED);
-                    return TM_ECODE_FAILED;
-                }
-            }
-            tv->tmqh_out(tv, extra_p);
+        if (TmThreadsSlotProcessPostPq(tv, s) != TM_ECODE_OK) {
+            /* extra packets of the rest of the batch */
+            TmqhReleasePacketsToPacketPool(&s->slot_pre_pq);
+            for (j = i + 1; j < cnt; j++)
+                TmqhOutputPacketpool(tv, pkts[j]);
+            return TM_ECODE_FAILED;
         }
     }
 
     return TM_ECODE_OK;
+
+error:
+    TmqhReleasePacketsToPacketPool(&s->slot_pre_pq);
+    for (TmSlot *slot = s; slot != NULL; slot = slot->slot_next) {
+        SCMutexLock(&slot->slot_post_pq.mutex_q);
+        TmqhReleasePacketsToPacketPool(&slot->slot_post_pq);
+        SCMutexUnlock(&slot->slot_post_pq.mutex_q);
+    }
+    TmThreadsSetFlag(tv, THV_FAILED);
+    return TM_ECODE_FAILED;
 }
 
 #ifndef AFLFUZZ_PCAP_RUNMODE
@@ -275,6 +416,7 @@ static void *TmThreadsSlotPktAcqLoop(void *td)
     SCDropCaps(tv);
 
     PacketPoolInit();
+    PacketPoolRegisterCounters(tv);
 
     /* check if we are setup properly */
     if (s == NULL || s->PktAcqLoop == NULL || tv->tmqh_in == NULL || tv->tmqh_out == NULL) {
@@ -402,6 +544,7 @@ static void *TmThreadsSlotPktAcqLoopAFL(void *td)
     TmSlot *slot = NULL;
 
     PacketPoolInit();
+    PacketPoolRegisterCounters(tv);
 
     /* check if we are setup properly */
     if (s == NULL || s->PktAcqLoop == NULL || tv->tmqh_in == NULL || tv->tmqh_out == NULL) {
@@ -514,6 +657,7 @@ static void *TmThreadsSlotVar(void *td)
     TmEcode r = TM_ECODE_OK;
 
     PacketPoolInitEmpty();
+    PacketPoolRegisterCounters(tv);
 
     /* Set the thread name */
     if (SCSetThreadName(tv->name) < 0) {
@@ -1446,7 +1590,7 @@ static int TmThreadKillThread(ThreadVars *tv)
         if (!(strlen(tv->inq->name) == strlen("packetpool") &&
               strcasecmp(tv->inq->name, "packetpool") == 0)) {
             PacketQueue *q = &trans_q[tv->inq->id];
-            if (q->len != 0) {
+            if (q->len != 0 || !TmqhRingIsEmpty(tv->inq->id)) {
                 return 0;
             }
         }
@@ -1525,7 +1669,7 @@ again:
             if (!(strlen(tv->inq->name) == strlen("packetpool") &&
                         strcasecmp(tv->inq->name, "packetpool") == 0)) {
                 PacketQueue *q = &trans_q[tv->inq->id];
-                if (q->len != 0) {
+                if (q->len != 0 || !TmqhRingIsEmpty(tv->inq->id)) {
                     SCMutexUnlock(&tv_root_lock);
 
                     /* sleep outside lock */
@@ -1597,7 +1741,7 @@ again:
                 if (!(strlen(tv->inq->name) == strlen("packetpool") &&
                       strcasecmp(tv->inq->name, "packetpool") == 0)) {
                     PacketQueue *q = &trans_q[tv->inq->id];
-                    if (q->len != 0) {
+                    if (q->len != 0 || !TmqhRingIsEmpty(tv->inq->id)) {
                         SCMutexUnlock(&tv_root_lock);
                         /* don't sleep while holding a lock */
                         SleepMsec(1);
@@ -1680,7 +1824,7 @@ again:
             if (!(strlen(tv->inq->name) == strlen("packetpool") &&
                         strcasecmp(tv->inq->name, "packetpool") == 0)) {
                 PacketQueue *q = &trans_q[tv->inq->id];
-                if (q->len != 0) {
+                if (q->len != 0 || !TmqhRingIsEmpty(tv->inq->id)) {
                     SCMutexUnlock(&tv_root_lock);
                     /* don't sleep while holding a lock */
                     SleepMsec(1);
@@ -2405,3 +2549,108 @@ int TmThreadsInjectPacketsById(Packet **packets, const int id)
     }
     return 1;
 }
+
+#ifdef UNITTESTS
+#include "util-unittest.h"
+
+static Packet *tm_test_seen[8];
+static Packet *tm_test_seen_root[8];
+static uint32_t tm_test_seen_cnt = 0;
+
+static TmEcode TmThreadsTestDecode(ThreadVars *tv, Packet *p, void *data,
+        PacketQueue *pq, PacketQueue *postpq)
+{
+    DecodeIPV4(tv, data, p, GET_PKT_DATA(p), GET_PKT_LEN(p), pq);
+    return TM_ECODE_OK;
+}
+
+static TmEcode TmThreadsTestRecord(ThreadVars *tv, Packet *p, void *data,
+        PacketQueue *pq, PacketQueue *postpq)
+{
+    if (tm_test_seen_cnt < 8) {
+        tm_test_seen[tm_test_seen_cnt] = p;
+        tm_test_seen_root[tm_test_seen_cnt] = p->root;
+        tm_test_seen_cnt++;
+    }
+    return TM_ECODE_OK;
+}
+
+/** \test a tunnel packet from the middle of a batch is run after the
+ *        packets before its parent, right before the parent */
+static int TmThreadsBatchTest01(void)
+{
+    /* ipv4, proto 253 */
+    uint8_t raw_plain[] = {
+        0x45, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x00,
+        0x40, 0xfd, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x01,
+        0x0a, 0x00, 0x00, 0x02 };
+    /* ipv6 in ipv4 */
+    uint8_t raw_tunnel[] = {
+        0x45, 0x00, 0x00, 0x3c, 0x00, 0x00, 0x00, 0x00,
+        0x40, 0x29, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x01,
+        0x0a, 0x00, 0x00, 0x02,
+        0x60, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3b, 0x40,
+        0x20, 0x01, 0x0d, 0xb8, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+        0x20, 0x01, 0x0d, 0xb8, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02 };
+    ThreadVars tv;
+    DecodeThreadVars dtv;
+    TmSlot decode_slot, record_slot;
+    Packet *pkts[3];
+
+    memset(&tv, 0, sizeof(tv));
+    memset(&dtv, 0, sizeof(dtv));
+    memset(&decode_slot, 0, sizeof(decode_slot));
+    memset(&record_slot, 0, sizeof(record_slot));
+    tv.tmqh_out = TmqhOutputPacketpool;
+
+    SC_ATOMIC_INIT(decode_slot.SlotFunc);
+    SC_ATOMIC_INIT(decode_slot.slot_data);
+    SC_ATOMIC_SET(decode_slot.SlotFunc, TmThreadsTestDecode);
+    SC_ATOMIC_SET(decode_slot.slot_data, &dtv);
+    SCMutexInit(&decode_slot.slot_post_pq.mutex_q, NULL);
+    decode_slot.tm_id = TMM_DECODEPCAPFILE;
+    decode_slot.id = 0;
+    decode_slot.slot_next = &record_slot;
+
+    SC_ATOMIC_INIT(record_slot.SlotFunc);
+    SC_ATOMIC_INIT(record_slot.slot_data);
+    SC_ATOMIC_SET(record_slot.SlotFunc, TmThreadsTestRecord);
+    SCMutexInit(&record_slot.slot_post_pq.mutex_q, NULL);
+    record_slot.tm_id = TMM_DECODEPCAPFILE;
+    record_slot.id = 1;
+
+    for (int i = 0; i < 3; i++) {
+        pkts[i] = PacketGetFromAlloc();
+        FAIL_IF_NULL(pkts[i]);
+        if (i == 1)
+            PacketCopyData(pkts[i], raw_tunnel, sizeof(raw_tunnel));
+        else
+            PacketCopyData(pkts[i], raw_plain, sizeof(raw_plain));
+    }
+    Packet *p0 = pkts[0], *p1 = pkts[1], *p2 = pkts[2];
+
+    tm_test_seen_cnt = 0;
+    FAIL_IF(TmThreadsSlotProcessPktBatch(&tv, &decode_slot, pkts, 3) != TM_ECODE_OK);
+
+    FAIL_IF(tm_test_seen_cnt != 4);
+    FAIL_IF(tm_test_seen[0] != p0);
+    /* the ipv6 tunnel packet */
+    FAIL_IF(tm_test_seen_root[1] != p1);
+    FAIL_IF(tm_test_seen[2] != p1);
+    FAIL_IF(tm_test_seen[3] != p2);
+    FAIL_IF(decode_slot.slot_pre_pq.len != 0);
+
+    SCMutexDestroy(&decode_slot.slot_post_pq.mutex_q);
+    SCMutexDestroy(&record_slot.slot_post_pq.mutex_q);
+    PASS;
+}
+#endif /* UNITTESTS */
+
+void TmThreadsRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("TmThreadsBatchTest01", TmThreadsBatchTest01);
+#endif /* UNITTESTS */
+}
@@ -138,7 +138,15 @@ void TmThreadsSetFlag(ThreadVars *, uint16_t);
 void TmThreadsUnsetFlag(ThreadVars *, uint16_t);
 void TmThreadWaitForFlag(ThreadVars *, uint16_t);
 
+/** max number of packets TmThreadsSlotProcessPktBatch() handles at once,
+ *  larger batches are split */
+#define TM_PKT_BATCH_MAX 64
+
 TmEcode TmThreadsSlotVarRun (ThreadVars *tv, Packet *p, TmSlot *slot);
+TmEcode TmThreadsSlotProcessPktBatch(ThreadVars *tv, TmSlot *s,
+        Packet **pkts, const uint32_t cnt);
+
+void TmThreadsRegisterTests(void);
 
 ThreadVars *TmThreadsGetTVContainingSlot(TmSlot *);
 void TmThreadDisablePacketThreads(void);
@@ -147,6 +155,45 @@ TmSlot *TmThreadGetFirstTmSlotForPartialPattern(const char *);
 
 uint32_t TmThreadCountThreadsByTmmFlags(uint8_t flags);
 
+/**
+ *  \brief Process the packets the slots put in their post pq.
+ */
+static inline TmEcode TmThreadsSlotProcessPostPq(ThreadVars *tv, TmSlot *s)
+{
+    TmEcode r = TM_ECODE_OK;
+
+    TmSlot *slot = s;
+    while (slot != NULL) {
+        if (slot->slot_post_pq.top != NULL) {
+            while (1) {
+                SCMutexLock(&slot->slot_post_pq.mutex_q);
+                Packet *extra_p = PacketDequeue(&slot->slot_post_pq);
+                SCMutexUnlock(&slot->slot_post_pq.mutex_q);
+
+                if (extra_p == NULL)
+                    break;
+
+                if (slot->slot_next != NULL) {
+                    r = TmThreadsSlotVarRun(tv, extra_p, slot->slot_next);
+                    if (r == TM_ECODE_FAILED) {
+                        SCMutexLock(&slot->slot_post_pq.mutex_q);
+                        TmqhReleasePacketsToPacketPool(&slot->slot_post_pq);
+                        SCMutexUnlock(&slot->slot_post_pq.mutex_q);
+
+                        TmqhOutputPacketpool(tv, extra_p);
+                        TmThreadsSetFlag(tv, THV_FAILED);
+                        break;
+                    }
+                }
+                tv->tmqh_out(tv, extra_p);
+            }
+        } /* if (slot->slot_post_pq.top != NULL) */
+        slot = slot->slot_next;
+    } /* while (slot != NULL) */
+
+    return r;
+}
+
 /**
  *  \brief Process the rest of the functions (if any) and queue.
  */
@@ -176,34 +223,7 @@ static inline TmEcode TmThreadsSlotProcessPkt(ThreadVars *tv, TmSlot *s, Packet
         tv->tmqh_out(tv, p);
 
         /* post process pq */
-        TmSlot *slot = s;
-        while (slot != NULL) {
-            if (slot->slot_post_pq.top != NULL) {
-                while (1) {
-                    SCMutexLock(&slot->slot_post_pq.mutex_q);
-                    Packet *extra_p = PacketDequeue(&slot->slot_post_pq);
-                    SCMutexUnlock(&slot->slot_post_pq.mutex_q);
-
-                    if (extra_p == NULL)
-                        break;
-
-                    if (slot->slot_next != NULL) {
-                        r = TmThreadsSlotVarRun(tv, extra_p, slot->slot_next);
-                        if (r == TM_ECODE_FAILED) {
-                            SCMutexLock(&slot->slot_post_pq.mutex_q);
-                            TmqhReleasePacketsToPacketPool(&slot->slot_post_pq);
-                            SCMutexUnlock(&slot->slot_post_pq.mutex_q);
-
-                            TmqhOutputPacketpool(tv, extra_p);
-                            TmThreadsSetFlag(tv, THV_FAILED);
-                            break;
-                        }
-                    }
-                    tv->tmqh_out(tv, extra_p);
-                }
-            } /* if (slot->slot_post_pq.top != NULL) */
-            slot = slot->slot_next;
-        } /* while (slot != NULL) */
+        r = TmThreadsSlotProcessPostPq(tv, s);
     }
 
     return r;
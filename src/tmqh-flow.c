@@ -33,6 +33,7 @@
 #include "threads.h"
 #include "threadvars.h"
 #include "tmqh-flow.h"
+#include "tmqh-ring.h"
 
 #include "tm-queuehandlers.h"
 
@@ -54,6 +55,11 @@ void TmqhFlowRegister(void)
     tmqh_table[TMQH_FLOW].OutHandlerCtxFree = TmqhOutputFlowFreeCtx;
     tmqh_table[TMQH_FLOW].RegisterTests = TmqhFlowRegisterTests;
 
+    if (TmqhRingEnabled()) {
+        tmqh_table[TMQH_FLOW].InHandler = TmqhInputRing;
+        tmqh_table[TMQH_FLOW].InShutdownHandler = TmqhInputRingShutdownHandler;
+    }
+
     const char *scheduler = NULL;
     if (ConfGet("autofp-scheduler", &scheduler) == 1) {
         if (strcasecmp(scheduler, "round-robin") == 0) {
@@ -149,6 +155,12 @@ static int StoreQueueId(TmqhFlowCtx *ctx, char *name)
     }
     ctx->queues[ctx->size - 1].q = &trans_q[id];
 
+    if (TmqhRingEnabled()) {
+        ctx->queues[ctx->size - 1].ring = TmqhRingGet(id);
+        if (ctx->queues[ctx->size - 1].ring == NULL)
+            return -1;
+    }
+
     return 0;
 }
 
@@ -220,6 +232,20 @@ void TmqhOutputFlowFreeCtx(void *ctx)
     return;
 }
 
+static inline void TmqhFlowEnqueue(TmqhFlowMode *m, Packet *p)
+{
+    if (m->ring != NULL) {
+        TmqhRingEnqueue(m->ring, p);
+        return;
+    }
+
+    PacketQueue *q = m->q;
+    SCMutexLock(&q->mutex_q);
+    PacketEnqueue(q, p);
+    SCCondSignal(&q->cond_q);
+    SCMutexUnlock(&q->mutex_q);
+}
+
 void TmqhOutputFlowHash(ThreadVars *tv, Packet *p)
 {
     int16_t qid = 0;
@@ -236,13 +262,7 @@ void TmqhOutputFlowHash(ThreadVars *tv, Packet *p)
             ctx->last = 0;
     }
 
-    PacketQueue *q = ctx->queues[qid].q;
-    SCMutexLock(&q->mutex_q);
-    PacketEnqueue(q, p);
-    SCCondSignal(&q->cond_q);
-    SCMutexUnlock(&q->mutex_q);
-
-    return;
+    TmqhFlowEnqueue(&ctx->queues[qid], p);
 }
 
 /**
@@ -271,13 +291,7 @@ void TmqhOutputFlowIPPair(ThreadVars *tv, Packet *p)
      * ctx->size will be lesser than 2 ** 31 for sure */
     qid = addr_hash % ctx->size;
 
-    PacketQueue *q = ctx->queues[qid].q;
-    SCMutexLock(&q->mutex_q);
-    PacketEnqueue(q, p);
-    SCCondSignal(&q->cond_q);
-    SCMutexUnlock(&q->mutex_q);
-
-    return;
+    TmqhFlowEnqueue(&ctx->queues[qid], p);
 }
 
 #ifdef UNITTESTS
@@ -26,6 +26,7 @@
 
 typedef struct TmqhFlowMode_ {
     PacketQueue *q;
+    struct PacketRing_ *ring;   /**< set if autofp-queue is 'ring' */
 } TmqhFlowMode;
 
 /** \brief Ctx for the flow queue handler
@@ -49,6 +49,7 @@
 #include "util-error.h"
 #include "util-profiling.h"
 #include "util-device.h"
+#include "util-unittest.h"
 
 /* Number of freed packet to save for one pool before freeing them. */
 #define MAX_PENDING_RETURN_PACKETS 32
@@ -134,32 +135,85 @@ void TmqhPacketpoolRegister (void)
     tmqh_table[TMQH_PACKETPOOL].name = "packetpool";
     tmqh_table[TMQH_PACKETPOOL].InHandler = TmqhInputPacketpool;
     tmqh_table[TMQH_PACKETPOOL].OutHandler = TmqhOutputPacketpool;
+    tmqh_table[TMQH_PACKETPOOL].RegisterTests = TmqhPacketpoolRegisterTests;
+}
+
+/** \brief register the counters for the packets this thread returns to
+ *         the pools of other threads
+ *
+ *  Must be called from the thread itself, after PacketPoolInit() or
+ *  PacketPoolInitEmpty() and before StatsSetupPrivate().
+ */
+void PacketPoolRegisterCounters(ThreadVars *tv)
+{
+    PktPool *my_pool = GetThreadPacketPool();
+
+    my_pool->counter_cross_returns =
+        StatsRegisterCounter("packetpool.cross_thread_returns", tv);
+    my_pool->counter_magazine_flushes =
+        StatsRegisterCounter("packetpool.magazine_flushes", tv);
+    my_pool->tv = tv;
 }
 
 static int PacketPoolIsEmpty(PktPool *pool)
 {
     /* Check local stack first. */
-    if (pool->head || pool->return_stack.head)
+    if (pool->head || __atomic_load_n(&pool->return_stack.head, __ATOMIC_RELAXED))
         return 0;
 
     return 1;
 }
 
+/** \brief wait for other threads to return packets to our pool
+ *
+ *  We flag that we wait, then check the return stack again. Threads
+ *  returning packets check the flag after pushing theirs, so either we
+ *  see their packets here or they see the flag and signal us. They take
+ *  the mutex to signal, so the signal can't get lost.
+ */
+static void PacketPoolWaitForReturn(PktPool *my_pool)
+{
+    SCMutexLock(&my_pool->return_stack.mutex);
+    __atomic_store_n(&my_pool->return_stack.sync_now, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&my_pool->return_stack.head, __ATOMIC_SEQ_CST) == NULL)
+        SCCondWait(&my_pool->return_stack.cond, &my_pool->return_stack.mutex);
+    SCMutexUnlock(&my_pool->return_stack.mutex);
+}
+
 void PacketPoolWait(void)
 {
     PktPool *my_pool = GetThreadPacketPool();
 
     if (PacketPoolIsEmpty(my_pool)) {
-        SCMutexLock(&my_pool->return_stack.mutex);
-        SC_ATOMIC_ADD(my_pool->return_stack.sync_now, 1);
-        SCCondWait(&my_pool->return_stack.cond, &my_pool->return_stack.mutex);
-        SCMutexUnlock(&my_pool->return_stack.mutex);
+        PacketPoolWaitForReturn(my_pool);
     }
 
     while(PacketPoolIsEmpty(my_pool))
         cc_barrier();
 }
 
+/** \brief Check if the local pool has at least n packets, without waiting
+ *
+ *  Only the thread local stack is considered, so the return stack lock
+ *  is never taken.
+ *
+ *  \retval 1 at least n packets available
+ *  \retval 0 less than n packets available
+ */
+int PacketPoolHasN(int n)
+{
+    PktPool *my_pool = GetThreadPacketPool();
+    Packet *p = my_pool->head;
+    int i = 0;
+
+    while (p != NULL) {
+        if (++i == n)
+            return 1;
+        p = p->next;
+    }
+    return 0;
+}
+
 /** \brief Wait until we have the requested amount of packets in the pool
  *
  *  In some cases waiting for packets is undesirable. Especially when
@@ -188,25 +242,20 @@ void PacketPoolWaitForN(int n)
             p = p->next;
         }
 
-        /* continue counting in the return stack */
-        if (my_pool->return_stack.head != NULL) {
-            SCMutexLock(&my_pool->return_stack.mutex);
-            p = my_pool->return_stack.head;
+        /* continue counting in the return stack. Other threads only
+         * push in front of the head and only we take packets off it, so
+         * the list from the head we read is stable. */
+        p = __atomic_load_n(&my_pool->return_stack.head, __ATOMIC_ACQUIRE);
+        if (p != NULL) {
             while (p != NULL) {
-                if (++i == n) {
-                    SCMutexUnlock(&my_pool->return_stack.mutex);
+                if (++i == n)
                     return;
-                }
                 p = p->next;
             }
-            SCMutexUnlock(&my_pool->return_stack.mutex);
 
         /* or signal that we need packets and wait */
         } else {
-            SCMutexLock(&my_pool->return_stack.mutex);
-            SC_ATOMIC_ADD(my_pool->return_stack.sync_now, 1);
-            SCCondWait(&my_pool->return_stack.cond, &my_pool->return_stack.mutex);
-            SCMutexUnlock(&my_pool->return_stack.mutex);
+            PacketPoolWaitForReturn(my_pool);
         }
     }
 }
@@ -227,11 +276,9 @@ static void PacketPoolStorePacket(Packet *p)
 
 static void PacketPoolGetReturnedPackets(PktPool *pool)
 {
-    SCMutexLock(&pool->return_stack.mutex);
-    /* Move all the packets from the locked return stack to the local stack. */
-    pool->head = pool->return_stack.head;
-    pool->return_stack.head = NULL;
-    SCMutexUnlock(&pool->return_stack.mutex);
+    /* Move all the packets from the return stack to the local stack. */
+    pool->head = __atomic_exchange_n(&pool->return_stack.head, NULL,
+            __ATOMIC_ACQUIRE);
 }
 
 /** \brief Get a new packet from the packet pool
@@ -257,8 +304,7 @@ Packet *PacketPoolGetPacket(void)
         return p;
     }
 
-    /* Local Stack is empty, so check the return stack, which requires
-     * locking. */
+    /* Local Stack is empty, so take the return stack. */
     PacketPoolGetReturnedPackets(pool);
 
     /* Try to allocate again. Need to check for not empty again, since the
@@ -278,6 +324,63 @@ Packet *PacketPoolGetPacket(void)
     return NULL;
 }
 
+/** \brief hand a magazine back to the pool that owns its packets
+ *
+ *  The packets are linked onto the return stack with a single CAS. The
+ *  owner takes the whole stack with an atomic exchange, so packets are
+ *  never taken off one by one and there is no ABA problem.
+ */
+static void PacketPoolMagazineFlush(PktPool *my_pool, PktPoolMagazine *mag)
+{
+    PktPool *pool = mag->pool;
+
+    Packet *old = __atomic_load_n(&pool->return_stack.head, __ATOMIC_RELAXED);
+    do {
+        mag->tail->next = old;
+    } while (!__atomic_compare_exchange_n(&pool->return_stack.head, &old,
+                mag->head, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    /* seq_cst, paired with PacketPoolWaitForReturn() */
+    if (__atomic_load_n(&pool->return_stack.sync_now, __ATOMIC_SEQ_CST)) {
+        SCMutexLock(&pool->return_stack.mutex);
+        __atomic_store_n(&pool->return_stack.sync_now, 0, __ATOMIC_RELAXED);
+        SCCondSignal(&pool->return_stack.cond);
+        SCMutexUnlock(&pool->return_stack.mutex);
+    }
+
+    if (my_pool->tv != NULL) {
+        StatsAddUI64(my_pool->tv, my_pool->counter_cross_returns, mag->count);
+        StatsIncr(my_pool->tv, my_pool->counter_magazine_flushes);
+    }
+
+    mag->pool = NULL;
+    mag->head = NULL;
+    mag->tail = NULL;
+    mag->count = 0;
+}
+
+/** \brief get the magazine for packets of 'pool', flushing another one
+ *         if they are all in use */
+static inline PktPoolMagazine *PacketPoolGetMagazine(PktPool *my_pool, PktPool *pool)
+{
+    PktPoolMagazine *unused = NULL;
+
+    for (int i = 0; i < PKT_POOL_MAGAZINES; i++) {
+        PktPoolMagazine *mag = &my_pool->magazines[i];
+        if (mag->pool == pool)
+            return mag;
+        if (mag->pool == NULL && unused == NULL)
+            unused = mag;
+    }
+
+    if (unused == NULL) {
+        unused = &my_pool->magazines[my_pool->magazine_evict++ % PKT_POOL_MAGAZINES];
+        PacketPoolMagazineFlush(my_pool, unused);
+    }
+    unused->pool = pool;
+    return unused;
+}
+
 /** \brief Return packet to Packet pool
  *
  */
@@ -304,41 +407,17 @@ void PacketPoolReturnPacket(Packet *p)
         p->next = my_pool->head;
         my_pool->head = p;
     } else {
-        PktPool *pending_pool = my_pool->pending_pool;
-        if (pending_pool == NULL) {
-            /* No pending packet, so store the current packet. */
-            p->next = NULL;
-            my_pool->pending_pool = pool;
-            my_pool->pending_head = p;
-            my_pool->pending_tail = p;
-            my_pool->pending_count = 1;
-        } else if (pending_pool == pool) {
-            /* Another packet for the pending pool list. */
-            p->next = my_pool->pending_head;
-            my_pool->pending_head = p;
-            my_pool->pending_count++;
-            if (SC_ATOMIC_GET(pool->return_stack.sync_now) || my_pool->pending_count > max_pending_return_packets) {
-                /* Return the entire list of pending packets. */
-                SCMutexLock(&pool->return_stack.mutex);
-                my_pool->pending_tail->next = pool->return_stack.head;
-                pool->return_stack.head = my_pool->pending_head;
-                SC_ATOMIC_RESET(pool->return_stack.sync_now);
-                SCMutexUnlock(&pool->return_stack.mutex);
-                SCCondSignal(&pool->return_stack.cond);
-                /* Clear the list of pending packets to return. */
-                my_pool->pending_pool = NULL;
-                my_pool->pending_head = NULL;
-                my_pool->pending_tail = NULL;
-                my_pool->pending_count = 0;
-            }
-        } else {
-            /* Push onto return stack for this pool */
-            SCMutexLock(&pool->return_stack.mutex);
-            p->next = pool->return_stack.head;
-            pool->return_stack.head = p;
-            SC_ATOMIC_RESET(pool->return_stack.sync_now);
-            SCMutexUnlock(&pool->return_stack.mutex);
-            SCCondSignal(&pool->return_stack.cond);
+        /* Collect it in the magazine for the owner of the packet. */
+        PktPoolMagazine *mag = PacketPoolGetMagazine(my_pool, pool);
+        p->next = mag->head;
+        mag->head = p;
+        if (mag->tail == NULL)
+            mag->tail = p;
+        mag->count++;
+
+        if (mag->count >= max_pending_return_packets ||
+                __atomic_load_n(&pool->return_stack.sync_now, __ATOMIC_RELAXED)) {
+            PacketPoolMagazineFlush(my_pool, mag);
         }
     }
 }
@@ -359,7 +438,7 @@ void PacketPoolInitEmpty(void)
 
     SCMutexInit(&my_pool->return_stack.mutex, NULL);
     SCCondInit(&my_pool->return_stack.cond, NULL);
-    SC_ATOMIC_INIT(my_pool->return_stack.sync_now);
+    my_pool->return_stack.sync_now = 0;
 }
 
 void PacketPoolInit(void)
@@ -380,7 +459,7 @@ void PacketPoolInit(void)
 
     SCMutexInit(&my_pool->return_stack.mutex, NULL);
     SCCondInit(&my_pool->return_stack.cond, NULL);
-    SC_ATOMIC_INIT(my_pool->return_stack.sync_now);
+    my_pool->return_stack.sync_now = 0;
 
     /* pre allocate packets */
     SCLogDebug("preallocating packets... packet size %" PRIuMAX "",
@@ -408,27 +487,30 @@ void PacketPoolDestroy(void)
     BUG_ON(my_pool->destroyed);
 #endif /* DEBUG_VALIDATION */
 
-    if (my_pool && my_pool->pending_pool != NULL) {
-        p = my_pool->pending_head;
+    for (int i = 0; my_pool && i < PKT_POOL_MAGAZINES; i++) {
+        PktPoolMagazine *mag = &my_pool->magazines[i];
+        if (mag->pool == NULL)
+            continue;
+
+        p = mag->head;
         while (p) {
             Packet *next_p = p->next;
             PacketFree(p);
             p = next_p;
-            my_pool->pending_count--;
+            mag->count--;
         }
 #ifdef DEBUG_VALIDATION
-        BUG_ON(my_pool->pending_count);
+        BUG_ON(mag->count);
 #endif /* DEBUG_VALIDATION */
-        my_pool->pending_pool = NULL;
-        my_pool->pending_head = NULL;
-        my_pool->pending_tail = NULL;
+        mag->pool = NULL;
+        mag->head = NULL;
+        mag->tail = NULL;
     }
 
     while ((p = PacketPoolGetPacket()) != NULL) {
         PacketFree(p);
     }
-
-    SC_ATOMIC_DESTROY(my_pool->return_stack.sync_now);
+    my_pool->tv = NULL;
 
 #ifdef DEBUG_VALIDATION
     my_pool->initialized = 0;
@@ -589,3 +671,193 @@ void PacketPoolPostRunmodes(void)
     SCLogDebug("detect threads %u, max packets %u, max_pending_return_packets %u",
             threads, threads, max_pending_return_packets);
 }
+
+#ifdef UNITTESTS
+static PktPool *PacketPoolTestPoolAlloc(void)
+{
+    PktPool *pool = SCMallocAligned(sizeof(PktPool), CLS);
+    if (pool == NULL)
+        return NULL;
+    memset(pool, 0, sizeof(*pool));
+#ifdef DEBUG_VALIDATION
+    pool->initialized = 1;
+#endif
+    SCMutexInit(&pool->return_stack.mutex, NULL);
+    SCCondInit(&pool->return_stack.cond, NULL);
+    return pool;
+}
+
+static void PacketPoolTestPoolFree(PktPool *pool)
+{
+    Packet *p = __atomic_exchange_n(&pool->return_stack.head, NULL,
+            __ATOMIC_ACQUIRE);
+    while (p != NULL) {
+        Packet *next = p->next;
+        PacketFree(p);
+        p = next;
+    }
+    SCMutexDestroy(&pool->return_stack.mutex);
+    SCCondDestroy(&pool->return_stack.cond);
+    SCFreeAligned(pool);
+}
+
+static int PacketPoolTestStackLen(PktPool *pool)
+{
+    int cnt = 0;
+    for (Packet *p = __atomic_load_n(&pool->return_stack.head, __ATOMIC_ACQUIRE);
+            p != NULL; p = p->next)
+        cnt++;
+    return cnt;
+}
+
+/** \test packets of more owners than there are magazines: a magazine
+ *        is flushed to make room */
+static int PacketPoolTest01(void)
+{
+    PktPool *my_pool = GetThreadPacketPool();
+    PktPool *owners[PKT_POOL_MAGAZINES + 1];
+    /* the magazines are taken in order, this one is evicted */
+    const uint32_t evict = my_pool->magazine_evict % PKT_POOL_MAGAZINES;
+
+    for (int i = 0; i < PKT_POOL_MAGAZINES + 1; i++) {
+        owners[i] = PacketPoolTestPoolAlloc();
+        FAIL_IF_NULL(owners[i]);
+    }
+
+    for (int i = 0; i < PKT_POOL_MAGAZINES + 1; i++) {
+        Packet *p = PacketGetFromAlloc();
+        FAIL_IF_NULL(p);
+        p->pool = owners[i];
+        PacketPoolReturnPacket(p);
+    }
+
+    /* the evicted magazine made room for the last owner */
+    for (uint32_t i = 0; i < PKT_POOL_MAGAZINES + 1; i++) {
+        FAIL_IF_NOT(PacketPoolTestStackLen(owners[i]) == (i == evict));
+    }
+    for (uint32_t i = 0; i < PKT_POOL_MAGAZINES; i++) {
+        PktPoolMagazine *mag = &my_pool->magazines[i];
+        FAIL_IF_NOT(mag->pool == owners[i == evict ? PKT_POOL_MAGAZINES : i]);
+        FAIL_IF_NOT(mag->count == 1);
+    }
+
+    /* hand the others back and clean up */
+    for (int i = 0; i < PKT_POOL_MAGAZINES; i++) {
+        PacketPoolMagazineFlush(my_pool, &my_pool->magazines[i]);
+    }
+    for (int i = 0; i < PKT_POOL_MAGAZINES + 1; i++) {
+        FAIL_IF_NOT(PacketPoolTestStackLen(owners[i]) == 1);
+        PacketPoolTestPoolFree(owners[i]);
+    }
+    PASS;
+}
+
+typedef struct PacketPoolTestReturner_ {
+    Packet **pkts;
+    int cnt;
+    /* packet the owner will be waiting for, returned after it is */
+    Packet *late;
+    PktPool *owner;
+    int done;
+    int result;
+} PacketPoolTestReturner;
+
+static void *PacketPoolTestReturnerThread(void *arg)
+{
+    PacketPoolTestReturner *r = arg;
+
+    PacketPoolInitEmpty();
+    PktPool *my_pool = GetThreadPacketPool();
+
+    /* a full magazine goes back to the owner */
+    for (int i = 0; i < r->cnt; i++) {
+        PacketPoolReturnPacket(r->pkts[i]);
+        if ((i < r->cnt - 1) != (my_pool->magazines[0].pool != NULL))
+            goto end;
+    }
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+
+    /* once the owner waits, a single packet goes back right away */
+    while (!__atomic_load_n(&r->owner->return_stack.sync_now, __ATOMIC_SEQ_CST))
+        usleep(100);
+    PacketPoolReturnPacket(r->late);
+    if (my_pool->magazines[0].pool != NULL)
+        goto end;
+
+    r->result = 1;
+end:
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    PacketPoolDestroy();
+    return NULL;
+}
+
+/** \test another thread returns packets to our pool: a full magazine is
+ *        flushed, we take the packets back when our stack runs empty,
+ *        and a thread waiting for packets gets them without waiting for
+ *        the magazine to fill up */
+static int PacketPoolTest02(void)
+{
+    extern intmax_t max_pending_packets;
+    PktPool *my_pool = GetThreadPacketPool();
+    const int total = (int)max_pending_packets;
+
+    FAIL_IF(total <= (int)max_pending_return_packets);
+    Packet **pkts = SCCalloc(total, sizeof(Packet *));
+    FAIL_IF_NULL(pkts);
+
+    /* empty our pool */
+    int cnt = 0;
+    Packet *p;
+    while ((p = PacketPoolGetPacket()) != NULL) {
+        FAIL_IF(cnt == total);
+        pkts[cnt++] = p;
+    }
+    FAIL_IF_NOT(cnt == total);
+    FAIL_IF_NOT(PacketPoolIsEmpty(my_pool));
+
+    PacketPoolTestReturner r = {
+        .pkts = pkts,
+        .cnt = (int)max_pending_return_packets,
+        .late = pkts[max_pending_return_packets],
+        .owner = my_pool,
+    };
+    pthread_t t;
+    FAIL_IF(pthread_create(&t, NULL, PacketPoolTestReturnerThread, &r) != 0);
+
+    /* the full magazine shows up on our return stack in one go */
+    while (!__atomic_load_n(&r.done, __ATOMIC_ACQUIRE))
+        usleep(100);
+    FAIL_IF_NOT(PacketPoolTestStackLen(my_pool) == r.cnt);
+    int got = 0;
+    while ((p = PacketPoolGetPacket()) != NULL) {
+        FAIL_IF_NOT(p->pool == my_pool);
+        got++;
+    }
+    FAIL_IF_NOT(got == r.cnt);
+
+    /* we run dry and wait, the other thread returns the late packet
+     * without waiting for its magazine to fill up */
+    PacketPoolWait();
+    p = PacketPoolGetPacket();
+    FAIL_IF_NOT(p == r.late);
+    pthread_join(t, NULL);
+    FAIL_IF_NOT(r.result);
+
+    /* put everything back in our own pool */
+    for (int i = 0; i < total; i++) {
+        PacketPoolReturnPacket(pkts[i]);
+    }
+    FAIL_IF_NOT(PacketPoolHasN(total));
+
+    SCFree(pkts);
+    PASS;
+}
+#endif /* UNITTESTS */
+
+void TmqhPacketpoolRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("PacketPoolTest01", PacketPoolTest01);
+    UtRegisterTest("PacketPoolTest02", PacketPoolTest02);
+#endif
+}
@@ -28,29 +28,45 @@
 #include "threads.h"
 #include "util-atomic.h"
 
-    /* Return stack, onto which other threads free packets. */
-typedef struct PktPoolLockedStack_{
-    /* linked list of free packets. */
+/** number of owner pools a thread keeps a magazine for */
+#define PKT_POOL_MAGAZINES 8
+
+/* Return stack, onto which other threads free packets. */
+typedef struct PktPoolReturnStack_ {
+    /* linked list of free packets. Pushed to by other threads with a CAS,
+     * taken as a whole by the owner with an atomic exchange. */
+    Packet *head;
+    /* set by the owner when it waits for packets on 'cond' */
+    int sync_now;
     SCMutex mutex;
     SCCondT cond;
-    SC_ATOMIC_DECLARE(int, sync_now);
+} __attribute__((aligned(CLS))) PktPoolReturnStack;
+
+/* Packets freed by a thread that belong to another thread's pool. They
+ * are collected per owner and returned in one go when the magazine is
+ * full, or when the owner runs out of packets. */
+typedef struct PktPoolMagazine_ {
+    struct PktPool_ *pool;  /**< owner of the packets, NULL if unused */
     Packet *head;
-} __attribute__((aligned(CLS))) PktPoolLockedStack;
+    Packet *tail;
+    uint32_t count;
+} PktPoolMagazine;
 
 typedef struct PktPool_ {
     /* link listed of free packets local to this thread.
      * No mutex is needed.
      */
     Packet *head;
-    /* Packets waiting (pending) to be returned to the given Packet
-     * Pool. Accumulate packets for the same pool until a theshold is
-     * reached, then return them all at once.  Keep the head and tail
-     * to fast insertion of the entire list onto a return stack.
-     */
-    struct PktPool_ *pending_pool;
-    Packet *pending_head;
-    Packet *pending_tail;
-    uint32_t pending_count;
+    /* Packets waiting (pending) to be returned to other Packet Pools,
+     * one magazine per pool. */
+    PktPoolMagazine magazines[PKT_POOL_MAGAZINES];
+    /* next magazine to flush if they are all in use */
+    uint32_t magazine_evict;
+
+    /* counters of the thread owning the pool, NULL if it has none */
+    ThreadVars *tv;
+    uint16_t counter_cross_returns;
+    uint16_t counter_magazine_flushes;
 
 #ifdef DEBUG_VALIDATION
     int initialized;
@@ -64,7 +80,7 @@ typedef struct PktPool_ {
     /* Return stack, where other threads put packets that they free that belong
      * to this thread.
      */
-    PktPoolLockedStack return_stack;
+    PktPoolReturnStack return_stack;
 } PktPool;
 
 Packet *TmqhInputPacketpool(ThreadVars *);
@@ -74,10 +90,13 @@ void TmqhPacketpoolRegister(void);
 Packet *PacketPoolGetPacket(void);
 void PacketPoolWait(void);
 void PacketPoolWaitForN(int n);
+int PacketPoolHasN(int n);
 void PacketPoolReturnPacket(Packet *p);
 void PacketPoolInit(void);
 void PacketPoolInitEmpty(void);
+void PacketPoolRegisterCounters(ThreadVars *tv);
 void PacketPoolDestroy(void);
 void PacketPoolPostRunmodes(void);
+void TmqhPacketpoolRegisterTests(void);
 
 #endif /* __TMQH_PACKETPOOL_H__ */
@@ -0,0 +1,555 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Lock free ring queue handler
+ *
+ * Packets are passed between threads through a bounded ring per queue
+ * instead of the mutex protected trans_q list. Writers (the capture
+ * threads in autofp) claim slots with a CAS, the single reader takes
+ * packets out in batches. When the ring is empty the reader spins for a
+ * while, adapting the spin budget to how often spinning pays off, before
+ * it sleeps on the trans_q cond of the queue.
+ *
+ * Enabled by setting "autofp-queue: ring" in the yaml. In that case the
+ * "flow" handler uses the rings too, so TmqhOutputFlowHash() hands the
+ * packets to the workers without taking a lock.
+ */
+
+#include "suricata.h"
+#include "packet-queue.h"
+#include "decode.h"
+#include "threads.h"
+#include "threadvars.h"
+#include "tm-threads.h"
+
+#include "tm-queuehandlers.h"
+#include "tmqh-ring.h"
+
+#include "conf.h"
+#include "util-optimize.h"
+#include "util-unittest.h"
+
+/** spin budget limits of the reader, in ring polls */
+#define TMQH_RING_SPIN_MIN      16
+#define TMQH_RING_SPIN_MAX      2048
+
+/** writer polls of a full ring before it backs off with a sleep */
+#define TMQH_RING_FULL_SPIN     64
+
+static int ring_enabled = 0;
+static uint32_t ring_size = TMQH_RING_SIZE;
+
+/** rings by queue id, created on first use */
+static PacketRing *rings[256];
+static SCMutex rings_lock = SCMUTEX_INITIALIZER;
+
+void TmqhOutputRing(ThreadVars *tv, Packet *p);
+void *TmqhOutputRingSetupCtx(const char *queue_str);
+void TmqhOutputRingFreeCtx(void *ctx);
+
+static inline void TmqhRingPause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    cc_barrier();
+#endif
+}
+
+void TmqhRingRegister(void)
+{
+    tmqh_table[TMQH_RING].name = "ring";
+    tmqh_table[TMQH_RING].InHandler = TmqhInputRing;
+    tmqh_table[TMQH_RING].InShutdownHandler = TmqhInputRingShutdownHandler;
+    tmqh_table[TMQH_RING].OutHandler = TmqhOutputRing;
+    tmqh_table[TMQH_RING].OutHandlerCtxSetup = TmqhOutputRingSetupCtx;
+    tmqh_table[TMQH_RING].OutHandlerCtxFree = TmqhOutputRingFreeCtx;
+    tmqh_table[TMQH_RING].RegisterTests = TmqhRingRegisterTests;
+
+    const char *queue = NULL;
+    if (ConfGet("autofp-queue", &queue) == 1) {
+        if (strcasecmp(queue, "ring") == 0) {
+            ring_enabled = 1;
+        } else if (strcasecmp(queue, "simple") != 0) {
+            SCLogError(SC_ERR_INVALID_YAML_CONF_ENTRY, "Invalid entry \"%s\" "
+                       "for autofp-queue in conf.  Killing engine.", queue);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    intmax_t size = 0;
+    if (ConfGetInt("autofp-ring-size", &size) == 1) {
+        if (size < TMQH_RING_BATCH || size > (1 << 20)) {
+            SCLogError(SC_ERR_INVALID_YAML_CONF_ENTRY, "Invalid entry %"PRIdMAX
+                       " for autofp-ring-size in conf, should be between "
+                       "%d and %d.  Killing engine.", size, TMQH_RING_BATCH,
+                       1 << 20);
+            exit(EXIT_FAILURE);
+        }
+        /* round up to a power of 2 so we can mask the positions */
+        ring_size = 1;
+        while (ring_size < (uint32_t)size)
+            ring_size <<= 1;
+    }
+
+    if (ring_enabled) {
+        SCLogConfig("AutoFP mode using lock free rings of %u packets",
+                ring_size);
+    }
+}
+
+int TmqhRingEnabled(void)
+{
+    return ring_enabled;
+}
+
+static PacketRing *PacketRingAlloc(uint32_t size, PacketQueue *q)
+{
+    PacketRing *r = SCMallocAligned(sizeof(PacketRing), CLS);
+    if (unlikely(r == NULL))
+        return NULL;
+    memset(r, 0, sizeof(PacketRing));
+
+    r->slots = SCMallocAligned(size * sizeof(PacketRingSlot), CLS);
+    if (unlikely(r->slots == NULL)) {
+        SCFreeAligned(r);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        r->slots[i].seq = i;
+        r->slots[i].p = NULL;
+    }
+    r->size = size;
+    r->mask = size - 1;
+    r->q = q;
+    r->spin = TMQH_RING_SPIN_MIN;
+    return r;
+}
+
+static void PacketRingFree(PacketRing *r)
+{
+    SCFreeAligned(r->slots);
+    SCFreeAligned(r);
+}
+
+/**
+ *  \brief get the ring of a queue, creating it if needed
+ *
+ *  \retval r ring or NULL if out of memory
+ */
+PacketRing *TmqhRingGet(uint16_t id)
+{
+    PacketRing *r = __atomic_load_n(&rings[id], __ATOMIC_ACQUIRE);
+    if (likely(r != NULL))
+        return r;
+
+    SCMutexLock(&rings_lock);
+    r = rings[id];
+    if (r == NULL) {
+        r = PacketRingAlloc(ring_size, &trans_q[id]);
+        if (r != NULL)
+            __atomic_store_n(&rings[id], r, __ATOMIC_RELEASE);
+    }
+    SCMutexUnlock(&rings_lock);
+    return r;
+}
+
+/** \brief free all rings. Only to be called when all threads are gone. */
+void TmqhRingCleanup(void)
+{
+    SCMutexLock(&rings_lock);
+    for (int i = 0; i < 256; i++) {
+        if (rings[i] != NULL) {
+            PacketRingFree(rings[i]);
+            rings[i] = NULL;
+        }
+    }
+    SCMutexUnlock(&rings_lock);
+}
+
+/**
+ *  \brief check if the ring of a queue has packets the reader didn't
+ *         take yet. Used to drain the queues at shutdown.
+ *
+ *  \retval 1 empty or no ring
+ *  \retval 0 not empty
+ */
+int TmqhRingIsEmpty(uint16_t id)
+{
+    PacketRing *r = __atomic_load_n(&rings[id], __ATOMIC_ACQUIRE);
+    if (r == NULL)
+        return 1;
+
+    return (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&r->done, __ATOMIC_ACQUIRE));
+}
+
+/**
+ *  \retval 1 packet added
+ *  \retval 0 ring full
+ */
+static int PacketRingTryEnqueue(PacketRing *r, Packet *p)
+{
+    uint32_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        PacketRingSlot *s = &r->slots[pos & r->mask];
+        const uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        const int32_t diff = (int32_t)(seq - pos);
+
+        if (diff == 0) {
+            /* on failure pos is updated to the current head */
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                s->p = p;
+                /* seq_cst so that this store and the load of 'sleeping'
+                 * in TmqhRingEnqueue() can't be reordered. */
+                __atomic_store_n(&s->seq, pos + 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+        } else if (diff < 0) {
+            /* slot not consumed yet: full */
+            return 0;
+        } else {
+            /* another writer took this position */
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ *  \brief add a packet to the ring, waking up the reader if it sleeps
+ *
+ *  Blocks while the ring is full: dropping or sending the packet around
+ *  the ring would reorder the packets of the flow.
+ */
+void TmqhRingEnqueue(PacketRing *r, Packet *p)
+{
+    uint32_t spins = 0;
+
+    while (PacketRingTryEnqueue(r, p) == 0) {
+        if (++spins < TMQH_RING_FULL_SPIN) {
+            TmqhRingPause();
+        } else {
+            SleepUsec(1);
+            spins = 0;
+        }
+    }
+
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST)) {
+        SCMutexLock(&r->q->mutex_q);
+        SCCondSignal(&r->q->cond_q);
+        SCMutexUnlock(&r->q->mutex_q);
+    }
+}
+
+/**
+ *  \brief take up to TMQH_RING_BATCH packets out of the ring into the
+ *         batch of the reader
+ *
+ *  \retval cnt number of packets in the batch
+ */
+static uint16_t PacketRingDequeueBatch(PacketRing *r)
+{
+    uint32_t pos = r->tail;
+    uint16_t cnt = 0;
+
+    while (cnt < TMQH_RING_BATCH) {
+        PacketRingSlot *s = &r->slots[pos & r->mask];
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+
+        r->batch[cnt++] = s->p;
+        /* hand the slot back to the writers for the next round */
+        __atomic_store_n(&s->seq, pos + r->size, __ATOMIC_RELEASE);
+        pos++;
+    }
+
+    r->tail = pos;
+    r->batch_idx = 0;
+    r->batch_cnt = cnt;
+    return cnt;
+}
+
+/** \brief get the next packet for the reader, or NULL if none */
+static inline Packet *PacketRingNext(PacketRing *r)
+{
+    if (r->batch_idx == r->batch_cnt && PacketRingDequeueBatch(r) == 0)
+        return NULL;
+
+    Packet *p = r->batch[r->batch_idx++];
+    __atomic_store_n(&r->done, r->done + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/** \brief get a packet from the trans_q list. Only pseudo packets
+ *         injected by the flow manager and detect reloads end up here. */
+static inline Packet *TmqhRingInputQueue(PacketQueue *q)
+{
+    Packet *p = NULL;
+
+    /* unlocked peek, the list is almost always empty */
+    if (q->len > 0) {
+        SCMutexLock(&q->mutex_q);
+        if (q->len > 0)
+            p = PacketDequeue(q);
+        SCMutexUnlock(&q->mutex_q);
+    }
+    return p;
+}
+
+/**
+ *  \brief wait for packets after spinning didn't get us any
+ *
+ *  The reader flags itself as sleeping and then checks the ring again.
+ *  Writers check the flag after adding their packet, so either we see the
+ *  packet here or the writer sees the flag and signals us. The writer
+ *  takes the mutex to signal, so the signal can't get lost between the
+ *  check and the SCCondWait().
+ */
+static void TmqhRingWait(PacketRing *r)
+{
+    PacketQueue *q = r->q;
+
+    __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    SCMutexLock(&q->mutex_q);
+    const uint32_t pos = r->tail;
+    if (__atomic_load_n(&r->slots[pos & r->mask].seq, __ATOMIC_SEQ_CST) != pos + 1 &&
+            q->len == 0) {
+        SCCondWait(&q->cond_q, &q->mutex_q);
+    }
+    SCMutexUnlock(&q->mutex_q);
+
+    __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+Packet *TmqhInputRing(ThreadVars *tv)
+{
+    PacketQueue *q = &trans_q[tv->inq->id];
+    PacketRing *r = TmqhRingGet(tv->inq->id);
+
+    StatsSyncCountersIfSignalled(tv);
+
+    if (unlikely(r == NULL)) {
+        SCMutexLock(&q->mutex_q);
+        if (q->len == 0)
+            SCCondWait(&q->cond_q, &q->mutex_q);
+        Packet *p = q->len > 0 ? PacketDequeue(q) : NULL;
+        SCMutexUnlock(&q->mutex_q);
+        return p;
+    }
+
+    Packet *p = PacketRingNext(r);
+    if (p != NULL)
+        return p;
+    p = TmqhRingInputQueue(q);
+    if (p != NULL)
+        return p;
+
+    /* spin for a while: sleeping and being woken up costs a lot more
+     * than a few polls if packets are about to come in */
+    for (uint32_t i = 0; i < r->spin; i++) {
+        TmqhRingPause();
+
+        p = PacketRingNext(r);
+        if (p == NULL)
+            p = TmqhRingInputQueue(q);
+        if (p != NULL) {
+            if (r->spin < TMQH_RING_SPIN_MAX)
+                r->spin <<= 1;
+            return p;
+        }
+    }
+
+    /* spinning didn't pay off, spin less next time */
+    if (r->spin > TMQH_RING_SPIN_MIN)
+        r->spin >>= 1;
+
+    TmqhRingWait(r);
+
+    /* return NULL if we have no pkt. Should only happen on signals. */
+    p = PacketRingNext(r);
+    if (p == NULL)
+        p = TmqhRingInputQueue(q);
+    return p;
+}
+
+void TmqhInputRingShutdownHandler(ThreadVars *tv)
+{
+    if (tv == NULL || tv->inq == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < (tv->inq->reader_cnt + tv->inq->writer_cnt); i++)
+        SCCondSignal(&trans_q[tv->inq->id].cond_q);
+}
+
+/**
+ *  \brief setup the ring of the output queue
+ *
+ *  \retval ctx the ring
+ */
+void *TmqhOutputRingSetupCtx(const char *queue_str)
+{
+    if (queue_str == NULL || strlen(queue_str) == 0)
+        return NULL;
+
+    Tmq *tmq = TmqGetQueueByName(queue_str);
+    if (tmq == NULL) {
+        tmq = TmqCreateQueue(queue_str);
+        if (tmq == NULL)
+            return NULL;
+    }
+    tmq->writer_cnt++;
+
+    return TmqhRingGet(tmq->id);
+}
+
+void TmqhOutputRingFreeCtx(void *ctx)
+{
+    /* rings are shared by the writers, TmqhRingCleanup() frees them */
+}
+
+void TmqhOutputRing(ThreadVars *tv, Packet *p)
+{
+    TmqhRingEnqueue((PacketRing *)tv->outctx, p);
+}
+
+#ifdef UNITTESTS
+
+/** \test fill the ring, check it refuses more, then drain it and wrap */
+static int TmqhRingTest01(void)
+{
+    PacketQueue q;
+    memset(&q, 0, sizeof(q));
+    PacketRing *r = PacketRingAlloc(64, &q);
+    FAIL_IF_NULL(r);
+
+    /* the ring never dereferences the packets */
+    for (uintptr_t i = 1; i <= 64; i++) {
+        FAIL_IF_NOT(PacketRingTryEnqueue(r, (Packet *)i) == 1);
+    }
+    FAIL_IF_NOT(PacketRingTryEnqueue(r, (Packet *)65) == 0);
+    FAIL_IF(r->head != 64);
+
+    for (uintptr_t i = 1; i <= 64; i++) {
+        Packet *p = PacketRingNext(r);
+        FAIL_IF_NOT(p == (Packet *)i);
+    }
+    FAIL_IF_NOT(PacketRingNext(r) == NULL);
+    FAIL_IF_NOT(r->done == r->head);
+
+    /* second round through the same slots */
+    for (uintptr_t i = 1; i <= 40; i++) {
+        FAIL_IF_NOT(PacketRingTryEnqueue(r, (Packet *)(i + 100)) == 1);
+    }
+    FAIL_IF_NOT(PacketRingDequeueBatch(r) == TMQH_RING_BATCH);
+    for (uintptr_t i = 1; i <= 40; i++) {
+        Packet *p = PacketRingNext(r);
+        FAIL_IF_NOT(p == (Packet *)(i + 100));
+    }
+    FAIL_IF_NOT(PacketRingNext(r) == NULL);
+
+    PacketRingFree(r);
+    PASS;
+}
+
+#define TMQH_RING_TEST_WRITERS  4
+#define TMQH_RING_TEST_PKTS     100000
+
+typedef struct TmqhRingTestWriter_ {
+    PacketRing *r;
+    uintptr_t id;
+} TmqhRingTestWriter;
+
+static void *TmqhRingTestWriterThread(void *arg)
+{
+    TmqhRingTestWriter *w = arg;
+
+    for (uintptr_t i = 1; i <= TMQH_RING_TEST_PKTS; i++) {
+        TmqhRingEnqueue(w->r, (Packet *)((w->id << 24) | i));
+    }
+    return NULL;
+}
+
+/** \test multiple writers and a reader, every packet must come out once
+ *        and in order per writer */
+static int TmqhRingTest02(void)
+{
+    PacketQueue q;
+    memset(&q, 0, sizeof(q));
+    SCMutexInit(&q.mutex_q, NULL);
+    SCCondInit(&q.cond_q, NULL);
+
+    PacketRing *r = PacketRingAlloc(256, &q);
+    FAIL_IF_NULL(r);
+
+    TmqhRingTestWriter w[TMQH_RING_TEST_WRITERS];
+    pthread_t t[TMQH_RING_TEST_WRITERS];
+    uintptr_t last[TMQH_RING_TEST_WRITERS];
+
+    for (int i = 0; i < TMQH_RING_TEST_WRITERS; i++) {
+        w[i].r = r;
+        w[i].id = i;
+        last[i] = 0;
+        FAIL_IF(pthread_create(&t[i], NULL, TmqhRingTestWriterThread, &w[i]) != 0);
+    }
+
+    uint32_t cnt = 0;
+    int result = 1;
+    while (cnt < TMQH_RING_TEST_WRITERS * TMQH_RING_TEST_PKTS) {
+        Packet *p = PacketRingNext(r);
+        if (p == NULL) {
+            TmqhRingPause();
+            continue;
+        }
+        const uintptr_t v = (uintptr_t)p;
+        const uintptr_t id = v >> 24;
+        const uintptr_t seq = v & 0xffffff;
+        if (id >= TMQH_RING_TEST_WRITERS || seq != last[id] + 1)
+            result = 0;
+        else
+            last[id] = seq;
+        cnt++;
+    }
+
+    for (int i = 0; i < TMQH_RING_TEST_WRITERS; i++) {
+        pthread_join(t[i], NULL);
+    }
+    FAIL_IF_NOT(result);
+    FAIL_IF_NOT(PacketRingNext(r) == NULL);
+    FAIL_IF_NOT(r->head == r->done);
+
+    PacketRingFree(r);
+    SCMutexDestroy(&q.mutex_q);
+    SCCondDestroy(&q.cond_q);
+    PASS;
+}
+
+#endif /* UNITTESTS */
+
+void TmqhRingRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("TmqhRingTest01", TmqhRingTest01);
+    UtRegisterTest("TmqhRingTest02", TmqhRingTest02);
+#endif
+}
@@ -0,0 +1,76 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ */
+
+#ifndef __TMQH_RING_H__
+#define __TMQH_RING_H__
+
+/** default number of slots per ring */
+#define TMQH_RING_SIZE          4096
+/** max number of packets the reader takes from the ring at once */
+#define TMQH_RING_BATCH         32
+
+typedef struct PacketRingSlot_ {
+    uint32_t seq;   /**< slot sequence: pos + 1 when filled, pos + size
+                     *   when free for position pos */
+    Packet *p;
+} PacketRingSlot;
+
+/** \brief bounded multi writer, single reader ring of packets
+ *
+ *  Writers claim a position by CAS'ing head, the reader owns tail. The
+ *  per slot sequence number tells both sides if a slot is filled or free,
+ *  so there is no shared lock. The reader sleeps on the cond of the
+ *  trans_q entry with the same id, so the existing wake ups (shutdown,
+ *  stats sync, pseudo packet injection) work for rings too. */
+typedef struct PacketRing_ {
+    /* read mostly */
+    uint32_t size;
+    uint32_t mask;
+    uint32_t sleeping;      /**< reader is (about to be) waiting on cond */
+    PacketQueue *q;         /**< trans_q used for sleeping and injection */
+    PacketRingSlot *slots;
+
+    /* writers */
+    uint32_t head __attribute__((aligned(CLS)));
+
+    /* reader */
+    uint32_t tail __attribute__((aligned(CLS)));
+    uint32_t done;          /**< packets handed out to the reader thread */
+    uint32_t spin;          /**< adaptive spin budget before sleeping */
+    uint16_t batch_idx;
+    uint16_t batch_cnt;
+    Packet *batch[TMQH_RING_BATCH];
+} PacketRing;
+
+void TmqhRingRegister(void);
+void TmqhRingCleanup(void);
+int TmqhRingEnabled(void);
+
+PacketRing *TmqhRingGet(uint16_t id);
+void TmqhRingEnqueue(PacketRing *r, Packet *p);
+int TmqhRingIsEmpty(uint16_t id);
+
+Packet *TmqhInputRing(ThreadVars *tv);
+void TmqhInputRingShutdownHandler(ThreadVars *tv);
+
+void TmqhRingRegisterTests(void);
+
+#endif /* __TMQH_RING_H__ */
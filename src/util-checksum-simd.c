@@ -0,0 +1,240 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Vectorized one's complement sum for the TCP and UDP checksums.
+ *
+ * The 16 bit words are widened to 32 bit lanes and added up, 8 (SSE2)
+ * or 16 (AVX2) words at a time. The one's complement sum doesn't depend
+ * on the order of the additions or on the byte order, so the lanes can
+ * be added up and folded at the end. With a length of at most 65535 a
+ * lane can't overflow.
+ */
+
+#include "suricata-common.h"
+#include "decode.h"
+#include "util-checksum-simd.h"
+#include "util-cpu.h"
+#include "util-unittest.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define CHECKSUM_HAVE_SSE2 1
+#endif
+
+#if defined(__x86_64__) && (defined(__clang__) || \
+        (defined(__GNUC__) && __GNUC__ >= 5))
+#include <immintrin.h>
+#define CHECKSUM_HAVE_AVX2 1
+#endif
+
+typedef uint32_t (*ChecksumSumFunc)(const uint16_t *, uint16_t);
+
+static uint32_t ChecksumSumScalar(const uint16_t *pkt, uint16_t len);
+
+/** set by ChecksumSetup() before the packet threads start */
+static ChecksumSumFunc checksum_sum = ChecksumSumScalar;
+
+/** \internal
+ *  \brief fold a sum to 16 bits */
+static inline uint32_t ChecksumFold(uint64_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint32_t)sum;
+}
+
+static uint32_t ChecksumSumScalar(const uint16_t *pkt, uint16_t len)
+{
+    return ChecksumFold(ChecksumSumWordsScalar(pkt, len));
+}
+
+#ifdef CHECKSUM_HAVE_SSE2
+static uint32_t ChecksumSumSSE2(const uint16_t *pkt, uint16_t len)
+{
+    const uint8_t *buf = (const uint8_t *)pkt;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+
+    while (len >= 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)buf);
+        acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+        acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+        buf += 16;
+        len -= 16;
+    }
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+
+    uint64_t sum = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    sum += ChecksumSumWordsScalar((const uint16_t *)buf, len);
+    return ChecksumFold(sum);
+}
+#endif
+
+#ifdef CHECKSUM_HAVE_AVX2
+__attribute__((target("avx2")))
+static uint32_t ChecksumSumAVX2(const uint16_t *pkt, uint16_t len)
+{
+    const uint8_t *buf = (const uint8_t *)pkt;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+
+    while (len >= 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)buf);
+        acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+        acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+        buf += 32;
+        len -= 32;
+    }
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+
+    uint64_t sum = 0;
+    for (int i = 0; i < 8; i++)
+        sum += lanes[i];
+    sum += ChecksumSumWordsScalar((const uint16_t *)buf, len);
+    return ChecksumFold(sum);
+}
+#endif
+
+/**
+ * \brief Sum the 16 bit words of a buffer using the implementation
+ *        for the CPU we run on
+ *
+ * \retval sum folded to 16 bits, not inverted
+ */
+uint32_t ChecksumSumWordsBulk(const uint16_t *pkt, uint16_t len)
+{
+    return checksum_sum(pkt, len);
+}
+
+/**
+ *  \brief select the checksum implementation for the CPU we run on
+ */
+void ChecksumSetup(void)
+{
+    const char *name = "scalar";
+    checksum_sum = ChecksumSumScalar;
+#ifdef CHECKSUM_HAVE_SSE2
+    name = "sse2";
+    checksum_sum = ChecksumSumSSE2;
+#endif
+#ifdef CHECKSUM_HAVE_AVX2
+    if (UtilCpuHasAVX2()) {
+        name = "avx2";
+        checksum_sum = ChecksumSumAVX2;
+    }
+#endif
+    SCLogDebug("using %s checksum implementation", name);
+}
+
+#ifdef UNITTESTS
+static int ChecksumCompare(ChecksumSumFunc func, const uint8_t *buf)
+{
+    const uint16_t lens[] = { 0, 1, 2, 15, 16, 17, 31, 32, 33, 63, 64,
+        127, 128, 129, 1460, 1461, 9000, 65535 };
+
+    /* the words are 2 byte aligned, but not to the vector size */
+    for (int off = 0; off < 16; off += 2) {
+        for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+            const uint16_t *pkt = (const uint16_t *)(buf + off);
+            if (ChecksumSumScalar(pkt, lens[l]) != func(pkt, lens[l]))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/** \test vector implementations agree with the scalar one, for
+ *        unaligned buffers and odd lengths, and don't overflow on
+ *        the largest buffer of all ones */
+static int ChecksumSimdTest01(void)
+{
+    const size_t size = 65535 + 16;
+    uint8_t *buf = SCMalloc(size);
+    FAIL_IF_NULL(buf);
+
+    uint32_t rnd = 1;
+    for (size_t i = 0; i < size; i++) {
+        rnd = rnd * 1103515245 + 12345;
+        buf[i] = (uint8_t)(rnd >> 16);
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+#ifdef CHECKSUM_HAVE_SSE2
+        FAIL_IF_NOT(ChecksumCompare(ChecksumSumSSE2, buf));
+#endif
+#ifdef CHECKSUM_HAVE_AVX2
+        if (UtilCpuHasAVX2()) {
+            FAIL_IF_NOT(ChecksumCompare(ChecksumSumAVX2, buf));
+        }
+#endif
+        FAIL_IF_NOT(ChecksumCompare(ChecksumSumWordsBulk, buf));
+        memset(buf, 0xff, size);
+    }
+
+    SCFree(buf);
+    PASS;
+}
+
+/** \test TCP and UDP checksums of segments around the bulk size
+ *        validate, a flipped bit in the payload is detected */
+static int ChecksumSimdTest02(void)
+{
+    uint8_t ipshdr[8] = { 0xc0, 0xa8, 0x01, 0x01, 0xc0, 0xa8, 0x01, 0x02 };
+    uint8_t seg[1500 + 2];
+    uint16_t *pkt = (uint16_t *)(seg + 2);
+    uint32_t rnd = 7;
+
+    ChecksumSetup();
+
+    for (uint16_t len = 20; len <= 1500; len += 37) {
+        for (uint16_t i = 0; i < sizeof(seg); i++) {
+            rnd = rnd * 1103515245 + 12345;
+            seg[i] = (uint8_t)(rnd >> 16);
+        }
+
+        /* TCP, checksum at offset 16 */
+        pkt[8] = 0;
+        pkt[8] = TCPChecksum((uint16_t *)ipshdr, pkt, len, 0);
+        FAIL_IF(TCPChecksum((uint16_t *)ipshdr, pkt, len, pkt[8]) != 0);
+        seg[2 + len - 1] ^= 0x10;
+        FAIL_IF(TCPChecksum((uint16_t *)ipshdr, pkt, len, pkt[8]) == 0);
+
+        /* UDP, checksum at offset 6 */
+        pkt[3] = 0;
+        pkt[3] = UDPV4Checksum((uint16_t *)ipshdr, pkt, len, 0);
+        FAIL_IF(UDPV4Checksum((uint16_t *)ipshdr, pkt, len, pkt[3]) != 0);
+        seg[2 + len - 1] ^= 0x10;
+        FAIL_IF(UDPV4Checksum((uint16_t *)ipshdr, pkt, len, pkt[3]) == 0);
+    }
+    PASS;
+}
+#endif /* UNITTESTS */
+
+void ChecksumSimdRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("ChecksumSimdTest01", ChecksumSimdTest01);
+    UtRegisterTest("ChecksumSimdTest02", ChecksumSimdTest02);
+#endif /* UNITTESTS */
+}
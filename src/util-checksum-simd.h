@@ -0,0 +1,97 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * One's complement sum of the 16 bit words of a buffer, the part of the
+ * internet checksum that scales with the packet size.
+ *
+ * Short buffers are summed inline, longer ones by a SSE2 or AVX2
+ * implementation selected at runtime by ChecksumSetup().
+ */
+
+#ifndef __UTIL_CHECKSUM_SIMD_H__
+#define __UTIL_CHECKSUM_SIMD_H__
+
+/** buffers of at least this size are summed by ChecksumSumWordsBulk() */
+#define CHECKSUM_BULK_MIN_LEN 128
+
+uint32_t ChecksumSumWordsBulk(const uint16_t *pkt, uint16_t len);
+
+/**
+ * \brief Sum the 16 bit words of a buffer in the scalar way
+ *
+ * A trailing odd byte is padded with a zero byte. As len is at most
+ * 65535 the sum fits in 32 bits.
+ */
+static inline uint32_t ChecksumSumWordsScalar(const uint16_t *pkt, uint16_t len)
+{
+    uint16_t pad = 0;
+    uint32_t csum = 0;
+
+    while (len >= 32) {
+        csum += pkt[0] + pkt[1] + pkt[2] + pkt[3] + pkt[4] + pkt[5] + pkt[6] +
+            pkt[7] + pkt[8] + pkt[9] + pkt[10] + pkt[11] + pkt[12] + pkt[13] +
+            pkt[14] + pkt[15];
+        len -= 32;
+        pkt += 16;
+    }
+
+    while (len >= 8) {
+        csum += pkt[0] + pkt[1] + pkt[2] + pkt[3];
+        len -= 8;
+        pkt += 4;
+    }
+
+    while (len >= 4) {
+        csum += pkt[0] + pkt[1];
+        len -= 4;
+        pkt += 2;
+    }
+
+    while (len > 1) {
+        csum += pkt[0];
+        pkt += 1;
+        len -= 2;
+    }
+
+    if (len == 1) {
+        *(uint8_t *)(&pad) = (*(const uint8_t *)pkt);
+        csum += pad;
+    }
+
+    return csum;
+}
+
+/**
+ * \brief Sum the 16 bit words of a buffer
+ *
+ * \retval sum not yet folded to 16 bits and not inverted, so it can be
+ *         added to the sum of the pseudo header
+ */
+static inline uint32_t ChecksumSumWords(const uint16_t *pkt, uint16_t len)
+{
+    if (len >= CHECKSUM_BULK_MIN_LEN)
+        return ChecksumSumWordsBulk(pkt, len);
+    return ChecksumSumWordsScalar(pkt, len);
+}
+
+void ChecksumSetup(void);
+void ChecksumSimdRegisterTests(void);
+
+#endif /* __UTIL_CHECKSUM_SIMD_H__ */
@@ -172,6 +172,28 @@ void UtilCpuPrintSummary(void)
     if (cpus_online == 0 && cpus_conf == 0)
         SCLogInfo("Couldn't retireve any information of CPU's, please, send your operating "
                   "system info and check util-cpu.{c,h}");
+    SCLogDebug("CPU features: AVX2 %s", UtilCpuHasAVX2() ? "yes" : "no");
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UTIL_CPU_HAVE_BUILTIN_CPU_SUPPORTS 1
+#endif
+
+/**
+ * \brief Check if the CPU we run on supports AVX2
+ *
+ * Unlike the __AVX2__ define this is about the CPU at runtime, not the
+ * build target, so it can be used to dispatch to code compiled for a
+ * specific target.
+ */
+int UtilCpuHasAVX2(void)
+{
+#ifdef UTIL_CPU_HAVE_BUILTIN_CPU_SUPPORTS
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? 1 : 0;
+#else
+    return 0;
+#endif
 }
 
 /**
@@ -36,4 +36,7 @@ void UtilCpuPrintSummary(void);
 
 uint64_t UtilCpuGetTicks(void);
 
+/* Instruction set extensions, to select vectorized code at runtime: */
+int UtilCpuHasAVX2(void);
+
 #endif /* __UTIL_CPU_H__ */
@@ -360,6 +360,9 @@ const char * SCErrorToString(SCError err)
         CASE_CODE (SC_WARN_RUST_NOT_AVAILABLE);
         CASE_CODE (SC_WARN_DEFAULT_WILL_CHANGE);
         CASE_CODE (SC_WARN_EVE_MISSING_EVENTS);
+        CASE_CODE (SC_ERR_NO_AF_XDP);
+        CASE_CODE (SC_ERR_AF_XDP_CREATE);
+        CASE_CODE (SC_ERR_AF_XDP_READ);
 
         CASE_CODE (SC_ERR_MAX);
     }
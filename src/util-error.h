@@ -350,6 +350,9 @@ typedef enum {
     SC_WARN_DEFAULT_WILL_CHANGE,
     SC_WARN_EVE_MISSING_EVENTS,
     SC_ERR_PLEDGE_FAILED,
+    SC_ERR_NO_AF_XDP,
+    SC_ERR_AF_XDP_CREATE,
+    SC_ERR_AF_XDP_READ,
 
     SC_ERR_MAX,
 } SCError;
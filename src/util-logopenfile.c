@@ -25,6 +25,7 @@
  */
 
 #include "suricata-common.h" /* errno.h, string.h, etc. */
+#include "suricata.h"        /* suricata_ctl_flags */
 #include "tm-modules.h"      /* LogFileCtx */
 #include "conf.h"            /* ConfNode, etc. */
 #include "output.h"          /* DEFAULT_LOG_* */
@@ -177,6 +178,162 @@ tryagain:
 }
 #endif /* BUILD_WITH_UNIXSOCKET */
 
+/* Ordered output
+ *
+ * Threads reading a sequence of inputs in parallel, like the pcap file
+ * readers, can have their output written in the order of the inputs. While
+ * reading input 'seq' the writes of a thread are held back, and at the end
+ * of the input they are written once all inputs before it are done. When
+ * a thread holds too much output it waits for its turn early, and from
+ * then on writes directly until the end of the input.
+ *
+ * Writes are held back in LogFileWrite(), for every output type, and in
+ * the Write callback of files and sockets for the loggers that call it
+ * directly. */
+
+/** held back output of a thread, above this it waits for its turn */
+#define LOG_FILE_ORDER_HOLD_MAX (32 * 1024 * 1024)
+
+typedef struct LogFileOrderRecord_ {
+    LogFileCtx *ctx;
+    int len;
+    struct LogFileOrderRecord_ *next;
+    char data[];
+} LogFileOrderRecord;
+
+typedef struct LogFileOrderThread_ {
+    bool active;
+    /** all inputs before seq are written */
+    bool have_turn;
+    uint64_t seq;
+    uint64_t size;
+    LogFileOrderRecord *head;
+    LogFileOrderRecord *tail;
+} LogFileOrderThread;
+
+static SCCtrlMutex log_order_m;
+static SCCtrlCondT log_order_cond;
+/** the input that is written next */
+static uint64_t log_order_next = 0;
+/** set when an input will never be done, don't wait anymore */
+static bool log_order_stop = false;
+
+#ifdef TLS
+static __thread LogFileOrderThread log_order_thread;
+#endif
+
+static void LogFileWriteDirect(LogFileCtx *file_ctx, const char *buffer, int buffer_len);
+
+void LogFileOrderInit(void)
+{
+    SCCtrlMutexInit(&log_order_m, NULL);
+    SCCtrlCondInit(&log_order_cond, NULL);
+    log_order_next = 0;
+    log_order_stop = false;
+}
+
+#ifdef TLS
+static void LogFileOrderWaitTurn(LogFileOrderThread *ot)
+{
+    SCCtrlMutexLock(&log_order_m);
+    while (log_order_next != ot->seq && !log_order_stop &&
+            !(suricata_ctl_flags & SURICATA_STOP)) {
+        struct timespec cond_time;
+        cond_time.tv_sec = time(NULL) + 1;
+        cond_time.tv_nsec = 0;
+        SCCtrlCondTimedwait(&log_order_cond, &log_order_m, &cond_time);
+    }
+    SCCtrlMutexUnlock(&log_order_m);
+    ot->have_turn = true;
+
+    /* write what was held back, the writes now go through directly */
+    LogFileOrderRecord *rec = ot->head;
+    while (rec != NULL) {
+        LogFileOrderRecord *next = rec->next;
+        LogFileWriteDirect(rec->ctx, rec->data, rec->len);
+        SCFree(rec);
+        rec = next;
+    }
+    ot->head = ot->tail = NULL;
+    ot->size = 0;
+}
+
+/** \internal
+ *  \retval 1 the write was held back, 0 write it now */
+static int LogFileOrderHold(const char *buffer, int buffer_len, LogFileCtx *log_ctx)
+{
+    LogFileOrderThread *ot = &log_order_thread;
+    if (ot->have_turn)
+        return 0;
+
+    /* terminated, for syslog */
+    LogFileOrderRecord *rec = SCMalloc(sizeof(*rec) + buffer_len + 1);
+    if (unlikely(rec == NULL)) {
+        LogFileOrderWaitTurn(ot);
+        return 0;
+    }
+    rec->ctx = log_ctx;
+    rec->len = buffer_len;
+    rec->next = NULL;
+    memcpy(rec->data, buffer, buffer_len);
+    rec->data[buffer_len] = '\0';
+    if (ot->tail != NULL)
+        ot->tail->next = rec;
+    else
+        ot->head = rec;
+    ot->tail = rec;
+    ot->size += buffer_len;
+
+    if (ot->size > LOG_FILE_ORDER_HOLD_MAX)
+        LogFileOrderWaitTurn(ot);
+    return 1;
+}
+#endif /* TLS */
+
+/** \brief start holding back the output of this thread for input seq
+ *
+ *  Every call must be followed by LogFileOrderCommit(). Without TLS
+ *  support output is not ordered. */
+void LogFileOrderBegin(uint64_t seq)
+{
+#ifdef TLS
+    LogFileOrderThread *ot = &log_order_thread;
+    ot->active = true;
+    ot->have_turn = false;
+    ot->seq = seq;
+#endif
+}
+
+/** \brief input is done: wait until all inputs before it are written,
+ *         then write the held back output and pass on the turn */
+void LogFileOrderCommit(void)
+{
+#ifdef TLS
+    LogFileOrderThread *ot = &log_order_thread;
+    if (!ot->active)
+        return;
+    if (!ot->have_turn)
+        LogFileOrderWaitTurn(ot);
+    ot->active = false;
+
+    SCCtrlMutexLock(&log_order_m);
+    if (log_order_next == ot->seq)
+        log_order_next++;
+    pthread_cond_broadcast(&log_order_cond);
+    SCCtrlMutexUnlock(&log_order_m);
+#endif
+}
+
+/** \brief called when inputs will never be done, e.g. when a reader
+ *         fails, so that nobody waits for them */
+void LogFileOrderStop(void)
+{
+    SCCtrlMutexLock(&log_order_m);
+    log_order_stop = true;
+    pthread_cond_broadcast(&log_order_cond);
+    SCCtrlMutexUnlock(&log_order_m);
+}
+
 /**
  * \brief Write buffer to log file.
  * \retval 0 on failure; otherwise, the return value of fwrite (number of
@@ -184,6 +341,12 @@ tryagain:
  */
 static int SCLogFileWrite(const char *buffer, int buffer_len, LogFileCtx *log_ctx)
 {
+#ifdef TLS
+    if (unlikely(log_order_thread.active) &&
+            LogFileOrderHold(buffer, buffer_len, log_ctx) == 1)
+        return 1;
+#endif
+
     SCMutexLock(&log_ctx->fp_mutex);
     int ret = 0;
 
@@ -570,28 +733,45 @@ int LogFileFreeCtx(LogFileCtx *lf_ctx)
     SCReturnInt(1);
 }
 
-int LogFileWrite(LogFileCtx *file_ctx, MemBuffer *buffer)
+/** \internal
+ *  \brief write a record to the output of its type, without ordering */
+static void LogFileWriteDirect(LogFileCtx *file_ctx, const char *buffer, int buffer_len)
 {
     if (file_ctx->type == LOGFILE_TYPE_SYSLOG) {
-        syslog(file_ctx->syslog_setup.alert_syslog_level, "%s",
-                (const char *)MEMBUFFER_BUFFER(buffer));
+        syslog(file_ctx->syslog_setup.alert_syslog_level, "%s", buffer);
     } else if (file_ctx->type == LOGFILE_TYPE_FILE ||
                file_ctx->type == LOGFILE_TYPE_UNIX_DGRAM ||
                file_ctx->type == LOGFILE_TYPE_UNIX_STREAM)
     {
-        /* append \n for files only */
-        MemBufferWriteString(buffer, "\n");
-        file_ctx->Write((const char *)MEMBUFFER_BUFFER(buffer),
-                        MEMBUFFER_OFFSET(buffer), file_ctx);
+        file_ctx->Write(buffer, buffer_len, file_ctx);
     }
 #ifdef HAVE_LIBHIREDIS
     else if (file_ctx->type == LOGFILE_TYPE_REDIS) {
         SCMutexLock(&file_ctx->fp_mutex);
-        LogFileWriteRedis(file_ctx, (const char *)MEMBUFFER_BUFFER(buffer),
-                MEMBUFFER_OFFSET(buffer));
+        LogFileWriteRedis(file_ctx, buffer, buffer_len);
         SCMutexUnlock(&file_ctx->fp_mutex);
     }
 #endif
+}
+
+int LogFileWrite(LogFileCtx *file_ctx, MemBuffer *buffer)
+{
+    if (file_ctx->type == LOGFILE_TYPE_FILE ||
+        file_ctx->type == LOGFILE_TYPE_UNIX_DGRAM ||
+        file_ctx->type == LOGFILE_TYPE_UNIX_STREAM)
+    {
+        /* append \n for files only */
+        MemBufferWriteString(buffer, "\n");
+    }
+
+#ifdef TLS
+    if (unlikely(log_order_thread.active) &&
+            LogFileOrderHold((const char *)MEMBUFFER_BUFFER(buffer),
+                MEMBUFFER_OFFSET(buffer), file_ctx) == 1)
+        return 0;
+#endif
 
+    LogFileWriteDirect(file_ctx, (const char *)MEMBUFFER_BUFFER(buffer),
+            MEMBUFFER_OFFSET(buffer));
     return 0;
 }
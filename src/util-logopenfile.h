@@ -148,4 +148,9 @@ int LogFileWrite(LogFileCtx *file_ctx, MemBuffer *buffer);
 int SCConfLogOpenGeneric(ConfNode *conf, LogFileCtx *, const char *, int);
 int SCConfLogReopen(LogFileCtx *);
 
+void LogFileOrderInit(void);
+void LogFileOrderBegin(uint64_t seq);
+void LogFileOrderCommit(void);
+void LogFileOrderStop(void);
+
 #endif /* __UTIL_LOGOPENFILE_H__ */
@@ -0,0 +1,348 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Sharded memcap accounting.
+ *
+ * The global 'reserved' counter holds the memory in use plus the unused
+ * credit of all threads and is what the memcap is enforced against. A
+ * thread only updates it when its credit runs out, or when it holds more
+ * than a chunk of unused credit after freeing memory. So a thread can
+ * fail a check while up to 'chunk' bytes per thread are reserved but
+ * unused.
+ *
+ * The memuse reported for stats is the sum of the per thread counters,
+ * which is exact once the threads are idle. Memory can be freed by
+ * another thread than the one that allocated it, so a per thread
+ * counter can wrap, only the sum is meaningful.
+ */
+
+#include "suricata-common.h"
+#include "util-memcap-shards.h"
+#include "util-unittest.h"
+#include "util-debug.h"
+
+struct MemcapShard_ {
+    uint64_t used;              /**< memory accounted by this thread */
+    uint64_t credit;            /**< reserved but not in use */
+    MemcapShard *next;
+};
+
+static __thread struct {
+    MemcapShard *shard;
+    uint32_t gen;
+} memcap_shards_tls[MEMCAP_SHARDS_MAX];
+
+static SC_ATOMIC_DECLARE(uint32_t, memcap_shards_gen);
+
+/** \internal
+ *  \brief set up the shard of the calling thread
+ *  \retval s shard or NULL if we're out of memory */
+static MemcapShard *MemcapShardNew(MemcapShards *m)
+{
+    MemcapShard *s = SCCalloc(1, sizeof(*s));
+    if (unlikely(s == NULL))
+        return NULL;
+
+    SCMutexLock(&m->lock);
+    s->next = m->shards;
+    m->shards = s;
+    SCMutexUnlock(&m->lock);
+
+    memcap_shards_tls[m->id].shard = s;
+    memcap_shards_tls[m->id].gen = m->gen;
+    return s;
+}
+
+/** \internal
+ *  \brief get the shard of the calling thread
+ *  \retval s shard or NULL if the global counters should be used */
+static inline MemcapShard *MemcapShardGet(MemcapShards *m)
+{
+    if (unlikely(m->gen == 0))
+        return NULL;
+    if (likely(memcap_shards_tls[m->id].gen == m->gen))
+        return memcap_shards_tls[m->id].shard;
+    return MemcapShardNew(m);
+}
+
+/** \internal
+ *  \brief take amount from the global budget
+ *  \retval 1 reserved
+ *  \retval 0 would exceed memcap */
+static int MemcapShardsReserve(MemcapShards *m, uint64_t amount, uint64_t memcap)
+{
+    uint64_t cur;
+    do {
+        cur = SC_ATOMIC_GET(m->reserved);
+        if (amount > memcap || cur > memcap - amount)
+            return 0;
+    } while (!SC_ATOMIC_CAS(&m->reserved, cur, cur + amount));
+    return 1;
+}
+
+/**
+ *  \brief setup the accounting
+ *
+ *  \param id slot of this user in the per thread data
+ *  \param chunk credit a thread reserves at once, 0 for the default
+ */
+void MemcapShardsInit(MemcapShards *m, int id, uint32_t chunk)
+{
+    BUG_ON(id < 0 || id >= MEMCAP_SHARDS_MAX);
+
+    if (m->gen != 0)
+        MemcapShardsDestroy(m);
+
+    SC_ATOMIC_INIT(m->reserved);
+    SC_ATOMIC_INIT(m->unsharded);
+    m->id = id;
+    m->chunk = chunk ? chunk : MEMCAP_SHARDS_CHUNK;
+    m->shards = NULL;
+    SCMutexInit(&m->lock, NULL);
+
+    uint32_t gen;
+    do {
+        gen = SC_ATOMIC_ADD(memcap_shards_gen, 1);
+    } while (gen == 0);
+    m->gen = gen;
+}
+
+/**
+ *  \brief free the per thread data
+ *
+ *  The memory still in use is kept in the global counters, so late
+ *  updates still add up.
+ */
+void MemcapShardsDestroy(MemcapShards *m)
+{
+    if (m->gen == 0)
+        return;
+
+    const uint64_t memuse = MemcapShardsGetMemuse(m);
+
+    SCMutexLock(&m->lock);
+    m->gen = 0;
+    MemcapShard *s = m->shards;
+    while (s != NULL) {
+        MemcapShard *next = s->next;
+        SCFree(s);
+        s = next;
+    }
+    m->shards = NULL;
+    SCMutexUnlock(&m->lock);
+    SCMutexDestroy(&m->lock);
+
+    SC_ATOMIC_SET(m->reserved, memuse);
+    SC_ATOMIC_SET(m->unsharded, memuse);
+}
+
+/**
+ *  \brief check if size more bytes fit in memcap
+ *
+ *  On success the memory is reserved for the calling thread, so that the
+ *  MemcapShardsIncr() that follows is local.
+ *
+ *  \retval 1 fits
+ *  \retval 0 doesn't fit
+ */
+int MemcapShardsCheck(MemcapShards *m, uint64_t size, uint64_t memcap)
+{
+    MemcapShard *s = MemcapShardGet(m);
+    if (unlikely(s == NULL)) {
+        const uint64_t cur = SC_ATOMIC_GET(m->reserved);
+        return (size <= memcap && cur <= memcap - size);
+    }
+
+    if (likely(s->credit >= size))
+        return 1;
+
+    /* take a chunk on top of what we need, or if that doesn't
+     * fit anymore just what we need */
+    const uint64_t need = size - s->credit;
+    uint64_t amount = need + m->chunk;
+    if (!MemcapShardsReserve(m, amount, memcap)) {
+        amount = need;
+        if (!MemcapShardsReserve(m, amount, memcap))
+            return 0;
+    }
+    s->credit += amount;
+    return 1;
+}
+
+/**
+ *  \brief account size bytes as in use
+ *
+ *  Doesn't fail, if the thread's credit is too small the rest is taken
+ *  from the global budget regardless of the memcap.
+ */
+void MemcapShardsIncr(MemcapShards *m, uint64_t size)
+{
+    MemcapShard *s = MemcapShardGet(m);
+    if (unlikely(s == NULL)) {
+        (void)SC_ATOMIC_ADD(m->reserved, size);
+        (void)SC_ATOMIC_ADD(m->unsharded, size);
+        return;
+    }
+
+    if (s->credit < size) {
+        const uint64_t need = size - s->credit;
+        (void)SC_ATOMIC_ADD(m->reserved, need);
+        s->credit += need;
+    }
+    s->credit -= size;
+    s->used += size;
+}
+
+/**
+ *  \brief account size bytes as freed
+ *
+ *  The memory becomes credit of the calling thread, anything above a
+ *  chunk is given back to the global budget.
+ */
+void MemcapShardsDecr(MemcapShards *m, uint64_t size)
+{
+    MemcapShard *s = MemcapShardGet(m);
+    if (unlikely(s == NULL)) {
+        (void)SC_ATOMIC_SUB(m->reserved, size);
+        (void)SC_ATOMIC_SUB(m->unsharded, size);
+        return;
+    }
+
+    s->used -= size;
+    s->credit += size;
+    if (s->credit > m->chunk) {
+        (void)SC_ATOMIC_SUB(m->reserved, s->credit - m->chunk);
+        s->credit = m->chunk;
+    }
+}
+
+/**
+ *  \brief get the memory in use by all threads
+ *
+ *  The per thread counters are read without synchronization, so while
+ *  the threads are busy the result is approximate.
+ */
+uint64_t MemcapShardsGetMemuse(MemcapShards *m)
+{
+    uint64_t memuse = SC_ATOMIC_GET(m->unsharded);
+    if (m->gen == 0)
+        return memuse;
+
+    SCMutexLock(&m->lock);
+    for (MemcapShard *s = m->shards; s != NULL; s = s->next) {
+        memuse += *(volatile uint64_t *)&s->used;
+    }
+    SCMutexUnlock(&m->lock);
+    return memuse;
+}
+
+/**
+ *  \brief get the memory reserved by all threads, this is what the
+ *         memcap is enforced against
+ */
+uint64_t MemcapShardsGetReserved(MemcapShards *m)
+{
+    return SC_ATOMIC_GET(m->reserved);
+}
+
+#ifdef UNITTESTS
+/** \test checks are exact for a single thread, freed memory beyond a
+ *        chunk goes back to the global budget */
+static int MemcapShardsTest01(void)
+{
+    MemcapShards m;
+    memset(&m, 0, sizeof(m));
+    MemcapShardsInit(&m, MEMCAP_SHARDS_STREAM, 1000);
+
+    FAIL_IF_NOT(MemcapShardsCheck(&m, 500, 10000));
+    FAIL_IF(MemcapShardsGetReserved(&m) != 1500);
+    MemcapShardsIncr(&m, 500);
+    FAIL_IF(MemcapShardsGetMemuse(&m) != 500);
+
+    /* the chunk doesn't fit anymore, what we need does */
+    FAIL_IF_NOT(MemcapShardsCheck(&m, 9500, 10000));
+    MemcapShardsIncr(&m, 9500);
+    FAIL_IF(MemcapShardsGetMemuse(&m) != 10000);
+    FAIL_IF(MemcapShardsGetReserved(&m) != 10000);
+    FAIL_IF(MemcapShardsCheck(&m, 1, 10000));
+
+    MemcapShardsDecr(&m, 10000);
+    FAIL_IF(MemcapShardsGetMemuse(&m) != 0);
+    FAIL_IF(MemcapShardsGetReserved(&m) != 1000);
+
+    /* unchecked incr is taken regardless of the memcap */
+    MemcapShardsIncr(&m, 20000);
+    FAIL_IF(MemcapShardsGetMemuse(&m) != 20000);
+    FAIL_IF(MemcapShardsCheck(&m, 1, 10000));
+
+    MemcapShardsDestroy(&m);
+    FAIL_IF(MemcapShardsGetMemuse(&m) != 20000);
+    MemcapShardsDecr(&m, 20000);
+    FAIL_IF(MemcapShardsGetMemuse(&m) != 0);
+    PASS;
+}
+
+#define MEMCAP_SHARDS_TEST_THREADS 4
+#define MEMCAP_SHARDS_TEST_MEMCAP  100000
+
+static void *MemcapShardsTestFill(void *arg)
+{
+    MemcapShards *m = arg;
+    while (MemcapShardsCheck(m, 100, MEMCAP_SHARDS_TEST_MEMCAP)) {
+        MemcapShardsIncr(m, 100);
+    }
+    return NULL;
+}
+
+/** \test threads fill the memcap, another thread frees it all */
+static int MemcapShardsTest02(void)
+{
+    MemcapShards m;
+    memset(&m, 0, sizeof(m));
+    MemcapShardsInit(&m, MEMCAP_SHARDS_STREAM, 1000);
+
+    pthread_t t[MEMCAP_SHARDS_TEST_THREADS];
+    for (int i = 0; i < MEMCAP_SHARDS_TEST_THREADS; i++) {
+        FAIL_IF(pthread_create(&t[i], NULL, MemcapShardsTestFill, &m) != 0);
+    }
+    for (int i = 0; i < MEMCAP_SHARDS_TEST_THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    const uint64_t memuse = MemcapShardsGetMemuse(&m);
+    FAIL_IF(memuse > MEMCAP_SHARDS_TEST_MEMCAP);
+    FAIL_IF(memuse < MEMCAP_SHARDS_TEST_MEMCAP - MEMCAP_SHARDS_TEST_THREADS * 1000);
+    FAIL_IF(MemcapShardsGetReserved(&m) > MEMCAP_SHARDS_TEST_MEMCAP);
+
+    MemcapShardsDecr(&m, memuse);
+    FAIL_IF(MemcapShardsGetMemuse(&m) != 0);
+
+    MemcapShardsDestroy(&m);
+    PASS;
+}
+#endif /* UNITTESTS */
+
+void MemcapShardsRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("MemcapShardsTest01", MemcapShardsTest01);
+    UtRegisterTest("MemcapShardsTest02", MemcapShardsTest02);
+#endif /* UNITTESTS */
+}
@@ -0,0 +1,76 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Sharded memcap accounting.
+ *
+ * Each thread reserves credit from the global budget in chunks and does
+ * its accounting against that credit, so the shared counter is only
+ * touched once per chunk instead of on every allocation.
+ */
+
+#ifndef __UTIL_MEMCAP_SHARDS_H__
+#define __UTIL_MEMCAP_SHARDS_H__
+
+#include "util-atomic.h"
+#include "threads.h"
+
+/** default size of the credit a thread takes from the global budget */
+#define MEMCAP_SHARDS_CHUNK (64 * 1024)
+
+/** users of the sharded accounting, one per thread local slot */
+enum MemcapShardsId {
+    MEMCAP_SHARDS_STREAM = 0,
+    MEMCAP_SHARDS_REASSEMBLY,
+    MEMCAP_SHARDS_FLOW,
+    MEMCAP_SHARDS_HOST,
+    MEMCAP_SHARDS_IPPAIR,
+    MEMCAP_SHARDS_DEFRAG,
+
+    MEMCAP_SHARDS_MAX,
+};
+
+typedef struct MemcapShard_ MemcapShard;
+
+typedef struct MemcapShards_ {
+    /** memory reserved by all threads: in use plus their credit */
+    SC_ATOMIC_DECLARE(uint64_t, reserved);
+    /** memory accounted without a shard */
+    SC_ATOMIC_DECLARE(uint64_t, unsharded);
+
+    int id;
+    uint32_t chunk;
+    uint32_t gen;               /**< 0 if not initialized */
+
+    SCMutex lock;               /**< protects shards */
+    MemcapShard *shards;
+} MemcapShards;
+
+void MemcapShardsInit(MemcapShards *m, int id, uint32_t chunk);
+void MemcapShardsDestroy(MemcapShards *m);
+
+int MemcapShardsCheck(MemcapShards *m, uint64_t size, uint64_t memcap);
+void MemcapShardsIncr(MemcapShards *m, uint64_t size);
+void MemcapShardsDecr(MemcapShards *m, uint64_t size);
+uint64_t MemcapShardsGetMemuse(MemcapShards *m);
+uint64_t MemcapShardsGetReserved(MemcapShards *m);
+
+void MemcapShardsRegisterTests(void);
+
+#endif /* __UTIL_MEMCAP_SHARDS_H__ */
@@ -41,6 +41,7 @@
 #include "util-hash.h"
 #include "util-hash-lookup3.h"
 #include "util-hyperscan.h"
+#include "util-misc.h"
 
 #ifdef BUILD_HYPERSCAN
 
@@ -78,6 +79,33 @@ static SCMutex g_scratch_proto_mutex = SCMUTEX_INITIALIZER;
 static HashTable *g_db_table = NULL;
 static SCMutex g_db_table_mutex = SCMUTEX_INITIALIZER;
 
+/* Global hash table of compiled Hyperscan databases, shared by pattern
+ * databases with the same compile input. Access is serialised via
+ * g_db_table_mutex. */
+static HashTable *g_compiled_table = NULL;
+static uint32_t g_db_reused = 0;
+
+/* On disk cache of compiled databases, enabled by setting
+ * detect.mpm-cache-dir. Files are named after a hash of the compile input
+ * and also contain the full input, so a hash collision is a cache miss.
+ * The counters are updated under g_db_table_mutex. */
+#define HS_CACHE_MAGIC      "SCHSDB01"
+#define HS_CACHE_MAGIC_LEN  8
+static uint32_t g_cache_loaded = 0;
+static uint32_t g_cache_stored = 0;
+
+/* Pattern databases get an id when they are added to g_db_table, so that
+ * stream states opened for a database that was freed by a reload can be
+ * recognized without touching it. Updated under g_db_table_mutex. */
+static uint32_t g_db_id = 0;
+
+/* Stream mode (detect.mpm-stream-mode): memory used by the stream states
+ * of all flows, its limit and the number of times it was hit. */
+#define SCHS_STREAM_MEMCAP_DEFAULT (64 * 1024 * 1024)
+SC_ATOMIC_DECLARE(uint64_t, hs_stream_memuse);
+SC_ATOMIC_DECLARE(uint64_t, hs_stream_memcap);
+SC_ATOMIC_DECLARE(uint64_t, hs_stream_memcap_hit);
+
 /**
  * \internal
  * \brief Wraps SCMalloc (which is a macro) so that it can be passed to
@@ -448,10 +476,36 @@ static void SCHSFreeCompileData(SCHSCompileData *cd)
     SCFree(cd);
 }
 
+/* A compiled Hyperscan database, keyed on the compile input only (see
+ * SCHSCacheKey). Pattern databases that only differ in the pattern and
+ * signature ids they map to, as happens to unchanged rule groups after
+ * rules were added or removed by a reload, share a single compiled
+ * database. */
+typedef struct CompiledDatabase_ {
+    uint8_t *key;
+    uint32_t key_len;
+    hs_database_t *hs_db;
+
+    /* Reference count: number of pattern databases using this database. */
+    uint32_t ref_cnt;
+} CompiledDatabase;
+
 typedef struct PatternDatabase_ {
     SCHSPattern **parray;
     hs_database_t *hs_db;
+    /* owner of hs_db, if set */
+    CompiledDatabase *compiled;
     uint32_t pattern_cnt;
+    uint32_t id;
+
+    /* database is used to search the raw stream in stream mode */
+    bool stream;
+    /* stream mode database, NULL if it couldn't be built */
+    hs_database_t *hs_stream_db;
+    /* owner of hs_stream_db, if set */
+    CompiledDatabase *compiled_stream;
+    /* size of a stream opened on hs_stream_db */
+    size_t stream_size;
 
     /* Reference count: number of MPM contexts using this pattern database. */
     uint32_t ref_cnt;
@@ -498,6 +552,8 @@ static uint32_t PatternDatabaseHash(HashTable *ht, void *data, uint16_t len)
     const PatternDatabase *pd = data;
     uint32_t hash = 0;
     hash = hashword(&pd->pattern_cnt, 1, hash);
+    const uint32_t stream = pd->stream;
+    hash = hashword(&stream, 1, hash);
 
     for (uint32_t i = 0; i < pd->pattern_cnt; i++) {
         hash = SCHSPatternHash(pd->parray[i], hash);
@@ -513,7 +569,7 @@ static char PatternDatabaseCompare(void *data1, uint16_t len1, void *data2,
     const PatternDatabase *pd1 = data1;
     const PatternDatabase *pd2 = data2;
 
-    if (pd1->pattern_cnt != pd2->pattern_cnt) {
+    if (pd1->pattern_cnt != pd2->pattern_cnt || pd1->stream != pd2->stream) {
         return 0;
     }
 
@@ -526,6 +582,126 @@ static char PatternDatabaseCompare(void *data1, uint16_t len1, void *data2,
     return 1;
 }
 
+static uint32_t CompiledDatabaseHash(HashTable *ht, void *data, uint16_t len)
+{
+    const CompiledDatabase *cdb = data;
+    return hashlittle_safe(cdb->key, cdb->key_len, 0) % ht->array_size;
+}
+
+static char CompiledDatabaseCompare(void *data1, uint16_t len1, void *data2,
+                                    uint16_t len2)
+{
+    const CompiledDatabase *cdb1 = data1;
+    const CompiledDatabase *cdb2 = data2;
+
+    return cdb1->key_len == cdb2->key_len &&
+           memcmp(cdb1->key, cdb2->key, cdb1->key_len) == 0;
+}
+
+static void CompiledDatabaseTableFree(void *data)
+{
+    /* Stub like PatternDatabaseTableFree, compiled databases are freed
+     * when their ref_cnt drops to zero. */
+}
+
+/**
+ * \internal
+ * \brief Find a compiled database by key and take a reference to it.
+ * Must be called with g_db_table_mutex held.
+ */
+static CompiledDatabase *CompiledDatabaseGet(const uint8_t *key,
+                                             uint32_t key_len)
+{
+    if (g_compiled_table == NULL)
+        return NULL;
+
+    CompiledDatabase lookup = { .key = (uint8_t *)key, .key_len = key_len };
+    CompiledDatabase *cdb = HashTableLookup(g_compiled_table, &lookup, 0);
+    if (cdb != NULL)
+        cdb->ref_cnt++;
+    return cdb;
+}
+
+/**
+ * \internal
+ * \brief Add a freshly compiled database, taking ownership of key and
+ * hs_db. If an equal database was added in the meantime that one is
+ * returned instead and hs_db is freed. Must be called with
+ * g_db_table_mutex held.
+ *
+ * \retval cdb with a reference taken, or NULL on error in which case the
+ * caller still owns key and hs_db
+ */
+static CompiledDatabase *CompiledDatabaseAdd(uint8_t *key, uint32_t key_len,
+                                             hs_database_t *hs_db)
+{
+    if (g_compiled_table == NULL) {
+        g_compiled_table = HashTableInit(INIT_DB_HASH_SIZE,
+                CompiledDatabaseHash, CompiledDatabaseCompare,
+                CompiledDatabaseTableFree);
+        if (g_compiled_table == NULL)
+            return NULL;
+    }
+
+    CompiledDatabase *cdb = CompiledDatabaseGet(key, key_len);
+    if (cdb != NULL) {
+        hs_free_database(hs_db);
+        SCFree(key);
+        return cdb;
+    }
+
+    cdb = SCCalloc(1, sizeof(*cdb));
+    if (cdb == NULL)
+        return NULL;
+    cdb->key = key;
+    cdb->key_len = key_len;
+    cdb->hs_db = hs_db;
+    cdb->ref_cnt = 1;
+    if (HashTableAdd(g_compiled_table, cdb, 0) != 0) {
+        SCFree(cdb);
+        return NULL;
+    }
+    return cdb;
+}
+
+/**
+ * \internal
+ * \brief Drop a reference to a compiled database, freeing it when it was
+ * the last one. Must be called with g_db_table_mutex held.
+ */
+static void CompiledDatabaseRelease(CompiledDatabase *cdb)
+{
+    BUG_ON(cdb->ref_cnt == 0);
+    if (--cdb->ref_cnt > 0)
+        return;
+
+    HashTableRemove(g_compiled_table, cdb, 0);
+    hs_free_database(cdb->hs_db);
+    SCFree(cdb->key);
+    SCFree(cdb);
+}
+
+/**
+ * \internal
+ * \brief Free the stream database of a pattern database. If it is a
+ * compiled database this must be called with g_db_table_mutex held.
+ */
+static void PatternDatabaseFreeStream(PatternDatabase *pd)
+{
+    if (pd->compiled_stream != NULL) {
+        CompiledDatabaseRelease(pd->compiled_stream);
+    } else {
+        hs_free_database(pd->hs_stream_db);
+    }
+    pd->compiled_stream = NULL;
+    pd->hs_stream_db = NULL;
+}
+
+/**
+ * \internal
+ * \brief Free a pattern database. If it holds a compiled database this
+ * must be called with g_db_table_mutex held.
+ */
 static void PatternDatabaseFree(PatternDatabase *pd)
 {
     BUG_ON(pd->ref_cnt != 0);
@@ -542,7 +718,12 @@ static void PatternDatabaseFree(PatternDatabase *pd)
         SCFree(pd->parray);
     }
 
-    hs_free_database(pd->hs_db);
+    if (pd->compiled != NULL) {
+        CompiledDatabaseRelease(pd->compiled);
+    } else {
+        hs_free_database(pd->hs_db);
+    }
+    PatternDatabaseFreeStream(pd);
 
     SCFree(pd);
 }
@@ -576,6 +757,408 @@ static PatternDatabase *PatternDatabaseAlloc(uint32_t pattern_cnt)
     return pd;
 }
 
+/**
+ * \internal
+ * \brief Serialise everything that determines the compiled database: the
+ * Hyperscan version, the mode and the patterns with their flags and
+ * extended parameters. Used as the key of the on disk cache.
+ */
+static uint8_t *SCHSCacheKey(const SCHSCompileData *cd, unsigned int mode,
+                             uint32_t *key_len)
+{
+    const char *version = hs_version();
+    const uint32_t version_len = (uint32_t)strlen(version);
+
+    size_t size = sizeof(uint32_t) * 3 + version_len;
+    for (unsigned int i = 0; i < cd->pattern_cnt; i++) {
+        size += sizeof(uint32_t) * 3 + sizeof(uint64_t) * 3 +
+                strlen(cd->expressions[i]);
+    }
+    if (size > UINT32_MAX)
+        return NULL;
+
+    uint8_t *key = SCMalloc(size);
+    if (key == NULL)
+        return NULL;
+
+    uint8_t *k = key;
+#define KEY_PUT(ptr, len) do { memcpy(k, (ptr), (len)); k += (len); } while (0)
+    KEY_PUT(&version_len, sizeof(version_len));
+    KEY_PUT(version, version_len);
+    const uint32_t mode32 = mode;
+    KEY_PUT(&mode32, sizeof(mode32));
+    const uint32_t cnt = cd->pattern_cnt;
+    KEY_PUT(&cnt, sizeof(cnt));
+    for (unsigned int i = 0; i < cd->pattern_cnt; i++) {
+        const uint32_t id = cd->ids[i];
+        const uint32_t flags = cd->flags[i];
+        const uint64_t ext_flags = cd->ext[i] ? cd->ext[i]->flags : 0;
+        const uint64_t min_offset = cd->ext[i] ? cd->ext[i]->min_offset : 0;
+        const uint64_t max_offset = cd->ext[i] ? cd->ext[i]->max_offset : 0;
+        const uint32_t expr_len = (uint32_t)strlen(cd->expressions[i]);
+        KEY_PUT(&id, sizeof(id));
+        KEY_PUT(&flags, sizeof(flags));
+        KEY_PUT(&ext_flags, sizeof(ext_flags));
+        KEY_PUT(&min_offset, sizeof(min_offset));
+        KEY_PUT(&max_offset, sizeof(max_offset));
+        KEY_PUT(&expr_len, sizeof(expr_len));
+        KEY_PUT(cd->expressions[i], expr_len);
+    }
+#undef KEY_PUT
+
+    *key_len = (uint32_t)size;
+    return key;
+}
+
+/**
+ * \internal
+ * \brief Get the path of the cache file for a key.
+ *
+ * \retval 0 on success, -1 if the cache is disabled
+ */
+static int SCHSCachePath(const uint8_t *key, uint32_t key_len, char *path,
+                         size_t path_len)
+{
+    const char *dir = NULL;
+    if (ConfGet("detect.mpm-cache-dir", &dir) != 1 || dir == NULL ||
+        strlen(dir) == 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        static int warned = 0;
+        if (!warned) {
+            SCLogWarning(SC_ERR_INVALID_ARGUMENT, "detect.mpm-cache-dir %s "
+                         "is not a directory, not caching Hyperscan databases",
+                         dir);
+            warned = 1;
+        }
+        return -1;
+    }
+
+    const uint32_t h1 = hashlittle_safe(key, key_len, 0);
+    const uint32_t h2 = hashlittle_safe(key, key_len, h1 ^ 0x5bd1e995);
+    int r = snprintf(path, path_len, "%s/%08x%08x.hs", dir, h1, h2);
+    if (r < 0 || (size_t)r >= path_len)
+        return -1;
+    return 0;
+}
+
+/**
+ * \internal
+ * \brief Load a database from the cache. The file is mapped and handed to
+ * hs_deserialize_database(), which copies it into its own allocation.
+ *
+ * \retval db database or NULL if it's not in the cache
+ */
+static hs_database_t *SCHSCacheLoad(const char *path, const uint8_t *key,
+                                    uint32_t key_len)
+{
+#ifdef HAVE_SYS_MMAN_H
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    const uint64_t hdr_len = HS_CACHE_MAGIC_LEN + sizeof(uint32_t) + key_len +
+                             sizeof(uint64_t);
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < hdr_len ||
+        (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+        close(fd);
+        return NULL;
+    }
+
+    const size_t size = (size_t)st.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    hs_database_t *db = NULL;
+    uint32_t stored_key_len;
+    uint64_t db_len;
+    memcpy(&stored_key_len, map + HS_CACHE_MAGIC_LEN, sizeof(stored_key_len));
+    memcpy(&db_len, map + HS_CACHE_MAGIC_LEN + sizeof(uint32_t) + key_len,
+           sizeof(db_len));
+
+    if (memcmp(map, HS_CACHE_MAGIC, HS_CACHE_MAGIC_LEN) != 0 ||
+        stored_key_len != key_len ||
+        memcmp(map + HS_CACHE_MAGIC_LEN + sizeof(uint32_t), key, key_len) != 0 ||
+        db_len != size - hdr_len) {
+        SCLogDebug("cache file %s doesn't match", path);
+        goto end;
+    }
+
+    if (hs_deserialize_database((const char *)map + hdr_len, (size_t)db_len,
+                                &db) != HS_SUCCESS) {
+        SCLogWarning(SC_ERR_INVALID_ARGUMENT, "failed to load Hyperscan "
+                     "database from %s", path);
+        db = NULL;
+    }
+end:
+    munmap(map, size);
+    return db;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * \internal
+ * \brief Store a compiled database in the cache. The file is written under
+ * a temporary name and renamed, so readers never see a partial file.
+ *
+ * \retval 0 stored, -1 otherwise
+ */
+static int SCHSCacheStore(const char *path, const uint8_t *key,
+                          uint32_t key_len, const hs_database_t *db)
+{
+    int ret = -1;
+    char *bytes = NULL;
+    size_t len = 0;
+    if (hs_serialize_database(db, &bytes, &len) != HS_SUCCESS) {
+        SCLogDebug("failed to serialize database");
+        return -1;
+    }
+
+    char tmp[PATH_MAX];
+    int r = snprintf(tmp, sizeof(tmp), "%s.%d.%lu.tmp", path, (int)getpid(),
+            (unsigned long)SCGetThreadIdLong());
+    if (r < 0 || (size_t)r >= sizeof(tmp))
+        goto end;
+
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        SCLogWarning(SC_ERR_FOPEN, "failed to create %s: %s", tmp,
+                     strerror(errno));
+        goto end;
+    }
+    const uint64_t db_len = len;
+    int ok = fwrite(HS_CACHE_MAGIC, HS_CACHE_MAGIC_LEN, 1, fp) == 1 &&
+             fwrite(&key_len, sizeof(key_len), 1, fp) == 1 &&
+             fwrite(key, key_len, 1, fp) == 1 &&
+             fwrite(&db_len, sizeof(db_len), 1, fp) == 1 &&
+             fwrite(bytes, len, 1, fp) == 1;
+    if (fclose(fp) != 0)
+        ok = 0;
+
+    if (!ok || rename(tmp, path) != 0) {
+        SCLogWarning(SC_ERR_FWRITE, "failed to write Hyperscan cache file %s",
+                     path);
+        unlink(tmp);
+        goto end;
+    }
+    SCLogDebug("stored database in %s", path);
+    ret = 0;
+end:
+    SCFree(bytes);
+    return ret;
+}
+
+/**
+ * \internal
+ * \brief Fill the compile input for the patterns of a pattern database.
+ *
+ * The stream database reports every match, as the stream state needs the
+ * end of the last match of each pattern. Offset and depth are relative to
+ * the chunk that is scanned in block mode, so they are not used for the
+ * stream database: its matches are a superset of the block mode matches.
+ *
+ * \retval 0 on success, -1 on error
+ */
+static int SCHSFillCompileData(SCHSCompileData *cd, const PatternDatabase *pd,
+                               bool stream)
+{
+    for (uint32_t i = 0; i < pd->pattern_cnt; i++) {
+        const SCHSPattern *p = pd->parray[i];
+
+        cd->ids[i] = i;
+        cd->flags[i] = stream ? 0 : HS_FLAG_SINGLEMATCH;
+        if (p->flags & MPM_PATTERN_FLAG_NOCASE) {
+            cd->flags[i] |= HS_FLAG_CASELESS;
+        }
+
+        cd->expressions[i] = HSRenderPattern(p->original_pat, p->len);
+
+        if (!stream &&
+            (p->flags & (MPM_PATTERN_FLAG_OFFSET | MPM_PATTERN_FLAG_DEPTH))) {
+            cd->ext[i] = SCMalloc(sizeof(hs_expr_ext_t));
+            if (cd->ext[i] == NULL) {
+                return -1;
+            }
+            memset(cd->ext[i], 0, sizeof(hs_expr_ext_t));
+
+            if (p->flags & MPM_PATTERN_FLAG_OFFSET) {
+                cd->ext[i]->flags |= HS_EXT_FLAG_MIN_OFFSET;
+                cd->ext[i]->min_offset = p->offset + p->len;
+            }
+            if (p->flags & MPM_PATTERN_FLAG_DEPTH) {
+                cd->ext[i]->flags |= HS_EXT_FLAG_MAX_OFFSET;
+                cd->ext[i]->max_offset = p->offset + p->depth;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * \internal
+ * \brief Get the database for the compile input. A compiled database with
+ * the same input is reused, which is only kept in memory as long as a
+ * pattern database uses it. Otherwise the on disk cache is tried before
+ * compiling.
+ *
+ * \param hs_db set to the database
+ * \param compiled set to the owner of hs_db, or NULL if it's not shared
+ *
+ * \retval 0 on success, -1 on error
+ */
+static int SCHSBuildDatabase(const SCHSCompileData *cd, unsigned int mode,
+                             hs_database_t **hs_db, CompiledDatabase **compiled,
+                             int *cache_loaded, int *cache_stored)
+{
+    hs_error_t err;
+    hs_compile_error_t *compile_err = NULL;
+    hs_database_t *db = NULL;
+    CompiledDatabase *cdb = NULL;
+
+    char cache_path[PATH_MAX];
+    uint32_t key_len = 0;
+    uint8_t *key = SCHSCacheKey(cd, mode, &key_len);
+    if (key != NULL) {
+        SCMutexLock(&g_db_table_mutex);
+        cdb = CompiledDatabaseGet(key, key_len);
+        if (cdb != NULL) {
+            db = cdb->hs_db;
+            g_db_reused++;
+            SCLogDebug("reusing compiled database %p", db);
+        }
+        SCMutexUnlock(&g_db_table_mutex);
+    }
+
+    /* try the on disk cache before compiling */
+    int use_cache = db == NULL && key != NULL &&
+        SCHSCachePath(key, key_len, cache_path, sizeof(cache_path)) == 0;
+    if (use_cache) {
+        db = SCHSCacheLoad(cache_path, key, key_len);
+        if (db != NULL) {
+            /* the scratch allocation also checks that the database was
+             * built for this platform */
+            SCMutexLock(&g_scratch_proto_mutex);
+            err = hs_alloc_scratch(db, &g_scratch_proto);
+            SCMutexUnlock(&g_scratch_proto_mutex);
+            if (err != HS_SUCCESS) {
+                SCLogDebug("cached database %s is not usable", cache_path);
+                hs_free_database(db);
+                db = NULL;
+            } else {
+                SCLogDebug("loaded database from %s", cache_path);
+                *cache_loaded += 1;
+            }
+        }
+    }
+
+    if (db == NULL) {
+        err = hs_compile_ext_multi((const char *const *)cd->expressions, cd->flags,
+                                   cd->ids, (const hs_expr_ext_t *const *)cd->ext,
+                                   cd->pattern_cnt, mode, NULL, &db,
+                                   &compile_err);
+
+        if (err != HS_SUCCESS) {
+            SCLogError(SC_ERR_FATAL, "failed to compile hyperscan database");
+            if (compile_err) {
+                SCLogError(SC_ERR_FATAL, "compile error: %s", compile_err->message);
+            }
+            hs_free_compile_error(compile_err);
+            SCFree(key);
+            return -1;
+        }
+
+        if (use_cache && SCHSCacheStore(cache_path, key, key_len, db) == 0) {
+            *cache_stored += 1;
+        }
+    }
+
+    if (cdb == NULL && key != NULL) {
+        SCMutexLock(&g_db_table_mutex);
+        CompiledDatabase *added = CompiledDatabaseAdd(key, key_len, db);
+        if (added != NULL) {
+            cdb = added;
+            db = added->hs_db;
+            key = NULL;
+        }
+        SCMutexUnlock(&g_db_table_mutex);
+    }
+    SCFree(key);
+
+    *hs_db = db;
+    *compiled = cdb;
+    return 0;
+}
+
+/**
+ * \internal
+ * \brief Read the stream state memcap. Done on every stream database
+ * prepare, so a rule reload picks up a changed value.
+ */
+static void SCHSStreamConfig(void)
+{
+    const char *str = NULL;
+    uint64_t memcap = SCHS_STREAM_MEMCAP_DEFAULT;
+
+    if (ConfGet("detect.mpm-stream-memcap", &str) == 1 && str != NULL) {
+        if (ParseSizeStringU64(str, &memcap) < 0) {
+            SCLogWarning(SC_ERR_INVALID_VALUE, "invalid value for "
+                         "detect.mpm-stream-memcap: %s, using %" PRIu64,
+                         str, (uint64_t)SCHS_STREAM_MEMCAP_DEFAULT);
+            memcap = SCHS_STREAM_MEMCAP_DEFAULT;
+        }
+    }
+    SC_ATOMIC_SET(hs_stream_memcap, memcap);
+}
+
+/**
+ * \internal
+ * \brief Build the stream mode database of a pattern database. On failure
+ * the pattern database is used without it, so the stream is searched in
+ * block mode.
+ */
+static void SCHSStreamPrepare(PatternDatabase *pd, int *cache_loaded,
+                              int *cache_stored)
+{
+    SCHSStreamConfig();
+
+    SCHSCompileData *cd = SCHSAllocCompileData(pd->pattern_cnt);
+    if (cd == NULL || SCHSFillCompileData(cd, pd, true) != 0 ||
+        SCHSBuildDatabase(cd, HS_MODE_STREAM, &pd->hs_stream_db,
+                          &pd->compiled_stream, cache_loaded,
+                          cache_stored) != 0) {
+        goto error;
+    }
+
+    SCMutexLock(&g_scratch_proto_mutex);
+    hs_error_t err = hs_alloc_scratch(pd->hs_stream_db, &g_scratch_proto);
+    SCMutexUnlock(&g_scratch_proto_mutex);
+    if (err != HS_SUCCESS ||
+        hs_stream_size(pd->hs_stream_db, &pd->stream_size) != HS_SUCCESS) {
+        goto error;
+    }
+
+    SCHSFreeCompileData(cd);
+    return;
+
+error:
+    SCLogWarning(SC_ERR_INITIALIZATION, "failed to build Hyperscan stream "
+                 "database, searching the stream in block mode");
+    if (pd->hs_stream_db != NULL) {
+        SCMutexLock(&g_db_table_mutex);
+        PatternDatabaseFreeStream(pd);
+        SCMutexUnlock(&g_db_table_mutex);
+    }
+    SCHSFreeCompileData(cd);
+}
+
 /**
  * \brief Process the patterns added to the mpm, and create the internal tables.
  *
@@ -591,7 +1174,6 @@ int SCHSPreparePatterns(MpmCtx *mpm_ctx)
     }
 
     hs_error_t err;
-    hs_compile_error_t *compile_err = NULL;
     SCHSCompileData *cd = NULL;
     PatternDatabase *pd = NULL;
 
@@ -604,6 +1186,7 @@ int SCHSPreparePatterns(MpmCtx *mpm_ctx)
     if (pd == NULL) {
         goto error;
     }
+    pd->stream = (mpm_ctx->flags & MPMCTX_FLAGS_STREAM) != 0;
 
     /* populate the pattern array with the patterns in the hash */
     for (uint32_t i = 0, p = 0; i < INIT_HASH_SIZE; i++) {
@@ -620,8 +1203,9 @@ int SCHSPreparePatterns(MpmCtx *mpm_ctx)
     SCFree(ctx->init_hash);
     ctx->init_hash = NULL;
 
-    /* Serialise whole database compilation as a relatively easy way to ensure
-     * dedupe is safe. */
+    /* Only the lookup and insertion are done under the table lock, so that
+     * several mpm contexts can be compiled at the same time. Two threads
+     * compiling the same database is handled when inserting the result. */
     SCMutexLock(&g_db_table_mutex);
 
     /* Init global pattern database hash if necessary. */
@@ -651,93 +1235,85 @@ int SCHSPreparePatterns(MpmCtx *mpm_ctx)
         SCHSFreeCompileData(cd);
         return 0;
     }
+    SCMutexUnlock(&g_db_table_mutex);
 
     BUG_ON(ctx->pattern_db != NULL); /* already built? */
 
-    for (uint32_t i = 0; i < pd->pattern_cnt; i++) {
-        const SCHSPattern *p = pd->parray[i];
-
-        cd->ids[i] = i;
-        cd->flags[i] = HS_FLAG_SINGLEMATCH;
-        if (p->flags & MPM_PATTERN_FLAG_NOCASE) {
-            cd->flags[i] |= HS_FLAG_CASELESS;
-        }
-
-        cd->expressions[i] = HSRenderPattern(p->original_pat, p->len);
-
-        if (p->flags & (MPM_PATTERN_FLAG_OFFSET | MPM_PATTERN_FLAG_DEPTH)) {
-            cd->ext[i] = SCMalloc(sizeof(hs_expr_ext_t));
-            if (cd->ext[i] == NULL) {
-                SCMutexUnlock(&g_db_table_mutex);
-                goto error;
-            }
-            memset(cd->ext[i], 0, sizeof(hs_expr_ext_t));
-
-            if (p->flags & MPM_PATTERN_FLAG_OFFSET) {
-                cd->ext[i]->flags |= HS_EXT_FLAG_MIN_OFFSET;
-                cd->ext[i]->min_offset = p->offset + p->len;
-            }
-            if (p->flags & MPM_PATTERN_FLAG_DEPTH) {
-                cd->ext[i]->flags |= HS_EXT_FLAG_MAX_OFFSET;
-                cd->ext[i]->max_offset = p->offset + p->depth;
-            }
-        }
+    if (SCHSFillCompileData(cd, pd, false) != 0) {
+        goto error;
     }
 
     BUG_ON(mpm_ctx->pattern_cnt == 0);
 
-    err = hs_compile_ext_multi((const char *const *)cd->expressions, cd->flags,
-                               cd->ids, (const hs_expr_ext_t *const *)cd->ext,
-                               cd->pattern_cnt, HS_MODE_BLOCK, NULL, &pd->hs_db,
-                               &compile_err);
-
-    if (err != HS_SUCCESS) {
-        SCLogError(SC_ERR_FATAL, "failed to compile hyperscan database");
-        if (compile_err) {
-            SCLogError(SC_ERR_FATAL, "compile error: %s", compile_err->message);
-        }
-        hs_free_compile_error(compile_err);
-        SCMutexUnlock(&g_db_table_mutex);
+    int cache_loaded = 0, cache_stored = 0;
+    if (SCHSBuildDatabase(cd, HS_MODE_BLOCK, &pd->hs_db, &pd->compiled,
+                          &cache_loaded, &cache_stored) != 0) {
         goto error;
     }
 
-    ctx->pattern_db = pd;
-
     SCMutexLock(&g_scratch_proto_mutex);
     err = hs_alloc_scratch(pd->hs_db, &g_scratch_proto);
     SCMutexUnlock(&g_scratch_proto_mutex);
     if (err != HS_SUCCESS) {
         SCLogError(SC_ERR_FATAL, "failed to allocate scratch");
-        SCMutexUnlock(&g_db_table_mutex);
         goto error;
     }
 
     err = hs_database_size(pd->hs_db, &ctx->hs_db_size);
     if (err != HS_SUCCESS) {
         SCLogError(SC_ERR_FATAL, "failed to query database size");
-        SCMutexUnlock(&g_db_table_mutex);
         goto error;
     }
 
+    if (pd->stream) {
+        SCHSStreamPrepare(pd, &cache_loaded, &cache_stored);
+        size_t stream_db_size = 0;
+        if (pd->hs_stream_db != NULL &&
+            hs_database_size(pd->hs_stream_db, &stream_db_size) == HS_SUCCESS) {
+            ctx->hs_db_size += stream_db_size;
+        }
+    }
+
     mpm_ctx->memory_cnt++;
     mpm_ctx->memory_size += ctx->hs_db_size;
 
     SCLogDebug("Built %" PRIu32 " patterns into a database of size %" PRIuMAX
                " bytes", mpm_ctx->pattern_cnt, (uintmax_t)ctx->hs_db_size);
 
-    /* Cache this database globally for later. */
+    /* Cache this database globally for later, unless another thread built
+     * the same database in the meantime. */
+    SCMutexLock(&g_db_table_mutex);
+    g_cache_loaded += cache_loaded;
+    g_cache_stored += cache_stored;
+    pd_cached = HashTableLookup(g_db_table, pd, 1);
+    if (pd_cached != NULL) {
+        SCLogDebug("Database %p was built concurrently, using it instead",
+                   pd_cached->hs_db);
+        pd_cached->ref_cnt++;
+        ctx->pattern_db = pd_cached;
+        PatternDatabaseFree(pd);
+        SCMutexUnlock(&g_db_table_mutex);
+        SCHSFreeCompileData(cd);
+        return 0;
+    }
     pd->ref_cnt = 1;
+    pd->id = ++g_db_id;
     int r = HashTableAdd(g_db_table, pd, 1);
     SCMutexUnlock(&g_db_table_mutex);
-    if (r < 0)
+    if (r < 0) {
+        pd->ref_cnt = 0;
         goto error;
+    }
 
+    ctx->pattern_db = pd;
     SCHSFreeCompileData(cd);
     return 0;
 
 error:
     if (pd) {
+        SCMutexLock(&g_db_table_mutex);
         PatternDatabaseFree(pd);
+        SCMutexUnlock(&g_db_table_mutex);
     }
     if (cd) {
         SCHSFreeCompileData(cd);
@@ -961,6 +1537,208 @@ uint32_t SCHSSearch(const MpmCtx *mpm_ctx, MpmThreadCtx *mpm_thread_ctx,
     return ret;
 }
 
+/* Stream mode: every TCP stream direction gets a Hyperscan stream that is
+ * fed the part of each raw stream chunk that wasn't scanned before. The
+ * end of the last match of recently matched patterns is kept, so that the
+ * patterns matching in a chunk can be reported like a block mode scan of
+ * the chunk would. Chunks the state can't answer for are scanned in block
+ * mode. */
+#define SCHS_STREAM_MATCHES 32
+
+typedef struct SCHSStreamMatch_ {
+    uint32_t id;  /* pattern database index */
+    uint64_t end; /* stream offset of the end of the last match */
+} SCHSStreamMatch;
+
+typedef struct SCHSStreamState_ {
+    MpmStreamState mpm;
+    hs_stream_t *stream;
+    /* id of the pattern database the stream was opened on */
+    uint32_t db_id;
+    uint32_t match_cnt;
+    /* memory accounted to hs_stream_memuse */
+    uint64_t size;
+    /* stream offset the state was opened at and the offset it scanned up
+     * to */
+    uint64_t start;
+    uint64_t offset;
+    /* bytes fed to the Hyperscan stream, which differs from offset - start
+     * if there were gaps */
+    uint64_t scanned;
+    /* highest end of a match that was dropped from matches */
+    uint64_t evicted;
+    SCHSStreamMatch matches[SCHS_STREAM_MATCHES];
+} SCHSStreamState;
+
+typedef struct SCHSStreamCallbackCtx_ {
+    SCHSStreamState *st;
+    /* stream offset of the first byte of the Hyperscan stream */
+    uint64_t base;
+} SCHSStreamCallbackCtx;
+
+/**
+ * \internal
+ * \brief Remember the end of a match. If all slots are used the match
+ * that ended first is dropped.
+ */
+static void SCHSStreamAddMatch(SCHSStreamState *st, uint32_t id, uint64_t end)
+{
+    uint32_t oldest = 0;
+    for (uint32_t i = 0; i < st->match_cnt; i++) {
+        if (st->matches[i].id == id) {
+            st->matches[i].end = end;
+            return;
+        }
+        if (st->matches[i].end < st->matches[oldest].end)
+            oldest = i;
+    }
+
+    if (st->match_cnt < SCHS_STREAM_MATCHES) {
+        oldest = st->match_cnt++;
+    } else if (st->matches[oldest].end > st->evicted) {
+        st->evicted = st->matches[oldest].end;
+    }
+    st->matches[oldest].id = id;
+    st->matches[oldest].end = end;
+}
+
+/* Hyperscan stream mode match event handler */
+static int SCHSStreamMatchEvent(unsigned int id, unsigned long long from,
+                                unsigned long long to, unsigned int flags,
+                                void *ctx)
+{
+    SCHSStreamCallbackCtx *cctx = ctx;
+    SCHSStreamAddMatch(cctx->st, (uint32_t)id, cctx->base + to);
+    return 0;
+}
+
+/**
+ * \internal
+ * \brief Open a stream state if the memcap allows it.
+ */
+static SCHSStreamState *SCHSStreamOpen(const PatternDatabase *pd,
+                                       uint64_t offset)
+{
+    const uint64_t size = sizeof(SCHSStreamState) + pd->stream_size;
+    if (SC_ATOMIC_ADD(hs_stream_memuse, size) > SC_ATOMIC_GET(hs_stream_memcap)) {
+        (void)SC_ATOMIC_SUB(hs_stream_memuse, size);
+        (void)SC_ATOMIC_ADD(hs_stream_memcap_hit, 1);
+        return NULL;
+    }
+
+    SCHSStreamState *st = SCCalloc(1, sizeof(*st));
+    if (st == NULL)
+        goto error;
+    if (hs_open_stream(pd->hs_stream_db, 0, &st->stream) != HS_SUCCESS)
+        goto error;
+
+    st->mpm.mpm_type = MPM_HS;
+    st->db_id = pd->id;
+    st->size = size;
+    st->start = st->offset = offset;
+    return st;
+
+error:
+    SCFree(st);
+    (void)SC_ATOMIC_SUB(hs_stream_memuse, size);
+    return NULL;
+}
+
+/**
+ * \brief Free a stream state.
+ */
+static void SCHSStreamFree(MpmStreamState *state)
+{
+    SCHSStreamState *st = (SCHSStreamState *)state;
+
+    /* without a match handler closing the stream doesn't access its
+     * database, which may have been freed by a reload already */
+    hs_close_stream(st->stream, NULL, NULL, NULL);
+    (void)SC_ATOMIC_SUB(hs_stream_memuse, st->size);
+    SCFree(st);
+}
+
+/**
+ * \brief The Hyperscan stream mode search function. Only the data after
+ *        what was scanned for this stream before is scanned.
+ *
+ * \param state  Stream state of the stream, opened on first use.
+ * \param buf    Raw stream chunk.
+ * \param buflen Chunk length.
+ * \param offset Stream offset of the chunk.
+ *
+ * \retval matches Number of patterns matching in the chunk.
+ */
+static uint32_t SCHSStreamSearch(const MpmCtx *mpm_ctx,
+        MpmThreadCtx *mpm_thread_ctx, PrefilterRuleStore *pmq,
+        MpmStreamState **state, const uint8_t *buf, const uint32_t buflen,
+        const uint64_t offset)
+{
+    SCHSCtx *ctx = (SCHSCtx *)mpm_ctx->ctx;
+    SCHSThreadCtx *hs_thread_ctx = (SCHSThreadCtx *)(mpm_thread_ctx->ctx);
+    const PatternDatabase *pd = ctx->pattern_db;
+    SCHSStreamState *st = (SCHSStreamState *)*state;
+
+    if (unlikely(buflen == 0)) {
+        return 0;
+    }
+    if (pd->hs_stream_db == NULL) {
+        return SCHSSearch(mpm_ctx, mpm_thread_ctx, pmq, buf, buflen);
+    }
+
+    /* opened on a database of another rule group, or of the detection
+     * engine before a reload */
+    if (st != NULL && st->db_id != pd->id) {
+        SCHSStreamFree(&st->mpm);
+        *state = NULL;
+        st = NULL;
+    }
+    if (st == NULL) {
+        st = SCHSStreamOpen(pd, offset);
+        if (st == NULL) {
+            return SCHSSearch(mpm_ctx, mpm_thread_ctx, pmq, buf, buflen);
+        }
+        *state = &st->mpm;
+    }
+
+    const uint64_t end = offset + buflen;
+    if (end > st->offset) {
+        /* after a gap the stream continues with the new data, matches
+         * spanning the gap only add candidates */
+        const uint64_t from = MAX(offset, st->offset);
+        const uint32_t skip = (uint32_t)(from - offset);
+        SCHSStreamCallbackCtx cctx = { .st = st, .base = from - st->scanned };
+
+        hs_scratch_t *scratch = hs_thread_ctx->scratch;
+        BUG_ON(scratch == NULL);
+
+        hs_error_t err = hs_scan_stream(st->stream, (const char *)buf + skip,
+                buflen - skip, 0, scratch, SCHSStreamMatchEvent, &cctx);
+        if (err != HS_SUCCESS) {
+            SCLogError(SC_ERR_FATAL, "Hyperscan returned error %d", err);
+            exit(EXIT_FAILURE);
+        }
+        st->scanned += buflen - skip;
+        st->offset = end;
+    }
+
+    /* the chunk starts before the state was opened, ends before the scanned
+     * data or a match in it may have been dropped */
+    if (offset < st->start || end < st->offset || offset < st->evicted) {
+        return SCHSSearch(mpm_ctx, mpm_thread_ctx, pmq, buf, buflen);
+    }
+
+    uint32_t ret = 0;
+    for (uint32_t i = 0; i < st->match_cnt; i++) {
+        if (st->matches[i].end > offset) {
+            const SCHSPattern *pat = pd->parray[st->matches[i].id];
+            PrefilterAddSids(pmq, pat->sids, pat->sids_size);
+            ret++;
+        }
+    }
+    return ret;
+}
+
 /**
  * \brief Add a case insensitive pattern.  Although we have different calls for
  *        adding case sensitive and insensitive patterns, we make a single call
@@ -1061,10 +1839,17 @@ void MpmHSRegister(void)
     mpm_table[MPM_HS].AddPatternNocase = SCHSAddPatternCI;
     mpm_table[MPM_HS].Prepare = SCHSPreparePatterns;
     mpm_table[MPM_HS].Search = SCHSSearch;
+    mpm_table[MPM_HS].StreamSearch = SCHSStreamSearch;
+    mpm_table[MPM_HS].StreamFree = SCHSStreamFree;
     mpm_table[MPM_HS].PrintCtx = SCHSPrintInfo;
     mpm_table[MPM_HS].PrintThreadCtx = SCHSPrintSearchStats;
     mpm_table[MPM_HS].RegisterUnittests = SCHSRegisterTests;
 
+    SC_ATOMIC_INIT(hs_stream_memuse);
+    SC_ATOMIC_INIT(hs_stream_memcap);
+    SC_ATOMIC_INIT(hs_stream_memcap_hit);
+    SC_ATOMIC_SET(hs_stream_memcap, SCHS_STREAM_MEMCAP_DEFAULT);
+
     /* Set Hyperscan memory allocators */
     SCHSSetAllocators();
 }
@@ -1085,11 +1870,28 @@ void MpmHSGlobalCleanup(void)
     SCMutexUnlock(&g_scratch_proto_mutex);
 
     SCMutexLock(&g_db_table_mutex);
+    if (g_db_reused) {
+        SCLogPerf("Hyperscan compiled databases reused: %" PRIu32,
+                  g_db_reused);
+    }
+    if (g_cache_loaded || g_cache_stored) {
+        SCLogPerf("Hyperscan database cache: %" PRIu32 " loaded, %" PRIu32
+                  " stored", g_cache_loaded, g_cache_stored);
+    }
+    if (SC_ATOMIC_GET(hs_stream_memcap_hit)) {
+        SCLogPerf("Hyperscan stream memcap hit %" PRIu64 " times, "
+                  "those streams were searched in block mode",
+                  SC_ATOMIC_GET(hs_stream_memcap_hit));
+    }
     if (g_db_table != NULL) {
         SCLogPerf("Clearing Hyperscan database cache");
         HashTableFree(g_db_table);
         g_db_table = NULL;
     }
+    if (g_compiled_table != NULL) {
+        HashTableFree(g_compiled_table);
+        g_compiled_table = NULL;
+    }
     SCMutexUnlock(&g_db_table_mutex);
 }
 
@@ -2145,6 +2947,163 @@ end:
     return result;
 }
 
+/** \test a database compiled once is loaded from the on disk cache */
+static int SCHSTest30(void)
+{
+    char dir[] = "/tmp/suricata-hs-cache-XXXXXX";
+    FAIL_IF_NULL(mkdtemp(dir));
+
+    ConfCreateContextBackup();
+    ConfInit();
+    FAIL_IF(ConfSet("detect.mpm-cache-dir", dir) != 1);
+
+    const uint32_t loaded = g_cache_loaded;
+    const uint32_t stored = g_cache_stored;
+
+    for (int i = 0; i < 2; i++) {
+        MpmCtx mpm_ctx;
+        MpmThreadCtx mpm_thread_ctx;
+        PrefilterRuleStore pmq;
+
+        memset(&mpm_ctx, 0, sizeof(MpmCtx));
+        memset(&mpm_thread_ctx, 0, sizeof(MpmThreadCtx));
+        MpmInitCtx(&mpm_ctx, MPM_HS);
+
+        MpmAddPatternCS(&mpm_ctx, (uint8_t *)"cacheme", 7, 0, 0, 0, 0, 0);
+        MpmAddPatternCI(&mpm_ctx, (uint8_t *)"AnD mE", 6, 0, 0, 1, 1, 0);
+        PmqSetup(&pmq);
+
+        FAIL_IF(SCHSPreparePatterns(&mpm_ctx) != 0);
+        SCHSInitThreadCtx(&mpm_ctx, &mpm_thread_ctx);
+
+        const char *buf = "please cacheme and me";
+        uint32_t cnt = SCHSSearch(&mpm_ctx, &mpm_thread_ctx, &pmq,
+                                  (uint8_t *)buf, strlen(buf));
+        FAIL_IF(cnt != 2);
+
+        /* releases the database, the second round can't reuse it */
+        SCHSDestroyCtx(&mpm_ctx);
+        SCHSDestroyThreadCtx(&mpm_ctx, &mpm_thread_ctx);
+        PmqFree(&pmq);
+    }
+    FAIL_IF(g_cache_stored != stored + 1);
+    FAIL_IF(g_cache_loaded != loaded + 1);
+
+    DIR *d = opendir(dir);
+    FAIL_IF_NULL(d);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+
+    ConfDeInit();
+    ConfRestoreContextBackup();
+    PASS;
+}
+
+/** \test the same patterns mapping to different signatures share a
+ *  compiled database */
+static int SCHSTest31(void)
+{
+    MpmCtx mpm_ctx[2];
+    MpmThreadCtx mpm_thread_ctx;
+    PrefilterRuleStore pmq;
+
+    const uint32_t reused = g_db_reused;
+    PmqSetup(&pmq);
+
+    for (int i = 0; i < 2; i++) {
+        memset(&mpm_ctx[i], 0, sizeof(MpmCtx));
+        MpmInitCtx(&mpm_ctx[i], MPM_HS);
+        MpmAddPatternCS(&mpm_ctx[i], (uint8_t *)"shareme", 7, 0, 0, 0, i, 0);
+        FAIL_IF(SCHSPreparePatterns(&mpm_ctx[i]) != 0);
+    }
+    const SCHSCtx *ctx0 = (SCHSCtx *)mpm_ctx[0].ctx;
+    const SCHSCtx *ctx1 = (SCHSCtx *)mpm_ctx[1].ctx;
+    FAIL_IF(ctx0->pattern_db == ctx1->pattern_db);
+    FAIL_IF(((PatternDatabase *)ctx0->pattern_db)->hs_db !=
+            ((PatternDatabase *)ctx1->pattern_db)->hs_db);
+    FAIL_IF(g_db_reused != reused + 1);
+
+    /* the second ctx keeps the database alive and maps to its own sid */
+    SCHSDestroyCtx(&mpm_ctx[0]);
+    memset(&mpm_thread_ctx, 0, sizeof(MpmThreadCtx));
+    SCHSInitThreadCtx(&mpm_ctx[1], &mpm_thread_ctx);
+    const char *buf = "please shareme";
+    uint32_t cnt = SCHSSearch(&mpm_ctx[1], &mpm_thread_ctx, &pmq,
+                              (uint8_t *)buf, strlen(buf));
+    FAIL_IF(cnt != 1);
+    FAIL_IF(pmq.rule_id_array_cnt != 1);
+    FAIL_IF(pmq.rule_id_array[0] != 1);
+
+    SCHSDestroyCtx(&mpm_ctx[1]);
+    SCHSDestroyThreadCtx(&mpm_ctx[1], &mpm_thread_ctx);
+    PmqFree(&pmq);
+    PASS;
+}
+
+/** \test stream mode finds patterns crossing chunks, scans each byte once
+ *        and falls back to block mode when the memcap is hit */
+static int SCHSTest32(void)
+{
+    MpmCtx mpm_ctx;
+    MpmThreadCtx mpm_thread_ctx;
+    PrefilterRuleStore pmq;
+    MpmStreamState *state = NULL;
+    const uint64_t memuse = SC_ATOMIC_GET(hs_stream_memuse);
+
+    memset(&mpm_ctx, 0, sizeof(MpmCtx));
+    memset(&mpm_thread_ctx, 0, sizeof(MpmThreadCtx));
+    MpmInitCtx(&mpm_ctx, MPM_HS);
+    mpm_ctx.flags |= MPMCTX_FLAGS_STREAM;
+    MpmAddPatternCS(&mpm_ctx, (uint8_t *)"abcd", 4, 0, 0, 0, 0, 0);
+    PmqSetup(&pmq);
+
+    FAIL_IF(SCHSPreparePatterns(&mpm_ctx) != 0);
+    SCHSInitThreadCtx(&mpm_ctx, &mpm_thread_ctx);
+    const PatternDatabase *pd = ((SCHSCtx *)mpm_ctx.ctx)->pattern_db;
+    FAIL_IF_NULL(pd->hs_stream_db);
+
+    /* the match crosses the chunks */
+    FAIL_IF(SCHSStreamSearch(&mpm_ctx, &mpm_thread_ctx, &pmq, &state,
+                             (uint8_t *)"xxab", 4, 0) != 0);
+    FAIL_IF_NULL(state);
+    FAIL_IF(SCHSStreamSearch(&mpm_ctx, &mpm_thread_ctx, &pmq, &state,
+                             (uint8_t *)"cdyy", 4, 4) != 1);
+    FAIL_IF(pmq.rule_id_array_cnt != 1);
+
+    /* data presented again is not scanned again, but still reported */
+    PmqReset(&pmq);
+    FAIL_IF(SCHSStreamSearch(&mpm_ctx, &mpm_thread_ctx, &pmq, &state,
+                             (uint8_t *)"xxabcdyy", 8, 0) != 1);
+    FAIL_IF(((SCHSStreamState *)state)->scanned != 8);
+    FAIL_IF(SCHSStreamSearch(&mpm_ctx, &mpm_thread_ctx, &pmq, &state,
+                             (uint8_t *)"zz", 2, 8) != 0);
+
+    MpmStreamStateFree(state);
+    FAIL_IF(SC_ATOMIC_GET(hs_stream_memuse) != memuse);
+
+    /* no room for a state: the chunk is searched in block mode */
+    const uint64_t memcap = SC_ATOMIC_GET(hs_stream_memcap);
+    SC_ATOMIC_SET(hs_stream_memcap, 0);
+    state = NULL;
+    FAIL_IF(SCHSStreamSearch(&mpm_ctx, &mpm_thread_ctx, &pmq, &state,
+                             (uint8_t *)"abcd", 4, 0) != 1);
+    FAIL_IF_NOT_NULL(state);
+    SC_ATOMIC_SET(hs_stream_memcap, memcap);
+
+    SCHSDestroyCtx(&mpm_ctx);
+    SCHSDestroyThreadCtx(&mpm_ctx, &mpm_thread_ctx);
+    PmqFree(&pmq);
+    PASS;
+}
+
 #endif /* UNITTESTS */
 
 void SCHSRegisterTests(void)
@@ -2179,6 +3138,9 @@ void SCHSRegisterTests(void)
     UtRegisterTest("SCHSTest27", SCHSTest27);
     UtRegisterTest("SCHSTest28", SCHSTest28);
     UtRegisterTest("SCHSTest29", SCHSTest29);
+    UtRegisterTest("SCHSTest30", SCHSTest30);
+    UtRegisterTest("SCHSTest31", SCHSTest31);
+    UtRegisterTest("SCHSTest32", SCHSTest32);
 #endif
 
     return;
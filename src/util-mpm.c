@@ -435,6 +435,18 @@ void MpmFreePattern(MpmCtx *mpm_ctx, MpmPattern *p)
     return;
 }
 
+/**
+ * \brief Free the per stream state of a streaming search.
+ */
+void MpmStreamStateFree(MpmStreamState *state)
+{
+    if (state == NULL)
+        return;
+
+    BUG_ON(mpm_table[state->mpm_type].StreamFree == NULL);
+    mpm_table[state->mpm_type].StreamFree(state);
+}
+
 static inline uint32_t MpmInitHash(MpmPattern *p)
 {
     uint32_t hash = p->len * p->original_pat[0];
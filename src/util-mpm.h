@@ -84,6 +84,8 @@ typedef struct MpmPattern_ {
  * one per sgh. */
 #define MPMCTX_FLAGS_GLOBAL     BIT_U8(0)
 #define MPMCTX_FLAGS_NODEPTH    BIT_U8(1)
+/* ctx is searched with StreamSearch, see detect.mpm-stream-mode */
+#define MPMCTX_FLAGS_STREAM     BIT_U8(2)
 
 typedef struct MpmCtx_ {
     void *ctx;
@@ -124,6 +126,12 @@ typedef struct MpmCtxFactoryContainer_ {
     int32_t no_of_items;
 } MpmCtxFactoryContainer;
 
+/** per stream state of a streaming search. Owned by the stream, the
+ *  matcher specific state starts with this. */
+typedef struct MpmStreamState_ {
+    uint8_t mpm_type;
+} MpmStreamState;
+
 /** pattern is case insensitive */
 #define MPM_PATTERN_FLAG_NOCASE     0x01
 /** pattern is negated */
@@ -160,6 +168,14 @@ typedef struct MpmTableElmt_ {
     int  (*AddPatternNocase)(struct MpmCtx_ *, uint8_t *, uint16_t, uint16_t, uint16_t, uint32_t, SigIntId, uint8_t);
     int  (*Prepare)(struct MpmCtx_ *);
     uint32_t (*Search)(const struct MpmCtx_ *, struct MpmThreadCtx_ *, PrefilterRuleStore *, const uint8_t *, uint32_t);
+    /** optional search of stream data, only scanning the part of the data
+     *  not seen before. The state is kept per stream by the caller.
+     *
+     *  \param state per stream state, created on first use
+     *  \param offset absolute stream offset of the data
+     */
+    uint32_t (*StreamSearch)(const struct MpmCtx_ *, struct MpmThreadCtx_ *, PrefilterRuleStore *, MpmStreamState **, const uint8_t *, uint32_t, uint64_t);
+    void (*StreamFree)(MpmStreamState *);
     void (*PrintCtx)(struct MpmCtx_ *);
     void (*PrintThreadCtx)(struct MpmThreadCtx_ *);
     void (*RegisterUnittests)(void);
@@ -197,6 +213,8 @@ int MpmAddPatternCI(struct MpmCtx_ *mpm_ctx, uint8_t *pat, uint16_t patlen,
 
 void MpmFreePattern(MpmCtx *mpm_ctx, MpmPattern *p);
 
+void MpmStreamStateFree(MpmStreamState *state);
+
 int MpmAddPattern(MpmCtx *mpm_ctx, uint8_t *pat, uint16_t patlen,
                             uint16_t offset, uint16_t depth, uint32_t pid,
                             SigIntId sid, uint8_t flags);
@@ -36,6 +36,14 @@
 #endif
 #endif
 
+/** hint the CPU to start loading the cache line at 'addr'. The address
+ *  doesn't have to be valid. */
+#if CPPCHECK==1
+#define prefetch(addr)
+#else
+#define prefetch(addr) __builtin_prefetch((addr))
+#endif
+
 /** from http://en.wikipedia.org/wiki/Memory_ordering
  *
  *  C Compiler memory barrier
@@ -47,13 +47,27 @@ typedef struct SCProfilePrefilterData_ {
     const char *name;
 } SCProfilePrefilterData;
 
+typedef struct SCProfilePrefilterMergeData_ {
+    uint64_t called;
+    uint64_t total;
+    uint64_t max;
+    uint64_t candidates;
+} SCProfilePrefilterMergeData;
+
 typedef struct SCProfilePrefilterDetectCtx_ {
     uint32_t id;
     uint32_t size;                  /**< size in elements */
     SCProfilePrefilterData *data;
+    /** candidate merge, indexed by PROF_PF_MERGE_* */
+    SCProfilePrefilterMergeData merge[PROF_PF_MERGE_MAX];
     pthread_mutex_t data_m;
 } SCProfilePrefilterDetectCtx;
 
+static const char *merge_names[PROF_PF_MERGE_MAX] = {
+    "sort",
+    "bitmap",
+};
+
 static int profiling_prefilter_output_to_file = 0;
 int profiling_prefilter_enabled = 0;
 __thread int profiling_prefilter_entered = 0;
@@ -127,6 +141,39 @@ static void DoDump(SCProfilePrefilterDetectCtx *rules_ctx, FILE *fp, const char
     }
 }
 
+/** \internal
+ *  \brief dump the cost of the two ways to merge the candidates, per
+ *         call and per candidate */
+static void DoDumpMerge(SCProfilePrefilterDetectCtx *ctx, FILE *fp)
+{
+    fprintf(fp, "\n  %-32s %-15s %-15s %-15s %-15s %-15s %-15s\n",
+            "Candidate merge", "Ticks", "Called", "Max Ticks", "Avg",
+            "Avg Candidates", "Avg/Candidate");
+    fprintf(fp, "  -------------------------------- "
+                "--------------- "
+                "--------------- "
+                "--------------- "
+                "--------------- "
+                "--------------- "
+                "--------------- "
+        "\n");
+    for (int i = 0; i < PROF_PF_MERGE_MAX; i++) {
+        const SCProfilePrefilterMergeData *d = &ctx->merge[i];
+        if (d->called == 0)
+            continue;
+
+        fprintf(fp,
+            "  %-32s %-15"PRIu64" %-15"PRIu64" %-15"PRIu64" %-15.2f %-15.2f %-15.2f\n",
+            merge_names[i],
+            d->total,
+            d->called,
+            d->max,
+            (double)d->total / d->called,
+            (double)d->candidates / d->called,
+            d->candidates ? (double)d->total / d->candidates : 0.0);
+    }
+}
+
 static void
 SCProfilingPrefilterDump(DetectEngineCtx *de_ctx)
 {
@@ -164,6 +211,7 @@ SCProfilingPrefilterDump(DetectEngineCtx *de_ctx)
 
     /* global stats first */
     DoDump(de_ctx->profile_prefilter_ctx, fp, "total");
+    DoDumpMerge(de_ctx->profile_prefilter_ctx, fp);
 
     fprintf(fp,"\n");
     if (fp != stdout)
@@ -194,6 +242,30 @@ SCProfilingPrefilterUpdateCounter(DetectEngineThreadCtx *det_ctx, int id, uint64
     }
 }
 
+/**
+ * \brief Update a candidate merge counter.
+ *
+ * \param path PROF_PF_MERGE_*
+ * \param ticks Number of CPU ticks for the merge.
+ * \param candidates Number of candidates that were merged.
+ */
+void
+SCProfilingPrefilterMergeUpdateCounter(DetectEngineThreadCtx *det_ctx,
+        int path, uint64_t ticks, uint32_t candidates)
+{
+    if (det_ctx != NULL && det_ctx->prefilter_merge_perf_data != NULL &&
+            path < PROF_PF_MERGE_MAX)
+    {
+        SCProfilePrefilterMergeData *p = &det_ctx->prefilter_merge_perf_data[path];
+
+        p->called++;
+        if (ticks > p->max)
+            p->max = ticks;
+        p->total += ticks;
+        p->candidates += candidates;
+    }
+}
+
 static SCProfilePrefilterDetectCtx *SCProfilingPrefilterInitCtx(void)
 {
     SCProfilePrefilterDetectCtx *ctx = SCMalloc(sizeof(SCProfilePrefilterDetectCtx));
@@ -236,10 +308,32 @@ void SCProfilingPrefilterThreadSetup(SCProfilePrefilterDetectCtx *ctx, DetectEng
 
     const uint32_t size = det_ctx->de_ctx->prefilter_id;
 
-    SCProfilePrefilterData *a = SCMalloc(sizeof(SCProfilePrefilterData) * size);
-    if (a != NULL) {
-        memset(a, 0x00, sizeof(SCProfilePrefilterData) * size);
-        det_ctx->prefilter_perf_data = a;
+    if (size > 0) {
+        SCProfilePrefilterData *a = SCMalloc(sizeof(SCProfilePrefilterData) * size);
+        if (a != NULL) {
+            memset(a, 0x00, sizeof(SCProfilePrefilterData) * size);
+            det_ctx->prefilter_perf_data = a;
+        }
+    }
+
+    det_ctx->prefilter_merge_perf_data = SCCalloc(PROF_PF_MERGE_MAX,
+            sizeof(SCProfilePrefilterMergeData));
+}
+
+static void SCProfilingPrefilterMergeThreadMerge(DetectEngineCtx *de_ctx, DetectEngineThreadCtx *det_ctx)
+{
+    if (de_ctx == NULL || de_ctx->profile_prefilter_ctx == NULL || det_ctx == NULL ||
+        det_ctx->prefilter_merge_perf_data == NULL)
+        return;
+
+    for (int i = 0; i < PROF_PF_MERGE_MAX; i++) {
+        SCProfilePrefilterMergeData *d = &de_ctx->profile_prefilter_ctx->merge[i];
+        const SCProfilePrefilterMergeData *t = &det_ctx->prefilter_merge_perf_data[i];
+        d->called += t->called;
+        d->total += t->total;
+        d->candidates += t->candidates;
+        if (t->max > d->max)
+            d->max = t->max;
     }
 }
 
@@ -260,15 +354,19 @@ static void SCProfilingPrefilterThreadMerge(DetectEngineCtx *de_ctx, DetectEngin
 
 void SCProfilingPrefilterThreadCleanup(DetectEngineThreadCtx *det_ctx)
 {
-    if (det_ctx == NULL || det_ctx->de_ctx == NULL || det_ctx->prefilter_perf_data == NULL)
+    if (det_ctx == NULL || det_ctx->de_ctx == NULL ||
+        det_ctx->de_ctx->profile_prefilter_ctx == NULL)
         return;
 
     pthread_mutex_lock(&det_ctx->de_ctx->profile_prefilter_ctx->data_m);
     SCProfilingPrefilterThreadMerge(det_ctx->de_ctx, det_ctx);
+    SCProfilingPrefilterMergeThreadMerge(det_ctx->de_ctx, det_ctx);
     pthread_mutex_unlock(&det_ctx->de_ctx->profile_prefilter_ctx->data_m);
 
     SCFree(det_ctx->prefilter_perf_data);
     det_ctx->prefilter_perf_data = NULL;
+    SCFree(det_ctx->prefilter_merge_perf_data);
+    det_ctx->prefilter_merge_perf_data = NULL;
 }
 
 /**
@@ -283,12 +381,13 @@ SCProfilingPrefilterInitCounters(DetectEngineCtx *de_ctx)
         return;
 
     const uint32_t size = de_ctx->prefilter_id;
-    if (size == 0)
-        return;
 
+    /* set up even without prefilter engines for the merge counters */
     de_ctx->profile_prefilter_ctx = SCProfilingPrefilterInitCtx();
     BUG_ON(de_ctx->profile_prefilter_ctx == NULL);
     de_ctx->profile_prefilter_ctx->size = size;
+    if (size == 0)
+        return;
 
     de_ctx->profile_prefilter_ctx->data = SCMalloc(sizeof(SCProfilePrefilterData) * size);
     BUG_ON(de_ctx->profile_prefilter_ctx->data == NULL);
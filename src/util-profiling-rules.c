@@ -33,6 +33,8 @@
 
 #include "util-unittest.h"
 #include "util-byte.h"
+#include "util-conf.h"
+#include "util-path.h"
 #include "util-profiling.h"
 #include "util-profiling-locks.h"
 
@@ -57,6 +59,11 @@ typedef struct SCProfileDetectCtx_ {
     uint32_t id;
     SCProfileData *data;
     pthread_mutex_t data_m;
+    /** data of the threads that are not merged into data yet, protected
+     *  by data_m */
+    SCProfileData **thread_data;
+    uint32_t thread_data_cnt;
+    uint32_t thread_data_size;
 } SCProfileDetectCtx;
 
 /**
@@ -81,6 +88,8 @@ extern int profiling_output_to_file;
 int profiling_rules_enabled = 0;
 static char profiling_file_name[PATH_MAX] = "";
 static const char *profiling_file_mode = "a";
+/** per rule cost for detect.rule-cost-file, empty if not enabled */
+static char profiling_cost_file_name[PATH_MAX] = "";
 #ifdef HAVE_LIBJANSSON
 static int profiling_rule_json = 0;
 #endif
@@ -184,6 +193,16 @@ void SCProfilingRulesGlobalInit(void)
 
                 profiling_output_to_file = 1;
             }
+            const char *cost_file = ConfNodeLookupChildValue(conf, "cost-file");
+            if (cost_file != NULL) {
+                if (PathIsAbsolute(cost_file)) {
+                    strlcpy(profiling_cost_file_name, cost_file,
+                            sizeof(profiling_cost_file_name));
+                } else {
+                    snprintf(profiling_cost_file_name, sizeof(profiling_cost_file_name),
+                            "%s/%s", ConfigGetLogDirectory(), cost_file);
+                }
+            }
             if (ConfNodeChildValueIsTrue(conf, "json")) {
 #ifdef HAVE_LIBJANSSON
                 profiling_rule_json = 1;
@@ -547,6 +566,73 @@ SCProfilingRuleDump(SCProfileDetectCtx *rules_ctx)
     SCLogPerf("Done dumping profiling data.");
 }
 
+/**
+ * \brief Write the cost of the profiled rules, so that
+ *        detect.rule-cost-file can use them to order the rules on the
+ *        next (re)load.
+ */
+static void SCProfilingRuleDumpCost(const SCProfileData *data, uint32_t size)
+{
+    if (profiling_cost_file_name[0] == '\0' || data == NULL)
+        return;
+
+    FILE *fp = fopen(profiling_cost_file_name, "w");
+    if (fp == NULL) {
+        SCLogError(SC_ERR_FOPEN, "failed to open %s: %s",
+                profiling_cost_file_name, strerror(errno));
+        return;
+    }
+
+    uint32_t cnt = 0;
+    fprintf(fp, "# gid sid rev checks ticks\n");
+    for (uint32_t i = 0; i < size; i++) {
+        const SCProfileData *d = &data[i];
+        if (d->checks == 0)
+            continue;
+        fprintf(fp, "%"PRIu32" %"PRIu32" %"PRIu32" %"PRIu64" %"PRIu64"\n",
+                d->gid, d->sid, d->rev, d->checks,
+                d->ticks_match + d->ticks_no_match);
+        cnt++;
+    }
+    fclose(fp);
+    SCLogPerf("Wrote cost of %u rules to %s", cnt, profiling_cost_file_name);
+}
+
+/**
+ * \brief Write the rule cost file of a detection engine that is still
+ *        in use
+ *
+ * Used on a rule reload, so that the new detection engine is ordered on
+ * the cost of the rules up to now. The counts of the threads are read
+ * while they update them, which is close enough for ordering the rules.
+ * The final counts are written again when the engine is freed.
+ */
+void SCProfilingRuleDumpCostLive(SCProfileDetectCtx *ctx)
+{
+    if (profiling_cost_file_name[0] == '\0' || ctx == NULL ||
+            ctx->data == NULL)
+        return;
+
+    SCProfileData *sum = SCMalloc(sizeof(SCProfileData) * ctx->size);
+    if (sum == NULL)
+        return;
+
+    pthread_mutex_lock(&ctx->data_m);
+    memcpy(sum, ctx->data, sizeof(SCProfileData) * ctx->size);
+    for (uint32_t t = 0; t < ctx->thread_data_cnt; t++) {
+        const SCProfileData *d = ctx->thread_data[t];
+        for (uint32_t i = 0; i < ctx->size; i++) {
+            sum[i].checks += d[i].checks;
+            sum[i].ticks_match += d[i].ticks_match;
+            sum[i].ticks_no_match += d[i].ticks_no_match;
+        }
+    }
+    pthread_mutex_unlock(&ctx->data_m);
+
+    SCProfilingRuleDumpCost(sum, ctx->size);
+    SCFree(sum);
+}
+
 /**
  * \brief Register a rule profiling counter.
  *
@@ -603,8 +689,11 @@ void SCProfilingRuleDestroyCtx(SCProfileDetectCtx *ctx)
 {
     if (ctx != NULL) {
         SCProfilingRuleDump(ctx);
+        SCProfilingRuleDumpCost(ctx->data, ctx->size);
         if (ctx->data != NULL)
             SCFree(ctx->data);
+        if (ctx->thread_data != NULL)
+            SCFree(ctx->thread_data);
         pthread_mutex_destroy(&ctx->data_m);
         SCFree(ctx);
     }
@@ -621,6 +710,20 @@ void SCProfilingRuleThreadSetup(SCProfileDetectCtx *ctx, DetectEngineThreadCtx *
 
         det_ctx->rule_perf_data = a;
         det_ctx->rule_perf_data_size = ctx->size;
+
+        pthread_mutex_lock(&ctx->data_m);
+        if (ctx->thread_data_cnt == ctx->thread_data_size) {
+            uint32_t new_size = ctx->thread_data_size ? ctx->thread_data_size * 2 : 8;
+            void *ptr = SCRealloc(ctx->thread_data, new_size * sizeof(SCProfileData *));
+            if (ptr != NULL) {
+                ctx->thread_data = ptr;
+                ctx->thread_data_size = new_size;
+            }
+        }
+        /* if that failed the thread is only counted once it's done */
+        if (ctx->thread_data_cnt < ctx->thread_data_size)
+            ctx->thread_data[ctx->thread_data_cnt++] = a;
+        pthread_mutex_unlock(&ctx->data_m);
     }
 }
 
@@ -646,9 +749,16 @@ void SCProfilingRuleThreadCleanup(DetectEngineThreadCtx *det_ctx)
     if (det_ctx == NULL || det_ctx->de_ctx == NULL || det_ctx->rule_perf_data == NULL)
         return;
 
-    pthread_mutex_lock(&det_ctx->de_ctx->profile_ctx->data_m);
+    SCProfileDetectCtx *ctx = det_ctx->de_ctx->profile_ctx;
+    pthread_mutex_lock(&ctx->data_m);
     SCProfilingRuleThreadMerge(det_ctx->de_ctx, det_ctx);
-    pthread_mutex_unlock(&det_ctx->de_ctx->profile_ctx->data_m);
+    for (uint32_t t = 0; t < ctx->thread_data_cnt; t++) {
+        if (ctx->thread_data[t] == det_ctx->rule_perf_data) {
+            ctx->thread_data[t] = ctx->thread_data[--ctx->thread_data_cnt];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctx->data_m);
 
     SCFree(det_ctx->rule_perf_data);
     det_ctx->rule_perf_data = NULL;
@@ -25,6 +25,13 @@
 #ifndef __UTIL_PROFILE_H__
 #define __UTIL_PROFILE_H__
 
+/** ways to merge the prefilter candidates of a packet */
+enum {
+    PROF_PF_MERGE_SORT,     /**< sort mpm ids, merge with non-pf ids */
+    PROF_PF_MERGE_BITMAP,   /**< DetectEngineThreadCtx::pf_bitmap */
+    PROF_PF_MERGE_MAX,
+};
+
 #ifdef PROFILING
 
 #include "util-profiling-locks.h"
@@ -299,12 +306,30 @@ extern __thread int profiling_prefilter_entered;
         profiling_prefilter_entered--; \
     }
 
+#define PREFILTER_MERGE_PROFILING_START \
+    uint64_t profile_merge_start_ = 0; \
+    if (profiling_prefilter_enabled) { \
+        profile_merge_start_ = UtilCpuGetTicks(); \
+    }
+
+/* counts the candidates of the merge as well, so call it before
+ * they are reset */
+#define PREFILTER_MERGE_PROFILING_END(det_ctx, path) \
+    if (profiling_prefilter_enabled) { \
+        uint64_t profile_merge_end_ = UtilCpuGetTicks(); \
+        if (profile_merge_end_ > profile_merge_start_) \
+            SCProfilingPrefilterMergeUpdateCounter((det_ctx), (path), \
+                    (profile_merge_end_ - profile_merge_start_), \
+                    (det_ctx)->pmq.rule_id_array_cnt + (det_ctx)->non_pf_id_cnt); \
+    }
+
 void SCProfilingRulesGlobalInit(void);
 void SCProfilingRuleDestroyCtx(struct SCProfileDetectCtx_ *);
 void SCProfilingRuleInitCounters(DetectEngineCtx *);
 void SCProfilingRuleUpdateCounter(DetectEngineThreadCtx *, uint16_t, uint64_t, int);
 void SCProfilingRuleThreadSetup(struct SCProfileDetectCtx_ *, DetectEngineThreadCtx *);
 void SCProfilingRuleThreadCleanup(DetectEngineThreadCtx *);
+void SCProfilingRuleDumpCostLive(struct SCProfileDetectCtx_ *);
 
 void SCProfilingKeywordsGlobalInit(void);
 void SCProfilingKeywordDestroyCtx(DetectEngineCtx *);//struct SCProfileKeywordDetectCtx_ *);
@@ -318,6 +343,8 @@ void SCProfilingPrefilterGlobalInit(void);
 void SCProfilingPrefilterDestroyCtx(DetectEngineCtx *);
 void SCProfilingPrefilterInitCounters(DetectEngineCtx *);
 void SCProfilingPrefilterUpdateCounter(DetectEngineThreadCtx *det_ctx, int id, uint64_t ticks);
+void SCProfilingPrefilterMergeUpdateCounter(DetectEngineThreadCtx *det_ctx,
+        int path, uint64_t ticks, uint32_t candidates);
 void SCProfilingPrefilterThreadSetup(struct SCProfilePrefilterDetectCtx_ *, DetectEngineThreadCtx *);
 void SCProfilingPrefilterThreadCleanup(DetectEngineThreadCtx *);
 
@@ -373,6 +400,9 @@ void SCProfilingDump(void);
 #define PREFILTER_PROFILING_START
 #define PREFILTER_PROFILING_END(ctx, profile_id)
 
+#define PREFILTER_MERGE_PROFILING_START
+#define PREFILTER_MERGE_PROFILING_END(det_ctx, path)
+
 #endif /* PROFILING */
 
 #endif /* ! __UTIL_PROFILE_H__ */
@@ -0,0 +1,571 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Lockless per thread slab allocator for fixed size objects.
+ *
+ * Free objects are either 'ready': Init has been called on them and they
+ * are accounted for by the consumer, or 'raw': memory only. The owner
+ * keeps up to 'prealloc' ready objects, objects returned beyond that get
+ * their Cleanup called and become raw. Raw objects are kept per slab, and
+ * a slab is freed as soon as all objects carved from it are raw again.
+ */
+
+#include "suricata-common.h"
+#include "util-slab-thread.h"
+#include "util-atomic.h"
+#include "util-unittest.h"
+#include "util-debug.h"
+#include "util-validate.h"
+
+struct SlabThreadSlab_;
+
+/** header in front of each object, 'next' is only used while it's free */
+typedef struct SlabThreadObj_ {
+    struct SlabThreadObj_ *next;
+    struct SlabThreadSlab_ *slab;
+} SlabThreadObj;
+
+typedef struct SlabThreadSlab_ {
+    /** list of all slabs of the element */
+    struct SlabThreadSlab_ *prev;
+    struct SlabThreadSlab_ *next;
+    /** list of the slabs that have raw objects */
+    struct SlabThreadSlab_ *raw_prev;
+    struct SlabThreadSlab_ *raw_next;
+    SlabThreadObj *raw;         /**< free objects that need Init */
+    uint32_t raw_cnt;
+    uint32_t carved;            /**< objects carved from the slab */
+    uint8_t data[] __attribute__((aligned(sizeof(void *))));
+} SlabThreadSlab;
+
+struct SlabThreadElement_ {
+    /* owner thread only */
+    pthread_t owner;
+    SlabThreadObj *ready;       /**< free objects that passed Init */
+    uint32_t ready_cnt;
+    SlabThreadSlab *slabs;      /**< all slabs */
+    uint32_t slab_cnt;
+    SlabThreadSlab *raw_slabs;  /**< slabs with raw objects */
+    SlabThreadSlab *carve;      /**< slab we carve new objects from */
+
+    /** objects returned by other threads. On its own cache line
+     *  so that the pushes don't bounce the owner's fields. */
+    SC_ATOMIC_DECLARE(SlabThreadObj *, remote) __attribute__((aligned(CLS)));
+};
+
+#define SLAB_OBJ_DATA(o)    ((void *)((uint8_t *)(o) + sizeof(SlabThreadObj)))
+#define SLAB_DATA_OBJ(d)    ((SlabThreadObj *)((uint8_t *)(d) - sizeof(SlabThreadObj)))
+
+static void SlabThreadSlabFree(SlabThreadElement *e, SlabThreadSlab *s)
+{
+    if (s->raw_cnt > 0) {
+        if (s->raw_prev != NULL)
+            s->raw_prev->raw_next = s->raw_next;
+        else
+            e->raw_slabs = s->raw_next;
+        if (s->raw_next != NULL)
+            s->raw_next->raw_prev = s->raw_prev;
+    }
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        e->slabs = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+    if (e->carve == s)
+        e->carve = NULL;
+    e->slab_cnt--;
+    SCFree(s);
+}
+
+/** \internal
+ *  \brief put an object on the raw list of its slab, free the slab if
+ *         all its objects are raw
+ *
+ *  Only full slabs are freed, so the slab we carve from stays around
+ *  and allocating and freeing a single object doesn't hit malloc. */
+static void SlabThreadPutRaw(SlabThreadElement *e, SlabThreadObj *o)
+{
+    SlabThreadSlab *s = o->slab;
+
+    if (s->raw_cnt + 1 == SLAB_THREAD_SLAB_OBJECTS) {
+        SlabThreadSlabFree(e, s);
+        return;
+    }
+
+    o->next = s->raw;
+    s->raw = o;
+    if (s->raw_cnt++ == 0) {
+        s->raw_prev = NULL;
+        s->raw_next = e->raw_slabs;
+        if (s->raw_next != NULL)
+            s->raw_next->raw_prev = s;
+        e->raw_slabs = s;
+    }
+}
+
+/** \internal
+ *  \brief get a raw object, reusing the slabs that have them first */
+static SlabThreadObj *SlabThreadGetRaw(SlabThread *st, SlabThreadElement *e)
+{
+    SlabThreadSlab *s = e->raw_slabs;
+    if (s != NULL) {
+        SlabThreadObj *o = s->raw;
+        s->raw = o->next;
+        if (--s->raw_cnt == 0) {
+            e->raw_slabs = s->raw_next;
+            if (s->raw_next != NULL)
+                s->raw_next->raw_prev = NULL;
+        }
+        return o;
+    }
+
+    s = e->carve;
+    if (s == NULL || s->carved == SLAB_THREAD_SLAB_OBJECTS) {
+        s = SCMalloc(sizeof(*s) + (size_t)st->slot_size * SLAB_THREAD_SLAB_OBJECTS);
+        if (unlikely(s == NULL))
+            return NULL;
+        memset(s, 0, sizeof(*s));
+        s->next = e->slabs;
+        if (s->next != NULL)
+            s->next->prev = s;
+        e->slabs = s;
+        e->slab_cnt++;
+        e->carve = s;
+    }
+    SlabThreadObj *o = (SlabThreadObj *)(s->data + (size_t)s->carved * st->slot_size);
+    o->slab = s;
+    s->carved++;
+    return o;
+}
+
+/** \internal
+ *  \brief get a raw object and Init it
+ *  \retval o object or NULL if out of memory or Init failed */
+static SlabThreadObj *SlabThreadNewObject(SlabThread *st, SlabThreadElement *e)
+{
+    SlabThreadObj *o = SlabThreadGetRaw(st, e);
+    if (unlikely(o == NULL))
+        return NULL;
+
+    /* Init must undo its own accounting if it fails */
+    if (st->Init != NULL && st->Init(SLAB_OBJ_DATA(o), st->InitData) != 1) {
+        SlabThreadPutRaw(e, o);
+        return NULL;
+    }
+    return o;
+}
+
+/** \internal
+ *  \brief put a free object on the owner's lists */
+static void SlabThreadPutLocal(SlabThread *st, SlabThreadElement *e, SlabThreadObj *o)
+{
+    if (e->ready_cnt < st->prealloc) {
+        o->next = e->ready;
+        e->ready = o;
+        e->ready_cnt++;
+    } else {
+        if (st->Cleanup != NULL)
+            st->Cleanup(SLAB_OBJ_DATA(o));
+        SlabThreadPutRaw(e, o);
+    }
+}
+
+/** \internal
+ *  \brief move the objects returned by other threads to our lists */
+static void SlabThreadTakeRemote(SlabThread *st, SlabThreadElement *e)
+{
+    SlabThreadObj *list;
+    do {
+        list = SC_ATOMIC_GET(e->remote);
+    } while (list != NULL && !SC_ATOMIC_CAS(&e->remote, list, NULL));
+
+    while (list != NULL) {
+        SlabThreadObj *next = list->next;
+        SlabThreadPutLocal(st, e, list);
+        list = next;
+    }
+}
+
+/**
+ *  \brief add an element for the calling thread
+ *  \retval id of the new element or -1 on error
+ */
+int SlabThreadGrow(SlabThread *st)
+{
+    if (st == NULL || st->size == UINT16_MAX) {
+        SCLogError(SC_ERR_POOL_INIT, "slab grow failed");
+        return -1;
+    }
+
+    SlabThreadElement **ptr = SCRealloc(st->array,
+            (st->size + 1) * sizeof(SlabThreadElement *));
+    if (ptr == NULL) {
+        SCLogError(SC_ERR_POOL_INIT, "slab grow failed");
+        return -1;
+    }
+    st->array = ptr;
+
+    SlabThreadElement *e = SCMallocAligned(sizeof(*e), CLS);
+    if (e == NULL) {
+        SCLogError(SC_ERR_POOL_INIT, "slab grow failed");
+        return -1;
+    }
+    memset(e, 0, sizeof(*e));
+    e->owner = pthread_self();
+    SC_ATOMIC_INIT(e->remote);
+    st->array[st->size] = e;
+    const int id = st->size++;
+
+    for (uint32_t i = 0; i < st->prealloc; i++) {
+        SlabThreadObj *o = SlabThreadNewObject(st, e);
+        if (o == NULL) {
+            SCLogError(SC_ERR_POOL_INIT, "slab prealloc failed");
+            return -1;
+        }
+        o->next = e->ready;
+        e->ready = o;
+        e->ready_cnt++;
+    }
+    return id;
+}
+
+/**
+ *  \brief set up a slab allocator with an element for the calling thread
+ *
+ *  \param prealloc number of ready objects to create and to keep around
+ *  \param elt_size object size, the object must start with a
+ *                  SlabThreadReserved
+ *  \param Init called before an object is first handed out. Returns 1 on
+ *              success. On failure it must undo what it did, as Cleanup
+ *              is not called for it.
+ *  \param Cleanup called when a ready object is dropped
+ *
+ *  \retval st slab allocator or NULL on error
+ */
+SlabThread *SlabThreadInit(uint32_t prealloc, uint32_t elt_size,
+        int (*Init)(void *, void *), void *InitData, void (*Cleanup)(void *))
+{
+    if (elt_size < sizeof(SlabThreadReserved))
+        return NULL;
+
+    SlabThread *st = SCMalloc(sizeof(*st));
+    if (unlikely(st == NULL))
+        return NULL;
+    memset(st, 0, sizeof(*st));
+
+    st->elt_size = elt_size;
+    /* keep the headers pointer aligned */
+    st->slot_size = (uint32_t)((sizeof(SlabThreadObj) + elt_size + sizeof(void *) - 1) &
+            ~(sizeof(void *) - 1));
+    st->prealloc = prealloc;
+    st->Init = Init;
+    st->InitData = InitData;
+    st->Cleanup = Cleanup;
+
+    if (SlabThreadGrow(st) != 0) {
+        SlabThreadFree(st);
+        return NULL;
+    }
+    return st;
+}
+
+/**
+ *  \brief free the slab allocator
+ *
+ *  Calls Cleanup for all ready objects, including the ones returned by
+ *  other threads. Must only be called when no thread uses it anymore.
+ */
+void SlabThreadFree(SlabThread *st)
+{
+    if (st == NULL)
+        return;
+
+    for (uint16_t i = 0; i < st->size; i++) {
+        SlabThreadElement *e = st->array[i];
+        SlabThreadTakeRemote(st, e);
+
+        if (st->Cleanup != NULL) {
+            for (SlabThreadObj *o = e->ready; o != NULL; o = o->next) {
+                st->Cleanup(SLAB_OBJ_DATA(o));
+            }
+        }
+        while (e->slabs != NULL) {
+            SlabThreadSlab *next = e->slabs->next;
+            SCFree(e->slabs);
+            e->slabs = next;
+        }
+        SCFreeAligned(e);
+    }
+    if (st->array != NULL)
+        SCFree(st->array);
+    SCFree(st);
+}
+
+/**
+ *  \brief get an object for thread id
+ *  \note must be called by the thread that owns id
+ *  \retval data or NULL
+ */
+void *SlabThreadGetById(SlabThread *st, uint16_t id)
+{
+    if (st == NULL || id >= st->size)
+        return NULL;
+
+    SlabThreadElement *e = st->array[id];
+    DEBUG_VALIDATE_BUG_ON(!pthread_equal(e->owner, pthread_self()));
+
+    if (e->ready == NULL && SC_ATOMIC_GET(e->remote) != NULL)
+        SlabThreadTakeRemote(st, e);
+
+    SlabThreadObj *o = e->ready;
+    if (o != NULL) {
+        e->ready = o->next;
+        e->ready_cnt--;
+    } else {
+        o = SlabThreadNewObject(st, e);
+        if (o == NULL)
+            return NULL;
+    }
+
+    SlabThreadReserved *res = SLAB_OBJ_DATA(o);
+    *res = id;
+    return res;
+}
+
+/**
+ *  \brief return an object to the thread it came from
+ *
+ *  The owner puts it on its free list directly, other threads
+ *  push it onto the owner's remote free queue.
+ */
+void SlabThreadReturn(SlabThread *st, void *data)
+{
+    const SlabThreadReserved id = *(SlabThreadReserved *)data;
+    if (st == NULL || id >= st->size)
+        return;
+
+    SlabThreadElement *e = st->array[id];
+    SlabThreadObj *o = SLAB_DATA_OBJ(data);
+
+    if (pthread_equal(e->owner, pthread_self())) {
+        SlabThreadPutLocal(st, e, o);
+        return;
+    }
+
+    SlabThreadObj *head;
+    do {
+        head = SC_ATOMIC_GET(e->remote);
+        o->next = head;
+    } while (!SC_ATOMIC_CAS(&e->remote, head, o));
+}
+
+int SlabThreadSize(SlabThread *st)
+{
+    if (st == NULL)
+        return -1;
+    return (int)st->size;
+}
+
+#ifdef UNITTESTS
+struct SlabThreadTestData {
+    SlabThreadReserved res;
+    int abc;
+};
+
+static int slab_test_memuse = 0;
+static int slab_test_memcap = 0;
+
+static int SlabThreadTestInit(void *data, void *initdata)
+{
+    if (slab_test_memcap && slab_test_memuse >= slab_test_memcap)
+        return 0;
+    memset(data, 0, sizeof(struct SlabThreadTestData));
+    slab_test_memuse++;
+    return 1;
+}
+
+static void SlabThreadTestCleanup(void *data)
+{
+    slab_test_memuse--;
+}
+
+/** \test objects are reused, ready objects beyond prealloc are cleaned
+ *        up and Init failures are reported */
+static int SlabThreadTestBasic01(void)
+{
+    slab_test_memuse = 0;
+    slab_test_memcap = 0;
+
+    SlabThread *st = SlabThreadInit(2, sizeof(struct SlabThreadTestData),
+            SlabThreadTestInit, NULL, SlabThreadTestCleanup);
+    FAIL_IF_NULL(st);
+    FAIL_IF(slab_test_memuse != 2);
+
+    struct SlabThreadTestData *d[100];
+    for (int i = 0; i < 100; i++) {
+        d[i] = SlabThreadGetById(st, 0);
+        FAIL_IF_NULL(d[i]);
+        FAIL_IF(d[i]->res != 0);
+        d[i]->abc = i;
+    }
+    FAIL_IF(slab_test_memuse != 100);
+    for (int i = 0; i < 100; i++) {
+        FAIL_IF(d[i]->abc != i);
+        SlabThreadReturn(st, d[i]);
+    }
+    /* only prealloc ready objects are kept */
+    FAIL_IF(slab_test_memuse != 2);
+    /* first slab holds the ready objects, the second is the one we
+     * carve from */
+    FAIL_IF(st->array[0]->slab_cnt != 2);
+
+    /* raw objects are reused, but need Init to pass */
+    slab_test_memcap = 3;
+    void *a = SlabThreadGetById(st, 0);
+    void *b = SlabThreadGetById(st, 0);
+    void *c = SlabThreadGetById(st, 0);
+    FAIL_IF(a == NULL || b == NULL || c == NULL);
+    FAIL_IF_NOT_NULL(SlabThreadGetById(st, 0));
+    FAIL_IF(slab_test_memuse != 3);
+    SlabThreadReturn(st, a);
+    SlabThreadReturn(st, b);
+    SlabThreadReturn(st, c);
+
+    SlabThreadFree(st);
+    FAIL_IF(slab_test_memuse != 0);
+    PASS;
+}
+
+/** \test slabs are freed once all their objects are raw, and their
+ *        raw objects are reused before new slabs are allocated */
+static int SlabThreadTestFreeSlabs01(void)
+{
+    slab_test_memuse = 0;
+    slab_test_memcap = 0;
+
+    SlabThread *st = SlabThreadInit(2, sizeof(struct SlabThreadTestData),
+            SlabThreadTestInit, NULL, SlabThreadTestCleanup);
+    FAIL_IF_NULL(st);
+    SlabThreadElement *e = st->array[0];
+
+    const int n = 3 * SLAB_THREAD_SLAB_OBJECTS + 8;
+    struct SlabThreadTestData *d[n];
+    for (int i = 0; i < n; i++) {
+        d[i] = SlabThreadGetById(st, 0);
+        FAIL_IF_NULL(d[i]);
+    }
+    FAIL_IF(e->slab_cnt != 4);
+
+    /* an object of a slab in use keeps it */
+    for (int i = 2 * SLAB_THREAD_SLAB_OBJECTS; i < n - 1; i++) {
+        SlabThreadReturn(st, d[i]);
+    }
+    FAIL_IF(e->slab_cnt != 4);
+    SlabThreadReturn(st, d[n - 1]);
+    FAIL_IF(e->slab_cnt != 4);
+
+    /* all objects of the second slab raw: freed */
+    for (int i = SLAB_THREAD_SLAB_OBJECTS; i < 2 * SLAB_THREAD_SLAB_OBJECTS; i++) {
+        SlabThreadReturn(st, d[i]);
+    }
+    FAIL_IF(e->slab_cnt != 3);
+
+    /* raw objects are reused before slabs are added */
+    for (int i = SLAB_THREAD_SLAB_OBJECTS; i < n; i++) {
+        d[i] = SlabThreadGetById(st, 0);
+        FAIL_IF_NULL(d[i]);
+    }
+    FAIL_IF(e->slab_cnt != 4);
+
+    for (int i = 0; i < n; i++) {
+        SlabThreadReturn(st, d[i]);
+    }
+    FAIL_IF(slab_test_memuse != 2);
+    /* the slab with the ready objects and the one we carve from */
+    FAIL_IF(e->slab_cnt != 2);
+
+    SlabThreadFree(st);
+    FAIL_IF(slab_test_memuse != 0);
+    PASS;
+}
+
+static void *SlabThreadTestReturner(void *arg)
+{
+    void **args = arg;
+    SlabThread *st = args[0];
+    struct SlabThreadTestData **d = args[1];
+    for (int i = 0; i < 10; i++) {
+        SlabThreadReturn(st, d[i]);
+    }
+    return NULL;
+}
+
+/** \test objects returned by another thread end up on the remote queue
+ *        and are reused by the owner */
+static int SlabThreadTestRemote01(void)
+{
+    slab_test_memuse = 0;
+    slab_test_memcap = 0;
+
+    SlabThread *st = SlabThreadInit(16, sizeof(struct SlabThreadTestData),
+            SlabThreadTestInit, NULL, SlabThreadTestCleanup);
+    FAIL_IF_NULL(st);
+
+    struct SlabThreadTestData *d[16];
+    for (int i = 0; i < 16; i++) {
+        d[i] = SlabThreadGetById(st, 0);
+        FAIL_IF_NULL(d[i]);
+    }
+    FAIL_IF_NOT_NULL(st->array[0]->ready);
+
+    pthread_t t;
+    void *args[2] = { st, d };
+    FAIL_IF(pthread_create(&t, NULL, SlabThreadTestReturner, args) != 0);
+    pthread_join(t, NULL);
+
+    FAIL_IF_NOT_NULL(st->array[0]->ready);
+    FAIL_IF(SC_ATOMIC_GET(st->array[0]->remote) == NULL);
+
+    /* taken from the remote queue, no new objects needed */
+    void *x = SlabThreadGetById(st, 0);
+    FAIL_IF_NULL(x);
+    FAIL_IF(SC_ATOMIC_GET(st->array[0]->remote) != NULL);
+    FAIL_IF(st->array[0]->ready_cnt != 9);
+    FAIL_IF(slab_test_memuse != 16);
+
+    SlabThreadReturn(st, x);
+    for (int i = 10; i < 16; i++) {
+        SlabThreadReturn(st, d[i]);
+    }
+    SlabThreadFree(st);
+    FAIL_IF(slab_test_memuse != 0);
+    PASS;
+}
+#endif /* UNITTESTS */
+
+void SlabThreadRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("SlabThreadTestBasic01", SlabThreadTestBasic01);
+    UtRegisterTest("SlabThreadTestFreeSlabs01", SlabThreadTestFreeSlabs01);
+    UtRegisterTest("SlabThreadTestRemote01", SlabThreadTestRemote01);
+#endif /* UNITTESTS */
+}
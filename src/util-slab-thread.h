@@ -0,0 +1,66 @@
+/* Copyright (C) 2019 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Lockless per thread slab allocator for fixed size objects.
+ *
+ * Each thread gets its objects from its own element. Objects are carved
+ * from slabs of SLAB_THREAD_SLAB_OBJECTS objects and kept on a free list
+ * that only the owning thread touches. Objects freed by another thread
+ * are pushed onto a lockless remote free queue of the owner, which the
+ * owner takes over when its free list runs empty.
+ *
+ * Like with PoolThread, consumers MUST add SlabThreadReserved as the
+ * first member of their data structure and must leave it alone.
+ */
+
+#ifndef __UTIL_SLAB_THREAD_H__
+#define __UTIL_SLAB_THREAD_H__
+
+/** number of objects allocated at once */
+#define SLAB_THREAD_SLAB_OBJECTS 64
+
+/** per object reserved data containing the owning thread's id */
+typedef uint16_t SlabThreadReserved;
+
+typedef struct SlabThreadElement_ SlabThreadElement;
+
+typedef struct SlabThread_ {
+    uint32_t elt_size;              /**< size of the objects */
+    uint32_t slot_size;             /**< object size incl our header */
+    uint32_t prealloc;              /**< number of ready objects to keep */
+    int (*Init)(void *, void *);    /**< called before first use, may fail */
+    void *InitData;
+    void (*Cleanup)(void *);        /**< called when a ready object is dropped */
+
+    uint16_t size;                  /**< number of elements (threads) */
+    SlabThreadElement **array;
+} SlabThread;
+
+SlabThread *SlabThreadInit(uint32_t prealloc, uint32_t elt_size,
+        int (*Init)(void *, void *), void *InitData, void (*Cleanup)(void *));
+int SlabThreadGrow(SlabThread *st);
+void SlabThreadFree(SlabThread *st);
+void *SlabThreadGetById(SlabThread *st, uint16_t id);
+void SlabThreadReturn(SlabThread *st, void *data);
+int SlabThreadSize(SlabThread *st);
+
+void SlabThreadRegisterTests(void);
+
+#endif /* __UTIL_SLAB_THREAD_H__ */
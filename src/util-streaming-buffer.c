@@ -106,6 +106,7 @@ static inline int InitBuffer(StreamingBuffer *sb)
         return -1;
     }
     sb->buf_size = sb->cfg->buf_size;
+    sb->buf_headroom = 0;
     return 0;
 }
 
@@ -136,8 +137,10 @@ void StreamingBufferClear(StreamingBuffer *sb)
 
         SBBFree(sb);
         if (sb->buf != NULL) {
-            FREE(sb->cfg, sb->buf, sb->buf_size);
+            FREE(sb->cfg, sb->buf - sb->buf_headroom,
+                    sb->buf_headroom + sb->buf_size);
             sb->buf = NULL;
+            sb->buf_headroom = 0;
         }
     }
 }
@@ -427,6 +430,41 @@ static void SBBPrune(StreamingBuffer *sb)
     }
 }
 
+/**
+ * \internal
+ * \brief move the window forward by 'slide'
+ *
+ * The data stays where it is, the slid out part becomes headroom
+ * that Compact() reclaims when we need room.
+ */
+static inline void DoSlide(StreamingBuffer *sb, uint32_t slide)
+{
+    SCLogDebug("sliding %u forward, size of original buffer left after slide %u",
+            slide, sb->buf_offset - slide);
+    sb->buf += slide;
+    sb->buf_size -= slide;
+    sb->buf_headroom += slide;
+    sb->stream_offset += slide;
+    sb->buf_offset -= slide;
+    SBBPrune(sb);
+}
+
+/**
+ * \internal
+ * \brief move the data to the start of the memory block
+ */
+static void Compact(StreamingBuffer *sb)
+{
+    if (sb->buf_headroom == 0)
+        return;
+
+    uint8_t *base = sb->buf - sb->buf_headroom;
+    memmove(base, sb->buf, sb->buf_offset);
+    sb->buf = base;
+    sb->buf_size += sb->buf_headroom;
+    sb->buf_headroom = 0;
+}
+
 /**
  * \internal
  * \brief move buffer forward by 'slide'
@@ -435,16 +473,14 @@ static void AutoSlide(StreamingBuffer *sb)
 {
     uint32_t size = sb->cfg->buf_slide;
     uint32_t slide = sb->buf_offset - size;
-    SCLogDebug("sliding %u forward, size of original buffer left after slide %u", slide, size);
-    memmove(sb->buf, sb->buf+slide, size);
-    sb->stream_offset += slide;
-    sb->buf_offset = size;
-    SBBPrune(sb);
+    DoSlide(sb, slide);
 }
 
 static int __attribute__((warn_unused_result))
 GrowToSize(StreamingBuffer *sb, uint32_t size)
 {
+    Compact(sb);
+
     /* try to grow in multiples of sb->cfg->buf_size */
     uint32_t x = sb->cfg->buf_size ? size % sb->cfg->buf_size : 0;
     uint32_t base = size - x;
@@ -478,6 +514,8 @@ GrowToSize(StreamingBuffer *sb, uint32_t size)
  */
 static int __attribute__((warn_unused_result)) Grow(StreamingBuffer *sb)
 {
+    Compact(sb);
+
     uint32_t grow = sb->buf_size * 2;
     void *ptr = REALLOC(sb->cfg, sb->buf, sb->buf_size, grow);
     if (ptr == NULL)
@@ -510,23 +548,13 @@ void StreamingBufferSlideToOffset(StreamingBuffer *sb, uint64_t offset)
         offset <= sb->stream_offset + sb->buf_offset)
     {
         uint32_t slide = offset - sb->stream_offset;
-        uint32_t size = sb->buf_offset - slide;
-        SCLogDebug("sliding %u forward, size of original buffer left after slide %u", slide, size);
-        memmove(sb->buf, sb->buf+slide, size);
-        sb->stream_offset += slide;
-        sb->buf_offset = size;
-        SBBPrune(sb);
+        DoSlide(sb, slide);
     }
 }
 
 void StreamingBufferSlide(StreamingBuffer *sb, uint32_t slide)
 {
-    uint32_t size = sb->buf_offset - slide;
-    SCLogDebug("sliding %u forward, size of original buffer left after slide %u", slide, size);
-    memmove(sb->buf, sb->buf+slide, size);
-    sb->stream_offset += slide;
-    sb->buf_offset = size;
-    SBBPrune(sb);
+    DoSlide(sb, slide);
 }
 
 #define DATA_FITS(sb, len) \
@@ -542,6 +570,7 @@ StreamingBufferSegment *StreamingBufferAppendRaw(StreamingBuffer *sb, const uint
     if (!DATA_FITS(sb, data_len)) {
         if (sb->cfg->flags & STREAMING_BUFFER_AUTOSLIDE)
             AutoSlide(sb);
+        Compact(sb);
         if (sb->buf_size == 0) {
             if (GrowToSize(sb, data_len) != 0)
                 return NULL;
@@ -586,6 +615,7 @@ int StreamingBufferAppend(StreamingBuffer *sb, StreamingBufferSegment *seg,
     if (!DATA_FITS(sb, data_len)) {
         if (sb->cfg->flags & STREAMING_BUFFER_AUTOSLIDE)
             AutoSlide(sb);
+        Compact(sb);
         if (sb->buf_size == 0) {
             if (GrowToSize(sb, data_len) != 0)
                 return -1;
@@ -627,6 +657,7 @@ int StreamingBufferAppendNoTrack(StreamingBuffer *sb,
     if (!DATA_FITS(sb, data_len)) {
         if (sb->cfg->flags & STREAMING_BUFFER_AUTOSLIDE)
             AutoSlide(sb);
+        Compact(sb);
         if (sb->buf_size == 0) {
             if (GrowToSize(sb, data_len) != 0)
                 return -1;
@@ -678,6 +709,7 @@ int StreamingBufferInsertAt(StreamingBuffer *sb, StreamingBufferSegment *seg,
             AutoSlide(sb);
             rel_offset = offset - sb->stream_offset;
         }
+        Compact(sb);
         if (!DATA_FITS_AT_OFFSET(sb, data_len, rel_offset)) {
             if (GrowToSize(sb, (rel_offset + data_len)) != 0)
                 return -1;
@@ -882,6 +914,57 @@ int StreamingBufferGetDataAtOffset (const StreamingBuffer *sb,
     }
 }
 
+/**
+ *  \brief get the contiguous ranges of data from offset onwards
+ *
+ *  The regions point into the buffer, so no data is copied. They are
+ *  valid until the buffer is modified.
+ *
+ *  \param offset absolute offset to start at, data before the window
+ *                is skipped
+ *  \param regions array of max_regions to fill
+ *
+ *  \retval cnt number of regions set
+ */
+uint32_t StreamingBufferGetRegions(const StreamingBuffer *sb, uint64_t offset,
+        StreamingBufferRegion *regions, uint32_t max_regions)
+{
+    if (sb == NULL || sb->buf == NULL || max_regions == 0)
+        return 0;
+
+    const uint64_t end = sb->stream_offset + sb->buf_offset;
+    if (offset < sb->stream_offset)
+        offset = sb->stream_offset;
+    if (offset >= end)
+        return 0;
+
+    /* no blocks means no gaps */
+    if (RB_EMPTY(&sb->sbb_tree)) {
+        regions[0].data = sb->buf + (offset - sb->stream_offset);
+        regions[0].data_len = end - offset;
+        regions[0].stream_offset = offset;
+        return 1;
+    }
+
+    StreamingBufferBlock lookup = { .offset = offset, .len = 1 };
+    StreamingBufferBlock *sbb = SBB_RB_FIND_INCLUSIVE((struct SBB *)&sb->sbb_tree, &lookup);
+    uint32_t cnt = 0;
+    for ( ; sbb != NULL && cnt < max_regions; sbb = SBB_RB_NEXT(sbb)) {
+        if (sbb->offset >= end)
+            break;
+        const uint64_t start = MAX(sbb->offset, offset);
+        const uint64_t stop = MIN(sbb->offset + sbb->len, end);
+        if (start >= stop)
+            continue;
+
+        regions[cnt].data = sb->buf + (start - sb->stream_offset);
+        regions[cnt].data_len = stop - start;
+        regions[cnt].stream_offset = start;
+        cnt++;
+    }
+    return cnt;
+}
+
 /**
  *  \retval 1 data is the same
  *  \retval 0 data is different
@@ -1472,6 +1555,87 @@ static int StreamingBufferTest10(void)
     PASS;
 }
 
+/** \test regions skip the gaps and start at the requested offset */
+static int StreamingBufferTest11(void)
+{
+    StreamingBufferConfig cfg = { 0, 8, 16, NULL, NULL, NULL, NULL };
+    StreamingBuffer *sb = StreamingBufferInit(&cfg);
+    FAIL_IF(sb == NULL);
+
+    StreamingBufferRegion r[4];
+    FAIL_IF(StreamingBufferGetRegions(sb, 0, r, 4) != 0);
+
+    StreamingBufferSegment seg1;
+    FAIL_IF(StreamingBufferInsertAt(sb, &seg1, (const uint8_t *)"ABCD", 4, 0) != 0);
+    FAIL_IF(StreamingBufferGetRegions(sb, 1, r, 4) != 1);
+    FAIL_IF(r[0].stream_offset != 1 || r[0].data_len != 3);
+    FAIL_IF(memcmp(r[0].data, "BCD", 3) != 0);
+
+    StreamingBufferSegment seg2;
+    FAIL_IF(StreamingBufferInsertAt(sb, &seg2, (const uint8_t *)"HIJ", 3, 7) != 0);
+    StreamingBufferSegment seg3;
+    FAIL_IF(StreamingBufferInsertAt(sb, &seg3, (const uint8_t *)"MN", 2, 12) != 0);
+
+    FAIL_IF(StreamingBufferGetRegions(sb, 0, r, 4) != 3);
+    FAIL_IF(r[0].stream_offset != 0 || r[0].data_len != 4);
+    FAIL_IF(r[1].stream_offset != 7 || r[1].data_len != 3);
+    FAIL_IF(memcmp(r[1].data, "HIJ", 3) != 0);
+    FAIL_IF(r[2].stream_offset != 12 || r[2].data_len != 2);
+    FAIL_IF(memcmp(r[2].data, "MN", 2) != 0);
+    /* data points into the buffer */
+    FAIL_IF(r[2].data != sb->buf + 12);
+
+    /* start in a gap */
+    FAIL_IF(StreamingBufferGetRegions(sb, 5, r, 4) != 2);
+    FAIL_IF(r[0].stream_offset != 7);
+    /* start in a block, limited by max_regions */
+    FAIL_IF(StreamingBufferGetRegions(sb, 8, r, 1) != 1);
+    FAIL_IF(r[0].stream_offset != 8 || r[0].data_len != 2);
+    FAIL_IF(StreamingBufferGetRegions(sb, 14, r, 4) != 0);
+
+    StreamingBufferFree(sb);
+    PASS;
+}
+
+/** \test sliding doesn't move the data, appending reclaims the space
+ *        before growing */
+static int StreamingBufferTest12(void)
+{
+    StreamingBufferConfig cfg = { 0, 8, 16, NULL, NULL, NULL, NULL };
+    StreamingBuffer *sb = StreamingBufferInit(&cfg);
+    FAIL_IF(sb == NULL);
+
+    FAIL_IF(StreamingBufferAppendNoTrack(sb, (const uint8_t *)"ABCDEFGH01234567", 16) != 0);
+    const uint8_t *p = sb->buf + 8;
+
+    StreamingBufferSlide(sb, 8);
+    FAIL_IF(sb->stream_offset != 8);
+    FAIL_IF(sb->buf_offset != 8);
+    FAIL_IF(sb->buf != p);
+
+    const uint8_t *data = NULL;
+    uint32_t data_len = 0;
+    FAIL_IF(StreamingBufferGetDataAtOffset(sb, &data, &data_len, 8) != 1);
+    FAIL_IF(data != p || data_len != 8);
+
+    /* fits after moving the data back, so no need to grow */
+    FAIL_IF(StreamingBufferAppendNoTrack(sb, (const uint8_t *)"XYZ", 3) != 0);
+    FAIL_IF(sb->buf_headroom != 0);
+    FAIL_IF(sb->buf_size != 16);
+    FAIL_IF(sb->stream_offset != 8);
+    FAIL_IF(sb->buf_offset != 11);
+    FAIL_IF(memcmp(sb->buf, "01234567XYZ", 11) != 0);
+
+    StreamingBufferSlideToOffset(sb, 10);
+    FAIL_IF(StreamingBufferAppendNoTrack(sb, (const uint8_t *)"0123456789", 10) != 0);
+    FAIL_IF(sb->buf_headroom != 0);
+    FAIL_IF(sb->buf_size != 32);
+    FAIL_IF(memcmp(sb->buf, "234567XYZ0123456789", 19) != 0);
+
+    StreamingBufferFree(sb);
+    PASS;
+}
+
 #endif
 
 void StreamingBufferRegisterTests(void)
@@ -1487,5 +1651,7 @@ void StreamingBufferRegisterTests(void)
     UtRegisterTest("StreamingBufferTest08", StreamingBufferTest08);
     UtRegisterTest("StreamingBufferTest09", StreamingBufferTest09);
     UtRegisterTest("StreamingBufferTest10", StreamingBufferTest10);
+    UtRegisterTest("StreamingBufferTest11", StreamingBufferTest11);
+    UtRegisterTest("StreamingBufferTest12", StreamingBufferTest12);
 #endif
 }
@@ -32,6 +32,10 @@
  * Similarly, StreamingBufferSegment::stream_offset is also an absolute
  * offset.
  *
+ * Sliding doesn't move the data. StreamingBuffer::buf is moved forward
+ * in the memory block instead, and the space before it is reclaimed
+ * when more room is needed.
+ *
  * Using the segments is optional.
  *
  *
@@ -99,6 +103,7 @@ typedef struct StreamingBuffer_ {
     uint8_t *buf;           /**< memory block for reassembly */
     uint32_t buf_size;      /**< size of memory block */
     uint32_t buf_offset;    /**< how far we are in buf_size */
+    uint32_t buf_headroom;  /**< slid out space in front of buf */
 
     struct SBB sbb_tree;    /**< red black tree of Stream Buffer Blocks */
     StreamingBufferBlock *head; /**< head, should always be the same as RB_MIN */
@@ -108,9 +113,9 @@ typedef struct StreamingBuffer_ {
 } StreamingBuffer;
 
 #ifndef DEBUG
-#define STREAMING_BUFFER_INITIALIZER(cfg) { (cfg), 0, NULL, 0, 0, { NULL }, NULL, };
+#define STREAMING_BUFFER_INITIALIZER(cfg) { (cfg), 0, NULL, 0, 0, 0, { NULL }, NULL, };
 #else
-#define STREAMING_BUFFER_INITIALIZER(cfg) { (cfg), 0, NULL, 0, 0, { NULL }, NULL, 0 };
+#define STREAMING_BUFFER_INITIALIZER(cfg) { (cfg), 0, NULL, 0, 0, 0, { NULL }, NULL, 0 };
 #endif
 
 typedef struct StreamingBufferSegment_ {
@@ -118,6 +123,13 @@ typedef struct StreamingBufferSegment_ {
     uint64_t stream_offset;
 } __attribute__((__packed__)) StreamingBufferSegment;
 
+/** \brief contiguous range of data, pointing into the buffer */
+typedef struct StreamingBufferRegion_ {
+    const uint8_t *data;
+    uint32_t data_len;
+    uint64_t stream_offset;
+} StreamingBufferRegion;
+
 StreamingBuffer *StreamingBufferInit(const StreamingBufferConfig *cfg);
 void StreamingBufferClear(StreamingBuffer *sb);
 void StreamingBufferFree(StreamingBuffer *sb);
@@ -162,6 +174,9 @@ int StreamingBufferGetDataAtOffset (const StreamingBuffer *sb,
         const uint8_t **data, uint32_t *data_len,
         uint64_t offset);
 
+uint32_t StreamingBufferGetRegions(const StreamingBuffer *sb, uint64_t offset,
+        StreamingBufferRegion *regions, uint32_t max_regions);
+
 int StreamingBufferSegmentIsBeforeWindow(const StreamingBuffer *sb,
                                          const StreamingBufferSegment *seg);
 
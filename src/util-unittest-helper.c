@@ -447,7 +447,7 @@ Flow *UTHBuildFlow(int family, const char *src, const char *dst, Port sp, Port d
 {
     struct in_addr in;
 
-    Flow *f = SCMalloc(sizeof(Flow));
+    Flow *f = SCMallocAligned(sizeof(Flow), CLS);
     if (unlikely(f == NULL)) {
         printf("FlowAlloc failed\n");
         ;
@@ -467,7 +467,7 @@ Flow *UTHBuildFlow(int family, const char *src, const char *dst, Port sp, Port d
         if (family == AF_INET) {
             if (inet_pton(AF_INET, src, &in) != 1) {
                 printf("invalid address %s\n", src);
-                SCFree(f);
+                SCFreeAligned(f);
                 return NULL;
             }
             f->src.addr_data32[0] = in.s_addr;
@@ -479,7 +479,7 @@ Flow *UTHBuildFlow(int family, const char *src, const char *dst, Port sp, Port d
         if (family == AF_INET) {
             if (inet_pton(AF_INET, dst, &in) != 1) {
                 printf("invalid address %s\n", dst);
-                SCFree(f);
+                SCFreeAligned(f);
                 return NULL;
             }
             f->dst.addr_data32[0] = in.s_addr;